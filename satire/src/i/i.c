@@ -15,7 +15,7 @@
 #include "i.h"
 #include "../u/utility_nodeps.h"
 #include "../u/arg_parser.h"
-#include "iArgTable.h"
+#include "iargTable.h"
 
 #define TWOMEG 2097152
 #define MAX_FGETS 1024  // It only has to be big enough for three numbers.
@@ -12,7 +12,7 @@
 #include "../definitions.h"
 #include "i.h"
 #include "../u/arg_parser.h"
-#include "iArgTable.h"
+#include "iargTable.h"
 
 arg_t args[] = {
   { "inputFileName", ASTRING, (void *)&(params.inputFileName), "This is the file of text containing the T-D scores for each term, in TSV format. "},
@@ -12,7 +12,7 @@
 #include "../u/unicode.h"
 #include "../u/utility_nodeps.h"
 #include "q.h"
-#include "qArgTable.h"
+#include "qargTable.h"
 
 #define MAX_QTERMS 100
 #define MAX_FGETS 2048
@@ -56,6 +56,12 @@ static term_control_block_t term_control_block[MAX_QTERMS];
 
 static int *accumulators = NULL, *fake_heap = NULL, items_in_fake_heap = 0, num_acc_blocks = 0;
 
+// When params.heapArity is 2 or 4, fake_heap is used as a real d-ary min-heap of
+// up to params.k docids, with the lowest scoring one at the root.  heap_pos[docid] is
+// one more than the docid's slot in the heap, or zero if the docid isn't in the heap,
+// allowing the score of an item already in the heap to be increased in O(log k).
+static int *heap_pos = NULL;
+
 static byte *acc_block_dirty_flags = NULL;
 
 
@@ -63,7 +69,7 @@ static void explain_counters() {
   fprintf(stderr, "Output lines starting with 'COUNTERS-' include a counter type code which is either PQ<qnum> (Per Query)\n"
 	  "or Global) and the values of %d counters:\n"
 	  " 2 - Number of postings processed.\n"
-	  " 3 - Number of comparisons to check whether new item is already in heap.\n"
+	  " 3 - Number of comparisons to check whether new item is already in heap. (heapArity > 0: lookups)\n"
 	  " 4 - Number of other comparisons with heap items.\n"
 	  " 5 - Number of times an item is moved one slot up or down the heap.\n"
 	  " 6 - Number of times an item was attempted to be inserted into an empty heap.\n"
@@ -205,6 +211,103 @@ static void insert_in_fake_heap(int docid, int score) {
 }
 
 
+static BOOL heap_lower(int docid1, int docid2) {
+  // Is docid1 lower in the ranking than docid2?  Ties on score are broken in
+  // favour of the lower docid so that the ranking is fully determined.
+  per_query_counter[OTHER_HEAP_COMPARISONS]++;
+  if (accumulators[docid1] < accumulators[docid2]) return TRUE;
+  if (accumulators[docid1] > accumulators[docid2]) return FALSE;
+  return (docid1 > docid2);
+}
+
+
+static void heap_place(int docid, int slot) {
+  fake_heap[slot] = docid;
+  heap_pos[docid] = slot + 1;
+}
+
+
+static void heap_sift_up(int slot) {
+  int docid = fake_heap[slot], parent;
+  while (slot > 0) {
+    parent = (slot - 1) / params.heapArity;
+    if (!heap_lower(docid, fake_heap[parent])) break;
+    per_query_counter[HEAP_ITEMS_MOVED]++;
+    heap_place(fake_heap[parent], slot);
+    slot = parent;
+  }
+  heap_place(docid, slot);
+}
+
+
+static void heap_sift_down(int slot, int items) {
+  // Move the item at slot down until it is no higher than any of its children.
+  int docid = fake_heap[slot], child, c, last, lowest;
+  while (1) {
+    child = slot * params.heapArity + 1;
+    if (child >= items) break;
+    last = child + params.heapArity;
+    if (last > items) last = items;
+    lowest = child;
+    for (c = child + 1; c < last; c++)
+      if (heap_lower(fake_heap[c], fake_heap[lowest])) lowest = c;
+    if (!heap_lower(fake_heap[lowest], docid)) break;
+    per_query_counter[HEAP_ITEMS_MOVED]++;
+    heap_place(fake_heap[lowest], slot);
+    slot = lowest;
+  }
+  heap_place(docid, slot);
+}
+
+
+static void insert_in_real_heap(int docid) {
+  // The accumulator for docid has just been increased.  Make sure that the heap
+  // still holds the params.k highest scoring docids seen so far.
+  if (params.debug) fprintf(stderr, "         Inserting docid %d (score %d) in heap.\n",
+		 docid, accumulators[docid]);
+
+  if (heap_pos[docid] == 0 && items_in_fake_heap == params.k
+      && accumulators[docid] <= accumulators[fake_heap[0]]) return; //Skip a whole lot of unnecessary work
+
+  per_query_counter[ALREADY_IN_HEAP_COMPARISONS]++;
+  if (heap_pos[docid] > 0) {
+    // Increase-key:  in a min-heap an item whose score goes up can only move down.
+    heap_sift_down(heap_pos[docid] - 1, items_in_fake_heap);
+    return;   // --------------------------------->
+  }
+
+  if (items_in_fake_heap < params.k) {
+    if (items_in_fake_heap == 0) per_query_counter[INSERT_INTO_EMPTY_HEAP]++;
+    else per_query_counter[INSERT_INTO_PARTIAL_HEAP]++;
+    fake_heap[items_in_fake_heap] = docid;
+    heap_sift_up(items_in_fake_heap++);
+    return;   // --------------------------------->
+  }
+
+  per_query_counter[INSERT_INTO_FULL_HEAP]++;
+  if (!heap_lower(fake_heap[0], docid)) return;   // --------------------------------->
+  // Evict the lowest item and let the new one find its level.
+  heap_pos[fake_heap[0]] = 0;
+  fake_heap[0] = docid;
+  heap_sift_down(0, items_in_fake_heap);
+}
+
+
+static void sort_real_heap() {
+  // In-place heapsort.  Repeatedly swapping the root to the end of the shrinking
+  // heap leaves fake_heap in descending order of score, as the fake heap is kept.
+  int items, docid;
+  for (items = items_in_fake_heap; items > 0; items--) {
+    docid = fake_heap[0];
+    fake_heap[0] = fake_heap[items - 1];
+    if (items > 1) heap_sift_down(0, items - 1);
+    fake_heap[items - 1] = docid;
+  }
+  // Clear heap_pos ready for the next query.
+  for (items = 0; items < items_in_fake_heap; items++) heap_pos[fake_heap[items]] = 0;
+}
+
+
 static int vcmp(const void *ip, const void *jp) {
   // Comparison function for bsearch.  Numerically compare two termids
   // represented as BYTES_FOR_TERMID bytes in byte-order independent order
@@ -347,7 +450,8 @@ static void process_query(int queryid, int *query_array, int q_len, byte *vocab_
 	}
 	if (accumulators[docid] == 0) per_query_counter[ACCUMULATORS_USED]++;
 	accumulators[docid] += max_qscore;
-	insert_in_fake_heap(docid, accumulators[docid]);	
+	if (params.heapArity == 0) insert_in_fake_heap(docid, accumulators[docid]);
+	else insert_in_real_heap(docid);
 	term_control_block[chosen].if_pointer += BYTES_FOR_RUN_LEN;
       }
 
@@ -388,6 +492,7 @@ static void process_query(int queryid, int *query_array, int q_len, byte *vocab_
 
   // ------ now produce the ranking ---------
   if (params.debug) fprintf(stderr, "Q: Producing a ranking.\n");
+  if (params.heapArity > 0) sort_real_heap();
 
   // Commented-out statements produce format used prior to changing over
   // to TREC-style submission format.
@@ -439,6 +544,12 @@ int main(int argc, char **argv) {
     params.k = 1;
   }
 
+  if (params.heapArity != 0 && params.heapArity != 2 && params.heapArity != 4) {
+    fprintf(stderr, "Warning:  heapArity must be 0, 2 or 4.  Adjusting %d to be 4 instead.\n",
+	   params.heapArity);
+    params.heapArity = 4;
+  }
+
   fprintf(stderr, "Q: Opening the query input steam, assigning buffers etc.\n");
   
   fgets_buf = (char *)cmalloc(MAX_FGETS, (u_char *)"buffer for fgets()", FALSE);
@@ -459,6 +570,10 @@ int main(int argc, char **argv) {
   acc_block_dirty_flags = cmalloc(num_acc_blocks, (u_char *)"acc_block_dirty_flags", FALSE);
   memset(acc_block_dirty_flags, 1, num_acc_blocks);  // Set all the accumulator blocks as DIRTY
   fake_heap = cmalloc(params.k * sizeof(int), (u_char *)"fake_heap", FALSE);
+  if (params.heapArity > 0) {
+    heap_pos = cmalloc(num_acc_blocks * ACC_BLOCK_SIZE * sizeof(int), (u_char *)"heap_pos", FALSE);
+    memset(heap_pos, 0, num_acc_blocks * ACC_BLOCK_SIZE * sizeof(int));
+  }
  
   free(fname_buf);
   fname_buf = NULL;
@@ -509,6 +624,7 @@ int main(int argc, char **argv) {
   unmmap_all_of(if_in_mem, ifh, ifmh, if_size);
   free(accumulators);
   free(fake_heap);
+  free(heap_pos);
 
   print_global_counters();
 
@@ -20,6 +20,7 @@ arg_t args[] = {
   { "k", AINT, (void *)&(params.k), "The number of ranked results required."},
   { "lowScoreCutoff", AINT, (void *)&(params.lowScoreCutoff), "An early termination mechanism (ETM).  Don't process any postings with scores below this value."},
   { "postingsCountCutoff", AINT, (void *)&(params.postingsCountCutoff), "Another ETM. Stop if the total number of postings processed exceeds this value. (Only checked at the end of a run, and if value > 0.)"},
+  { "heapArity", AINT, (void *)&(params.heapArity), "How the top k are maintained. 2 or 4: an indexed binary or 4-ary min-heap; 0: the original sorted array (fake heap)."},
   { "debug", AINT, (void *)&(params.debug), "Controls verbosity of debugging output."},
   { "", AEOL, NULL, "" }
   };
@@ -31,6 +32,7 @@ void initialiseParams(params_t *params) {
   params->k = 10;
   params->lowScoreCutoff = 1;
   params->postingsCountCutoff = 0;
+  params->heapArity = 4;
   params->debug = 0;
 }
 
@@ -0,0 +1,92 @@
+#! /usr/bin/perl -w
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+# Compare the ways q.exe can maintain the top k (heapArity=0, 2 and 4) for k = 10, 100
+# and 1000.  Generates a synthetic T-D score file with Zipf-like postings list lengths,
+# indexes it with i.exe, runs the same queries through each configuration and reports
+# postings processed per second plus heap operations per query, taken from the
+# COUNTERS-GB line q.exe writes to stderr.  Also checks that the 2-ary and 4-ary heaps
+# produce identical rankings.
+#
+# Usage: cd satire/test; ./heap_benchmark.pl [num_docs num_terms num_queries]
+#        (Run make in ../src first.)
+
+use List::Util qw(shuffle);
+
+$num_docs = 200000;
+$num_terms = 1000;
+$num_queries = 1000;
+($num_docs, $num_terms, $num_queries) = @ARGV if $#ARGV == 2;
+
+$idir = "../src";
+die "Can't find $idir/i.exe and $idir/q.exe.  Please run make in $idir\n"
+    unless -x "$idir/i.exe" && -x "$idir/q.exe";
+
+$tsv = "heap_benchmark.tsv";
+$stem = "heap_benchmark";
+$qfile = "heap_benchmark.q";
+
+srand(42);
+
+print "Generating T-D scores for $num_terms terms over $num_docs documents.\n";
+die "Can't write to $tsv\n" unless open T, ">$tsv";
+@docs = 0 .. ($num_docs - 1);
+for ($t = 0; $t < $num_terms; $t++) {
+    # Postings list lengths fall off with term rank.  Within a term, lines must be in
+    # descending score order so that i.exe can form runs.
+    $plen = int($num_docs * 0.3 / ($t + 1) ** 0.7);
+    $plen = 1 if $plen < 1;
+    @docs = shuffle @docs;
+    @scores = sort {$b <=> $a} map {(1 + int(rand(999))) / 1000} 1 .. $plen;
+    for ($p = 0; $p < $plen; $p++) {
+	print T "$t\t$docs[$p]\t$scores[$p]\n";
+    }
+}
+close T;
+
+print "Generating $num_queries queries.\n";
+die "Can't write to $qfile\n" unless open Q, ">$qfile";
+for ($q = 1; $q <= $num_queries; $q++) {
+    $qlen = 1 + int(rand(5));
+    @terms = ();
+    for ($w = 0; $w < $qlen; $w++) {
+	push @terms, int($num_terms * rand() ** 2);  # Biased toward the commoner terms
+    }
+    print Q "$q\t@terms\n";
+}
+close Q;
+
+$cmd = "$idir/i.exe inputFileName=$tsv outputStem=$stem numDocs=$num_docs maxQuantisedValue=1000 > heap_benchmark.ilog";
+die "Indexing command ($cmd) failed\n"
+    if system($cmd);
+
+print "\n    k  heapArity  postings/sec  in-heap-checks/q  comparisons/q    moves/q  heap-ops/q\n";
+foreach $k (10, 100, 1000) {
+    foreach $arity (0, 2, 4) {
+	$out = "heap_benchmark_k${k}_a${arity}.out";
+	$cmd = "$idir/q.exe indexStem=$stem numDocs=$num_docs k=$k heapArity=$arity < $qfile > $out 2> heap_benchmark.err";
+	die "Query processing command ($cmd) failed\n"
+	    if system($cmd);
+	die "Can't read heap_benchmark.err\n" unless open E, "heap_benchmark.err";
+	@gb = ();
+	$secs = 0;
+	while (<E>) {
+	    @gb = split /\s+/ if /^COUNTERS-GB/;
+	    $secs = $1 if /queries processed in ([0-9.]+) sec/;
+	}
+	close E;
+	die "Didn't find global counters in q.exe output\n" unless $#gb >= 10;
+	# $gb[1] .. $gb[10] are counters 2 .. 11 in q.exe's explanation
+	$secs = 0.001 if $secs <= 0;
+	$ops = $gb[2] + $gb[3] + $gb[4];
+	printf "%5d  %9d  %12.0f  %16.1f  %13.1f  %9.1f  %10.1f\n", $k, $arity, $gb[1] / $secs,
+	    $gb[2] / $num_queries, $gb[3] / $num_queries, $gb[4] / $num_queries, $ops / $num_queries;
+    }
+    die "2-ary and 4-ary heaps gave different rankings for k=$k\n"
+	if system("cmp -s heap_benchmark_k${k}_a2.out heap_benchmark_k${k}_a4.out");
+}
+
+print "\nAll finished.  2-ary and 4-ary rankings agree.\n\n";
+
+exit(0);
@@ -0,0 +1,153 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks that an index built with QBASHI -block_postings=TRUE (index format
+# 1.6) gives exactly the same query results as one built with the classic
+# postings format (1.5) from the same .forward file.  Only the postings lists
+# differ between the two formats, so any difference in the output, other than
+# the reported index format, is an error.
+#
+# Both indexes are built in Block_Postings_Tempdata, which is removed if all
+# the checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+@qsets = ("$tqdir/emulated_log_10k.q",
+	  "$tqdir/emulated_log_four_words_with_operators.q");
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $tqdir.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+
+$tmpdir = "Block_Postings_Tempdata";
+$classic = "$tmpdir/classic";
+$blocked = "$tmpdir/blocked";
+
+build_index($classic, "");
+build_index($blocked, "-block_postings=TRUE");
+
+$if_classic = -s "$classic/QBASH.if";
+$if_blocked = -s "$blocked/QBASH.if";
+print sprintf("QBASH.if sizes:  classic %d bytes, blocked %d bytes (%+.1f%%)\n\n",
+	      $if_classic, $if_blocked, 100.0 * ($if_blocked - $if_classic) / $if_classic);
+
+@option_sets = (
+    "-relaxation_level=0",
+    "-relaxation_level=1",
+    "-relaxation_level=2",
+    "-auto_partials=on -max_to_show=20",
+    "-relaxation_level=1 -alpha=0.5 -beta=0.2 -gamma=0.2 -max_candidates=200",
+    );
+
+$err_cnt = 0;
+
+foreach $qset (@qsets) {
+    die "Can't find $qset\n" unless -r $qset;
+    foreach $opts (@option_sets) {
+	print "$qset {$opts}: ";
+	$out_classic = run_queries($classic, $qset, $opts);
+	$out_blocked = run_queries($blocked, $qset, $opts);
+
+	# The reported index format is the only expected difference.
+	if ($out_classic !~ s/Format of index: 1\.5\n//) {
+	    print "[FAIL] classic index doesn't report format 1.5\n";
+	    $err_cnt++;
+	    exit(1) if $fail_fast;
+	} elsif ($out_blocked !~ s/Format of index: 1\.6\n//) {
+	    print "[FAIL] blocked index doesn't report format 1.6\n";
+	    $err_cnt++;
+	    exit(1) if $fail_fast;
+	} elsif ($out_classic ne $out_blocked) {
+	    print "[FAIL] results differ\n";
+	    $err_cnt++;
+	    if ($fail_fast) {
+		save_and_diff($out_classic, $out_blocked);
+		exit(1);
+	    }
+	} else {
+	    print "[OK]\n";
+	}
+    }
+}
+
+die "\nCurses and confusion! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nBlocked and classic postings give identical results.  Splendid.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub build_index {
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
+
+
+sub save_and_diff {
+    my $a = shift;
+    my $b = shift;
+    die "Can't write $tmpdir/classic.out\n" unless open A, ">$tmpdir/classic.out";
+    print A $a;
+    close A;
+    die "Can't write $tmpdir/blocked.out\n" unless open B, ">$tmpdir/blocked.out";
+    print B $b;
+    close B;
+    system("diff $tmpdir/classic.out $tmpdir/blocked.out | head -20");
+}
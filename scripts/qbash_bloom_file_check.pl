@@ -0,0 +1,230 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks QBASH.bloom, written by QBASHI -bloom_bits=16|32|64.  The file only
+# lets QBASHQ reject candidates for partial word queries sooner, so indexes
+# built with each width, and a sharded one, must give exactly the same results
+# as indexes built without it from the same .forward.  Also checks that the
+# filter is consulted and saves partial checks, and that a .bloom file which
+# doesn't belong to the index is ignored.  (qbash_bloombits_check.pl covers
+# the coarse Bloom signatures in the .doctable.)
+#
+# The indexes are built in Bloom_File_Tempdata, which is removed if all the
+# checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$qlog = "$tqdir/emulated_log_10k.q";
+$max_queries = 3000;
+$max_qwds = 8;   # Longer queries may be truncated, losing the partial word
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qlog.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $qlog\n"
+	unless -r $qlog;
+
+$tmpdir = "Bloom_File_Tempdata";
+
+build_index("$tmpdir/plain", "");
+foreach $bits (16, 32, 64) {
+    build_index("$tmpdir/bloom$bits", "-bloom_bits=$bits");
+    die "$tmpdir/bloom$bits/QBASH.bloom wasn't written\n"
+	unless -s "$tmpdir/bloom$bits/QBASH.bloom";
+}
+build_index("$tmpdir/sharded", "-shards=4");
+build_index("$tmpdir/sharded_bloom", "-shards=4 -bloom_bits=32");
+die "$tmpdir/sharded_bloom/shard3/QBASH.bloom wasn't written\n"
+    unless -s "$tmpdir/sharded_bloom/shard3/QBASH.bloom";
+
+# An index with a .bloom file from a different index.
+build_index("$tmpdir/stale", "");
+die "Can't copy a stale .bloom file\n"
+    if system("cp $tmpdir/sharded_bloom/shard0/QBASH.bloom $tmpdir/stale");
+
+# Queries from the log with a partial word of one or two letters appended,
+# some of them accented.
+$partq = "$tmpdir/partials.q";
+$wordq = "$tmpdir/words.q";
+make_query_batches();
+
+@option_sets = (
+    "",
+    "-relaxation_level=1",
+    "-max_candidates=20",
+    "-x_conflate_accents=TRUE",
+    );
+
+$err_cnt = 0;
+
+foreach $opts (@option_sets) {
+    $ref = run_queries("plain", $partq, $opts);
+    foreach $dir ("bloom16", "bloom32", "bloom64", "stale") {
+	compare("$dir {$opts}", $ref, run_queries($dir, $partq, $opts));
+    }
+}
+compare("sharded_bloom", run_queries("sharded", $partq, ""),
+	run_queries("sharded_bloom", $partq, ""));
+foreach $opts ("-auto_partials=on", "-auto_partials=on -relaxation_level=1") {
+    compare("bloom32 {$opts}", run_queries("plain", $wordq, $opts),
+	    run_queries("bloom32", $wordq, $opts));
+}
+
+# The filter must be consulted and must save partial checks.
+($strong, $ref_partials) = op_counts("plain");
+foreach $dir ("bloom16", "bloom32", "bloom64", "stale") {
+    ($strong, $partials) = op_counts($dir);
+    print "$dir: $strong strong Bloom checks, $partials partial checks (plain: $ref_partials): ";
+    if ($dir eq "stale") {
+	if ($strong > 0) {
+	    fail("stale .bloom file was used");
+	    next;
+	}
+    } elsif ($strong == 0) {
+	fail("QBASH.bloom wasn't used");
+	next;
+    } elsif ($partials >= $ref_partials) {
+	fail("no partial checks were saved");
+	next;
+    }
+    print "[OK]\n";
+}
+
+die "\nPlague and pestilence! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nQBASH.bloom changes nothing but the work done.  Ripping.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub fail {
+    my $msg = shift;
+    print "[FAIL] $msg\n";
+    $err_cnt++;
+    if ($fail_fast) {
+	print "\nIndexes retained in $tmpdir\n";
+	exit(1);
+    }
+}
+
+
+sub compare {
+    my $label = shift;
+    my $a = shift;
+    my $b = shift;
+    print "$label: ";
+    if ($a eq $b) {
+	print "[OK]\n";
+	return;
+    }
+    if ($fail_fast) {
+	die "Can't write $tmpdir/a.out\n" unless open A, ">$tmpdir/a.out";
+	print A $a;
+	close A;
+	die "Can't write $tmpdir/b.out\n" unless open B, ">$tmpdir/b.out";
+	print B $b;
+	close B;
+	system("diff $tmpdir/a.out $tmpdir/b.out | head -20");
+    }
+    fail("results differ");
+}
+
+
+sub make_query_batches {
+    my @partials = ("a", "b", "c", "m", "s", "t", "r", "p", "w", "l", "se", "ma", "é", "ö");
+    my $n = 0;
+    die "Can't read $qlog\n" unless open IN, $qlog;
+    die "Can't write $partq\n" unless open P, ">$partq";
+    die "Can't write $wordq\n" unless open W, ">$wordq";
+    while (<IN>) {
+	chomp;
+	next if (split /\s+/) >= $max_qwds;
+	print P "$_ /", $partials[$n % ($#partials + 1)], "\n";
+	print W "$_\n";
+	last if ++$n >= $max_queries;
+    }
+    close IN;
+    close P;
+    close W;
+}
+
+
+sub build_index {
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $tmpdir/$dir and return
+    # the output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$tmpdir/$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
+
+
+sub op_counts {
+    # Return the total numbers of strong Bloom filter checks and of partial
+    # checks over the partial word queries against the index in $tmpdir/$dir.
+    my $dir = shift;
+    my $cmd = "$qp index_dir=$tmpdir/$dir -file_query_batch=$partq -x_show_qtimes=2";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $strong = 0;
+    my $partials = 0;
+    foreach (split /\n/, $out) {
+	$strong += $1 if /Check_strong_Bloom_filter\(cost = [0-9]+\): ([0-9]+)/;
+	$partials += $1 if /partial_checks\(cost = [0-9]+\): ([0-9]+)/;
+    }
+    return ($strong, $partials);
+}
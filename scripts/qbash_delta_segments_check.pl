@@ -0,0 +1,361 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks incremental updating with delta segments and QBASH.tombstones.  The
+# records of ../test_data/wikipedia_titles are split into a base and two
+# deltas.  Each delta holds new records and changed versions (different
+# scores) of records in older segments, and a list of deleted records is also
+# made.  QBASH_segment_merger -tombstone hides the superseded and deleted
+# records.  The results from that index must then be the same as from a
+# single index built from the live records.  The same goes for an index built
+# from the output of QBASH_segment_merger -merge.
+#
+# Doc scores are quantized, so records with different raw scores may tie.  A
+# full rebuild orders ties by raw score, which the segments can't know.  So the
+# results for each query are compared with tied results in sorted order, and
+# only the number and score of the results tied for the last place shown.
+#
+# The indexes are built in Delta_Segments_Tempdata, which is removed if all
+# the checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$qlog = "$tqdir/emulated_log_10k.q";
+$max_qwds = 8;
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qlog.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+$merger = $qp;
+$merger =~ s/QBASHQ/QBASH_segment_merger/;
+$merger =~ s/qbashq/QBASH_segment_merger/;
+
+die "$merger is not executable\n" unless -e $merger;
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $qlog\n"
+	unless -r $qlog;
+
+$tmpdir = "Delta_Segments_Tempdata";
+$seg = "$tmpdir/segmented";
+$full = "$tmpdir/full";
+$merged = "$tmpdir/merged";
+$deleted_keys = "$tmpdir/deleted.keys";
+$changedq = "$tmpdir/changed.q";
+
+make_collections();
+
+foreach $dir ($seg, "$seg/delta1", "$seg/delta2", $full) {
+    build_index($dir);
+}
+
+# Hide the superseded versions in the older segments, and the deleted records
+# everywhere.
+tombstone($seg, "$seg/delta1/QBASH.forward");
+tombstone($seg, "$seg/delta2/QBASH.forward");
+tombstone("$seg/delta1", "$seg/delta2/QBASH.forward");
+foreach $dir ($seg, "$seg/delta1", "$seg/delta2") {
+    tombstone($dir, $deleted_keys);
+}
+
+@option_sets = (
+    "",
+    "-relaxation_level=1",
+    "-relaxation_level=2 -max_to_show=3",
+    "-relaxation_level=3 -max_to_show=20",
+    "-auto_partials=on",
+    "-segment_threads=3",
+    );
+
+$err_cnt = 0;
+
+foreach $opts (@option_sets) {
+    foreach $qset ($qlog, $changedq) {
+	compare("segmented {$opts} $qset", $full, $seg, $qset, $opts);
+    }
+}
+
+# The merged .forward must hold exactly the live records which QBASHI indexes
+# (not those with no words), and its index give the same results.
+system("mkdir -p $merged");
+$cmd = "$merger -merge $seg $merged/QBASH.forward > $tmpdir/merge.log";
+die "Command '$cmd' failed with code $?\n"
+    if system($cmd);
+print "Merged .forward: ";
+%live = ();
+die "Can't read $full/QBASH.forward\n" unless open F, "$full/QBASH.forward";
+while (<F>) {
+    $live{$_} = 1;
+}
+close F;
+$merged_cnt = 0;
+$strays = 0;
+die "Can't read $merged/QBASH.forward\n" unless open F, "$merged/QBASH.forward";
+while (<F>) {
+    $merged_cnt++;
+    $strays++ unless $live{$_};
+}
+close F;
+$indexed = indexed_records($full);
+if ($strays) {
+    fail("$strays records which aren't live");
+} elsif ($merged_cnt != $indexed) {
+    fail("$merged_cnt records, rather than $indexed");
+} else {
+    print "$merged_cnt records [OK]\n";
+}
+
+build_index($merged);
+foreach $opts ("", "-relaxation_level=2") {
+    foreach $qset ($qlog, $changedq) {
+	compare("merged {$opts} $qset", $full, $merged, $qset, $opts);
+    }
+}
+
+die "\nDeath and damnation! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nDeltas plus tombstones equal a full rebuild.  Corking.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub fail {
+    my $msg = shift;
+    print "[FAIL] $msg\n";
+    $err_cnt++;
+    if ($fail_fast) {
+	print "\nIndexes retained in $tmpdir\n";
+	exit(1);
+    }
+}
+
+
+sub make_collections {
+    # Split the records of $fwd into the base and two deltas of $seg, make the
+    # keys file of deleted records and the .forward of the live records for a
+    # full rebuild in $full, and a query set of the triggers of the changed and
+    # deleted records.
+    my (@base, @new1, @new2, @delta1, @delta2, @deleted, @order, %live, $i, $t);
+    die "Can't read $fwd\n" unless open F, $fwd;
+    @base = <F>;
+    close F;
+    @new2 = splice(@base, -10000);
+    @new1 = splice(@base, -10000);
+
+    for ($i = 0; $i <= $#base; $i++) {
+	if ($i % 97 == 5) {
+	    push @delta1, rescore($base[$i], 3);
+	} elsif ($i % 101 == 11) {
+	    push @delta2, rescore($base[$i], 2);
+	} elsif ($i % 89 == 7) {
+	    push @deleted, $base[$i];
+	}
+    }
+    push @delta1, @new1;
+    for ($i = 0; $i <= $#new1; $i++) {
+	if ($i % 50 == 3) {
+	    push @delta2, rescore($new1[$i], 2);
+	} elsif ($i % 70 == 9) {
+	    push @deleted, $new1[$i];
+	}
+    }
+    push @delta2, @new2;
+
+    # A later version of a record replaces an earlier one.
+    foreach $segment (\@base, \@delta1, \@delta2) {
+	foreach (@$segment) {
+	    $t = trigger($_);
+	    push @order, $t unless exists $live{$t};
+	    $live{$t} = $_;
+	}
+    }
+    foreach (@deleted) {
+	delete $live{trigger($_)};
+    }
+
+    system("mkdir -p $seg/delta1 $seg/delta2 $full");
+    write_lines("$seg/QBASH.forward", \@base);
+    write_lines("$seg/delta1/QBASH.forward", \@delta1);
+    write_lines("$seg/delta2/QBASH.forward", \@delta2);
+    write_lines($deleted_keys, \@deleted);
+    write_lines("$full/QBASH.forward", [map { $live{$_} } grep { exists $live{$_} } @order]);
+
+    # All the segments must quantize scores on the same scale.
+    $max_score = 0;
+    foreach (values %live, @base, @delta1) {
+	$max_score = $1 if /\t([0-9]+)/ && $1 > $max_score;
+    }
+
+    die "Can't write $changedq\n" unless open Q, ">$changedq";
+    foreach (@delta1, @delta2, @deleted) {
+	$t = trigger($_);
+	next unless $t =~ /^[A-Za-z0-9 ]+$/;
+	next if (split /\s+/, $t) > $max_qwds;
+	print Q "$t\n";
+    }
+    close Q;
+}
+
+
+sub trigger {
+    my $r = shift;
+    $r =~ /^([^\t\r\n]*)/;
+    return $1;
+}
+
+
+sub rescore {
+    # Return record $r with its score multiplied by $m, plus one.
+    my $r = shift;
+    my $m = shift;
+    $r =~ s/\t([0-9]+)/"\t" . ($1 * $m + 1)/e;
+    return $r;
+}
+
+
+sub write_lines {
+    my $fname = shift;
+    my $lines = shift;
+    die "Can't write $fname\n" unless open O, ">$fname";
+    print O @$lines;
+    close O;
+}
+
+
+sub build_index {
+    my $dir = shift;
+    my $cmd = "$dexer index_dir=$dir -max_raw_score=$max_score > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub indexed_records {
+    my $dir = shift;
+    my $n = -1;
+    die "Can't read $dir/index.log\n" unless open L, "$dir/index.log";
+    while (<L>) {
+	$n = $1 if /^Records \(excluding ignoreds\): ([0-9]+)/;
+    }
+    close L;
+    return $n;
+}
+
+
+sub tombstone {
+    my $dir = shift;
+    my $keys = shift;
+    my $cmd = "$merger -tombstone $dir $keys >> $tmpdir/tombstone.log";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+    die "$dir/QBASH.tombstones wasn't written\n"
+	unless -e "$dir/QBASH.tombstones";
+}
+
+
+sub compare {
+    my $label = shift;
+    my $refdir = shift;
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $max_to_show = ($opts =~ /max_to_show=([0-9]+)/) ? $1 : 8;
+    my $a = untie_results(run_queries($refdir, $qset, $opts), $max_to_show);
+    my $b = untie_results(run_queries($dir, $qset, $opts), $max_to_show);
+    print "$label: ";
+    if ($a eq $b) {
+	print "[OK]\n";
+	return;
+    }
+    if ($fail_fast) {
+	die "Can't write $tmpdir/a.out\n" unless open A, ">$tmpdir/a.out";
+	print A $a;
+	close A;
+	die "Can't write $tmpdir/b.out\n" unless open B, ">$tmpdir/b.out";
+	print B $b;
+	close B;
+	system("diff $tmpdir/a.out $tmpdir/b.out | head -20");
+    }
+    fail("results differ");
+}
+
+
+sub untie_results {
+    # Sort each run of results with the same score, and if all $max_to_show
+    # results were shown, replace the last run by its length.
+    my $out = shift;
+    my $max_to_show = shift;
+    my $untied = "";
+    my @results = ();
+    foreach (split /\n/, $out . "\n-\n") {
+	if (/^(.*)\t([0-9.]+)$/) {
+	    push @results, [$2, $1];
+	    next;
+	}
+	if (@results) {
+	    my @runs = ();
+	    foreach $r (@results) {
+		if (@runs && $runs[$#runs][0] eq $r->[0]) {
+		    push @{$runs[$#runs][1]}, $r->[1];
+		} else {
+		    push @runs, [$r->[0], [$r->[1]]];
+		}
+	    }
+	    my $last = (@results >= $max_to_show) ? pop @runs : undef;
+	    foreach $run (@runs) {
+		$untied .= join("", map { "$_\t$run->[0]\n" } sort @{$run->[1]});
+	    }
+	    $untied .= "(" . scalar(@{$last->[1]}) . " tied)\t$last->[0]\n" if defined $last;
+	    @results = ();
+	}
+	$untied .= "$_\n";
+    }
+    return $untied;
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone|^Degree of parallelism/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
@@ -0,0 +1,192 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks QBASH.if.head_answers, written by QBASHI -head_answers=N.  Two line
+# prefix indexes are built from the same .forward, one with the file and one
+# without, and line prefix queries run against both with a range of options.
+# The results must always be the same: whether QBASHQ answers from the stored
+# answers or, when they don't suffice, falls back to the postings.  Also checks
+# that the stored answers are actually used.
+#
+# The indexes are built in Head_Answers_Tempdata, which is removed if all the
+# checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$qlog = "$tqdir/emulated_log_10k.q";
+$max_queries = 3000;
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qlog.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $qlog\n"
+	unless -r $qlog;
+
+$tmpdir = "Head_Answers_Tempdata";
+$plain = "$tmpdir/plain";
+$ha = "$tmpdir/head_answers";
+
+build_index($plain, "-max_line_prefix=15");
+build_index($ha, "-max_line_prefix=15 -head_answers=10 -head_answers_min_postings=20");
+die "$ha/QBASH.if.head_answers wasn't written\n"
+    unless -s "$ha/QBASH.if.head_answers";
+die "$plain/QBASH.if.head_answers shouldn't have been written\n"
+    if -e "$plain/QBASH.if.head_answers";
+
+# Line prefixes of 2, 3 and 5 characters (>ab), and words of 2 and 4
+# characters to be turned into line prefixes by -auto_line_prefix.
+$prefixq = "$tmpdir/prefixes.q";
+$wordq = "$tmpdir/words.q";
+make_query_batches();
+
+# Between them these cover answers found, answers running out before the
+# results are complete, and candidates rejected.
+@option_sets = (
+    "",
+    "-max_to_show=3",
+    "-max_to_show=20",
+    "-max_candidates=5",
+    "-max_length_diff=2",
+    "-duplicate_handling=2 -max_to_show=15",
+    "-x_use_head_answers=FALSE",
+    );
+
+$err_cnt = 0;
+
+foreach $opts (@option_sets) {
+    compare($prefixq, $opts);
+}
+compare($wordq, "-auto_line_prefix=on");
+compare($wordq, "-auto_line_prefix=on -max_to_show=20");
+
+# The stored answers must really be used.
+print "Stored answers used: ";
+$answered = 0;
+foreach (split /\n/, `$qp index_dir=$ha -file_query_batch=$prefixq -debug=1 2>&1`) {
+    $answered++ if /^head_answers_search\(/;
+}
+if ($answered == 0) {
+    print "[FAIL] never\n";
+    $err_cnt++;
+} else {
+    print "$answered times [OK]\n";
+}
+
+die "\nThunder and lightning! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nHead answers and postings agree.  Top hole.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub compare {
+    my $qset = shift;
+    my $opts = shift;
+    print "$qset {$opts}: ";
+    my $out_plain = run_queries($plain, $qset, $opts);
+    my $out_ha = run_queries($ha, $qset, $opts);
+    if ($out_plain ne $out_ha) {
+	print "[FAIL] results differ\n";
+	$err_cnt++;
+	if ($fail_fast) {
+	    save_and_diff($out_plain, $out_ha);
+	    exit(1);
+	}
+    } else {
+	print "[OK]\n";
+    }
+}
+
+
+sub make_query_batches {
+    my $n = 0;
+    die "Can't read $qlog\n" unless open IN, $qlog;
+    die "Can't write $prefixq\n" unless open P, ">$prefixq";
+    die "Can't write $wordq\n" unless open W, ">$wordq";
+    while (<IN>) {
+	next unless /^(\S+)/;
+	$w = $1;
+	print P ">", substr($w, 0, 2), "\n>", substr($w, 0, 3), "\n>", substr($w, 0, 5), "\n";
+	print W substr($w, 0, 2), "\n", substr($w, 0, 4), "\n";
+	last if ++$n >= $max_queries / 3;
+    }
+    close IN;
+    close P;
+    close W;
+}
+
+
+sub build_index {
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
+
+
+sub save_and_diff {
+    my $a = shift;
+    my $b = shift;
+    die "Can't write $tmpdir/plain.out\n" unless open A, ">$tmpdir/plain.out";
+    print A $a;
+    close A;
+    die "Can't write $tmpdir/head_answers.out\n" unless open B, ">$tmpdir/head_answers.out";
+    print B $b;
+    close B;
+    system("diff $tmpdir/plain.out $tmpdir/head_answers.out | head -20");
+}
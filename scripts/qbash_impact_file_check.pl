@@ -0,0 +1,191 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks QBASH.impact, written by QBASHI -impact_file=TRUE and used by QBASHQ
+# -engine=saat_impact.  Indexes with and without the file are built from the
+# same .forward, and the query output compared:
+#
+#  1. With the default relaxed_and engine, the .impact file must make no
+#     difference at all.
+#  2. -engine=saat_impact against the plain index must fall back to
+#     relaxed_and and so give the plain results.
+#  3. Queries with operators or partial words must fall back too.
+#  4. For plain queries, saat_impact must actually change the results (or
+#     the engine isn't being used), and give the same results with an
+#     impact_postings_budget too large to cut anything off, and with
+#     several query streams.
+#  5. With only a few candidates kept, saat_impact must give the same top
+#     results as with plenty.  That only holds if a document whose score grows
+#     while it's the last one kept moves up past those it now beats.
+#
+# The indexes are built in Impact_File_Tempdata, which is removed if all the
+# checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$plain_qset = "$tqdir/emulated_log_10k.q";
+$ops_qset = "$tqdir/emulated_log_four_words_with_operators.q";
+$max_qwds = 8;   # Longer queries may be truncated, losing their operators
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $tqdir.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+
+$tmpdir = "Impact_File_Tempdata";
+$plain = "$tmpdir/plain";
+$impact = "$tmpdir/impact";
+
+build_index($plain, "");
+build_index($impact, "-impact_file=TRUE");
+die "$impact/QBASH.impact wasn't written\n"
+    unless -s "$impact/QBASH.impact";
+die "$plain/QBASH.impact shouldn't have been written\n"
+    if -e "$plain/QBASH.impact";
+
+$opq = "$tmpdir/operators.q";
+$partq = "$tmpdir/partials.q";
+make_query_batches();
+
+$err_cnt = 0;
+
+foreach $qset ($plain_qset, $opq, $partq) {
+    $ref = run_queries($plain, $qset, "");
+    compare("$qset: relaxed_and with .impact", $ref, run_queries($impact, $qset, ""), 1);
+    compare("$qset: saat_impact without .impact", $ref, run_queries($plain, $qset, "-engine=saat_impact"), 1);
+    if ($qset eq $plain_qset) {
+	$sat = run_queries($impact, $qset, "-engine=saat_impact");
+	compare("$qset: saat_impact differs from relaxed_and", $ref, $sat, 0);
+	compare("$qset: saat_impact with a huge budget", $sat,
+		run_queries($impact, $qset, "-engine=saat_impact -impact_postings_budget=1000000000"), 1);
+	compare("$qset: saat_impact with 4 query streams", $sat,
+		run_queries($impact, $qset, "-engine=saat_impact -query_streams=4"), 1);
+	foreach $k (3, 5) {
+	    compare("$qset: saat_impact keeping $k candidates",
+		    run_queries($impact, $qset, "-engine=saat_impact -max_candidates=1000 -max_to_show=$k"),
+		    run_queries($impact, $qset, "-engine=saat_impact -max_candidates=$k -max_to_show=$k"), 1);
+	}
+    } else {
+	compare("$qset: saat_impact falls back", $ref, run_queries($impact, $qset, "-engine=saat_impact"), 1);
+    }
+}
+
+die "\nBother and blast! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nQBASH.impact behaves itself.  Smashing.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub compare {
+    # If $should_match, $a and $b must be the same, otherwise they must differ.
+    my $label = shift;
+    my $a = shift;
+    my $b = shift;
+    my $should_match = shift;
+    print "$label: ";
+    if (($a eq $b) == $should_match) {
+	print "[OK]\n";
+	return;
+    }
+    print "[FAIL]\n";
+    $err_cnt++;
+    if ($fail_fast) {
+	die "Can't write $tmpdir/a.out\n" unless open A, ">$tmpdir/a.out";
+	print A $a;
+	close A;
+	die "Can't write $tmpdir/b.out\n" unless open B, ">$tmpdir/b.out";
+	print B $b;
+	close B;
+	system("diff $tmpdir/a.out $tmpdir/b.out | head -20") if $should_match;
+	exit(1);
+    }
+}
+
+
+sub make_query_batches {
+    # The queries with operators from $ops_qset, and the queries from
+    # $plain_qset with a partial word appended.  Both limited to $max_qwds words.
+    my $n = 0;
+    die "Can't read $ops_qset\n" unless open IN, $ops_qset;
+    die "Can't write $opq\n" unless open OUT, ">$opq";
+    while (<IN>) {
+	next unless /[\[\]"~\/%]/;
+	next if (split /\s+/) > $max_qwds;
+	print OUT;
+    }
+    close IN;
+    close OUT;
+    die "Can't read $plain_qset\n" unless open IN, $plain_qset;
+    die "Can't write $partq\n" unless open OUT, ">$partq";
+    while (<IN>) {
+	chomp;
+	next if (split /\s+/) >= $max_qwds;
+	print OUT "$_ /", ("a", "s", "m", "c")[$n++ % 4], "\n";
+	last if $n >= 3000;
+    }
+    close IN;
+    close OUT;
+}
+
+
+sub build_index {
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone|^Degree of parallelism/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
@@ -0,0 +1,184 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks that QBASHI gives the same index whatever the value of
+# memory_budget_mb.  An index is built without a budget, and then with budgets
+# small enough to force partitions to be spilled to runs, with one and with
+# several index threads.  Each budgeted index must have the same .vocab and
+# .doctable, the same .if apart from its header (which records the options),
+# and give the same query results as the unbudgeted one.  The number of runs
+# must stay reasonable -- i.e. QBASHI mustn't spill after every document --
+# and no run files may be left behind.
+#
+# Also checks that a budget too small for even an empty partition is rejected.
+#
+# The indexes are built in Memory_Budget_Tempdata, which is removed if all
+# the checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$qset = "$tqdir/emulated_log_10k.q";
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qset.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $qset\n"
+	unless -r $qset;
+
+$tmpdir = "Memory_Budget_Tempdata";
+$IF_HEADER_LEN = 4096;   # As in QBASHER_common_definitions.h
+$max_runs = 100;   # Far more than should be needed for this collection
+
+$refdir = "$tmpdir/unbudgeted";
+build_index($refdir, "index_threads=1");
+$ref_results = run_queries($refdir);
+
+# Each option set must cause some spilling.
+@option_sets = (
+    "index_threads=1 memory_budget_mb=4",
+    "index_threads=1 memory_budget_mb=8",
+    "index_threads=4 memory_budget_mb=16",
+    "index_threads=3 memory_budget_mb=12",
+    );
+
+$err_cnt = 0;
+$d = 0;
+
+foreach $opts (@option_sets) {
+    $d++;
+    $dir = "$tmpdir/budget$d";
+    $log = build_index($dir, $opts);
+    print "{$opts}: ";
+    $runs = 0;
+    $runs = $1 if ($log =~ /Scan finished: ([0-9]+) runs were spilled/);
+    print "$runs runs.  ";
+    if ($runs < 1) {
+	fail("nothing was spilled");
+    } elsif ($runs > $max_runs) {
+	fail("too many runs");
+    } elsif (scalar(@left = glob("$dir/QBASH.if.run_*"))) {
+	fail("run files left behind");
+    } elsif (system("cmp -s $refdir/QBASH.vocab $dir/QBASH.vocab")) {
+	fail(".vocab differs");
+    } elsif (system("cmp -s $refdir/QBASH.doctable $dir/QBASH.doctable")) {
+	fail(".doctable differs");
+    } elsif (if_body("$refdir/QBASH.if") ne if_body("$dir/QBASH.if")) {
+	fail(".if differs");
+    } elsif (run_queries($dir) ne $ref_results) {
+	fail("query results differ");
+    } else {
+	print "[OK]\n";
+    }
+}
+
+# A budget smaller than twice an empty word table must be rejected.
+$dir = "$tmpdir/too_small";
+system("mkdir -p $dir");
+system("cp $fwd $dir/QBASH.forward");
+$cmd = "$dexer index_dir=$dir memory_budget_mb=1";
+print "{memory_budget_mb=1}: ";
+$out = `$cmd`;
+if ($? == 0) {
+    fail("too small a budget was accepted");
+} elsif ($out !~ /Error: memory_budget_mb=1 is too small/) {
+    fail("no explanation of the rejection");
+} else {
+    print "rejected [OK]\n";
+}
+
+die "\nFire and brimstone! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nBudgeted and unbudgeted indexes are the same.  Marvellous.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub fail {
+    my $msg = shift;
+    print "[FAIL] $msg\n";
+    $err_cnt++;
+    if ($fail_fast) {
+	print "\nIndexes retained in $tmpdir\n";
+	exit(1);
+    }
+}
+
+
+sub build_index {
+    # Build an index in $dir from $fwd with options $opts and return the
+    # indexer's output.
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    die "Can't write $dir/index.log\n" unless open L, ">$dir/index.log";
+    print L $out;
+    close L;
+    return $out;
+}
+
+
+sub if_body {
+    # Return the contents of a .if file, after the header.
+    my $fname = shift;
+    my $body;
+    local $/;
+    die "Can't read $fname\n" unless open IF, $fname;
+    binmode IF;
+    $body = <IF>;
+    close IF;
+    return substr($body, $IF_HEADER_LEN);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings.
+    my $dir = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
@@ -0,0 +1,229 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks QBASH.normforward, written by QBASHI -normforward=TRUE.  The file
+# only saves QBASHQ normalizing and splitting candidate documents, so indexes
+# built with it must give exactly the same results as indexes built without it
+# from the same .forward, for partial word queries and in the classifier
+# modes.  This is checked for an index with accents kept, one with accents
+# conflated (where the file holds de-accented text), and a sharded one.  With
+# substitutions, or with QBASHQ's x_conflate_accents not matching the file, the
+# file must be bypassed, again without changing the results.  Also checks that
+# the file is loaded, and that one which doesn't belong to the index is not.
+#
+# The indexes are built in Normforward_Tempdata, which is removed if all the
+# checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$rules = "$idxdir/wikipedia_titles/QBASH.substitution_rules";
+$qlog = "$tqdir/emulated_log_10k.q";
+$max_queries = 2000;
+$max_qwds = 8;   # Longer queries may be truncated, losing the partial word
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qlog.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $rules\n"
+	unless -r $rules;
+die "Can't find $qlog\n"
+	unless -r $qlog;
+
+$tmpdir = "Normforward_Tempdata";
+
+build_index("plain", "");
+build_index("normforward", "-normforward=TRUE");
+build_index("plain_ca", "-conflate_accents=TRUE");
+build_index("normforward_ca", "-conflate_accents=TRUE -normforward=TRUE");
+build_index("sharded", "-shards=4");
+build_index("sharded_normforward", "-shards=4 -normforward=TRUE");
+foreach $dir ("normforward", "normforward_ca", "sharded_normforward/shard3") {
+    die "$tmpdir/$dir/QBASH.normforward wasn't written\n"
+	unless -s "$tmpdir/$dir/QBASH.normforward";
+}
+
+# An index with a .normforward file from a different index.
+build_index("stale", "");
+die "Can't copy a stale .normforward file\n"
+    if system("cp $tmpdir/sharded_normforward/shard0/QBASH.normforward $tmpdir/stale");
+
+# Queries from the log as they are, and with a partial word of one or two
+# letters appended, some of them accented.
+$partq = "$tmpdir/partials.q";
+$wordq = "$tmpdir/words.q";
+make_query_batches();
+
+@classifier_sets = ();
+foreach $mode (1, 2, 3, 4) {
+    push @classifier_sets, "-classifier_mode=$mode -classifier_threshold=0.5 -relaxation_level=1";
+}
+
+# Each comparison is [index with file, index without, query set, options].
+@comparisons = (
+    ["normforward", "plain", $partq, ""],
+    ["normforward", "plain", $partq, "-relaxation_level=1"],
+    ["normforward", "plain", $partq, "-use_substitutions=TRUE -language=EN"],
+    ["normforward", "plain", $partq, "-x_conflate_accents=TRUE"],
+    ["normforward_ca", "plain_ca", $partq, "-x_conflate_accents=TRUE"],
+    ["normforward_ca", "plain_ca", $partq, ""],
+    ["normforward_ca", "plain_ca", $wordq, "-x_conflate_accents=TRUE $classifier_sets[2]"],
+    ["sharded_normforward", "sharded", $partq, ""],
+    ["sharded_normforward", "sharded", $wordq, $classifier_sets[1]],
+    ["stale", "plain", $partq, ""],
+    );
+foreach $opts (@classifier_sets) {
+    push @comparisons, ["normforward", "plain", $wordq, $opts];
+}
+
+$err_cnt = 0;
+
+foreach $c (@comparisons) {
+    ($with, $without, $qset, $opts) = @$c;
+    compare("$with v. $without: $qset {$opts}", run_queries($without, $qset, $opts),
+	    run_queries($with, $qset, $opts));
+}
+
+# The file must be loaded when it belongs to the index, and not otherwise.
+$oneq = "$tmpdir/one.q";
+die "Can't write $oneq\n" unless open Q, ">$oneq";
+print Q "cafe /s\n";
+close Q;
+foreach $dir ("normforward", "normforward_ca", "sharded_normforward", "stale") {
+    print "$dir: ";
+    $cmd = "$qp index_dir=$tmpdir/$dir -file_query_batch=$oneq -debug=1 2>&1";
+    $out = `$cmd`;
+    $loaded = ($out =~ /Loading \S+\/QBASH\.normforward/);
+    $rejected = ($out =~ /QBASH\.normforward doesn't match/);
+    if (!$loaded) {
+	fail("QBASH.normforward wasn't loaded");
+    } elsif ($rejected != ($dir eq "stale")) {
+	fail($rejected ? "QBASH.normforward was rejected" : "stale QBASH.normforward was accepted");
+    } else {
+	print $rejected ? "rejected" : "loaded", " [OK]\n";
+    }
+}
+
+die "\nHeavens to Betsy! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nQBASH.normforward changes nothing but the work done.  Wizard.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub fail {
+    my $msg = shift;
+    print "[FAIL] $msg\n";
+    $err_cnt++;
+    if ($fail_fast) {
+	print "\nIndexes retained in $tmpdir\n";
+	exit(1);
+    }
+}
+
+
+sub compare {
+    my $label = shift;
+    my $a = shift;
+    my $b = shift;
+    print "$label: ";
+    if ($a eq $b) {
+	print "[OK]\n";
+	return;
+    }
+    if ($fail_fast) {
+	die "Can't write $tmpdir/a.out\n" unless open A, ">$tmpdir/a.out";
+	print A $a;
+	close A;
+	die "Can't write $tmpdir/b.out\n" unless open B, ">$tmpdir/b.out";
+	print B $b;
+	close B;
+	system("diff $tmpdir/a.out $tmpdir/b.out | head -20");
+    }
+    fail("results differ");
+}
+
+
+sub make_query_batches {
+    my @partials = ("a", "b", "c", "m", "s", "t", "r", "p", "w", "l", "se", "ma", "é", "ö");
+    my $n = 0;
+    die "Can't read $qlog\n" unless open IN, $qlog;
+    die "Can't write $partq\n" unless open P, ">$partq";
+    die "Can't write $wordq\n" unless open W, ">$wordq";
+    while (<IN>) {
+	chomp;
+	next if (split /\s+/) >= $max_qwds;
+	print P "$_ /", $partials[$n % ($#partials + 1)], "\n";
+	print W "$_\n";
+	last if ++$n >= $max_queries;
+    }
+    close IN;
+    close P;
+    close W;
+}
+
+
+sub build_index {
+    # Build an index in $tmpdir/$dir, with the substitution rules QBASHQ
+    # needs for -use_substitutions.
+    my $dir = "$tmpdir/" . shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    die "Can't copy $rules to $dir\n"
+	if system("cp $rules $dir");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $tmpdir/$dir and return
+    # the output, without the lines which report timings.
+    my $dir = shift;
+    my $qset = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$tmpdir/$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
@@ -0,0 +1,143 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks that running a query batch with several query streams gives exactly
+# the same output, in the same order, as running it with one.  With more than
+# one stream, QBASHQ hands queries to a pool of worker threads and writes their
+# results out in input order, so no reordering is allowed (cf.
+# qbash_multi_threading_check.pl, which tolerates it.)
+#
+# Each option set is run several times with each number of streams, with more
+# streams than most machines have cores, so that different interleavings of
+# the workers get a chance to show up.  The query batch mixes plain queries,
+# queries with per-query options, multi-queries and query labels.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$ix = "$idxdir/wikipedia_titles";
+$qset = "$tqdir/emulated_log_10k.q";
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects a current index in $ix and
+         test queries in $qset.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+die "Can't find QBASHER indexes in $ix\n"
+	unless (-r "$ix/QBASH.if");
+
+$qbatch = "query_streams_check.q";
+$reffile = "tmp_query_streams_A";
+$qsfile = "tmp_query_streams_B";
+$repeats = 3;
+
+make_query_batch();
+
+@option_sets = (
+    "",
+    "-x_batch_testing=TRUE -display_col=1 -max_to_show=10",
+    "-relaxation_level=1 -alpha=0.5 -beta=0.2 -gamma=0.2 -zeta=0.3 -max_candidates=200",
+    "-auto_partials=on -timeout_kops=1000",
+    "-classifier_mode=1 -classifier_threshold=0.3 -relaxation_level=1",
+    "-result_cache_mb=1",
+    );
+
+$err_cnt = 0;
+
+foreach $opts (@option_sets) {
+    print "{$opts}\n";
+    $cmd = "$qp index_dir=$ix $opts -query_streams=1 < $qbatch";
+    run_to_file($cmd, $reffile);
+    foreach $QS (2, 4, 8, 16) {
+	for ($r = 1; $r <= $repeats; $r++) {
+	    $cmd = "$qp index_dir=$ix $opts -query_streams=$QS < $qbatch";
+	    run_to_file($cmd, $qsfile);
+	    print "   $QS query streams, run $r: ";
+	    if (system("cmp -s $reffile $qsfile")) {
+		print "[FAIL] output differs from a single stream\n";
+		$err_cnt++;
+		if ($fail_fast) {
+		    system("diff $reffile $qsfile | head -20");
+		    print "\nCommand was: $cmd\n";
+		    exit(1);
+		}
+	    } else {
+		print "[OK]\n";
+	    }
+	}
+    }
+}
+
+die "\nThunder and lightning! $err_cnt failures.\n"
+    if ($err_cnt);
+
+unlink $reffile;
+unlink $qsfile;
+unlink $qbatch;
+print "\nSingle and multiple query streams agree.  Jolly good.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub make_query_batch {
+    # The first 3000 queries from $qset, with options, labels and extra query
+    # variants attached to some of them.
+    my $n = 0;
+    die "Can't read $qset\n" unless open QS, $qset;
+    die "Can't write $qbatch\n" unless open QB, ">$qbatch";
+    while (<QS>) {
+	chomp;
+	s/\r//;
+	next unless /\S/;
+	$n++;
+	if ($n % 7 == 0) {
+	    print QB "$_\t-max_to_show=3\n";
+	} elsif ($n % 11 == 0) {
+	    print QB "$_\t-relaxation_level=1\n";
+	} elsif ($n % 13 == 0) {
+	    print QB "$_\t\t1.0\036$_/\t\t0.5\035LABEL$n\n";
+	} elsif ($n % 17 == 0) {
+	    print QB "$_\035LABEL$n\n";
+	} else {
+	    print QB "$_\n";
+	}
+	last if $n >= 3000;
+    }
+    close QS;
+    close QB;
+}
+
+
+sub run_to_file {
+    # Run $cmd, saving its output without the lines which report timings or
+    # the number of streams.
+    my $cmd = shift;
+    my $file = shift;
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    die "Can't write $file\n" unless open F, ">$file";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone|^Degree of parallelism/i;
+	print F "$_\n";
+    }
+    close F;
+}
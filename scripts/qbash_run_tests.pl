@@ -25,7 +25,7 @@ $lite_tests = 0;
 print "
 Usage: qbash_run_tests.pl [GCC] [RI | LITE | BASIC | FULL] [ithreads=<int>] [qthreads=<int>]
 
-    'GCC', meaning test with the GCC-built executables (no multi-threading, no C#),
+    'GCC', meaning test with the GCC-built executables (no C#),
     'LITE', meaning run a reduced set of tests (a quick check)
     'BASIC', meaning run the LITE tests plus some longer ones,
     'FULL', meaning run all tests including ones with very large query sets, or
@@ -120,12 +120,21 @@ if ($lite_tests) {
 	"disjunctions",
 	"substitution_rules",
 	"classifier_modes",    
+	"sharded_classifier",
 	"relaxation",
 	"street_addresses",
 	"index_modes",
+	"block_postings",
+	"memory_budget",
+	"impact_file",
+	"head_answers",
+	"bloom_file",
+	"normforward",
+	"delta_segments",
 	"timeout",
 	"fuzz",
 	"batch_labels",
+	"query_streams",
 	);
 } else {
     @tests = (
@@ -143,14 +152,23 @@ if ($lite_tests) {
 	"substitution_rules",
 	"c-sharp",
 	"classifier_modes",    
+	"sharded_classifier",
 	# "option_overrides",   # This test needs work
 	"relaxation",
 	"street_addresses",
 	"multi_threading",
 	"index_modes",
+	"block_postings",
+	"memory_budget",
+	"impact_file",
+	"head_answers",
+	"bloom_file",
+	"normforward",
+	"delta_segments",
 	"fuzz",
 	"batch_labels",
 	"timeout",
+	"query_streams",
 	);
 }
 
@@ -259,8 +277,7 @@ for ($th = 0; $th < $qthreads; $th++) {
 	    my $rezo;
 	    if ($global_abort) {last;}
 	    $rezo = run_test($tests[$test]) 
-		unless $use_gcc_executables && 
-		($tests[$test] =~ /c-sharp/ || $tests[$test] =~ /multi_threading/);
+		unless $use_gcc_executables && $tests[$test] =~ /c-sharp/;
 	    if ($rezo) {
 		$global_abort++;
 		last;
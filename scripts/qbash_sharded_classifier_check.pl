@@ -0,0 +1,140 @@
+#! /usr/bin/perl - w
+
+# Copyright (c) Microsoft Corporation. All rights reserved.
+# Licensed under the MIT license.
+
+
+# Checks that the classifier modes give exactly the same results from a
+# sharded index (QBASHI -shards=N) as from an unsharded index built from the
+# same .forward file.  The candidates from all the shards must be considered
+# and merged by score, and in classifier modes 2 and 4 the IDFs must be those
+# of the whole collection.
+#
+# Both indexes are built in Sharded_Classifier_Tempdata, which is removed if
+# all the checks pass.
+
+# Assumes run in a directory with the following subdirectories:
+
+$idxdir = "../test_data";
+$tqdir = "../test_queries";
+
+$|++;
+
+$fwd = "$idxdir/wikipedia_titles/QBASH.forward";
+$qset = "$tqdir/emulated_log_10k.q";
+$num_shards = 4;
+
+die "Usage: $0 <QBASHQ_binary> [-fail_fast]
+   Note: This script expects $fwd and
+         test queries in $qset.\n"
+	unless ($#ARGV >= 0);
+
+$qp = $ARGV[0];
+$qp = "../src/visual_studio/x64/Release/QBASHQ.exe"
+    if $qp eq "default";
+
+die "$qp is not executable\n" unless -e $qp;
+
+$fail_fast = 0;
+$fail_fast = 1 if ($#ARGV > 0 && $ARGV[1] eq "-fail_fast");
+
+$dexer = $qp;
+$dexer =~ s/QBASHQ/QBASHI/;
+$dexer =~ s/qbashq/qbashi/;
+
+die "Can't find $fwd\n"
+	unless -r $fwd;
+die "Can't find $qset\n"
+	unless -r $qset;
+
+$tmpdir = "Sharded_Classifier_Tempdata";
+$unsharded = "$tmpdir/unsharded";
+$sharded = "$tmpdir/sharded";
+
+build_index($unsharded, "");
+build_index($sharded, "-shards=$num_shards");
+die "$sharded/shard" . ($num_shards - 1) . " wasn't written\n"
+    unless -r "$sharded/shard" . ($num_shards - 1) . "/QBASH.if";
+
+@option_sets = ();
+foreach $mode (1, 2, 3, 4) {
+    foreach $rl (0, 1, 2) {
+	push @option_sets, "-classifier_mode=$mode -classifier_threshold=0.5 -relaxation_level=$rl";
+    }
+}
+push @option_sets, "-classifier_mode=2 -classifier_threshold=0.3 -relaxation_level=2 -max_to_show=20";
+push @option_sets, "-classifier_mode=3 -relaxation_level=1 -segment_threads=$num_shards";
+push @option_sets, "-classifier_mode=1 -relaxation_level=1 -classifier_min_words=2 -chi=0.6 -psi=0.2 -omega=0.2";
+
+$err_cnt = 0;
+
+foreach $opts (@option_sets) {
+    print "{$opts}: ";
+    $out_unsharded = run_queries($unsharded, $opts);
+    $out_sharded = run_queries($sharded, $opts);
+    if ($out_unsharded ne $out_sharded) {
+	print "[FAIL] results differ\n";
+	$err_cnt++;
+	if ($fail_fast) {
+	    save_and_diff($out_unsharded, $out_sharded);
+	    exit(1);
+	}
+    } else {
+	print "[OK]\n";
+    }
+}
+
+die "\nWrack and ruin! $err_cnt failures.\n"
+    if ($err_cnt);
+
+system("rm -rf $tmpdir");
+print "\nSharded and unsharded indexes classify alike.  Capital.\n";
+exit(0);
+
+
+#----------------------------------------------------------------
+
+
+sub build_index {
+    my $dir = shift;
+    my $opts = shift;
+    system("mkdir -p $dir");
+    die "Can't create $dir\n" unless -d $dir;
+    die "Can't copy $fwd to $dir\n"
+	if system("cp $fwd $dir/QBASH.forward");
+    my $cmd = "$dexer index_dir=$dir $opts > $dir/index.log";
+    print "Indexing: $cmd\n";
+    die "Command '$cmd' failed with code $?\n"
+	if system($cmd);
+}
+
+
+sub run_queries {
+    # Run the queries in $qset against the index in $dir and return the
+    # output, without the lines which report timings or operation counts.
+    my $dir = shift;
+    my $opts = shift;
+    my $cmd = "$qp index_dir=$dir -file_query_batch=$qset $opts";
+    my $out = `$cmd`;
+    die "Command '$cmd' failed with code $?\n"
+	if ($?);
+    my $filtered = "";
+    foreach (split /\n/, $out) {
+	next if /elapsed|QPS|msec|^\s*[0-9.]+th -|^Milestone|Global_IDF Lookups/i;
+	$filtered .= "$_\n";
+    }
+    return $filtered;
+}
+
+
+sub save_and_diff {
+    my $a = shift;
+    my $b = shift;
+    die "Can't write $tmpdir/unsharded.out\n" unless open A, ">$tmpdir/unsharded.out";
+    print A $a;
+    close A;
+    die "Can't write $tmpdir/sharded.out\n" unless open B, ">$tmpdir/sharded.out";
+    print B $b;
+    close B;
+    system("diff $tmpdir/unsharded.out $tmpdir/sharded.out | head -20");
+}
@@ -10,6 +10,7 @@
 #include <Psapi.h>  // Windows Process State API
 #else
 #include <errno.h>
+#include <pthread.h>
 #endif
 
 #include <stdio.h>
@@ -38,6 +39,7 @@ static double earth_radius = 6371.0;  // Km
 static int MAX_LINE = MAX_DOCBYTES_NORMAL;    // Will be increased by -x_bigger_trigger..
                                               // Only used in file order indexing
 #define DFLT_MAX_DOCS 127000000000   // 100 billion +
+#define MAX_INDEX_THREADS 64
 
 
 // QBASHI Builds an inverted file index for searching and auto-suggesting.  It takes as input
@@ -65,7 +67,6 @@ static int MAX_LINE = MAX_DOCBYTES_NORMAL;    // Will be increased by -x_bigger_
 
 
 CROSS_PLATFORM_FILE_HANDLE forward_handle, dt_handle;  // Make global so error handlers can close.
-static dahash_table_t *word_table = NULL;
 
 // Define the masks and shifts to enable extraction of the fields from a .doctable entry.
 // the fields are:  word count, document offset in .forward, document static score, and
@@ -96,6 +97,9 @@ DTE_WDCNT_SHIFT,
 // Variables settable from the command line
 u_int SB_POSTINGS_PER_RUN = 0;   // How many postings per skip block run.  Can't exceed SB_MAX_COUNT.  Zero means set dynamically
 u_int SB_TRIGGER = 500;            // If there are more than this number of postings and it's > 0, skip blocks will be inserted.
+BOOL block_postings = FALSE;       // If TRUE, write postings lists in blocks (INDEX_FORMAT_BLOCKED) rather than with skip blocks.
+BOOL impact_file = FALSE;          // If TRUE, also write QBASH.impact for QBASHQ -engine=saat_impact.
+BOOL normforward = FALSE;          // If TRUE, also write QBASH.normforward.  See QBASHER_common_definitions.h
 docnum_t x_max_docs = DFLT_MAX_DOCS;   // QBASHI can be configured to stop after x_max_docs records.  This 
 double max_forward_GB;
 docnum_t doccount = 0, ignored_docs = 0, truncated_docs = 0, incompletely_indexed_docs = 0, empty_docs = 0;
@@ -107,6 +111,12 @@ u_int min_wds = 0, max_wds = 0;   // You can tell QBASHI to index only records w
 u_int max_line_prefix = 0, // This turns on and controls the line prefix indexing mechanism.
                            // (Autosuggest when there are no full words)
   max_line_prefix_postings = 100;  
+u_int head_answers = 0,    // If > 0, write this many answers per line prefix to QBASH.if.head_answers
+  head_answers_min_postings = 50;   // ... for line prefixes with at least this many postings.
+int index_threads = 1;   // Records are indexed in this many partitions, in parallel.  See index_partition_t.
+int memory_budget_mb = 0;   // If > 0, partitions are spilled to runs to keep within about this much memory.
+int shards = 1;   // If > 1, each partition is written as a separate shard.  See QBASHER_common_definitions.h
+int bloom_bits = 0;   // If > 0, also write QBASH.bloom with signatures of this many bits.  See QBASHER_common_definitions.h
 
 // The following group of declarations correspond to options which are regarded as experimental.  I.e, the 
 // non-experimental values are set as defaults and the corresponding x_<blah> option can be used to 
@@ -129,10 +139,10 @@ DWORD pfc_list_build_start, pfc_list_build_end, pfc_list_scan_start, pfc_list_sc
 
 int debug = 0, MAX_WDS_INDEXED_PER_DOC = MAX_WDPOS + 1;
 u_char *index_dir = NULL, *fname_if = NULL, *fname_doctable = NULL, *fname_vocab = NULL, 
-  *fname_forward = NULL, *fname_dlh = NULL, *language = NULL, *other_token_breakers = NULL,
+  *fname_forward = NULL, *fname_dlh = NULL, *fname_bloom = NULL, *fname_normforward = NULL, *language = NULL, *other_token_breakers = NULL,
   *token_break_set = NULL;
 BOOL sort_records_by_weight = TRUE, unicode_case_fold = TRUE, conflate_accents = FALSE,
-  expect_cp1252 = TRUE, this_trigger_was_truncated = FALSE;
+  expect_cp1252 = TRUE;
 
 // Next two are items for when we sort postings rather than build linked lists (not fully implemented)
 byte *postings_accumulator_for_sort;
@@ -140,12 +150,11 @@ u_ll postings_accumulated;
 
 
 
-doh_t ll_heap;     // Note that ll_heap is nothing to do with min_heaps or max_heaps.  It's a reference to 
-// a program-managed memory heap in which linked_list blocks are allocated.   Replacing 
+// Each index partition has an ll_heap.  Note that ll_heap is nothing to do with min_heaps or max_heaps.
+// It's a reference to a program-managed memory heap in which linked_list blocks are allocated.   Replacing 
 // millions of very small malloc()s with a small number of big ones saved huge amounts of 
 // time and reduced memory overhead.  A pointer to ll_heap is passed to all the functions
 // which need to access linked lists.
-size_t num_doh_blocks;   // DOH = Dave's Own Heap
 
 
 static void print_usage();
@@ -578,10 +587,9 @@ static void show_count_n_postings(const void *valptr, doh_t ll_heap) {
 // Functions for accessing records in QBASH.forward and indexing the trigger                                           //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos, u_ll *max_plist_len, 
-		    doh_t ll_heap) {
-  // Look up wd in the vocabulary hash, inserting if not already there. Update 
-  // occurrence count, add a posting and boost max_plist_len if appropriate
+static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos, index_partition_t *ixp) {
+  // Look up wd in the vocabulary hash of partition ixp, inserting if not already there. Update 
+  // occurrence count and add a posting.
   // All the information needed to build the .vocab and .if files is accumulated
   // in memory until the input is all consumed, then those files are written.
   // The in-memory representation is a hash table keyed by words in the vocabulary,
@@ -605,7 +613,7 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
   // ASCII lower casing
   if (unicode_case_fold) utf8_lower_case(wd);  // This function returns length but we ignore it.
 
-  vep = (vocab_entry_p)dahash_lookup(word_table, (byte *)wd, 1);  // Returns a pointer to the value part of the entry.
+  vep = (vocab_entry_p)dahash_lookup(ixp->word_table, (byte *)wd, 1);  // Returns a pointer to the value part of the entry.
   if (vep != NULL) {
     // NOTE: Memory in the hash table is zeroed when created
     count = ve_get_count(vep);   // ve_get_count works whether the hash table entry is organized 4,6,6 or 4,5,5,2.  This relies on that
@@ -616,7 +624,7 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
       byte *entryp;
       u_ll *entryullp, ull;
       u_short *entryshortp;
-      vep -= word_table->key_size;  // In this mode, we want this to point to the key rather than the value
+      vep -= ixp->word_table->key_size;  // In this mode, we want this to point to the key rather than the value
 
       if (postings_accumulator_for_sort == NULL) {
 	// The value of x_sort_postings_instead gives the number of million entries in an array of termid, docnum, wordpos postings
@@ -626,7 +634,7 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
       else if (postings_accumulated > x_sort_postings_instead * 1000000) {
 	error_exit("Array postings_accumulator_for_sort has overflowed.");
       }
-      termid = (u_int)((vep - (vocab_entry_p)(word_table->table))/word_table->entry_size);   // Termid is just entry number in vocab
+      termid = (u_int)((vep - (vocab_entry_p)(ixp->word_table->table))/ixp->word_table->entry_size);   // Termid is just entry number in vocab
 
       if (0) printf("PAW(%s) - termid is %u.  HT contains (%s)\n", wd, termid, vep);
       entryp = postings_accumulator_for_sort + postings_accumulated * SORTABLE_POSTING_SIZE;
@@ -665,16 +673,16 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
 	    wdpost = dnwp1 & WDPOS_MASK;
 	    if (0) printf("Count=2.  About to append 1. doccountt = %llu, wdpost = %u, count = %u\n",
 			  doccountt, wdpost, count);
-	    append_posting(ll_heap, vep, doccountt, wdpost, wd);   // Transfer the first posting
+	    append_posting(ixp->ll_heap, vep, doccountt, wdpost, wd);   // Transfer the first posting
 	    doccountt = dnwp2 >> WDPOS_BITS;
 	    wdpost = dnwp2 & WDPOS_MASK;
 	    if (0) printf("Count=2.  About to append 2.\n");
 	    ve_store_count(vep, 2);
-	    append_posting(ll_heap, vep, doccountt, wdpost, wd);  // Transfer the second posting
+	    append_posting(ixp->ll_heap, vep, doccountt, wdpost, wd);  // Transfer the second posting
 	    // Finally, append the [third] posting we've just encountered
 	    if (0) printf("Count=2.  About to append 3.\n");
 	    ve_store_count(vep, 3);
-	    append_posting(ll_heap, vep, doccount, wdpos, wd);  // Store the new (third) posting
+	    append_posting(ixp->ll_heap, vep, doccount, wdpos, wd);  // Store the new (third) posting
 	    if (0) printf("Count=2.  Done appending.\n");
 	  }
 	  else if (count == 1) {
@@ -705,9 +713,8 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
 
 	count++;
 	ve_store_count(vep, count);
-	if (count > *max_plist_len) *max_plist_len = count;
 	if (0) printf("  ------  About to append a posting for '%s', count = %d\n", wd, count);
-	append_posting(ll_heap, vep, doccount, wdpos, wd);
+	append_posting(ixp->ll_heap, vep, doccount, wdpos, wd);
       }
   }
   else {
@@ -715,28 +722,26 @@ static void process_a_word_internal(u_char *wd, docnum_t doccount, u_int wdpos,
   }
 }
 
-void process_a_word(u_char *wd, docnum_t doccount, u_int wdpos, u_ll *max_plist_len, 
-		    doh_t ll_heap) {
+static void process_a_word(u_char *wd, docnum_t doccount, u_int wdpos, index_partition_t *ixp) {
   // This fn is now a front-end to process_a_word_internal(), which allows us to
   // generate multiple variants of the same word and index them at the same word
   // position.  This structure is initially motivated by the desire to be able
   // to index accented and unaccented versions of a word.
 
   int accents_removed = 0, verbose = 0;
-  process_a_word_internal(wd, doccount, wdpos, max_plist_len, ll_heap);  // First one first
+  process_a_word_internal(wd, doccount, wdpos, ixp);  // First one first
   if (conflate_accents) {
     if (verbose) printf("Indexed '%s' at position %d\n", wd, wdpos);
     accents_removed = utf8_remove_accents(wd);
     if (accents_removed > 0) {
-      process_a_word_internal(wd, doccount, wdpos, max_plist_len, ll_heap);
+      process_a_word_internal(wd, doccount, wdpos, ixp);
       if (verbose) printf("Also indexed '%s' at position %d\n", wd, wdpos);
     }
   }
 }
 
 
-static int process_trigger(u_char *str, docnum_t doccount, u_ll *max_plist_len,
-			   doh_t ll_heap) {
+static int process_trigger(u_char *str, docnum_t doccount, index_partition_t *ixp) {
   // str is assumed to be a null terminated string in which words are separated by 
   // non-token characters.   Break into words and (eventually) add to the term
   // hash.
@@ -782,14 +787,14 @@ static int process_trigger(u_char *str, docnum_t doccount, u_ll *max_plist_len,
 	  if (verbose) printf("Indexing UTF-8 '%s'\n", line_prefix);
 	}	  
 	line_prefix[l] = 0;
-	process_a_word(line_prefix, doccount, 0, max_plist_len, ll_heap);
+	process_a_word(line_prefix, doccount, 0, ixp);
 	// wdcount++;  // Don't count invisible words!
       } else {
 	if (ascii_non_tokens[*p] || *p == 0) break;  
 	line_prefix[l++] = *p++;
 	line_prefix[l] = 0;
 	if (verbose) printf("Indexing ASCII'%s'\n", line_prefix);
-	process_a_word(line_prefix, doccount, 0, max_plist_len, ll_heap);
+	process_a_word(line_prefix, doccount, 0, ixp);
 	// wdcount++; // Don't count invisible words!
       }
     }
@@ -825,7 +830,7 @@ static int process_trigger(u_char *str, docnum_t doccount, u_ll *max_plist_len,
       savep = *p;
       *p = 0;
       if (wdstart[0]) {
-	process_a_word(wdstart, doccount, wdcount, max_plist_len, ll_heap);
+	process_a_word(wdstart, doccount, wdcount, ixp);
 	wdcount++;
 	if (verbose) printf("INdexing '%s'\n", wdstart);
       }
@@ -848,7 +853,7 @@ static int process_trigger(u_char *str, docnum_t doccount, u_ll *max_plist_len,
       // Processing the last word in the trigger
       if (verbose) printf("   Processing last word in trigger\n");
       if (!ascii_non_tokens[wdstart[0]]) {
-	process_a_word(wdstart, doccount, wdcount, max_plist_len, ll_heap);
+	process_a_word(wdstart, doccount, wdcount, ixp);
 	wdcount++;
 	if (verbose) printf("INDexing '%s'\n", wdstart);
       }
@@ -873,24 +878,23 @@ static int process_trigger(u_char *str, docnum_t doccount, u_ll *max_plist_len,
     }
   }  // End of outer loop over words.
 
-  if (this_trigger_was_truncated) incompletely_indexed = TRUE;  // this_trigger_was_truncated means length exceeded buffer
-  if (incompletely_indexed) incompletely_indexed_docs++;
+  if (ixp->this_trigger_was_truncated) incompletely_indexed = TRUE;  // this_trigger_was_truncated means length exceeded buffer
+  if (incompletely_indexed) ixp->incompletely_indexed_docs++;
 
-  tot_postings += wdcount;
+  ixp->tot_postings += wdcount;
   if (verbose) printf("Wdcnt = %d\n", wdcount);
 
   //if (0 && wdcount == 1) printf("Short rec: %d wds: '%s'\n", wdcount, str);
-  if (x_doc_length_histo && index_dir != NULL  && doc_length_histo != NULL) {
-    if (incompletely_indexed) doc_length_histo[MAX_WDS_INDEXED_PER_DOC + 1]++;  // Array malloced with MAX_w... + 2
-    else if (wdcount > 0) doc_length_histo[wdcount]++;
+  if (x_doc_length_histo && index_dir != NULL  && ixp->doc_length_histo != NULL) {
+    if (incompletely_indexed) ixp->doc_length_histo[MAX_WDS_INDEXED_PER_DOC + 1]++;  // Array malloced with MAX_w... + 2
+    else if (wdcount > 0) ixp->doc_length_histo[wdcount]++;
   }
   return  wdcount;
 } 
 
-#define CPYBUF_SIZE MAX_DOCBYTES_BIGGER 
-static u_char cpybuf[CPYBUF_SIZE + 1];  // Used in split_and_index_record() below
+#define CPYBUF_SIZE MAX_DOCBYTES_BIGGER   // Size of the cpybuf in each index partition
 
-static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_plist_len, doh_t ll_heap, 
+static double split_and_index_record(u_char *buf, docnum_t doccount, index_partition_t *ixp,
 				     unsigned long long *d_signature, u_int *wds_indexed,
 				     size_t *actual_trigger_length) {
   // Each input record consists of at least two tab separated fields.
@@ -898,7 +902,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
   // Return the raw score as a double
   // Skip indexing if the raw score in column 2 is below the score_threshold.
   // Also calculate and return a signature based on word first letters.
-  u_char *start = buf, *end = start, *p, *q;
+  u_char *start = buf, *end = start, *p, *q, *cpybuf = ixp->cpybuf;
   double score;
   int l = 0;
 
@@ -907,7 +911,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
     show_string_upto_nator(start, '\n', 0);
   }
 
-  this_trigger_was_truncated = FALSE;
+  ixp->this_trigger_was_truncated = FALSE;
 
   // Scan the trigger (first column) and copy into cpybuf 
   while (*end && *end != '\t' && l < CPYBUF_SIZE) {
@@ -916,7 +920,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
   }
   cpybuf[l] = 0;
   if (l >= CPYBUF_SIZE) {
-    this_trigger_was_truncated = TRUE;
+    ixp->this_trigger_was_truncated = TRUE;
     // The trigger field has been truncated.  Avoid the chance of indexing a truncated word.
     l--;
     while (l >= 0 && ((cpybuf[l] & 0x80) || (!ascii_non_tokens[cpybuf[l]]))) {
@@ -927,7 +931,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
     }
     // Now skip end forward to the tab so we can get the frequency.
     while (*end && *end != '\t') end++;
-    truncated_docs++;
+    ixp->truncated_docs++;
   }
   *actual_trigger_length = end - buf;
 
@@ -945,9 +949,9 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
   }
   if (score < score_threshold) return score;  // Frequency too low, signal no_index
   *d_signature = calculate_signature_from_first_letters(cpybuf, (int)DTE_BLOOM_BITS);
-  *wds_indexed = process_trigger(cpybuf, doccount, max_plist_len, ll_heap);
+  *wds_indexed = process_trigger(cpybuf, doccount, ixp);
   if (*wds_indexed <= 0)
-    empty_docs++;
+    ixp->empty_docs++;
 
   // Generation and indexing of special words indicating geospatial tiles
   if (x_geo_tile_width > 0) {
@@ -983,7 +987,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
 					       MAX_WD_LEN, 0);
 	    for (g = 0; g < generated; g++) {
 	      process_a_word((u_char *)special_words + g * (MAX_WD_LEN + 1), doccount,
-			     wdpos, max_plist_len, ll_heap);
+			     wdpos, ixp);
 	      if (0) printf("   Special word '%s' indexed at wdpos %d\n",
 			    special_words + g * (MAX_WD_LEN + 1), wdpos);
 	      if (g == 2) wdpos++;  // First three are lat words, 2nd three are long words	      
@@ -1000,7 +1004,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
 	      for (g = 0; g < generated; g++) {
 		strcpy(big_words + 3, special_words + g * (MAX_WD_LEN + 1));  // Buffer has room
 		process_a_word((u_char *)big_words, doccount,
-			       wdpos, max_plist_len, ll_heap);
+			       wdpos, ixp);
 		if (0) printf("   Special word '%s' indexed at wdpos %d\n",
 			      special_words + g * (MAX_WD_LEN + 1), wdpos);
 		if (g == 2) wdpos++;  // First three are lat words, 2nd three are long words	      
@@ -1035,7 +1039,7 @@ static double split_and_index_record(u_char *buf, docnum_t doccount, u_ll *max_p
 								    TRUE, FALSE, FALSE, FALSE);
 	      for (w = 0; w < numWords; w++) {
 		process_a_word(funny_word_starts[w], doccount,
-			       ++wdpos, max_plist_len, ll_heap);
+			       ++wdpos, ixp);
 		if (0) printf("   Special word '%s' indexed at wdpos %d\n",
 			      funny_word_starts[w], wdpos);
 	      }
@@ -1113,11 +1117,51 @@ static int count_wds_in_trigger(u_char *str) {
 
 
 #define DFLT_DOH_BLOCKSIZE 67108864   // that ensures allocations are 64MB which is large multiple of the 1 or 2MB Large Page size [Note: bytes not entries]
+#define MIN_BUDGETED_HASHBITS 16   // The smallest word table used to keep within memory_budget_mb
+
+static int budgeted_hashbits = 0;   // If > 0, the largest hashbits for which an empty word table takes
+                                    // no more than half of a partition's share of memory_budget_mb.
+
+
+static void set_budgeted_hashbits() {
+  // With memory_budget_mb set, a partition is spilled whenever its word table plus postings take
+  // more than its share of the budget.  If the freshly allocated word table alone took most of
+  // that share, every document would cause a spill.  So cap the size of the word tables at half
+  // the share, and reject budgets too small to allow even a MIN_BUDGETED_HASHBITS table.
+  double share = (double)memory_budget_mb * MEGA / (double)index_threads;
+  double entry_size = (double)(MAX_WD_LEN + 1 + VOCAB_ENTRY_SIZE);   // As in dahash_create()
+  int min_budget_mb;
+
+  if (memory_budget_mb <= 0) return;  // ------------------------------------------------------->
+  if (x_hashbits) {
+    if ((double)(1ULL << x_hashbits) * entry_size > share / 2.0) {
+      printf("Error: memory_budget_mb=%d allows only %.1fMB per partition, but a word table with x_hashbits=%d takes %.1fMB.\n"
+	     "       The budget must be at least twice the size of the word tables.\n",
+	     memory_budget_mb, share / MEGA, x_hashbits, (double)(1ULL << x_hashbits) * entry_size / MEGA);
+      exit(1);
+    }
+    return;  // ------------------------------------------------------->
+  }
+  if ((double)(1ULL << MIN_BUDGETED_HASHBITS) * entry_size > share / 2.0) {
+    min_budget_mb = (int)ceil(2.0 * (double)(1ULL << MIN_BUDGETED_HASHBITS) * entry_size * (double)index_threads / MEGA);
+    printf("Error: memory_budget_mb=%d is too small for %d partition(s).  An empty partition takes %.1fMB.\n"
+	   "       Please give memory_budget_mb=%d or more.\n",
+	   memory_budget_mb, index_threads, (double)(1ULL << MIN_BUDGETED_HASHBITS) * entry_size / MEGA,
+	   min_budget_mb);
+    exit(1);
+  }
+  budgeted_hashbits = MIN_BUDGETED_HASHBITS;
+  while (budgeted_hashbits < 40 && (double)(1ULL << (budgeted_hashbits + 1)) * entry_size <= share / 2.0)
+    budgeted_hashbits++;
+}
+
 
-void allocate_hashtable_and_heap(docnum_t doccount_estimate) {
+static void allocate_hashtable_and_heap(index_partition_t *ixp, docnum_t doccount_estimate) {
   // The hashtable is for storing the vocabulary and the heap provides memory storage for the linked 
-  // lists representing postings lists internally.
+  // lists representing postings lists internally.  Both belong to the index partition ixp, as does
+  // the buffer into which triggers are copied for indexing.
   int hashbits;
+  size_t num_doh_blocks;   // DOH = Dave's Own Heap
 
   if (x_hashbits) hashbits = x_hashbits;   // Explicitly set
   else {
@@ -1129,9 +1173,10 @@ void allocate_hashtable_and_heap(docnum_t doccount_estimate) {
     else if (doccount_estimate > 50000000) hashbits = 23;
     else if (doccount_estimate > 15000000)hashbits = 22;
     else if (doccount_estimate > 5000000) hashbits = 21;
+    if (budgeted_hashbits > 0 && hashbits > budgeted_hashbits) hashbits = budgeted_hashbits;
   }
 
-  word_table = dahash_create((u_char *)"words", hashbits, MAX_WD_LEN, VOCAB_ENTRY_SIZE, (double)0.9, FALSE);
+  ixp->word_table = dahash_create((u_char *)"words", hashbits, MAX_WD_LEN, VOCAB_ENTRY_SIZE, (double)0.9, FALSE);
 #ifdef WIN64
   report_memory_usage(stdout, (u_char *)"after creating hash table", NULL);
 #endif
@@ -1141,11 +1186,51 @@ void allocate_hashtable_and_heap(docnum_t doccount_estimate) {
   // space is wasted in partly allocated chunks.
   if (x_bigger_trigger) num_doh_blocks *= 20;    // Have to substantially increase the allowance when indexing whole doc.s
   if (num_doh_blocks < 1) num_doh_blocks = 1;
-  ll_heap = doh_create_heap(num_doh_blocks, DFLT_DOH_BLOCKSIZE); // Each block can hold millions of  postings.
+  ixp->ll_heap = doh_create_heap(num_doh_blocks, DFLT_DOH_BLOCKSIZE); // Each block can hold millions of  postings.
 #ifdef WIN64
   report_memory_usage(stdout, (u_char *)"after initial doh creation", NULL);
 #endif
+  if (ixp->cpybuf == NULL) {   // Still there if the partition has been spilled
+    ixp->cpybuf = (u_char *)malloc(CPYBUF_SIZE + 1);  // MAL103
+    if (ixp->cpybuf == NULL) error_exit("Malloc of cpybuf failed");
+  }
+}
+
 
+static void spill_partition_if_over_budget(index_partition_t *ixp, docnum_t doccount_estimate) {
+  // If memory_budget_mb is set and the hash table and heap of ixp have outgrown its share of the
+  // budget, write their postings lists to a new run, then replace them with empty ones sized for
+  // about doccount_estimate more documents.  See index_partition_t.  Called between documents.
+  // set_budgeted_hashbits() ensures that an empty table takes at most half the share, so that
+  // each run holds at least that much.
+  index_partition_t *run;
+  size_t *header, fname_len;
+  double MB;
+
+  if (memory_budget_mb <= 0) return;  // ------------------------------------------------------->
+  header = (size_t *)ixp->ll_heap;
+  MB = ((double)ixp->word_table->capacity * (double)ixp->word_table->entry_size + (double)header[5]) / MEGA;
+  if (MB < (double)memory_budget_mb / (double)index_threads) return;  // ------------------------------------------------------->
+
+  ixp->runs = (index_partition_t *)realloc(ixp->runs, (ixp->num_runs + 1) * sizeof(index_partition_t));  // MAL108
+  if (ixp->runs == NULL) error_exit("Realloc of runs failed");
+  run = ixp->runs + ixp->num_runs;
+  memset(run, 0, sizeof(index_partition_t));
+  fname_len = strlen((char *)fname_if) + 50;
+  run->run_vocab_fname = (u_char *)malloc(fname_len);  // MAL109
+  run->run_postings_fname = (u_char *)malloc(fname_len);  // MAL109
+  if (run->run_vocab_fname == NULL || run->run_postings_fname == NULL) error_exit("Malloc of run file names failed");
+  sprintf((char *)run->run_vocab_fname, "%s.run_%d_%d.vocab", fname_if, ixp->partition_number, ixp->num_runs);
+  sprintf((char *)run->run_postings_fname, "%s.run_%d_%d.postings", fname_if, ixp->partition_number, ixp->num_runs);
+
+  spill_partition_to_run(ixp, run);
+  printf("Partition %d: %.1fMB in memory. %zu terms and %.1fMB of postings spilled to run %d\n",
+	 ixp->partition_number, MB, run->num_keys, (double)run->run_postings_size / MEGA, ixp->num_runs);
+  ixp->num_runs++;
+
+  doh_free(&(ixp->ll_heap));
+  dahash_destroy(&(ixp->word_table));
+  allocate_hashtable_and_heap(ixp, doccount_estimate);
 }
 
 
@@ -1154,28 +1239,380 @@ void allocate_hashtable_and_heap(docnum_t doccount_estimate) {
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-static void process_records_in_score_order(u_char *fname_forward, CROSS_PLATFORM_FILE_HANDLE dt_handle, dahash_table_t *word_table, 
-					   u_int min_wds, u_int max_wds, docnum_t *ignored_docs, docnum_t *gdoccount,
-					   u_ll *gmax_plist_len, size_t *infile_size) {
+static void index_permuted_records(index_partition_t *ixp) {
+  // Index the records at positions ixp->first_rec to ixp->end_rec - 1 of the permuted (score)
+  // order, numbering the documents from zero, and keep their .doctable entries in ixp->dt_entries.
+  u_char *p;
+  double raw_score;
+  long long docoff;
+  size_t trigger_len;
+  u_int wds = 0;   // wds in the current record
+  u_ll r, pr, dt_ent, qwt, d_signature = 0;
+
+  ixp->dt_entries = (u_ll *)malloc((ixp->end_rec - ixp->first_rec + 1) * sizeof(u_ll));  // MAL104
+  if (ixp->dt_entries == NULL) error_exit("Malloc of dt_entries failed");
+
+  for (r = ixp->first_rec; r < ixp->end_rec; r++) {
+    if (debug >= 2) printf("indexing record %lld\n", r);
+    pr = ixp->permute[r];
+    p = ixp->recstarts[pr];
+    if (*p < ' ') continue;   // This line is empty, will be ignored.
+    if (min_wds > 0 || max_wds > 0) {
+      // Only do this counting  if limits are being imposed.
+      wds = count_wds_in_trigger(p);  // Returns -1 in case of error
+      if (wds < min_wds || wds > max_wds) {
+	ixp->ignored_docs++;
+	continue;
+      }
+    } 
+    docoff = ixp->recstarts[pr] - ixp->forward;
+    raw_score = split_and_index_record(ixp->recstarts[pr], ixp->doccount, ixp, &d_signature, 
+				       &wds, &trigger_len);
+    if (wds > 0 && raw_score >= score_threshold) {
+      // We ignore records with scores below the frequency threshold and those which have no
+      // indexable words.
+
+      if ((u_ll)docoff > DTE_DOCOFF_MASK2) {
+	ixp->ignored_docs++;
+	continue;   // ----------------------------------------------->
+      }
+
+
+      qwt = (u_ll)quantize_log_score_ratio((double)raw_score, (double)log_max_score);
+      dt_ent = docoff << DTE_DOCOFF_SHIFT;
+      if (wds > DTE_WDCNT_MASK) wds = (int)DTE_WDCNT_MASK;
+      dt_ent |= (wds & DTE_WDCNT_MASK);
+      dt_ent |= ((qwt & DTE_DOCSCORE_MASK2) << DTE_DOCSCORE_SHIFT);
+      dt_ent |= ((d_signature & DTE_DOCBLOOM_MASK2) << DTE_DOCBLOOM_SHIFT);
+      ixp->dt_entries[ixp->doccount] = dt_ent;
+      ixp->doccount++;
+      spill_partition_if_over_budget(ixp, (docnum_t)(ixp->end_rec - r));
+
+      if (index_threads == 1 && ixp->doccount % 10000 == 0) {
+	printf("%11lld\n", ixp->doccount);
+#ifdef WIN64
+	report_memory_usage(stdout, (u_char *)"permuted scanning", NULL);
+#endif
+      }
+    }
+    else ixp->ignored_docs++;
+  }
+}
+
+
+#ifdef WIN64
+static DWORD WINAPI index_partition_thread(LPVOID arg) {
+#else
+static void *index_partition_thread(void *arg) {
+#endif
+  // Index one partition, then sort its vocabulary ready for write_inverted_file().
+  index_partition_t *ixp = (index_partition_t *)arg;
+  index_permuted_records(ixp);
+  sort_partition_vocabulary(ixp);
+#ifdef WIN64
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+
+static void index_partitions_in_parallel(index_partition_t *partitions, int num_partitions) {
+  // Run index_partition_thread() on each of the partitions, in its own thread, and wait for
+  // them all to finish.
+  int k;
+#ifdef WIN64
+  HANDLE *threads = (HANDLE *)malloc(num_partitions * sizeof(HANDLE));  // MAL105
+  if (threads == NULL) error_exit("Malloc of thread handles failed");
+  for (k = 0; k < num_partitions; k++) {
+    threads[k] = CreateThread(NULL, 0, index_partition_thread, (LPVOID)(partitions + k), 0, NULL);
+    if (threads[k] == NULL) error_exit("CreateThread() failed for an indexing thread");
+  }
+  WaitForMultipleObjects(num_partitions, threads, TRUE, INFINITE);
+  for (k = 0; k < num_partitions; k++) CloseHandle(threads[k]);
+#else
+  int code;
+  pthread_t *threads = (pthread_t *)malloc(num_partitions * sizeof(pthread_t));  // MAL105
+  if (threads == NULL) error_exit("Malloc of thread handles failed");
+  for (k = 0; k < num_partitions; k++) {
+    code = pthread_create(threads + k, NULL, index_partition_thread, (void *)(partitions + k));
+    if (code) {
+      printf("Error %d from pthread_create()\n", code);
+      error_exit("Unable to start an indexing thread");
+    }
+  }
+  for (k = 0; k < num_partitions; k++) pthread_join(threads[k], NULL);
+#endif
+  free(threads);  // FRE105
+}
+
+
+static u_ll strong_signature(u_char *rec, u_char *last, u_char *copy, u_char **dwds) {
+  // Return the QBASH.bloom signature of the record at rec, splitting its trigger into words as
+  // possibly_record_candidate() does in QBASHQ.  copy must have room for MAX_RESULT_LEN + 1 bytes
+  // and dwds for WDPOS_MASK + 1 pointers.
+  u_ll signature = 0;
+  u_char *p = rec;
+  int dc_len, w, n, pass;
+
+  while (p < last && *p >= ' ') p++;  // Skip to the tab
+  dc_len = (int)(p - rec);
+  if (dc_len > MAX_RESULT_LEN) return ~0ULL;   // QBASHQ rejects these anyway. ------------->
+  for (pass = 0; pass < 2; pass++) {
+    utf8_lowering_ncopy(copy, rec, dc_len);
+    if (pass == 1) utf8_remove_accents(copy);
+    copy[dc_len] = 0;
+    n = utf8_split_line_into_null_terminated_words(copy, dwds, WDPOS_MASK, MAX_WD_LEN, FALSE, FALSE, FALSE, FALSE);
+    for (w = 0; w < n; w++) {
+      if (dwds[w][0] == 0) continue;
+      signature |= BL_BIT(BL_KEY1(dwds[w][0]), bloom_bits);
+      if (dwds[w][1]) signature |= BL_BIT(BL_KEY2(dwds[w][0], dwds[w][1]), bloom_bits);
+    }
+  }
+  return signature;
+}
+
+
+static u_ll write_bloom_file(u_char *fname_fwd, u_char *fname_dt, u_char *fname_bl) {
+  // Write the QBASH.bloom file for the complete .forward and .doctable files given.  See
+  // QBASHER_common_definitions.h.  Return the size of the file in bytes.
+  CROSS_PLATFORM_FILE_HANDLE FH, DH, bl_handle;
+  HANDLE FMH, DMH;
+  u_char *forward, *copy, **dwds;
+  u_ll *doctable, header[BL_HEADER_ULLS], d, docoff, signature;
+  byte *bl_buf = NULL;
+  size_t fsz, dtsz, bl_buf_used = 0;
+  int error_code = 0, bytes = bloom_bits / 8;
+
+  forward = (u_char *)mmap_all_of(fname_fwd, &fsz, FALSE, &FH, &FMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .forward file for QBASH.bloom");
+  doctable = (u_ll *)mmap_all_of(fname_dt, &dtsz, FALSE, &DH, &DMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .doctable file for QBASH.bloom");
+  copy = (u_char *)malloc(MAX_RESULT_LEN + 1);  // MAL112
+  dwds = (u_char **)malloc((WDPOS_MASK + 1) * sizeof(u_char *));  // MAL113
+  if (copy == NULL || dwds == NULL) error_exit("Error: malloc failed for QBASH.bloom buffers");
+
+  header[0] = bloom_bits;
+  header[1] = dtsz / DTE_LENGTH;
+  bl_handle = open_w((char *)fname_bl, &error_code);
+  if (error_code) error_exit("Unable to open QBASH.bloom for writing.");
+  buffered_write(bl_handle, &bl_buf, HUGEBUFSIZE, &bl_buf_used, (byte *)header, sizeof(header), "QBASH.bloom header");
+  for (d = 0; d < header[1]; d++) {
+    docoff = (doctable[d] >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2;
+    signature = (docoff < fsz) ? strong_signature(forward + docoff, forward + fsz, copy, dwds) : ~0ULL;
+    buffered_write(bl_handle, &bl_buf, HUGEBUFSIZE, &bl_buf_used, (byte *)&signature, bytes, "QBASH.bloom signature");
+  }
+  buffered_flush(bl_handle, &bl_buf, &bl_buf_used, "QBASH.bloom", TRUE);
+  free(copy);  // FRE112
+  free(dwds);  // FRE113
+  unmmap_all_of(forward, FH, FMH, fsz);
+  unmmap_all_of(doctable, DH, DMH, dtsz);
+  return sizeof(header) + header[1] * bytes;
+}
+
+
+static u_int vocab_ordinal(u_char *wd, u_char *vocab, size_t vsz) {
+  // Return the ordinal of wd's entry in the .vocab, or NF_NO_TERMID if it isn't there.
+  u_char key[VOCABFILE_REC_LEN], *entry;
+  strncpy((char *)key, (char *)wd, MAX_WD_LEN + 1);
+  key[MAX_WD_LEN] = 0;
+  entry = (u_char *)bsearch(key, vocab, vsz / VOCABFILE_REC_LEN, VOCABFILE_REC_LEN,
+			    (int(*)(const void *, const void *))strcmp);
+  if (entry == NULL) return NF_NO_TERMID;
+  return (u_int)((entry - vocab) / VOCABFILE_REC_LEN);
+}
+
+
+static size_t normalized_record(u_char *rec, u_char *last, u_char *vocab, size_t vsz,
+				u_char *copy, u_short *record) {
+  // Fill record with the QBASH.normforward record for the .forward record at rec, normalizing its
+  // trigger exactly as possibly_record_candidate() in QBASHQ does.  copy must have room for
+  // 2 * (MAX_RESULT_LEN + 1) bytes, and record for that plus the header and WDPOS_MASK term
+  // ids and offsets.  Return the size of the record in bytes.
+  u_char *p = rec, *split, *dwds[WDPOS_MASK + 1];
+  size_t bytes;
+  int dc_len, len, w, n;
+
+  while (p < last && *p >= ' ') p++;  // Skip to the tab
+  dc_len = (int)(p - rec);
+  if (dc_len > MAX_RESULT_LEN) {
+    // QBASHQ rejects these anyway.
+    record[0] = NF_TOO_LONG;
+    record[1] = 0;
+    record[2] = 0;
+    record[3] = 0;
+    nf_text(record)[0] = 0;
+    nf_split(record)[0] = 0;
+    bytes = NF_RECORD_SHORTS * sizeof(u_short) + 2;
+    while (bytes % 8) ((byte *)record)[bytes++] = 0;
+    return bytes;  // ------------->
+  }
+  utf8_lowering_ncopy(copy, rec, dc_len);
+  if (conflate_accents) utf8_remove_accents(copy);
+  copy[dc_len] = 0;
+  len = (int)strlen((char *)copy);
+  split = copy + len + 1;
+  memcpy(split, copy, len + 1);
+  n = utf8_split_line_into_null_terminated_words(split, dwds, WDPOS_MASK, MAX_WD_LEN, FALSE, FALSE, FALSE, FALSE);
+  record[0] = (u_short)dc_len;
+  record[1] = (u_short)len;
+  record[2] = (u_short)n;
+  record[3] = NF_ALL_IN_VOCAB;
+  for (w = 0; w < n; w++) {
+    nf_termids(record)[w] = vocab_ordinal(dwds[w], vocab, vsz);
+    if (nf_termids(record)[w] == NF_NO_TERMID) record[3] &= ~NF_ALL_IN_VOCAB;
+    nf_word_offsets(record)[w] = (u_short)(dwds[w] - split);
+  }
+  memcpy(nf_text(record), copy, 2 * (len + 1));
+  bytes = nf_text(record) + 2 * (len + 1) - (u_char *)record;
+  while (bytes % 8) ((byte *)record)[bytes++] = 0;
+  return bytes;
+}
+
+
+static u_ll write_normforward_file(u_char *fname_fwd, u_char *fname_dt, u_char *fname_vocab, u_char *fname_nf) {
+  // Write the QBASH.normforward file for the complete .forward, .doctable and .vocab files given.
+  // See QBASHER_common_definitions.h.  Return the size of the file in bytes.
+  CROSS_PLATFORM_FILE_HANDLE FH, DH, VH, nf_handle;
+  HANDLE FMH, DMH, VMH;
+  u_char *forward, *vocab, *copy;
+  u_short *record;
+  u_ll *doctable, *offsets, header[NF_HEADER_ULLS], d, docoff;
+  byte *nf_buf = NULL;
+  size_t fsz, dtsz, vsz, nf_buf_used = 0, bytes;
+  int error_code = 0;
+
+  forward = (u_char *)mmap_all_of(fname_fwd, &fsz, FALSE, &FH, &FMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .forward file for QBASH.normforward");
+  doctable = (u_ll *)mmap_all_of(fname_dt, &dtsz, FALSE, &DH, &DMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .doctable file for QBASH.normforward");
+  vocab = (u_char *)mmap_all_of(fname_vocab, &vsz, FALSE, &VH, &VMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .vocab file for QBASH.normforward");
+
+  header[0] = conflate_accents ? NF_ACCENTS_REMOVED : 0;
+  header[1] = dtsz / DTE_LENGTH;
+  copy = (u_char *)malloc(2 * (MAX_RESULT_LEN + 1));  // MAL114
+  record = (u_short *)malloc(NF_RECORD_SHORTS * sizeof(u_short) + WDPOS_MASK * (sizeof(u_int) + sizeof(u_short))
+			     + 2 * (MAX_RESULT_LEN + 1) + 8);  // MAL115
+  offsets = (u_ll *)malloc((header[1] + 1) * sizeof(u_ll));  // MAL116
+  if (copy == NULL || record == NULL || offsets == NULL) error_exit("Error: malloc failed for QBASH.normforward buffers");
+  nf_handle = open_w((char *)fname_nf, &error_code);
+  if (error_code) error_exit("Unable to open QBASH.normforward for writing.");
+  buffered_write(nf_handle, &nf_buf, HUGEBUFSIZE, &nf_buf_used, (byte *)header, sizeof(header), "QBASH.normforward header");
+  offsets[0] = sizeof(header);
+  for (d = 0; d < header[1]; d++) {
+    docoff = (doctable[d] >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2;
+    if (docoff < fsz) bytes = normalized_record(forward + docoff, forward + fsz, vocab, vsz, copy, record);
+    else bytes = normalized_record(forward, forward, vocab, vsz, copy, record);   // Can't happen.  Write an empty record.
+    buffered_write(nf_handle, &nf_buf, HUGEBUFSIZE, &nf_buf_used, (byte *)record, bytes, "QBASH.normforward record");
+    offsets[d + 1] = offsets[d] + bytes;
+  }
+  buffered_write(nf_handle, &nf_buf, HUGEBUFSIZE, &nf_buf_used, (byte *)offsets, (header[1] + 1) * sizeof(u_ll),
+		 "QBASH.normforward offsets");
+  buffered_flush(nf_handle, &nf_buf, &nf_buf_used, "QBASH.normforward", TRUE);
+  bytes = offsets[header[1]] + (header[1] + 1) * sizeof(u_ll);
+  free(copy);  // FRE114
+  free(record);  // FRE115
+  free(offsets);  // FRE116
+  unmmap_all_of(forward, FH, FMH, fsz);
+  unmmap_all_of(doctable, DH, DMH, dtsz);
+  unmmap_all_of(vocab, VH, VMH, vsz);
+  return bytes;
+}
+
+
+static u_char *shard_file_name(int k, char *suffix) {
+  // Return a malloced <index_dir>/shard<k>/QBASH<suffix>, or <index_dir>/shard<k> if suffix is NULL.
+  u_char *fname = (u_char *)malloc(strlen((char *)index_dir) + 40);  // MAL111
+  if (fname == NULL) error_exit("Malloc of shard file name failed");
+  if (suffix == NULL) sprintf((char *)fname, "%s/%s%d", index_dir, SHARD_PREFIX, k);
+  else sprintf((char *)fname, "%s/%s%d/QBASH%s", index_dir, SHARD_PREFIX, k, suffix);
+  return fname;
+}
+
+
+static void write_shard_forward_and_doctable(index_partition_t *ixp, u_char *forward, u_char *last) {
+  // Write the records indexed in partition ixp, in the order they were indexed, to the .forward of
+  // its shard, and write their .doctable entries, with the document offsets changed to match.
+  CROSS_PLATFORM_FILE_HANDLE shard_fwd_handle, shard_dt_handle;
+  u_char *fname, *rec, *end;
+  byte *fwd_buf = NULL, *dt_buf = NULL;
+  size_t fwd_buf_used = 0, dt_buf_used = 0;
+  u_ll docoff, shard_docoff = 0;
+  docnum_t d;
+  int error_code = 0;
+
+#ifdef WIN64
+  shard_fwd_handle = NULL;
+  shard_dt_handle = NULL;
+#else
+  shard_fwd_handle = -1;
+  shard_dt_handle = -1;
+#endif
+  if (!x_minimize_io) {
+    fname = shard_file_name(ixp->partition_number, ".forward");
+    shard_fwd_handle = open_w((char *)fname, &error_code);
+    if (error_code) error_exit("Unable to open a shard .forward for writing.");
+    free(fname);  // FRE111
+    fname = shard_file_name(ixp->partition_number, ".doctable");
+    shard_dt_handle = open_w((char *)fname, &error_code);
+    if (error_code) error_exit("Unable to open a shard .doctable for writing.");
+    free(fname);  // FRE111
+  }
+  for (d = 0; d < ixp->doccount; d++) {
+    docoff = (ixp->dt_entries[d] >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2;
+    rec = forward + docoff;
+    end = rec;
+    while (end < last && *end != '\n') end++;
+    if (end < last) end++;   // Include the LF
+    ixp->dt_entries[d] = (ixp->dt_entries[d] & ~DTE_DOCOFF_MASK) | (shard_docoff << DTE_DOCOFF_SHIFT);
+    if (!x_minimize_io) buffered_write(shard_fwd_handle, &fwd_buf, HUGEBUFSIZE, &fwd_buf_used, rec, end - rec,
+				       (char *)"shard forward record");
+    shard_docoff += end - rec;
+  }
+  if (!x_minimize_io) {
+    buffered_write(shard_dt_handle, &dt_buf, HUGEBUFSIZE, &dt_buf_used, (byte *)ixp->dt_entries,
+		   ixp->doccount * sizeof(u_ll), (char *)"doctable entries");
+    buffered_flush(shard_fwd_handle, &fwd_buf, &fwd_buf_used, "shard .forward", TRUE);
+    buffered_flush(shard_dt_handle, &dt_buf, &dt_buf_used, "shard .doctable", TRUE);
+    if (bloom_bits > 0) {
+      u_char *fname_fwd = shard_file_name(ixp->partition_number, ".forward"),
+	*fname_dt = shard_file_name(ixp->partition_number, ".doctable"),
+	*fname_bl = shard_file_name(ixp->partition_number, BL_SUFFIX);
+      write_bloom_file(fname_fwd, fname_dt, fname_bl);
+      free(fname_fwd);  // FRE111
+      free(fname_dt);  // FRE111
+      free(fname_bl);  // FRE111
+    }
+  }
+  ixp->shard_fsz = shard_docoff;
+}
+
+
+static void process_records_in_score_order(u_char *fname_forward, CROSS_PLATFORM_FILE_HANDLE dt_handle,
+					   index_partition_t *partitions, int num_partitions,
+					   docnum_t *ignored_docs, docnum_t *gdoccount, size_t *infile_size) {
   //  --- Called when processing tab separated, non-score-ordered TSV  files ---
   // 1. Memory map fname_forward
   // 2. Scan it and make an array of all the line starts and a parallel array of the scores.  (Keep track of max score.)
   // 3. Sort the two arrays so that they corrspond to descending score order.
-  // 4. Then re-scan the records in that order and index them.
+  // 4. Then re-scan the records in that order and index them.  The permuted order is split into
+  //    num_partitions contiguous ranges, indexed in parallel if there is more than one.
+  // 5. Write the .doctable, or with -shards, the .forward and .doctable of each partition's shard.
   //
   // Note that the sort method is a "counting sort".  See https://en.wikipedia.org/wiki/Counting_sort
   docnum_t doccount = 0;
-  long long docoff;
-  double score, raw_score, max_score = 0;
+  double score, max_score = 0;
   u_char *forward, *last, *p, *ep, **recstarts = NULL;
   byte *dt_buf = NULL;
-  size_t sighs, scanned = 0, trigger_len, dt_buf_used = 0;
+  size_t sighs, scanned = 0, dt_buf_used = 0;
   HANDLE FMH;
   CROSS_PLATFORM_FILE_HANDLE FH;
-  int  error_code = 0, s;
-  u_int *scores = NULL, docscore, wds = 0;   // wds in the current record
-  u_ll max_plist_len = 0, igdocs = 0, *score_histo, *permute = NULL, sum = 0,
-    count, r, r_wi_maxscore = 0, recs = 0, dt_ent, qwt, d_signature = 0, pr;
+  int  error_code = 0, s, k;
+  u_int *scores = NULL, docscore;
+  u_ll igdocs = 0, *score_histo, *permute = NULL, sum = 0,
+    count, r, r_wi_maxscore = 0, recs = 0;
+  index_partition_t *ixp;
   double start, verystart;
 
   start = what_time_is_it();
@@ -1219,6 +1656,12 @@ static void process_records_in_score_order(u_char *fname_forward, CROSS_PLATFORM
 
   printf("Sorted-scan first pass elapsed time %.1f sec.\n", what_time_is_it() - start);
   printf("Records scanned: %lld\nMax score: %.3f\n", recs, max_score);
+  if (max_raw_score != UNDEFINED_DOUBLE) {
+    // Quantize against a fixed scale, e.g. one shared with the base and delta segments of an index.
+    // Higher scores will be clipped.
+    printf("Max score taken from max_raw_score: %.3f\n", max_raw_score);
+    max_score = max_raw_score;
+  }
   log_max_score = log(max_score);
 
   fflush(stdout);  // Next stage might take ages.  Make sure to show where we're up to
@@ -1313,64 +1756,46 @@ static void process_records_in_score_order(u_char *fname_forward, CROSS_PLATFORM
   scores = NULL;
 
   // Allocate large in-memory structures based on the actual document count.
-  allocate_hashtable_and_heap((docnum_t)recs);
+  for (k = 0; k < num_partitions; k++) {
+    ixp = partitions + k;
+    ixp->forward = forward;
+    ixp->recstarts = recstarts;
+    ixp->permute = permute;
+    ixp->first_rec = (recs * k) / num_partitions;
+    ixp->end_rec = (recs * (k + 1)) / num_partitions;
+    allocate_hashtable_and_heap(ixp, (docnum_t)(ixp->end_rec - ixp->first_rec));
+  }
 
   // Fourth loop: Do the business in permuted order
   start = what_time_is_it();
-  for (r = 0; r < recs; r++) {
-    if (debug >= 2) printf("indexing record %lld\n", r);
-    pr = permute[r];
-    p = recstarts[pr];
-    if (*p < ' ') continue;   // This line is empty, will be ignored.
-    if (min_wds > 0 || max_wds > 0) {
-      // Only do this counting  if limits are being imposed.
-      wds = count_wds_in_trigger(p);  // Returns -1 in case of error
-      if (wds < min_wds || wds > max_wds) {
-	igdocs++;
-	continue;
-      }
-    } 
-    docoff = recstarts[pr] - forward;
-    raw_score = split_and_index_record(recstarts[pr], doccount, &max_plist_len, ll_heap, &d_signature, 
-				       &wds, &trigger_len);
-    if (wds > 0 && raw_score >= score_threshold) {
-      // We ignore records with scores below the frequency threshold and those which have no
-      // indexable words.
-
-      if ((u_ll)docoff > DTE_DOCOFF_MASK2) {
-	igdocs++;
-	continue;   // ----------------------------------------------->
-      }
-
-
-      qwt = (u_ll)quantize_log_score_ratio((double)raw_score, (double)log_max_score);
-      dt_ent = docoff << DTE_DOCOFF_SHIFT;
-      if (wds > DTE_WDCNT_MASK) wds = (int)DTE_WDCNT_MASK;
-      dt_ent |= (wds & DTE_WDCNT_MASK);
-      dt_ent |= ((qwt & DTE_DOCSCORE_MASK2) << DTE_DOCSCORE_SHIFT);
-      dt_ent |= ((d_signature & DTE_DOCBLOOM_MASK2) << DTE_DOCBLOOM_SHIFT);
-      if (!x_minimize_io) buffered_write(dt_handle, &dt_buf, HUGEBUFSIZE, &dt_buf_used, (byte *)&dt_ent, sizeof(dt_ent), (char *)"doctable entry");
-      doccount++;
-
-      if (doccount % 10000 == 0) {
-	printf("%11lld\n", doccount);
-#ifdef WIN64
-	report_memory_usage(stdout, (u_char *)"permuted scanning", NULL);
-#endif
-      }
-    }
-    else igdocs++;
+  if (num_partitions == 1) index_permuted_records(partitions);
+  else {
+    index_partitions_in_parallel(partitions, num_partitions);
+    printf("%d partitions of about %llu records each indexed in parallel.\n", num_partitions, recs / num_partitions);
   }
 
   printf("Sorted-scan fourth pass elapsed time %.1f sec.\n", what_time_is_it() - start);
 
+  // Documents in each partition are numbered on from those in the previous one.  That's the
+  // order in which the .doctable entries are written.  Shards number their documents from zero.
+  for (k = 0; k < num_partitions; k++) {
+    ixp = partitions + k;
+    ixp->docnum_base = (shards > 1) ? 0 : doccount;
+    doccount += ixp->doccount;
+    igdocs += ixp->ignored_docs;
+    if (shards > 1) write_shard_forward_and_doctable(ixp, forward, last);
+    else if (!x_minimize_io) buffered_write(dt_handle, &dt_buf, HUGEBUFSIZE, &dt_buf_used, (byte *)ixp->dt_entries,
+					    ixp->doccount * sizeof(u_ll), (char *)"doctable entries");
+    free(ixp->dt_entries);  // FRE104
+    ixp->dt_entries = NULL;
+  }
+
   free((void *)permute);    // FRE102
   free((void *)recstarts);  // FRE100
   free((void *)score_histo); // FRE0707
-  if (!x_minimize_io) buffered_flush(dt_handle, &dt_buf, &dt_buf_used, ".doctable", TRUE); // Frees the buffer and closes the handle
+  if (!x_minimize_io && shards <= 1) buffered_flush(dt_handle, &dt_buf, &dt_buf_used, ".doctable", TRUE); // Frees the buffer and closes the handle
   unmmap_all_of(forward, FH, FMH, sighs);
   *gdoccount = doccount;
-  *gmax_plist_len = max_plist_len;
   *ignored_docs = igdocs;
 
   msec_elapsed_list_building = (what_time_is_it() - verystart) * 1000.0;
@@ -1505,9 +1930,9 @@ static u_char *get_line(buffer_queue_t *bq, u_char **linebuf, size_t linebufsize
 
 
 static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_FILE_HANDLE dt_handle,
-					  dahash_table_t *word_table, docnum_t max_docs, u_int min_wds,
+					  index_partition_t *ixp, docnum_t max_docs, u_int min_wds,
 					  u_int max_wds, docnum_t *ignored_docs, docnum_t *gdoccount,
-					  u_ll *gmax_plist_len, size_t *infile_size) {
+					  size_t *infile_size) {
   //  --- Called when processing tab separated, frequency-ordered or frequency-lacking TSV  files ---
   // 1. Memory map fname_forward  OR open for reading using get_line() (above).....  
   // 2. Scan the records in file order and index them.
@@ -1521,7 +1946,7 @@ static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_
   HANDLE FMH = NULL;
   double start;
   int error_code;
-  u_ll max_plist_len = 0, igdocs = 0, estimated_doccount;
+  u_ll igdocs = 0, estimated_doccount;
   u_int wds = 0, qwt;
   unsigned long long dt_ent, d_signature;
 #ifdef WIN64
@@ -1603,7 +2028,7 @@ static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_
   }
 
 	
-  allocate_hashtable_and_heap(estimated_doccount);
+  allocate_hashtable_and_heap(ixp, estimated_doccount);
 
 
   start = what_time_is_it();
@@ -1639,7 +2064,7 @@ static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_
 	continue;    // ------------------------------------------------------>
       }
     }
-    raw_score = split_and_index_record(p, doccount, &max_plist_len, ll_heap, &d_signature, 
+    raw_score = split_and_index_record(p, doccount, ixp, &d_signature, 
 				       &wds, &trigger_len);
     if (wds > 0 && raw_score >= score_threshold) {
       // We ignore suggestions with scores below the frequency threshold.
@@ -1659,6 +2084,7 @@ static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_
       if (!x_minimize_io) buffered_write(dt_handle, &dt_buf, HUGEBUFSIZE, &dt_buf_used, (byte *)&dt_ent, sizeof(dt_ent), "doctable entry");
 
       doccount++;
+      spill_partition_if_over_budget(ixp, (docnum_t)(estimated_doccount > (u_ll)doccount ? estimated_doccount - doccount : 1));
 
       if (doccount % 10000 == 0) {
 	printf("%11lld\n", doccount);
@@ -1713,7 +2139,6 @@ static void process_records_in_file_order(u_char *fname_forward, CROSS_PLATFORM_
 		
   }
   *gdoccount = doccount;
-  *gmax_plist_len = max_plist_len;
   *ignored_docs = igdocs;
 }
 
@@ -1765,7 +2190,11 @@ static void print_version_and_option_settings() {
   printf("Filtering parameters:\n    x_max_docs=%lld\n    min_wds=%d\n    max_wds=%d\n    score_threshold=%.3f\n\n",
 	 x_max_docs, min_wds, max_wds, score_threshold);
 
-  if (SB_TRIGGER > 0) {
+  if (block_postings) {
+    printf("Postings lists will be written in blocks of about %d postings, in index format %s.\n",
+	   BP_POSTINGS_PER_BLOCK, INDEX_FORMAT_BLOCKED);
+  }
+  else if (SB_TRIGGER > 0) {
     printf("Skip blocks will be written in runs of %d when there are more than %d postings.\n"
 	   " - a run length of zero means that run length is dynamically set.\n",
 	   SB_POSTINGS_PER_RUN, SB_TRIGGER);
@@ -1774,6 +2203,8 @@ static void print_version_and_option_settings() {
     printf("Skip blocks will not be written.\n");
   }
 
+  if (index_threads > 1) printf("Records will be indexed in %d partitions, by parallel threads.\n", index_threads);
+  if (memory_budget_mb > 0) printf("Postings will be spilled to runs to keep memory use to about %dMB.\n", memory_budget_mb);
   if (x_hashbits) printf("Initial hashbits explicitly set to %d.\n", x_hashbits);
   if (x_hashprobe) printf("Hashtable collisions handled by linear probing.\n");
   else printf("Hashtable collisions handled by relatively prime rehash.\n");
@@ -1953,13 +2384,54 @@ static void write_doc_length_histo_to_file(double *mean, double *stdev) {
 	 highest, *mean, *stdev, tot_postings);
 }
 
+static double write_shards(index_partition_t *sources, int num_sources, index_partition_t *partitions,
+			   int num_partitions, u_ll *max_plist_len, u_ll *vocab_size) {
+  // Write the .vocab and .if of each partition's shard, from the partition and the runs spilled from
+  // it, which are consecutive in sources.  The QIDFs are calculated from corpus-wide statistics so
+  // that they agree across shards.  Return the total size in MB, and the length of the longest
+  // postings list and the number of distinct terms over all the shards.
+  corpus_term_stats_t *cts;
+  u_char *fname_shard_vocab, *fname_shard_if;
+  u_ll shard_max_plist_len, shard_vocab_size;
+  double MB = 0.0;
+  int k, s = 0;
+
+  cts = compute_corpus_term_stats(sources, num_sources);
+  for (k = 0; k < num_partitions; k++) {
+    fname_shard_vocab = shard_file_name(k, ".vocab");
+    fname_shard_if = shard_file_name(k, ".if");
+    printf("Writing shard %d: %lld docs\n", k, partitions[k].doccount);
+    MB += write_inverted_file(sources + s, partitions[k].num_runs + 1, fname_shard_vocab, fname_shard_if,
+			      SB_POSTINGS_PER_RUN, SB_TRIGGER, partitions[k].doccount, partitions[k].shard_fsz,
+			      partitions[k].tot_postings, cts, &shard_max_plist_len, &shard_vocab_size);
+    s += partitions[k].num_runs + 1;
+    if (normforward && !x_minimize_io) {
+      // Written now because the term ids in it are ordinals in the shard's .vocab
+      u_char *fname_fwd = shard_file_name(k, ".forward"), *fname_dt = shard_file_name(k, ".doctable"),
+	*fname_nf = shard_file_name(k, NF_SUFFIX);
+      write_normforward_file(fname_fwd, fname_dt, fname_shard_vocab, fname_nf);
+      free(fname_fwd);  // FRE111
+      free(fname_dt);  // FRE111
+      free(fname_nf);  // FRE111
+    }
+    free(fname_shard_vocab);  // FRE111
+    free(fname_shard_if);  // FRE111
+  }
+  *max_plist_len = cts->max_plist_len;
+  *vocab_size = cts->num_terms;
+  free_corpus_term_stats(&cts);
+  return MB;
+}
+
+
 int main(int argc, char **argv) {
 
   double total_index_size = 0.0, doclen_mean = 0.0, doclen_stdev = 0.0, total_elapsed_time;
-  int a;
-  size_t infile_size = 0, l1, l2;
+  int a, k, r, s, num_partitions, num_sources, num_runs = 0;
+  size_t infile_size = 0, l1, l2, partition_vocab_sizes = 0;
   u_char *ap, *p;
   u_ll max_plist_len = 0, word_table_collisions = 0;
+  index_partition_t *partitions = NULL, *sources, *ixp;
   double start = 0, wifstart = 0;
 
 
@@ -2028,6 +2500,42 @@ int main(int argc, char **argv) {
     x_max_docs = DFLT_MAX_DOCS;
   }
 
+  if (index_threads < 1) index_threads = 1;
+  else if (index_threads > MAX_INDEX_THREADS) {
+    printf("Warning:  Too large a value for index_threads. Setting to %d\n", MAX_INDEX_THREADS);
+    index_threads = MAX_INDEX_THREADS;
+  }
+  if (index_threads > 1 && !sort_records_by_weight) {
+    printf("Warning:  index_threads is only supported with sort_records_by_weight.  Indexing with one thread.\n");
+    index_threads = 1;
+  }
+  if (shards > 1 && (!sort_records_by_weight || index_dir == NULL)) {
+    printf("Warning:  shards is only supported with sort_records_by_weight and index_dir.  Writing a single index.\n");
+    shards = 1;
+  }
+  else if (shards > SEG_MAX_SHARDS) {
+    printf("Warning:  Too large a value for shards. Setting to %d\n", SEG_MAX_SHARDS);
+    shards = SEG_MAX_SHARDS;
+  }
+  if (bloom_bits != 0 && bloom_bits != 16 && bloom_bits != 32 && bloom_bits != 64) {
+    printf("Warning:  bloom_bits must be 0, 16, 32 or 64.  Setting to 64.\n");
+    bloom_bits = 64;
+  }
+  if (bloom_bits > 0 && index_dir == NULL) {
+    printf("Warning:  bloom_bits is only supported with index_dir.  QBASH.bloom won't be written.\n");
+    bloom_bits = 0;
+  }
+  if (normforward && index_dir == NULL) {
+    printf("Warning:  normforward is only supported with index_dir.  QBASH.normforward won't be written.\n");
+    normforward = FALSE;
+  }
+  if (shards > 1) {
+    // Each shard is a partition, indexed by its own thread.
+    if (index_threads > 1 && index_threads != shards) printf("Warning:  index_threads is set to the number of shards.\n");
+    index_threads = shards;
+  }
+  set_budgeted_hashbits();
+
   if (SB_POSTINGS_PER_RUN && SB_POSTINGS_PER_RUN < 2) SB_POSTINGS_PER_RUN = 2;  //  SB_RUN_LENGTH = 0 is OK
   if (SB_TRIGGER && SB_TRIGGER < 3) SB_TRIGGER = 3;  // To avoid problems when postings lists of length 2 are stored in hash table
 
@@ -2037,6 +2545,11 @@ int main(int argc, char **argv) {
       printf("Warning:  Too large a value for max_line_prefix. Setting to %d\n",
 	     max_line_prefix);
     }
+    if (head_answers > 0 && head_answers_min_postings < 2) {
+      head_answers_min_postings = 2;
+      printf("Warning:  Too small a value for head_answers_min_postings. Setting to %d\n",
+	     head_answers_min_postings);
+    }
     if (max_line_prefix_postings < 10) {
       max_line_prefix_postings = 10;
       printf("Warning:  Too small a value for max_line_prefix_postings. Setting to %d\n",
@@ -2080,6 +2593,26 @@ int main(int argc, char **argv) {
     strcpy((char *)fname_doctable, (char *)index_dir);
     strcpy((char *)fname_doctable + l, "/QBASH.");
     strcpy((char *)fname_doctable + l + 7, "doctable");
+    if (bloom_bits > 0) {
+      fname_bloom = (u_char *)malloc(max_fname_len);
+      if (fname_bloom == NULL) {
+	printf("Error: Malloc failed for filename allocation.\n");
+	exit(1);
+      }
+      strcpy((char *)fname_bloom, (char *)index_dir);
+      strcpy((char *)fname_bloom + l, "/QBASH");
+      strcpy((char *)fname_bloom + l + 6, BL_SUFFIX);
+    }
+    if (normforward) {
+      fname_normforward = (u_char *)malloc(max_fname_len);
+      if (fname_normforward == NULL) {
+	printf("Error: Malloc failed for filename allocation.\n");
+	exit(1);
+      }
+      strcpy((char *)fname_normforward, (char *)index_dir);
+      strcpy((char *)fname_normforward + l, "/QBASH");
+      strcpy((char *)fname_normforward + l + 6, NF_SUFFIX);
+    }
 
   }
 
@@ -2185,7 +2718,17 @@ int main(int argc, char **argv) {
   if (SB_POSTINGS_PER_RUN > SB_MAX_COUNT)
     error_exit("Error in skip block parameters: SB_POSTINGS_PER_RUN must be >= 0 and <= SB_MAX_COUNT");
 
-  if (!x_minimize_io)  {
+  if (shards > 1) {
+    for (k = 0; k < shards; k++) {
+      u_char *shard_dir = shard_file_name(k, NULL);
+      if (!is_a_directory((char *)shard_dir) && !make_directory((char *)shard_dir)) {
+	printf("Error: Unable to create shard directory %s\n", shard_dir);
+	exit(1);
+      }
+      free(shard_dir);  // FRE111
+    }
+  }
+  else if (!x_minimize_io)  {
     int error_code;
     dt_handle = open_w((char *)fname_doctable, &error_code);
     if (error_code)	error_exit("Unable to open QBASH.doctable for writing.");
@@ -2195,21 +2738,53 @@ int main(int argc, char **argv) {
   report_memory_usage(stdout, (u_char *)"Start of List Building phase", &pfc_list_build_start);
 #endif
 
+  // Each partition gets its own hash table and heap when the number of records is known.
+  num_partitions = index_threads;
+  partitions = (index_partition_t *)calloc(num_partitions, sizeof(index_partition_t));  // MAL106
+  if (partitions == NULL) error_exit("Calloc of index partitions failed");
+  for (k = 0; k < num_partitions; k++) partitions[k].partition_number = k;
+  if (x_doc_length_histo) {
+    if (num_partitions == 1) partitions[0].doc_length_histo = doc_length_histo;
+    else {
+      for (k = 0; k < num_partitions; k++) {
+	partitions[k].doc_length_histo = (u_ll *)calloc(MAX_WDS_INDEXED_PER_DOC + 2, sizeof(u_ll));  // MAL107
+	if (partitions[k].doc_length_histo == NULL) error_exit("Calloc of doc_length_histo failed");
+      }
+    }
+  }
+
     if (sort_records_by_weight) {
       // In this case, we don't need to allocate hash tables until we've scanned the entire input
       // So process_records_in_score_order() calls 	allocate_hashtable_and_heap() with the actual
       // number of documents.
       printf("About to do score-order scan ...\n");
-      process_records_in_score_order(fname_forward, dt_handle, word_table, min_wds, max_wds,
-				     &ignored_docs, &doccount, &max_plist_len, &infile_size);
+      process_records_in_score_order(fname_forward, dt_handle, partitions, num_partitions,
+				     &ignored_docs, &doccount, &infile_size);
       printf("Returned from process_records_in_score_order()\n");
     } else {
       printf("About to do file-order scan ...\n");
-      process_records_in_file_order(fname_forward, dt_handle, word_table, x_max_docs, min_wds, max_wds,
-				    &ignored_docs, &doccount, &max_plist_len, &infile_size);
+      process_records_in_file_order(fname_forward, dt_handle, partitions, x_max_docs, min_wds, max_wds,
+				    &ignored_docs, &doccount, &infile_size);
       printf("Returned from process_records_in_file_order()\n");
     }
 
+  // Add up the counts from the partitions.
+  for (k = 0; k < num_partitions; k++) {
+    ixp = partitions + k;
+    tot_postings += ixp->tot_postings;
+    truncated_docs += ixp->truncated_docs;
+    incompletely_indexed_docs += ixp->incompletely_indexed_docs;
+    empty_docs += ixp->empty_docs;
+    partition_vocab_sizes += ixp->word_table->entries_used;
+    for (r = 0; r < ixp->num_runs; r++) partition_vocab_sizes += ixp->runs[r].num_keys;
+    num_runs += ixp->num_runs;
+    if (num_partitions > 1 && ixp->doc_length_histo != NULL) {
+      for (a = 0; a < MAX_WDS_INDEXED_PER_DOC + 2; a++) doc_length_histo[a] += ixp->doc_length_histo[a];
+      free(ixp->doc_length_histo);  // FRE107
+    }
+    ixp->doc_length_histo = NULL;
+  }
+
 #ifdef WIN64
   report_memory_usage(stdout, (u_char *)"End of List Building phase", &pfc_list_build_end);
 #endif
@@ -2217,7 +2792,9 @@ int main(int argc, char **argv) {
 
   // Show some more stats immediately after the scan.
   printf("Scan finished: Number of documents scanned: %lld\n", doccount);
-  printf("Scan finished: Vocabulary size: %zu\n", word_table->entries_used);
+  if (num_partitions == 1) printf("Scan finished: Vocabulary size: %zu\n", partition_vocab_sizes);
+  else printf("Scan finished: Sum of vocabulary sizes in %d partitions: %zu\n", num_partitions, partition_vocab_sizes);
+  if (num_runs > 0) printf("Scan finished: %d runs were spilled to keep within memory_budget_mb.\n", num_runs);
 
   if (x_doc_length_histo) {
     // File won't be written if fname_dlh == NULL
@@ -2228,32 +2805,60 @@ int main(int argc, char **argv) {
 
   if (debug) {
     printf("Alphabetic word list\n====================\n");
-    dahash_dump_alphabetic(word_table, ll_heap, show_key, show_count_n_postings);
+    for (k = 0; k < num_partitions; k++)
+      dahash_dump_alphabetic(partitions[k].word_table, partitions[k].ll_heap, show_key, show_count_n_postings);
     printf("====================\nAlphabetic word list\n");
   }
 
   wifstart = what_time_is_it();
   printf("Vocab filename is %s\n", fname_vocab);
 
+  // The runs spilled from each partition hold its earlier documents, so they are merged ahead of it.
+  num_sources = num_partitions + num_runs;
+  sources = partitions;
+  if (num_runs > 0) {
+    sources = (index_partition_t *)malloc(num_sources * sizeof(index_partition_t));  // MAL110
+    if (sources == NULL) error_exit("Malloc of merge sources failed");
+    s = 0;
+    for (k = 0; k < num_partitions; k++) {
+      for (r = 0; r < partitions[k].num_runs; r++) {
+	sources[s] = partitions[k].runs[r];
+	sources[s++].docnum_base = partitions[k].docnum_base;
+      }
+      sources[s++] = partitions[k];
+    }
+  }
+
   // ===============  This is where the inverted file is written ========================
-  total_index_size = write_inverted_file(word_table, fname_vocab, fname_if, ll_heap,
-					 SB_POSTINGS_PER_RUN, SB_TRIGGER, doccount, infile_size, max_plist_len);
+  if (shards > 1) total_index_size = write_shards(sources, num_sources, partitions, num_partitions,
+						  &max_plist_len, &vocab_size);
+  else total_index_size = write_inverted_file(sources, num_sources, fname_vocab, fname_if,
+					      SB_POSTINGS_PER_RUN, SB_TRIGGER, doccount, infile_size, tot_postings,
+					      NULL, &max_plist_len, &vocab_size);
+  if (sources != partitions) free(sources);  // FRE110
   msec_elapsed_list_traversal = (what_time_is_it() - wifstart) * 1000.0;
   printf("Write-inverted-file elapsed time %.1f sec.\n", msec_elapsed_list_traversal / 1000.0);
 #ifdef WIN64
   report_memory_usage(stdout, (u_char *)"End of List Building phase", &pfc_list_scan_end);
 #endif
   printf("QBASH.doctable file: %8.1fMB\n", (double)(doccount * DTE_LENGTH) / 1048576.0);
+  if (head_answers > 0 && shards <= 1 && !x_minimize_io)
+    printf("QBASH.if.head_answers file: %8.1fMB\n",
+	   (double)write_head_answers_file(fname_if, fname_forward, fname_doctable) / 1048576.0);
+  if (bloom_bits > 0 && shards <= 1 && !x_minimize_io)
+    printf("QBASH.bloom file:    %8.1fMB\n", (double)write_bloom_file(fname_forward, fname_doctable, fname_bloom) / 1048576.0);
+  if (normforward && shards <= 1 && !x_minimize_io)
+    printf("QBASH.normforward file: %8.1fMB\n",
+	   (double)write_normforward_file(fname_forward, fname_doctable, fname_vocab, fname_normforward) / 1048576.0);
   total_index_size += ((double)(doccount * DTE_LENGTH + (double)infile_size)) / 1048576.0;
   printf("Total index size:    %8.1fMB\n", total_index_size);
   printf("=================================\n\n");
 
 
   printf("Input file of was kosher: %.1fMB\n", (double)infile_size / MEGA);
-  vocab_size = word_table->entries_used;  // Save for reporting at the end
 
 
-  word_table_collisions = word_table->collisions;
+  for (k = 0; k < num_partitions; k++) word_table_collisions += partitions[k].word_table->collisions;
 
 
   if (CLEAN_UP_BEFORE_EXIT) {
@@ -2262,15 +2867,25 @@ int main(int argc, char **argv) {
 #ifdef WIN64
     report_memory_usage(stdout, (u_char *)"after writing the inverted file, before cleaning up memory", NULL);
 #endif
-    doh_free(&ll_heap);
+    for (k = 0; k < num_partitions; k++) {
+      ixp = partitions + k;
+      doh_free(&(ixp->ll_heap));
 
 #ifdef WIN64 
-    report_memory_usage(stdout, (u_char *)"before destroying the hash table", NULL);
+      report_memory_usage(stdout, (u_char *)"before destroying the hash table", NULL);
 #endif
-    perc = 100.0 * (double)word_table->entries_used / (double)word_table->capacity;
-    printf("The 'word' hash table was doubled %d times.  %zu / %zu entries were used.  I.e. it was %.1f%% full.\n\n",
-	   word_table->times_doubled, word_table->entries_used, word_table->capacity, perc);
-    dahash_destroy(&word_table);
+      perc = 100.0 * (double)ixp->word_table->entries_used / (double)ixp->word_table->capacity;
+      printf("The 'word' hash table was doubled %d times.  %zu / %zu entries were used.  I.e. it was %.1f%% full.\n\n",
+	     ixp->word_table->times_doubled, ixp->word_table->entries_used, ixp->word_table->capacity, perc);
+      dahash_destroy(&(ixp->word_table));
+      free(ixp->cpybuf);  // FRE103
+      for (r = 0; r < ixp->num_runs; r++) {
+	free(ixp->runs[r].run_vocab_fname);  // FRE109
+	free(ixp->runs[r].run_postings_fname);  // FRE109
+      }
+      free(ixp->runs);  // FRE108
+    }
+    free(partitions);  // FRE106
   }
 #ifdef WIN64
   report_memory_usage(stdout, (u_char *)"at the very end", NULL);
@@ -47,12 +47,6 @@ unsigned long long calculate_signature_from_first_letters(u_char *str, int bits)
 typedef byte *doh_t;
 #endif
 
-extern doh_t ll_heap;
-void allocate_hashtable_and_heap(docnum_t doccount_estimate);
-
-void process_a_word(u_char *wd, docnum_t doccount, u_int wdpos, u_ll *max_plist_len,
-	doh_t ll_heap);
-
 extern byte *postings_accumulator_for_sort;
 extern u_ll postings_accumulated, chunks_allocated;
 extern double hashtable_MB, linkedlists_MB;
@@ -66,10 +60,13 @@ extern double msec_elapsed_list_building, msec_elapsed_list_traversal;
 // Variables settable from the command line.
 extern docnum_t x_max_docs;
 extern u_int SB_POSTINGS_PER_RUN, SB_TRIGGER;
+extern BOOL block_postings, impact_file, normforward;
 extern docnum_t x_max_docs;
-extern u_int min_wds, max_wds, max_line_prefix, max_line_prefix_postings, x_min_payloads_per_chunk, x_sort_postings_instead;
+extern u_int min_wds, max_wds, max_line_prefix, max_line_prefix_postings, head_answers, head_answers_min_postings,
+  x_min_payloads_per_chunk, x_sort_postings_instead;
+extern unsigned long long DTE_DOCOFF_SHIFT, DTE_DOCOFF_MASK2;
 extern int head_terms;
-extern int debug, x_hashbits, x_hashprobe, x_chunk_func, x_cpu_affinity;
+extern int debug, x_hashbits, x_hashprobe, x_chunk_func, x_cpu_affinity, index_threads, memory_budget_mb, shards, bloom_bits;
 extern double x_geo_tile_width;
 extern int x_geo_big_tile_factor;
 extern u_char *index_dir, *fname_forward, *fname_if, *fname_doctable, *fname_vocab, *fname_synthetic_docs,
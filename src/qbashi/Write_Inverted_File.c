@@ -34,6 +34,23 @@
 // count OC of a word exceeds 2 * PREFERRED_MAX_BLOCK, then OC / PREFERRED_MAX_BLOCK
 // skip blocks will be used.
 //
+// With -block_postings=TRUE, each postings list long enough to benefit is instead written as
+// a directory followed by blocks of about 128 postings with the docgaps bit-packed, and the
+// .if header records INDEX_FORMAT_BLOCKED.  See QBASHER_common_definitions.h.
+//
+// A hash table mapping terms to .vocab record numbers is written to QBASH.vocab.hash.  QBASHQ
+// uses it, if present, instead of binary searching the .vocab.
+//
+// With -impact_file=TRUE, the postings are also written to QBASH.impact in descending order of
+// quantized BM25 weight, for QBASHQ's score-at-a-time engine.  See write_impact_file().
+//
+// With -head_answers=N, the first N documents of each commonly occurring line prefix's postings
+// list are also written, with their record text, to QBASH.if.head_answers.  See
+// write_head_answers_file().
+//
+// With -shards, write_inverted_file() is called once for each shard, and the QIDFs are calculated
+// from corpus-wide statistics gathered by compute_corpus_term_stats().
+//
 
 #ifdef WIN64
 #include <tchar.h>
@@ -50,6 +67,7 @@
 
 #include "../shared/utility_nodeps.h"
 #include "../shared/QBASHER_common_definitions.h"
+#include "../imported/Fowler-Noll-Vo-hash/fnv.h"
 #include "QBASHI.h"
 #include "../utils/linked_list.h"
 #include "../utils/dahash.h"
@@ -84,6 +102,333 @@ static int compare_sortable_postings(const void *i, const void*j) {
 static byte sb_run_accumulator[SB_MAX_BYTES_PER_RUN];   // Would need to malloc this if we start multi-threading.
 
 
+// The following are used when writing block-based postings lists (-block_postings=TRUE).  See
+// the layout described in QBASHER_common_definitions.h.  Postings are accumulated in the
+// current block until it is closed, when it is packed onto the end of bp_list_buf and an entry
+// is added to bp_dir_buf.  When the list is complete, both are written out.  Again, these
+// would need to be malloced if we started multi-threading.
+
+static docnum_t bp_block_docnums[BP_MAX_POSTINGS_PER_BLOCK];
+static byte bp_block_wposs[BP_MAX_POSTINGS_PER_BLOCK];
+static int bp_block_postings = 0;
+static byte *bp_list_buf = NULL, *bp_dir_buf = NULL;
+static size_t bp_list_used = 0, bp_list_capacity = 0, bp_dir_used = 0, bp_dir_capacity = 0;
+static u_int bp_list_blocks = 0, bp_list_postings = 0;
+static u_ll bp_tot_blocks = 0, bp_max_blocks_per_list = 0, bp_bits_histo[64] = { 0 };
+
+
+// The following accumulate the directory and entries of the .if.skips file as skip blocks are
+// written.  See QBASHER_common_definitions.h.
+
+static byte *sk_dir_buf = NULL, *sk_entry_buf = NULL;
+static size_t sk_dir_used = 0, sk_dir_capacity = 0, sk_entry_used = 0, sk_entry_capacity = 0;
+
+
+// With -head_answers=N, the following accumulate the directory entries of the .if.head_answers
+// file and the docnums of the answers, which write_head_answers_file() completes and writes.
+// See QBASHER_common_definitions.h.
+
+static byte *ha_dir_buf = NULL, *ha_doc_buf = NULL;
+static size_t ha_dir_used = 0, ha_dir_capacity = 0, ha_doc_used = 0, ha_doc_capacity = 0;
+static u_ll ha_term_answers = 0;
+static docnum_t ha_last_docnum = 0;
+
+
+static void bp_make_room(byte **buf, size_t *capacity, size_t needed) {
+  // Make sure that *buf has room for at least needed bytes.
+  size_t newcap = *capacity;
+  if (needed <= *capacity) return;
+  if (newcap < 65536) newcap = 65536;
+  while (newcap < needed) newcap *= 2;
+  *buf = (byte *)realloc(*buf, newcap);  // MAL602
+  if (*buf == NULL) error_exit("Error: realloc failed for block postings buffer");
+  *capacity = newcap;
+}
+
+
+static void bp_close_block() {
+  // Pack the accumulated postings into a block on the end of bp_list_buf, and add its
+  // directory entry.
+  docnum_t gap, maxgap = 0;
+  int i, bits = 0, accbits = 0;
+  u_ll acc = 0, lastdocnum;
+  byte *out;
+
+  if (bp_block_postings == 0) return;
+  for (i = 1; i < bp_block_postings; i++) {
+    gap = bp_block_docnums[i] - bp_block_docnums[i - 1];
+    if (gap > maxgap) maxgap = gap;
+  }
+  while (bits < 63 && (1ULL << bits) <= (u_ll)maxgap) bits++;
+  bp_bits_histo[bits]++;
+
+  // The directory entry
+  bp_make_room(&bp_dir_buf, &bp_dir_capacity, bp_dir_used + BP_DIRENT_BYTES);
+  out = bp_dir_buf + bp_dir_used;
+  lastdocnum = (u_ll)bp_block_docnums[bp_block_postings - 1];
+  for (i = 0; i < 5; i++) out[i] = (byte)(lastdocnum >> (8 * i));
+  for (i = 0; i < 5; i++) out[5 + i] = (byte)(bp_list_used >> (8 * i));
+  memcpy(out + 10, &bp_list_postings, 4);
+  bp_dir_used += BP_DIRENT_BYTES;
+
+  // The block itself
+  bp_make_room(&bp_list_buf, &bp_list_capacity, bp_list_used + BP_BLOCK_HEADER_BYTES + bp_block_postings
+	       + ((size_t)(bp_block_postings - 1) * bits + 7) / 8);
+  out = bp_list_buf + bp_list_used;
+  *out++ = (byte)bits;
+  for (i = 0; i < 5; i++) *out++ = (byte)((u_ll)bp_block_docnums[0] >> (8 * i));
+  memcpy(out, bp_block_wposs, bp_block_postings);
+  out += bp_block_postings;
+  for (i = 1; i < bp_block_postings; i++) {
+    gap = bp_block_docnums[i] - bp_block_docnums[i - 1];
+    acc |= (u_ll)gap << accbits;
+    accbits += bits;
+    while (accbits >= 8) {
+      *out++ = (byte)(acc & 0xFF);
+      acc >>= 8;
+      accbits -= 8;
+    }
+  }
+  if (accbits > 0) *out++ = (byte)acc;
+  bp_list_used = out - bp_list_buf;
+
+  bp_list_postings += bp_block_postings;
+  bp_list_blocks++;
+  bp_block_postings = 0;
+}
+
+
+static void bp_add_posting(docnum_t docnum, int wdnum) {
+  // Add a posting to the current block, first closing the block if it's full and this
+  // posting starts a new document.
+  if (bp_block_postings >= BP_POSTINGS_PER_BLOCK
+      && docnum != bp_block_docnums[bp_block_postings - 1]) bp_close_block();
+  if (bp_block_postings >= BP_MAX_POSTINGS_PER_BLOCK)
+    error_exit("Error: too many postings for one document in a postings block.\n");
+  bp_block_docnums[bp_block_postings] = docnum;
+  bp_block_wposs[bp_block_postings] = (byte)wdnum;
+  bp_block_postings++;
+}
+
+
+static u_ll bp_write_list(CROSS_PLATFORM_FILE_HANDLE if_handle, byte **if_buf, size_t *if_buf_used) {
+  // Close the last block, then write the list header, the directory and the blocks.
+  // Return the number of bytes in the list.
+  u_ll bytes_written;
+  bp_close_block();
+  if (!x_minimize_io) {
+    buffered_write(if_handle, if_buf, HUGEBUFSIZE, if_buf_used, (byte *)&bp_list_blocks, BP_LIST_HEADER_BYTES, "BP list header");
+    buffered_write(if_handle, if_buf, HUGEBUFSIZE, if_buf_used, bp_dir_buf, bp_dir_used, "BP directory");
+    buffered_write(if_handle, if_buf, HUGEBUFSIZE, if_buf_used, bp_list_buf, bp_list_used, "BP blocks");
+  }
+  bytes_written = BP_LIST_HEADER_BYTES + bp_dir_used + bp_list_used;
+  bp_tot_blocks += bp_list_blocks;
+  if (bp_list_blocks > bp_max_blocks_per_list) bp_max_blocks_per_list = bp_list_blocks;
+  bp_list_blocks = 0;
+  bp_list_postings = 0;
+  bp_dir_used = 0;
+  bp_list_used = 0;
+  return bytes_written;
+}
+
+
+static void sk_append(byte **buf, size_t *used, size_t *capacity, u_ll a, u_ll b, u_ll c, int n) {
+  // Append the first n of a, b and c to *buf
+  u_ll ulls[3];
+  ulls[0] = a;
+  ulls[1] = b;
+  ulls[2] = c;
+  bp_make_room(buf, capacity, *used + n * sizeof(u_ll));
+  memcpy(*buf + *used, ulls, n * sizeof(u_ll));
+  *used += n * sizeof(u_ll);
+}
+
+
+static u_ll write_skips_file(u_char *fname_if, u_ll if_size) {
+  // Write the .if.skips file from sk_dir_buf and sk_entry_buf.  See QBASHER_common_definitions.h
+  // for the layout.  Return the size of the file in bytes.
+  u_ll header[SK_HEADER_ULLS], sentinel[2];
+  u_char *fname;
+  byte *sk_buf = NULL;
+  size_t sk_buf_used = 0;
+  CROSS_PLATFORM_FILE_HANDLE sk_handle;
+  int error_code = 0;
+
+  header[0] = sk_dir_used / (2 * sizeof(u_ll));
+  header[1] = if_size;
+  sentinel[0] = 0;
+  sentinel[1] = sk_entry_used / (SK_ENTRY_ULLS * sizeof(u_ll));
+
+  fname = (u_char *)malloc(strlen((char *)fname_if) + strlen(SK_SUFFIX) + 1);  // MAL616
+  if (fname == NULL) error_exit("Error: malloc failed for the .if.skips file name");
+  strcpy((char *)fname, (char *)fname_if);
+  strcat((char *)fname, SK_SUFFIX);
+  sk_handle = open_w((char *)fname, &error_code);
+  if (error_code) error_exit("Unable to open .if.skips file for writing.");
+  buffered_write(sk_handle, &sk_buf, HUGEBUFSIZE, &sk_buf_used, (byte *)header, sizeof(header), ".if.skips header");
+  if (sk_dir_used > 0)
+    buffered_write(sk_handle, &sk_buf, HUGEBUFSIZE, &sk_buf_used, sk_dir_buf, sk_dir_used, ".if.skips directory");
+  buffered_write(sk_handle, &sk_buf, HUGEBUFSIZE, &sk_buf_used, (byte *)sentinel, sizeof(sentinel), ".if.skips sentinel");
+  if (sk_entry_used > 0)
+    buffered_write(sk_handle, &sk_buf, HUGEBUFSIZE, &sk_buf_used, sk_entry_buf, sk_entry_used, ".if.skips entries");
+  buffered_flush(sk_handle, &sk_buf, &sk_buf_used, ".if.skips", TRUE);
+  free(fname);  // FRE616
+  return sizeof(header) + sk_dir_used + sizeof(sentinel) + sk_entry_used;
+}
+
+
+static void ha_start_term() {
+  ha_term_answers = 0;
+  ha_last_docnum = 0;
+}
+
+
+static void ha_note_posting(docnum_t docnum) {
+  // Record docnum as an answer for the current term, unless there are enough already or it's a
+  // repeat of the last one.
+  if (ha_term_answers >= head_answers || (ha_term_answers > 0 && docnum == ha_last_docnum)) return;
+  sk_append(&ha_doc_buf, &ha_doc_used, &ha_doc_capacity, (u_ll)docnum, 0, 0, 1);
+  ha_last_docnum = docnum;
+  ha_term_answers++;
+}
+
+
+static void ha_finish_term(byte *key, u_int count) {
+  // Add the directory entry for the term whose answers have just been noted.
+  u_ll entry[HA_DIR_ENTRY_ULLS];
+  memset(entry, 0, sizeof(entry));
+  strncpy((char *)entry, (char *)key, MAX_WD_LEN);
+  ha_entry_postings(entry) = count;
+  ha_entry_answers(entry) = ha_term_answers;
+  ha_entry_first(entry) = ha_doc_used / sizeof(u_ll) - ha_term_answers;
+  bp_make_room(&ha_dir_buf, &ha_dir_capacity, ha_dir_used + sizeof(entry));
+  memcpy(ha_dir_buf + ha_dir_used, entry, sizeof(entry));
+  ha_dir_used += sizeof(entry);
+}
+
+
+u_ll write_head_answers_file(u_char *fname_if, u_char *fname_forward, u_char *fname_doctable) {
+  // Write the .if.head_answers file from ha_dir_buf and ha_doc_buf, looking up each answer's
+  // .doctable entry and record text.  Must be called after the .if, .doctable and .forward files
+  // are complete.  See QBASHER_common_definitions.h for the layout.  Return the size of the file
+  // in bytes.
+  u_ll header[HA_HEADER_ULLS], answer[HA_ANSWER_ULLS], *docnums = (u_ll *)ha_doc_buf, a, text_off = 0,
+    docoff;
+  u_char *fname, *forward, *doctable, *rec, *end;
+  byte *ha_buf = NULL, nul = 0;
+  size_t ha_buf_used = 0, fsz, dtsz;
+  CROSS_PLATFORM_FILE_HANDLE ha_handle, FH, DH;
+  HANDLE FMH, DMH;
+  int error_code = 0;
+
+  header[0] = ha_dir_used / (HA_DIR_ENTRY_ULLS * sizeof(u_ll));
+  header[1] = get_filesize(fname_if, FALSE, &error_code);
+  if (error_code) error_exit("Error: unable to find the size of the .if file for .if.head_answers");
+  header[2] = ha_doc_used / sizeof(u_ll);
+  header[3] = 0;
+
+  forward = (u_char *)mmap_all_of(fname_forward, &fsz, FALSE, &FH, &FMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .forward file for .if.head_answers");
+  doctable = (u_char *)mmap_all_of(fname_doctable, &dtsz, FALSE, &DH, &DMH, &error_code);
+  if (error_code) error_exit("Error: unable to mmap the .doctable file for .if.head_answers");
+
+  // The text area follows the answers, so its size must be known before they are written.
+  for (a = 0; a < header[2]; a++) {
+    if ((docnums[a] + 1) * DTE_LENGTH > dtsz) error_exit("Error: head answer beyond the end of .doctable");
+    docoff = (*(u_ll *)(doctable + docnums[a] * DTE_LENGTH) >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2;
+    if (docoff >= fsz) error_exit("Error: head answer beyond the end of .forward");
+    rec = forward + docoff;
+    end = rec;
+    while (end < forward + fsz && *end != '\n') end++;
+    header[3] += (end - rec) + 1;
+  }
+
+  fname = (u_char *)malloc(strlen((char *)fname_if) + strlen(HA_SUFFIX) + 1);  // MAL617
+  if (fname == NULL) error_exit("Error: malloc failed for the .if.head_answers file name");
+  strcpy((char *)fname, (char *)fname_if);
+  strcat((char *)fname, HA_SUFFIX);
+  ha_handle = open_w((char *)fname, &error_code);
+  if (error_code) error_exit("Unable to open .if.head_answers file for writing.");
+  buffered_write(ha_handle, &ha_buf, HUGEBUFSIZE, &ha_buf_used, (byte *)header, sizeof(header), ".if.head_answers header");
+  if (ha_dir_used > 0)
+    buffered_write(ha_handle, &ha_buf, HUGEBUFSIZE, &ha_buf_used, ha_dir_buf, ha_dir_used, ".if.head_answers directory");
+  for (a = 0; a < header[2]; a++) {
+    answer[0] = docnums[a];
+    answer[1] = *(u_ll *)(doctable + docnums[a] * DTE_LENGTH);
+    answer[2] = text_off;
+    buffered_write(ha_handle, &ha_buf, HUGEBUFSIZE, &ha_buf_used, (byte *)answer, sizeof(answer), ".if.head_answers answer");
+    rec = forward + ((answer[1] >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2);
+    end = rec;
+    while (end < forward + fsz && *end != '\n') end++;
+    text_off += (end - rec) + 1;
+  }
+  for (a = 0; a < header[2]; a++) {
+    rec = forward + ((*(u_ll *)(doctable + docnums[a] * DTE_LENGTH) >> DTE_DOCOFF_SHIFT) & DTE_DOCOFF_MASK2);
+    end = rec;
+    while (end < forward + fsz && *end != '\n') end++;
+    if (end > rec) buffered_write(ha_handle, &ha_buf, HUGEBUFSIZE, &ha_buf_used, rec, end - rec, ".if.head_answers text");
+    buffered_write(ha_handle, &ha_buf, HUGEBUFSIZE, &ha_buf_used, &nul, 1, ".if.head_answers text");
+  }
+  buffered_flush(ha_handle, &ha_buf, &ha_buf_used, ".if.head_answers", TRUE);
+  unmmap_all_of(forward, FH, FMH, fsz);
+  unmmap_all_of(doctable, DH, DMH, dtsz);
+  free(fname);  // FRE617
+
+  free(ha_dir_buf);  // FRE602
+  free(ha_doc_buf);  // FRE602
+  ha_dir_buf = NULL;
+  ha_doc_buf = NULL;
+  ha_dir_used = 0;
+  ha_doc_used = 0;
+  ha_dir_capacity = 0;
+  ha_doc_capacity = 0;
+  return sizeof(header) + header[0] * HA_DIR_ENTRY_ULLS * sizeof(u_ll) + header[2] * sizeof(answer) + header[3];
+}
+
+
+static u_ll write_vocab_hash_file(u_char *fname_vocab, byte **permute, int p, u_ll vocab_file_size) {
+  // Write the .vocab.hash file for the p terms in permute, which are in .vocab order.  See
+  // QBASHER_common_definitions.h for the layout.  Return the size of the file in bytes.
+  u_ll *slots, slot_count = 1, mask, h, s, vh_file_size;
+  u_char *fname;
+  char term[MAX_WD_LEN + 1];
+  byte *vh_buf = NULL;
+  size_t vh_buf_used = 0;
+  CROSS_PLATFORM_FILE_HANDLE vh_handle;
+  int e, error_code = 0;
+
+  while ((double)slot_count * VH_MAX_LOAD < (double)p) slot_count <<= 1;
+  mask = slot_count - 1;
+  vh_file_size = (slot_count + VH_HEADER_ULLS) * sizeof(u_ll);
+  slots = (u_ll *)malloc(vh_file_size);  // MAL603
+  if (slots == NULL) error_exit("Error: malloc failed for the .vocab.hash table");
+  memset(slots, 0, vh_file_size);
+  slots[0] = slot_count;
+  slots[1] = vocab_file_size;
+  for (e = 0; e < p; e++) {
+    // Hash the term exactly as vocabfile_entry_packer() will have truncated it.
+    strncpy(term, (char *)permute[e], MAX_WD_LEN + 1);
+    term[MAX_WD_LEN] = 0;
+    h = fnv_64a_str(term, FNV1A_64_INIT);
+    s = h & mask;
+    while (slots[VH_HEADER_ULLS + s] != 0) s = (s + 1) & mask;
+    slots[VH_HEADER_ULLS + s] = vh_assemble(h, (u_ll)e);
+  }
+
+  fname = (u_char *)malloc(strlen((char *)fname_vocab) + strlen(VH_SUFFIX) + 1);  // MAL604
+  if (fname == NULL) error_exit("Error: malloc failed for the .vocab.hash file name");
+  strcpy((char *)fname, (char *)fname_vocab);
+  strcat((char *)fname, VH_SUFFIX);
+  vh_handle = open_w((char *)fname, &error_code);
+  if (error_code) error_exit("Unable to open .vocab.hash file for writing.");
+  buffered_write(vh_handle, &vh_buf, HUGEBUFSIZE, &vh_buf_used, (byte *)slots, vh_file_size, ".vocab.hash");
+  buffered_flush(vh_handle, &vh_buf, &vh_buf_used, ".vocab.hash", TRUE);
+  free(fname);  // FRE604
+  free(slots);  // FRE603
+  return vh_file_size;
+}
+
+
 
 // The following functions are used in the experimental mode where we sort accumulated postings instead of 
 // building linked lists.
@@ -191,30 +536,567 @@ static void sort_accumulated_postings(dahash_table_t *ht, LPCSTR fname_vocab, LP
 
 static byte vocabfile_record[VOCABFILE_REC_LEN + 10], arg_list[IF_HEADER_LEN - 250];
 
-double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fname_if, doh_t ll_heap,
-			   u_int SB_POSTINGS_PER_RUN, u_int SB_TRIGGER, docnum_t doccount, long long fsz, u_ll max_plist_len) {
-  // Sort the keys stored in ht into alphabetic order, then write the .vocab an
-  // .if files
-  // 
-  // doccount and fsz are passed in only to enable file lengths to be written into the .if header
-  // Return size of .if and .vocab files in MB (as a double)
+// A postings_reader_t delivers the postings for one term in document number order, drawing on the
+// lists for that term in each of the partitions in which it occurs.  Within a partition, a list is
+// either one or two postings packed into the hash table entry, or a chunked linked list in the
+// partition's DOH.  See process_a_word_internal() in QBASHI.c, and append_posting().  Within a run,
+// it's a contiguous sequence of postings in the run's postings file.  See spill_partition_to_run().
+
+typedef struct {
+  index_partition_t *partitions;
+  int *parts, num_parts, part;   // The partitions containing the term, and which of them we're up to
+  vocab_entry_p *veps;           // The term's hash table entries in those partitions
+  u_int to_deliver;              // Postings still to be delivered, over all the partitions
+
+  // The state of the list for the current partition
+  doh_t ll_heap;
+  u_int count, delivered;
+  u_ll dnwp[2];                  // Postings from the hash table entry.  (currptr == NULL)
+  byte *runptr;                  // The next posting in a run.  (Otherwise NULL)
+  docnum_t last_docnum;
+  posting_p currptr, tailptr, payloadptr;
+  u_int chunkno, current_k, K;
+  u_ll count_limit_for_current_k;
+} postings_reader_t;
+
+
+static void pr_start_partition(postings_reader_t *pr) {
+  // Set up to read the term's list in partition pr->parts[pr->part]
+  vocab_entry_p vep = pr->veps[pr->part];
+  index_partition_t *ixp = pr->partitions + pr->parts[pr->part];
+  u_ll head, tail;
+  u_short chunk_count;
+
+  pr->ll_heap = ixp->ll_heap;
+  pr->delivered = 0;
+  pr->last_docnum = 0;
+  pr->count = ve_get_count(vep);
+  pr->runptr = NULL;
+  if (ixp->run_postings != NULL) {
+    ve_unpack466(vep, &pr->count, &head, &tail);
+    pr->runptr = ixp->run_postings + head;
+    return;  // ------------------------------------------------------->
+  }
+  if (x_2postings_in_vocab && pr->count < 3) {
+    ve_unpack466(vep, &pr->count, pr->dnwp, pr->dnwp + 1);
+    pr->currptr = NULL;
+    return;  // ------------------------------------------------------->
+  }
+  ve_unpack4552(vep, &pr->count, &head, &tail, &chunk_count);
+  pr->currptr = doh_get_pointer(pr->ll_heap, head);
+  pr->tailptr = doh_get_pointer(pr->ll_heap, tail);
+  pr->payloadptr = pr->currptr;
+  pr->chunkno = 1;
+  pr->current_k = 1;
+  pr->K = chunk_K_table[1];
+  pr->count_limit_for_current_k = chunk_length_table[1];
+}
+
+
+static void pr_start(postings_reader_t *pr, u_int count) {
+  // Start reading the count postings for a term whose partitions and hash table entries have
+  // been set up in pr->parts and pr->veps.
+  pr->part = 0;
+  pr->to_deliver = count;
+  pr_start_partition(pr);
+}
+
+
+static BOOL pr_next(postings_reader_t *pr, docnum_t *docnum, int *wdnum, u_char *key) {
+  // Set *docnum and *wdnum from the next posting and return TRUE, or return FALSE if there
+  // are no more.  key is only used in error messages.
+  docnum_t docnum_diff;
+  u_ll next;
+  byte *nextptrptr;
+  int b;
+
+  if (pr->to_deliver == 0) return FALSE;  // ------------------------------------------------------->
+  while (pr->delivered >= pr->count) {
+    pr->part++;
+    if (pr->part >= pr->num_parts) {
+      printf("Error in postings for '%s': %u postings missing\n", key, pr->to_deliver);
+      error_exit("Error: Postings list ended early while writing inverted file.\n");
+    }
+    pr_start_partition(pr);
+  }
+
+  if (pr->runptr != NULL) {
+    // Written by spill_partition_to_run() in the same way as postings in the .if
+    *wdnum = pr->runptr[0];
+    b = 1;
+    docnum_diff = 0;
+    do {
+      docnum_diff <<= 7;
+      docnum_diff |= pr->runptr[b] >> 1;
+      b++;
+    } while (!(pr->runptr[b - 1] & 1));
+    *docnum = pr->last_docnum + docnum_diff;
+    pr->last_docnum = *docnum;
+    pr->runptr += b;
+  }
+  else if (pr->currptr == NULL) {
+    *docnum = pr->dnwp[pr->delivered] >> WDPOS_BITS;
+    *wdnum = pr->dnwp[pr->delivered] & WDPOS_MASK;
+  }
+  else {
+    // Move on to the next chunk if there are no more postings in this one.  A wdnum of 0xFF
+    // marks the unused part of a chunk.
+    while (pr->payloadptr >= pr->currptr + pr->K * PAYLOAD_SIZE || pr->payloadptr[0] == 0xFF) {
+      if (pr->currptr == pr->tailptr) {
+	printf("Error in postings for '%s': %u postings missing\n", key, pr->to_deliver);
+	error_exit("Error: Postings list ended early while writing inverted file.\n");
+      }
+      // This is not the last chunk, so the NEXT field is actually a pointer
+      nextptrptr = pr->currptr + pr->K * PAYLOAD_SIZE;
+      next = 0;
+      for (b = (NEXT_POINTER_SIZE - 3); b >= 0; b--) {
+	next <<= 8;
+	next |= nextptrptr[b];
+      }
+      pr->currptr = doh_get_pointer(pr->ll_heap, next);
+      pr->payloadptr = pr->currptr;
+      if (pr->chunkno < 0xFFFF) pr->chunkno++;
+      if (pr->chunkno > pr->count_limit_for_current_k) {
+	pr->current_k++;
+	pr->count_limit_for_current_k = chunk_length_table[pr->current_k];
+	pr->K = chunk_K_table[pr->current_k];
+	if (pr->chunkno > pr->count_limit_for_current_k) {
+	  error_exit("Chunking stuffed!\n");
+	}
+      }
+    }
+
+    // Get the wordnum - just a single byte.
+    *wdnum = pr->payloadptr[0];
+    if (x_use_vbyte_in_chunks) {
+      // Get the vbyte-encoded docnum_diff.  Continuation bit is LSB
+      b = 1;
+      docnum_diff = 0;
+      do {
+	docnum_diff <<= 7;
+	docnum_diff |= pr->payloadptr[b] >> 1;
+	b++;
+      } while (!(pr->payloadptr[b - 1] & 1));
+      *docnum = pr->last_docnum + docnum_diff;
+      pr->payloadptr += b;
+    }
+    else {
+      // Get the docnum out of five bytes, written little-endian
+      *docnum = 0;
+      for (b = 5; b > 0; b--) {
+	*docnum <<= 8;
+	*docnum |= pr->payloadptr[b];
+      }
+      pr->payloadptr += PAYLOAD_SIZE;
+    }
+    pr->last_docnum = *docnum;
+  }
+
+  pr->delivered++;
+  pr->to_deliver--;
+  *docnum += pr->partitions[pr->parts[pr->part]].docnum_base;
+  if (*docnum > x_max_docs) {
+    printf("Error in postings for '%s': wdnum=%u, docnum = %llu\n", key, *wdnum, *docnum);
+    error_exit("Error: Erroneous docnum encountered while writing inverted file.\n");
+  }
+  return TRUE;
+}
+
+
+void sort_partition_vocabulary(index_partition_t *ixp) {
+  // Set ixp->sorted_keys to an array of pointers to the keys in ixp->word_table, in alphabetic
+  // order.  Called by the indexing threads as they finish, so that the sorts run in parallel.
+  dahash_table_t *ht = ixp->word_table;
+  size_t e, ht_off = 0;
+
+  ixp->sorted_keys = (byte **)malloc((ht->entries_used + 1) * sizeof(byte *));  // MAL600
+  if (ixp->sorted_keys == NULL) error_exit("Error: malloc failed for the vocabulary permuter");
+  ixp->num_keys = 0;
+  for (e = 0; e < ht->capacity; e++) {
+    if (((byte *)(ht->table))[ht_off]) {
+      ixp->sorted_keys[ixp->num_keys++] = ((byte *)(ht->table)) + ht_off;
+    }
+    ht_off += ht->entry_size;
+  }
+  qsort(ixp->sorted_keys, ixp->num_keys, sizeof(byte *), compare_keys_alphabetic);
+  ixp->key_size = ht->key_size;
+}
+
+
+void spill_partition_to_run(index_partition_t *ixp, index_partition_t *run) {
+  // Write the postings lists accumulated in partition ixp to the run files named in run, and
+  // set up run to describe them.  The run's vocab file holds the hash table entries in alphabetic
+  // order, with each value replaced by the term's count (where ve_get_count() expects it) and the
+  // offset of its list in the run's postings file.  There, each posting is a wdpos byte followed by
+  // the vbyte-encoded docgap, as in a .if without skip blocks.  Document numbers are local to the
+  // partition, like those in its hash table.  The caller replaces the hash table and heap.
+  //
+  // This is the external-memory version of what sort_accumulated_postings() set out to do: the
+  // run is written sequentially, and write_inverted_file() merges the runs by reading them
+  // sequentially, so the random access is confined to the hash table and heap of one run.
+  postings_reader_t reader;
+  int part = 0, wdnum = 0, b, bytes_needed, error_code = 0;
+  vocab_entry_p vep;
+  byte *entry, *vocab_buf = NULL, *postings_buf = NULL, bytes[6];
+  size_t k, entry_size, vocab_buf_used = 0, postings_buf_used = 0;
+  u_ll offset = 0;
+  u_int count;
+  docnum_t docnum, last_docnum, docnum_diff, limit;
+  CROSS_PLATFORM_FILE_HANDLE vocab_handle, postings_handle;
+
+  sort_partition_vocabulary(ixp);
+  entry_size = ixp->word_table->entry_size;
+  entry = (byte *)malloc(entry_size);  // MAL609
+  if (entry == NULL) error_exit("Error: malloc failed for a run vocab entry");
+  vocab_handle = open_w((char *)run->run_vocab_fname, &error_code);
+  if (error_code) error_exit("Unable to open a run vocab file for writing.");
+  postings_handle = open_w((char *)run->run_postings_fname, &error_code);
+  if (error_code) error_exit("Unable to open a run postings file for writing.");
+
+  reader.partitions = ixp;
+  reader.parts = &part;
+  reader.veps = &vep;
+  reader.num_parts = 1;
+  for (k = 0; k < ixp->num_keys; k++) {
+    vep = ixp->sorted_keys[k] + ixp->key_size;
+    count = ve_get_count(vep);
+    memcpy(entry, ixp->sorted_keys[k], entry_size);
+    ve_pack466(entry + ixp->key_size, count, offset, 0);
+    buffered_write(vocab_handle, &vocab_buf, HUGEBUFSIZE, &vocab_buf_used, entry, entry_size, "run vocab");
+
+    pr_start(&reader, count);
+    last_docnum = 0;
+    while (pr_next(&reader, &docnum, &wdnum, ixp->sorted_keys[k])) {
+      docnum_diff = docnum - last_docnum;
+      last_docnum = docnum;
+      limit = 1ULL << 7;
+      bytes_needed = 1;
+      while (docnum_diff >= limit) {
+	bytes_needed++;
+	limit <<= 7;
+      }
+      bytes[0] = (byte)wdnum;
+      for (b = bytes_needed; b > 0; b--) {
+	bytes[b] = (byte)((docnum_diff & 0x7F) << 1);
+	docnum_diff >>= 7;
+      }
+      bytes[bytes_needed] |= 1;   // Set the termination bit on the last byte
+      buffered_write(postings_handle, &postings_buf, HUGEBUFSIZE, &postings_buf_used, bytes, bytes_needed + 1, "run postings");
+      offset += bytes_needed + 1;
+    }
+  }
+  buffered_flush(vocab_handle, &vocab_buf, &vocab_buf_used, "run vocab", TRUE);
+  buffered_flush(postings_handle, &postings_buf, &postings_buf_used, "run postings", TRUE);
+  free(entry);  // FRE609
+
+  run->num_keys = ixp->num_keys;
+  run->key_size = ixp->key_size;
+  run->run_postings_size = offset;
+  free(ixp->sorted_keys);  // FRE600
+  ixp->sorted_keys = NULL;
+}
+
+
+static void map_run(index_partition_t *run) {
+  // Map the files of a run written by spill_partition_to_run() and point its sorted_keys at
+  // the entries in its vocab file.
+  int error_code = 0;
+  size_t k, entry_size;
+
+  run->run_vocab = (byte *)mmap_all_of(run->run_vocab_fname, &run->run_vocab_size, FALSE,
+				       &run->run_vocab_FH, &run->run_vocab_FMH, &error_code);
+  if (error_code) {
+    printf("Error: mmap_all_of(%s): code = %d\n", run->run_vocab_fname, error_code);
+    exit(1);
+  }
+  run->run_postings = (byte *)mmap_all_of(run->run_postings_fname, &run->run_postings_size, FALSE,
+					  &run->run_postings_FH, &run->run_postings_FMH, &error_code);
+  if (error_code) {
+    printf("Error: mmap_all_of(%s): code = %d\n", run->run_postings_fname, error_code);
+    exit(1);
+  }
+  entry_size = run->run_vocab_size / run->num_keys;
+  run->sorted_keys = (byte **)malloc((run->num_keys + 1) * sizeof(byte *));  // MAL600
+  if (run->sorted_keys == NULL) error_exit("Error: malloc failed for the vocabulary of a run");
+  for (k = 0; k < run->num_keys; k++) run->sorted_keys[k] = run->run_vocab + k * entry_size;
+}
+
+
+static void unmap_and_remove_run(index_partition_t *run) {
+  unmmap_all_of(run->run_vocab, run->run_vocab_FH, run->run_vocab_FMH, run->run_vocab_size);
+  unmmap_all_of(run->run_postings, run->run_postings_FH, run->run_postings_FMH, run->run_postings_size);
+  run->run_vocab = NULL;
+  run->run_postings = NULL;
+  remove((char *)run->run_vocab_fname);
+  remove((char *)run->run_postings_fname);
+}
+
+
+static int next_merged_term(index_partition_t *partitions, int num_partitions, size_t *cursors,
+			    byte **key, int *parts, vocab_entry_p *veps, u_int *count) {
+  // Find the alphabetically next term among the sorted vocabularies of all the partitions,
+  // starting from cursors[].  Set *key to its key in the first partition which contains it, and
+  // record the partitions containing it, and its hash table entries in them, in parts[] and veps[].
+  // Advance the cursors past it, set *count to the number of postings to be written for it, and
+  // return the number of partitions containing it.  Return zero when there are no more terms.
+  int k, num_parts = 0;
+  index_partition_t *ixp;
+
+  *key = NULL;
+  for (k = 0; k < num_partitions; k++) {
+    ixp = partitions + k;
+    if (cursors[k] < ixp->num_keys
+	&& (*key == NULL || strcmp((char *)ixp->sorted_keys[cursors[k]], (char *)*key) < 0))
+      *key = ixp->sorted_keys[cursors[k]];
+  }
+  if (*key == NULL) return 0;  // ------------------------------------------------------->
+
+  *count = 0;
+  for (k = 0; k < num_partitions; k++) {
+    ixp = partitions + k;
+    if (cursors[k] < ixp->num_keys && !strcmp((char *)ixp->sorted_keys[cursors[k]], (char *)*key)) {
+      parts[num_parts] = k;
+      veps[num_parts] = ixp->sorted_keys[cursors[k]] + ixp->key_size;
+      *count += ve_get_count(veps[num_parts]);
+      num_parts++;
+      cursors[k]++;
+    }
+  }
+  // Each partition keeps at most max_line_prefix_postings postings for a line prefix.  Only the
+  // first max_line_prefix_postings of them, in docnum order, are wanted overall.
+  if ((*key)[0] == '>' && *count > max_line_prefix_postings) *count = max_line_prefix_postings;
+  return num_parts;
+}
+
+
+corpus_term_stats_t *compute_corpus_term_stats(index_partition_t *partitions, int num_partitions) {
+  // Merge the vocabularies of all the partitions, including runs, as write_inverted_file() does,
+  // and return a malloced copy of each distinct term with its total number of postings, plus the
+  // length of the longest postings list.  Runs are mapped here and left mapped for
+  // write_inverted_file().
+  corpus_term_stats_t *cts;
+  size_t total_keys = 0, *cursors;
+  int k, *parts;
+  vocab_entry_p *veps;
+  byte *key;
+  u_int count;
+
+  for (k = 0; k < num_partitions; k++) {
+    if (partitions[k].run_vocab_fname != NULL) {
+      if (partitions[k].run_vocab == NULL) map_run(partitions + k);
+    }
+    else if (partitions[k].sorted_keys == NULL) sort_partition_vocabulary(partitions + k);
+    total_keys += partitions[k].num_keys;
+  }
+
+  cts = (corpus_term_stats_t *)malloc(sizeof(corpus_term_stats_t));  // MAL610
+  cursors = (size_t *)calloc(num_partitions, sizeof(size_t));  // MAL606
+  parts = (int *)malloc(num_partitions * sizeof(int));  // MAL607
+  veps = (vocab_entry_p *)malloc(num_partitions * sizeof(vocab_entry_p));  // MAL608
+  if (cts == NULL || cursors == NULL || parts == NULL || veps == NULL)
+    error_exit("Error: malloc failed for corpus term statistics");
+  cts->terms = (corpus_term_t *)malloc((total_keys + 1) * sizeof(corpus_term_t));  // MAL611
+  if (cts->terms == NULL) error_exit("Error: malloc failed for corpus term statistics");
+
+  cts->num_terms = 0;
+  cts->cursor = 0;
+  cts->max_plist_len = 0;
+  while (next_merged_term(partitions, num_partitions, cursors, &key, parts, veps, &count)) {
+    // The same accounting as in write_inverted_file()
+    if ((!x_2postings_in_vocab || count > 3) && count > cts->max_plist_len) cts->max_plist_len = count;
+    strncpy((char *)cts->terms[cts->num_terms].term, (char *)key, MAX_WD_LEN);
+    cts->terms[cts->num_terms].term[MAX_WD_LEN] = 0;
+    cts->terms[cts->num_terms++].count = count;
+  }
+  printf("Corpus-wide statistics gathered for %zu distinct terms.\n", cts->num_terms);
+
+  free(cursors);    // FRE606
+  free(parts);      // FRE607
+  free(veps);       // FRE608
+  return cts;
+}
 
-  int b, e, p, interval = 1000, error_code = 0;
+
+void free_corpus_term_stats(corpus_term_stats_t **ctsp) {
+  if (*ctsp == NULL) return;
+  free((*ctsp)->terms);  // FRE611
+  free(*ctsp);  // FRE610
+  *ctsp = NULL;
+}
+
+
+static byte term_qidf(byte *key, u_int count, u_ll max_plist_len, corpus_term_stats_t *cts) {
+  // Return the quantized IDF to be stored in the .vocab entry for key, which has count postings
+  // in this index.  If cts is given, the term's count over all the shards is used instead.  The
+  // terms are looked up in .vocab order, so cts->cursor only ever moves forward.
+  if (cts != NULL) {
+    while (cts->cursor < cts->num_terms && strcmp((char *)cts->terms[cts->cursor].term, (char *)key) < 0) cts->cursor++;
+    if (cts->cursor < cts->num_terms && !strcmp((char *)cts->terms[cts->cursor].term, (char *)key))
+      count = cts->terms[cts->cursor].count;
+    max_plist_len = cts->max_plist_len;
+  }
+  // The constants make the QIDF of the most common term come out to be 1
+  if (count <= 1) return (byte)quantized_idf(max_plist_len * 1.5, count, 0XFF);
+  return (byte)quantized_idf(max_plist_len * 1.05, count, 0XFF);
+}
+
+
+static int compare_impact_entries(const void *i, const void *j) {
+  u_ll a = *(u_ll *)i, b = *(u_ll *)j;
+  if (a < b) return -1;
+  if (a > b) return 1;
+  return 0;
+}
+
+
+static u_ll write_impact_file(u_char *fname_vocab, index_partition_t *partitions, int num_partitions,
+			      byte **permute, int p, size_t *cursors, int *parts, vocab_entry_p *veps,
+			      docnum_t doccount, u_ll vocab_file_size) {
+  // Write the .impact file for the p terms in permute, which are in .vocab order.  See
+  // QBASHER_common_definitions.h for the layout.  The postings are read twice more:  once to
+  // find the document lengths, and once to calculate the impacts.  Return the size of the file.
+  //
+  // Each term's documents are collected in entries[] as (IM_MAX_IMPACT - impact) << 40 | docnum,
+  // so that sorting them in ascending order gives descending impact and ascending docnum.
+  u_short *doclens;
+  u_ll *list_offsets, *entries = NULL, header[IM_HEADER_ULLS], im_off, total_dl = 0;
+  size_t entries_capacity = 0, num_entries, r, run_start, im_buf_used = 0;
+  u_int count, n, run_count;
+  u_short impact;
+  int e, wdnum, tf, error_code = 0;
+  docnum_t docnum, prev_docnum;
+  double N = (double)doccount, avdl, idf, max_weight, w;
+  byte *key, *im_buf = NULL, docnum_bytes[8];
+  u_char *fname;
+  postings_reader_t reader;
+  CROSS_PLATFORM_FILE_HANDLE im_handle;
+
+  if (doccount < 1) return 0;  // ------------------------------------------------------->
+  doclens = (u_short *)calloc(doccount, sizeof(u_short));  // MAL612
+  list_offsets = (u_ll *)calloc(p + 1, sizeof(u_ll));  // MAL613
+  if (doclens == NULL || list_offsets == NULL) error_exit("Error: malloc failed for the .impact file");
+  reader.partitions = partitions;
+  reader.parts = parts;
+  reader.veps = veps;
+
+  // Pass 1:  Document lengths, counted in postings, excluding line prefixes.
+  memset(cursors, 0, num_partitions * sizeof(size_t));
+  for (e = 0; e < p; e++) {
+    reader.num_parts = next_merged_term(partitions, num_partitions, cursors, &key, parts, veps, &count);
+    if (key[0] == '>') continue;
+    pr_start(&reader, count);
+    while (pr_next(&reader, &docnum, &wdnum, (u_char *)key)) {
+      if (doclens[docnum] < 0xFFFF) doclens[docnum]++;
+      total_dl++;
+    }
+  }
+  avdl = (double)total_dl / N;
+  if (avdl <= 0.0) avdl = 1.0;
+  max_weight = log(N + 1.0);
+
+  fname = (u_char *)malloc(strlen((char *)fname_vocab) - strlen(".vocab") + strlen(IM_SUFFIX) + 1);  // MAL614
+  if (fname == NULL) error_exit("Error: malloc failed for the .impact file name");
+  strcpy((char *)fname, (char *)fname_vocab);
+  strcpy((char *)fname + strlen((char *)fname_vocab) - strlen(".vocab"), IM_SUFFIX);
+  im_handle = open_w((char *)fname, &error_code);
+  if (error_code) error_exit("Unable to open .impact file for writing.");
+  header[0] = (u_ll)p;
+  header[1] = vocab_file_size;
+  header[2] = (u_ll)doccount;
+  header[3] = IM_MAX_IMPACT;
+  buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)header, sizeof(header), ".impact header");
+  im_off = sizeof(header);
+
+  // Pass 2:  The impacts
+  memset(cursors, 0, num_partitions * sizeof(size_t));
+  for (e = 0; e < p; e++) {
+    reader.num_parts = next_merged_term(partitions, num_partitions, cursors, &key, parts, veps, &count);
+    if (key[0] == '>') continue;
+    if (count > entries_capacity) {
+      free(entries);  // FRE615
+      entries_capacity = count;
+      entries = (u_ll *)malloc(entries_capacity * sizeof(u_ll));  // MAL615
+      if (entries == NULL) error_exit("Error: malloc failed for the .impact entries");
+    }
+    // Gather the docnums, with their tfs in the top bits for now.
+    pr_start(&reader, count);
+    num_entries = 0;
+    prev_docnum = -1;
+    while (pr_next(&reader, &docnum, &wdnum, (u_char *)key)) {
+      if (docnum == prev_docnum) entries[num_entries - 1] += 1ULL << 40;
+      else entries[num_entries++] = (1ULL << 40) | (u_ll)docnum;
+      prev_docnum = docnum;
+    }
+    n = (u_int)num_entries;
+    idf = log((N + 1.0) / (double)n);
+    for (r = 0; r < num_entries; r++) {
+      docnum = (docnum_t)(entries[r] & BP_MASK40);
+      tf = (int)(entries[r] >> 40);
+      w = idf * tf / (tf + IM_K1 * (1.0 - IM_B + IM_B * (double)doclens[docnum] / avdl));
+      impact = (u_short)(1 + floor((IM_MAX_IMPACT - 1) * w / max_weight));
+      if (impact > IM_MAX_IMPACT) impact = IM_MAX_IMPACT;
+      entries[r] = ((u_ll)(IM_MAX_IMPACT - impact) << 40) | (u_ll)docnum;
+    }
+    qsort(entries, num_entries, sizeof(u_ll), compare_impact_entries);
+
+    list_offsets[e] = im_off;
+    buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)&n, IM_LIST_HEADER_BYTES, ".impact list");
+    im_off += IM_LIST_HEADER_BYTES;
+    for (run_start = 0; run_start < num_entries; run_start = r) {
+      for (r = run_start; r < num_entries && (entries[r] >> 40) == (entries[run_start] >> 40); r++);
+      impact = (u_short)(IM_MAX_IMPACT - (entries[run_start] >> 40));
+      run_count = (u_int)(r - run_start);
+      buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)&impact, 2, ".impact run");
+      buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)&run_count, 4, ".impact run");
+      im_off += IM_RUN_HEADER_BYTES;
+      for (; run_start < r; run_start++) {
+	*(u_ll *)docnum_bytes = entries[run_start] & BP_MASK40;
+	buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, docnum_bytes, IM_DOCNUM_BYTES, ".impact docnum");
+	im_off += IM_DOCNUM_BYTES;
+      }
+    }
+  }
+
+  buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)list_offsets, p * sizeof(u_ll), ".impact table");
+  im_off += p * sizeof(u_ll) + sizeof(u_ll);
+  buffered_write(im_handle, &im_buf, HUGEBUFSIZE, &im_buf_used, (byte *)&im_off, sizeof(u_ll), ".impact length");
+  buffered_flush(im_handle, &im_buf, &im_buf_used, ".impact", TRUE);
+
+  free(fname);  // FRE614
+  free(entries);  // FRE615
+  free(list_offsets);  // FRE613
+  free(doclens);  // FRE612
+  return im_off;
+}
+
+
+double write_inverted_file(index_partition_t *partitions, int num_partitions, u_char *fname_vocab, u_char *fname_if,
+			   u_int SB_POSTINGS_PER_RUN, u_int SB_TRIGGER, docnum_t doccount, long long fsz, u_ll postings,
+			   corpus_term_stats_t *cts, u_ll *max_plist_len, u_ll *vocab_size) {
+  // Merge the alphabetically sorted vocabularies of the partitions, then write the .vocab and
+  // .if files.  With only one partition, the merge is trivial.  Partitions which are runs are
+  // mapped here, and their files are removed when they've been merged.
+  //
+  // doccount, fsz and postings are passed in only to enable file lengths to be written into the .if header.
+  // cts is NULL unless this is one of a set of shards.  See term_qidf().
+  // Return size of .if and .vocab files in MB (as a double).  Also return the length of the
+  // longest postings list and the number of distinct terms.
+
+  int b, e, k, p, num_parts, interval = 1000, error_code = 0, *parts;
   byte **permute, *vocab_buf = NULL, *if_buf = NULL, qidf = 1;
-  posting_p headptr = NULL, currptr = NULL, nextptr = NULL, tailptr = NULL;    // posting_p is just byte *
-  size_t entry_size, vocab_buf_used = 0, if_buf_used = 0;
-  u_ll ht_off = 0, if_off = 0, list_elts = 0, histo[7] = { 0 }, vocab_file_size,
-								  postings_lists_with_skip_blocks = 0, skip_blocks_written = 0, tot_skip_blocks_written = 0,
-								  max_sb_runs_per_list = 0;
+  vocab_entry_p *veps;
+  size_t entry_size, vocab_buf_used = 0, if_buf_used = 0, total_keys = 0, *cursors, *header;
+  u_ll if_off = 0, list_elts = 0, histo[7] = { 0 }, vocab_file_size,
+    postings_lists_with_skip_blocks = 0, skip_blocks_written = 0, tot_skip_blocks_written = 0,
+    max_sb_runs_per_list = 0;
   CROSS_PLATFORM_FILE_HANDLE vocab_handle, if_handle;
-  double invfile_MB, permute_MB;
+  double invfile_MB, permute_MB, table_MB = 0.0;
   u_char *if_header = NULL;
-  u_short chunk_count = 0;
-  u_int count, current_sb_postings_per_run, chunkno = 1;  // I assume we start from one.
-  u_ll head, tail;
-  size_t *header, blocknum, byteoffset, bytes_used_in_header;
-  posting_p *pblock;
+  u_int count, current_sb_postings_per_run;
+  size_t bytes_used_in_header;
+  postings_reader_t reader;
   BOOL verbose = (debug >= 2);
+  char *index_format = block_postings ? INDEX_FORMAT_BLOCKED : INDEX_FORMAT;
 #ifdef WIN64
   vocab_handle = NULL;
   if_handle = NULL;
@@ -223,42 +1105,52 @@ double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fnam
   if_handle = -1;
 #endif
 
-  header = (size_t *)ll_heap;
-  pblock = (posting_p *)(header + DOH_HEADER_ENTS);
-
   if (verbose) printf("write_inverted_file()\n");
 
 
-  if (ht == NULL) {
+  if (partitions == NULL || num_partitions < 1) {
     printf("Error: write_inverted_file(): attempt to dump NULL table.\n");
     exit(1);
   }
 
-  vocab_file_size = ht->entries_used * VOCABFILE_REC_LEN;
-  if (0) printf("CANBERRA: vfs = %zu * %d = %lld\n",
-		ht->entries_used, VOCABFILE_REC_LEN, vocab_file_size);
-
-  entry_size = ht->key_size + ht->val_size;
-  permute = (byte **)malloc(ht->entries_used * sizeof(byte *));  // MAL600
-  permute_MB = (double)(ht->entries_used * sizeof(byte *)) / MEGA;
-
+  for (k = 0; k < num_partitions; k++) {
+    if (partitions[k].run_vocab_fname != NULL) {
+      if (partitions[k].run_vocab == NULL) map_run(partitions + k);   // Maybe by compute_corpus_term_stats()
+    }
+    else if (partitions[k].sorted_keys == NULL) sort_partition_vocabulary(partitions + k);
+    total_keys += partitions[k].num_keys;
+  }
 
-#ifdef WIN64
-  report_memory_usage(stdout, (u_char *)"before writing the inverted file", &pfc_list_scan_start);
-#endif
+  printf("QSORT of vocabulary permuter complete.\n");
 
-  // permute is freed at the end of this function
+  // Merge the partitions' vocabularies to find the distinct terms and the number of postings
+  // for each.  permute is freed at the end of this function.
+  permute = (byte **)malloc((total_keys + 1) * sizeof(byte *));  // MAL605
+  cursors = (size_t *)malloc(num_partitions * sizeof(size_t));  // MAL606
+  parts = (int *)malloc(num_partitions * sizeof(int));  // MAL607
+  veps = (vocab_entry_p *)malloc(num_partitions * sizeof(vocab_entry_p));  // MAL608
+  if (permute == NULL || cursors == NULL || parts == NULL || veps == NULL)
+    error_exit("Error: malloc failed for vocabulary merging");
+  permute_MB = (double)(total_keys * sizeof(byte *)) / MEGA;
+
+  memset(cursors, 0, num_partitions * sizeof(size_t));
+  *max_plist_len = 0;
   p = 0;
-  for (e = 0; e < ht->capacity; e++) {
-    if (((byte *)(ht->table))[ht_off]) {
-      permute[p++] = ((byte *)(ht->table)) + ht_off;
-    }
-    ht_off += ht->entry_size;
+  while (next_merged_term(partitions, num_partitions, cursors, permute + p, parts, veps, &count)) {
+    // This reproduces the accounting in process_a_word_internal(), which doesn't count lists of
+    // up to three postings when the first two are kept in the hash table entry.
+    if ((!x_2postings_in_vocab || count > 3) && count > *max_plist_len) *max_plist_len = count;
+    p++;
   }
+  *vocab_size = p;
+  if (cts != NULL) cts->cursor = 0;
+  if (num_partitions > 1) printf("Vocabularies of %d partitions merged.\n", num_partitions);
 
-  qsort(permute, p, sizeof(byte *), compare_keys_alphabetic);
+  vocab_file_size = (u_ll)p * VOCABFILE_REC_LEN;
 
-  printf("QSORT of vocabulary permuter complete.\n");
+#ifdef WIN64
+  report_memory_usage(stdout, (u_char *)"before writing the inverted file", &pfc_list_scan_start);
+#endif
 
   if (!x_minimize_io) {
     vocab_handle = open_w((char *)fname_vocab, &error_code);
@@ -285,10 +1177,10 @@ double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fnam
     sprintf((char *)if_header, "Index_format: %s\nQBASHER version:%s%s\nQuery_meta_chars: %s\nOther_token_breakers: %s\n"
 	    "Size of .forward: %lld\nSize of .dt: %lld\nSize of .vocab: %llu\nTotal postings: %llu\nNumber of documents: %lld\n"
 	    "Vocabulary size: %llu\n%s",
-	    INDEX_FORMAT, INDEX_FORMAT, QBASHER_VERSION, QBASH_META_CHARS, other_token_breakers,
-	    fsz, doccount * DTE_LENGTH, vocab_file_size, tot_postings, doccount, vocab_file_size / VOCABFILE_REC_LEN,
+	    index_format, index_format, QBASHER_VERSION, QBASH_META_CHARS, other_token_breakers,
+	    fsz, doccount * DTE_LENGTH, vocab_file_size, postings, doccount, vocab_file_size / VOCABFILE_REC_LEN,
 	    arg_list);
-		
+
     bytes_used_in_header = strlen((char *)if_header);
     printf("Bytes written in header %zu/%d\n", bytes_used_in_header, IF_HEADER_LEN);
     if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, if_header, IF_HEADER_LEN, "IF header");
@@ -297,12 +1189,19 @@ double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fnam
     free(if_header);   //FRE601
   }   // End of if (!x_minimize_io)
 
-  // Report memory use prior to writing .vocab and .if so we can see what might be 
+  // Report memory use prior to writing .vocab and .if so we can see what might be
   // causing slowness at that stage.
+  for (k = 0; k < num_partitions; k++) {
+    if (partitions[k].word_table == NULL) continue;   // A run
+    entry_size = partitions[k].word_table->key_size + partitions[k].word_table->val_size;
+    table_MB += (double)partitions[k].word_table->capacity * (double)entry_size / MEGA;
+  }
   printf("write_inverted_file: permute array occupies %.1f MB\n", permute_MB);
-  printf("write_inverted_file: hash table occupies: %.1fMB\n", (double)ht->capacity * (double)entry_size / MEGA);
+  printf("write_inverted_file: hash table occupies: %.1fMB\n", table_MB);
 
-  doh_print_usage_report(ll_heap);
+  for (k = 0; k < num_partitions; k++) {
+    if (partitions[k].ll_heap != NULL) doh_print_usage_report(partitions[k].ll_heap);
+  }
   fflush(stdout);
 
 
@@ -315,473 +1214,231 @@ double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fnam
 
   fflush(stdout);
 
-#if 0
-  if (x_sort_postings_instead > 0) {
-    sort_accumulated_postings(ht, (LPCSTR)fname_vocab, (LPCSTR)fname_if, ll_heap,
-			      SB_POSTINGS_PER_RUN, SB_TRIGGER, doccount, fsz);
-  }
-  else
-#endif
-    {
-      printf("Starting to write out postings and vocab table entries....\n");
-      for (e = 0; e < p; e++) {
-	char *key = (char *)(permute[e]);
-	vocab_entry_p vep = ((vocab_entry_p)(((byte *)permute[e]) + ht->key_size));
-	// The following declarations are to support chunking
-	u_int current_k = 1, K = chunk_K_table[current_k];
-	u_ll count_limit_for_current_k = chunk_length_table[current_k];
-	byte *payloadptr, *nextptrptr;
-	u_ll next;
-
-	// The vocab entry may be packed either 4,6,6 or 4,5,5,2
-	count = ve_get_count(vep);
-	if (x_2postings_in_vocab && count < 3)
-	  ve_unpack466(vep, &count, &head, &tail);     // Head and tail should be 5-byte (or 6-byte) compound references within the DOH
-	else
-	  ve_unpack4552(vep, &count, &head, &tail, &chunk_count);
-
-
-	if (verbose) printf("   - %s %u, %lld, %lld\n", key, count, head, tail);
-	headptr = doh_get_pointer(ll_heap, head);
-	tailptr = doh_get_pointer(ll_heap, tail);
-
-	list_elts = 0;
-
-	if (count <= 1) {
-	  // There's only one posting, write docnum and wdnum into .vocab entry
-	  unsigned long long towrite;
-	  docnum_t docnum;
-	  int wdnum, b;
-	  if (verbose) printf("Single\n");
-	  if (x_2postings_in_vocab) {
-	    //  ---- The posting is actually in the .vocab entry.  head is not actually a list pointer
-	    docnum = head >> WDPOS_BITS;
-	    wdnum = head & WDPOS_MASK;
-	    if (verbose) printf("Extracted single posting (%llu, %u) from the vocab entry for %s.\n", docnum, wdnum, key);
+  printf("Starting to write out postings and vocab table entries....\n");
+  reader.partitions = partitions;
+  reader.parts = parts;
+  reader.veps = veps;
+  memset(cursors, 0, num_partitions * sizeof(size_t));
+  for (e = 0; e < p; e++) {
+    char *key = (char *)(permute[e]);
+    docnum_t docnum = 0, last_docnum = 0, docnum_diff, limit;
+    int wdnum = 0, bytes_needed;
+    byte bight;
+    BOOL head_answers_wanted;
+
+    // Find the term's lists again.  The merge goes through the terms in the same order as before.
+    num_parts = next_merged_term(partitions, num_partitions, cursors, (byte **)&key, parts, veps, &count);
+    reader.num_parts = num_parts;
+    pr_start(&reader, count);
+
+    if (verbose) printf("   - %s %u from %d partition(s)\n", key, count, num_parts);
+
+    // Line prefixes with enough postings get an entry in .if.head_answers.  See write_head_answers_file()
+    head_answers_wanted = (head_answers > 0 && cts == NULL && !x_minimize_io && key[0] == '>'
+			   && count >= head_answers_min_postings);
+    if (head_answers_wanted) ha_start_term();
+
+    list_elts = 0;
+
+    if (count <= 1) {
+      // There's only one posting, write docnum and wdnum into .vocab entry
+      unsigned long long towrite;
+      if (verbose) printf("Single\n");
+      pr_next(&reader, &docnum, &wdnum, (u_char *)key);
+      if (verbose) printf("Extracted single posting (%llu, %u) for %s.\n", docnum, wdnum, key);
+      towrite = (docnum << WDPOS_BITS) | (wdnum & WDPOS_MASK);
+      qidf = term_qidf((byte *)key, count, *max_plist_len, cts);
+      if (0) printf("  -- count = %u,  idf = %.4f,  qidf = %u\n", count, log(*max_plist_len * 1.004008 / (double)count), qidf);
+      vocabfile_entry_packer(vocabfile_record, MAX_WD_LEN + 1, (byte *)key, count, qidf, towrite);
+      if (!x_minimize_io) {
+	buffered_write(vocab_handle, &vocab_buf, HUGEBUFSIZE, &vocab_buf_used, vocabfile_record,
+		       VOCABFILE_REC_LEN, "vocab single posting");
+      }
+
+
+      // In this case there's nothing to be written to .if
+      histo[0]++;
+      if (verbose) printf("Single. done\n");
+    }
+    else {
+      // There are multiple postings.
+      BOOL in_blocks = (block_postings && count >= BP_MIN_POSTINGS_IN_BLOCKS);
+
+
+      // Write the .if offset into .vocab
+      if (verbose) printf("Multiple\n");
+      qidf = term_qidf((byte *)key, count, *max_plist_len, cts);
+      if (0) printf("  -- count = %u,  idf = %.4f,  qidf = %u\n", count, log(*max_plist_len * 1.05 / (double)count), qidf);
+      vocabfile_entry_packer(vocabfile_record, MAX_WD_LEN + 1, (byte *)key, count, qidf, if_off);
+      if (!x_minimize_io) {
+	buffered_write(vocab_handle, &vocab_buf, HUGEBUFSIZE, &vocab_buf_used, vocabfile_record,
+		       VOCABFILE_REC_LEN, "vocab if offset");
+      }
+      // Then write the postings list entries into .if and update if_off
+
+      if (!block_postings && SB_TRIGGER > 0 && count >= SB_TRIGGER) {  // No skip blocks unless SB_TRIGGER is non-zero
+	// ---------------------------- We're writing skip blocks for this inverted file.  -----------
+	u_int sb_postings_accumulated = 0, sb_bytes_accumulated = SB_BYTES + 1;  // Allow for SB_MARKER and SKIP BLOCK
+	u_ll *ullp, list_off = if_off, sk_entries_before = sk_entry_used / (SK_ENTRY_ULLS * sizeof(u_ll)),
+	  sb_postings_before = 0;
+	docnum_t sb_prev_last_docnum = 0;
+
+	if (SB_POSTINGS_PER_RUN == 0) {
+	  // Dynamic setting of run lengths
+	  current_sb_postings_per_run = (u_int)round(sqrt((double)count));
+	  // Since the number of postings per run is limited to SB_MAX_COUNT (4096 at present)
+	  // we need to limit the run lengths for terms with more than 16 million postings.
+	  if (current_sb_postings_per_run > SB_MAX_COUNT) current_sb_postings_per_run = SB_MAX_COUNT;
+	}
+	else current_sb_postings_per_run = SB_POSTINGS_PER_RUN;  // Static setting
+
+
+	if (verbose) printf("Skip blocks.  Count = %u; Current run length = %u\n", count, current_sb_postings_per_run);
+	skip_blocks_written = 0;
+	postings_lists_with_skip_blocks++;
+
+	list_elts = 0;   // How many postings have been written so far.  (compare against count, the nummber to be written)
+	while (pr_next(&reader, &docnum, &wdnum, (u_char *)key)) {
+	  list_elts++;
+	  if (0) printf("Extracted a posting (%llu, %u) for %s.\n", docnum, wdnum, key);
+	  if (head_answers_wanted) ha_note_posting(docnum);
+
+	  // NOTE:  Here we're writing vbytes, no longer reading them.
+	  docnum_diff = docnum - last_docnum;
+	  last_docnum = docnum;
+	  // How many bytes do we need to represent the diff?  Can't be more than 6
+	  limit = 1ULL << 7;
+	  bytes_needed = 1;
+	  while ((unsigned long long) docnum_diff >= limit) {
+	    bytes_needed++;
+	    limit <<= 7;
+	  }
+
+	  //printf(" Docnumdiff = %lld, bytes_needed = %d ", docnum_diff, bytes_needed);
+	  // Write the first byte
+	  bight = (byte)(wdnum);
+	  if (bight == 255) {
+	    // We've come to the end of the valid postings in this chunk.
+	    // Shouldn't ever happen
+	    error_exit("Error:  invalid wdpos (AXE)\n"); // -------------------------------------------------------------------------------------------------->
+	  }
+	  sb_run_accumulator[sb_bytes_accumulated++] = bight;
+	  // Need a loop and an array to be able to write the bytes
+	  // in order of decreasing significance.
+	  for (b = bytes_needed - 1; b >= 0; b--) {
+	    bight = docnum_diff & 0x7F;
+	    bight <<= 1;
+	    sb_run_accumulator[sb_bytes_accumulated + b] = bight;
+	    docnum_diff >>= 7;
 	  }
-	  else {  // ---- The posting is in a list chunk.  It may be vbyte compressed
-	    // Get the wordnum - just a single byte.
-	    wdnum = headptr[0];
-	    docnum = 0;
-	    if (x_use_vbyte_in_chunks) {
-	      byte bight;
-	      b = 1;
-	      do {
-		bight = headptr[b] >> 1;  // Continuation bit is LSB
-		docnum <<= 7;
-		docnum |= bight;
-		b++;
-	      } while (!(headptr[b - 1] & 1));
+	  sb_run_accumulator[sb_bytes_accumulated + bytes_needed - 1] |= 1;  // Signal last byte
+	  sb_bytes_accumulated += bytes_needed;
+	  histo[(bytes_needed + 1)]++;
+	  sb_postings_accumulated++;
+	  if (sb_postings_accumulated >= current_sb_postings_per_run) {
+	    // Need to output SB_MARKER, skipblock and run.
+	    if (skip_blocks_written > 0 && skip_blocks_written % SK_INTERVAL == 0)
+	      sk_append(&sk_entry_buf, &sk_entry_used, &sk_entry_capacity, (u_ll)sb_prev_last_docnum, if_off,
+			sb_postings_before, SK_ENTRY_ULLS);
+	    sb_prev_last_docnum = docnum;
+	    sb_postings_before += sb_postings_accumulated;
+	    sb_run_accumulator[0] = SB_MARKER;
+	    ullp = (unsigned long long *) (sb_run_accumulator + 1);
+	    if (list_elts >= count) {
+	      // If this run happens to end at the end of the list, write a length of zero.
+	      *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, 0ULL);
 	    }
 	    else {
-	      for (b = 5; b > 0; b--){   // bytes were written little-endian
-		docnum <<= 8;
-		docnum |= headptr[b];
-	      }
+	      *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, (u_ll)sb_bytes_accumulated);
 	    }
-	    if (verbose) printf("Extracted single posting (%llu, %u) from the only list chunk for %s.\n", docnum, wdnum, key);
-	  }
-
-	  towrite = (docnum << WDPOS_BITS) | (wdnum & WDPOS_MASK);
-	  qidf = (byte)quantized_idf(max_plist_len * 1.5, count, 0XFF);    // The constant makes the QIDF of the most common term come out to be 1
-	  if (0) printf("  -- count = %u,  idf = %.4f,  qidf = %u\n", count, log(max_plist_len * 1.004008 / (double)count), qidf);
-	  vocabfile_entry_packer(vocabfile_record, MAX_WD_LEN + 1, (byte *)key, count, qidf, towrite);
-	  if (!x_minimize_io) {
-	    buffered_write(vocab_handle, &vocab_buf, HUGEBUFSIZE, &vocab_buf_used, vocabfile_record,
-			   VOCABFILE_REC_LEN, "vocab single posting");
+	    if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, sb_run_accumulator, sb_bytes_accumulated, "SB full run");
+	    if_off += sb_bytes_accumulated;
+	    skip_blocks_written++;
+	    tot_skip_blocks_written++;
+	    sb_postings_accumulated = 0;
+	    sb_bytes_accumulated = SB_BYTES + 1;
 	  }
+	}
 
-
-	  // In this case there's nothing to be written to .if
-	  histo[0]++;
-	  if (verbose) printf("Single. done\n");
+	// May need to write a partial run
+	if (sb_postings_accumulated) {
+	  // Need to output SB_MARKER, skipblock and run.
+	  if (skip_blocks_written > 0 && skip_blocks_written % SK_INTERVAL == 0)
+	    sk_append(&sk_entry_buf, &sk_entry_used, &sk_entry_capacity, (u_ll)sb_prev_last_docnum, if_off,
+		      sb_postings_before, SK_ENTRY_ULLS);
+	  sb_run_accumulator[0] = SB_MARKER;
+	  ullp = (u_ll *)(sb_run_accumulator + 1);
+	  *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, 0ULL);  // Zero because this is the last one.
+	  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, sb_run_accumulator, sb_bytes_accumulated, "SB part run");
+	  if_off += sb_bytes_accumulated;
+	  skip_blocks_written++;
+	  tot_skip_blocks_written++;
+	  sb_postings_accumulated = 0;
+	  sb_bytes_accumulated = SB_BYTES + 1;
 	}
-	else {
-	  // There are multiple postings.  
-	  docnum_t last_docnum = 0, docnum_diff = 0, docnum;
-	  u_int payload_bytes_available = K * PAYLOAD_SIZE;
-
-
-	  // Write the .if offset into .vocab
-	  if (verbose) printf("Multiple\n");
-	  qidf = (byte)quantized_idf(max_plist_len * 1.05, count, 0XFF);    // The constant makes the QIDF of the most common term come out to be 1
-	  if (0) printf("  -- count = %u,  idf = %.4f,  qidf = %u\n", count, log(max_plist_len * 1.05 / (double)count), qidf);
-	  vocabfile_entry_packer(vocabfile_record, MAX_WD_LEN + 1, (byte *)key, count, qidf, if_off);
-	  if (!x_minimize_io) {
-	    buffered_write(vocab_handle, &vocab_buf, HUGEBUFSIZE, &vocab_buf_used, vocabfile_record,
-			   VOCABFILE_REC_LEN, "vocab if offset");
-	  }
-	  // Then write the postings list entries into .if and update if_off
-	  currptr = headptr;
-	  //printf(" Multiple: e=%d\n", e);
-
-	  if (SB_TRIGGER > 0 && count >= SB_TRIGGER) {  // No skip blocks unless SB_TRIGGER is non-zero
-	    // ---------------------------- We're writing skip blocks for this inverted file.  -----------
-	    u_int sb_postings_accumulated = 0, sb_bytes_accumulated = SB_BYTES + 1;  // Allow for SB_MARKER and SKIP BLOCK
-	    byte bight;
-	    u_ll *ullp, limit;
-	    int wdnum, bytes_needed;
-
-	    if (SB_POSTINGS_PER_RUN == 0) {
-	      // Dynamic setting of run lengths
-	      current_sb_postings_per_run = (u_int)round(sqrt((double)count));
-	      // Since the number of postings per run is limited to SB_MAX_COUNT (4096 at present)
-	      // we need to limit the run lengths for terms with more than 16 million postings.
-	      if (current_sb_postings_per_run > SB_MAX_COUNT) current_sb_postings_per_run = SB_MAX_COUNT;
-	    }
-	    else current_sb_postings_per_run = SB_POSTINGS_PER_RUN;  // Static setting
-
-
-	    if (verbose) printf("Skip blocks.  Count = %u; Current run length = %u\n", count, current_sb_postings_per_run);
-	    skip_blocks_written = 0;
-	    postings_lists_with_skip_blocks++;
-
-	    list_elts = 0;   // How many postings have been written so far.  (compare against count, the nummber to be written)
-	    chunkno = 1;
-	    currptr = headptr;
-	    if (0) printf("Head of list (with skipping) for '%s' is %llu\n", key, head);
-	    while (currptr != NULL) {  // Zooming through the linked list of postings for this term
-	      if (chunkno > count_limit_for_current_k) {
-		current_k++;
-		count_limit_for_current_k = chunk_length_table[current_k];
-		K = chunk_K_table[current_k];
-		payload_bytes_available = K * PAYLOAD_SIZE;
-		if (chunkno > count_limit_for_current_k) {
-		  error_exit("Chunking stuffed!\n");
-		}
-	      }
-	      if (0) printf("'%s' looping through chunks.  chunkno=%u/chunk_count=%u list_elts=%llu, count=%u, K = %u\n", key, chunkno, chunk_count, list_elts, count, K);
-	      // Get all the postings out of the current chunk.
-	      payloadptr = currptr;
-	      while (payloadptr < (currptr + payload_bytes_available)) {
-		if (list_elts >= count) break;
-		// Get the wordnum - just a single byte.
-		wdnum = payloadptr[0];
-		if (wdnum == 0xFF)  {
-		  if (0) printf("Breaking out because of wdnum == 0xFF\n");
-		  break;  // --------------------------------------->
-		}
-		list_elts++;
-
-		if (x_use_vbyte_in_chunks) {
-		  // Get the vbyte-encoded docnum_diff
-		  byte bight;
-		  b = 1;
-		  docnum_diff = 0;
-		  do {
-		    bight = payloadptr[b] >> 1;  // Continuation bit is LSB
-		    docnum_diff <<= 7;
-		    docnum_diff |= bight;
-		    b++;
-		  } while (!(payloadptr[b - 1] & 1));
-		  docnum = last_docnum + docnum_diff;
-		  payloadptr += b;
-		}
-		else {
-		  // Get the docnum out of five bytes
-		  docnum = 0;
-		  for (b = 5; b > 0; b--){
-		    docnum <<= 8;
-		    docnum |= payloadptr[b];
-		  }
-		  payloadptr += PAYLOAD_SIZE;
-		}
-		if (0) printf("Extracted a posting (%llu, %u) from list chunk %d for %s.\n",
-			      docnum, wdnum, chunkno, key);
-
-		if (docnum > x_max_docs) {
-		  printf("Error in postings for '%s': x-th payload out of chunk of %d. wdnum=%u, docnum = %llu\n",
-			 key, K, wdnum, docnum);
-		  printf("  -- list_elts=%llu, count = %u\n", list_elts, count);
-		  error_exit("Error: Erroneous docnum encountered while writing inverted file.\n");
-		}
 
-		// NOTE:  Here we're writing vbytes, no longer reading them.
-		docnum_diff = docnum - last_docnum;
-		last_docnum = docnum;
-		// How many bytes do we need to represent the diff?  Can't be more than 6
-		limit = 1ULL << 7;
-		bytes_needed = 1;
-		while ((unsigned long long) docnum_diff >= limit) {
-		  bytes_needed++;
-		  limit <<= 7;
-		}
 
-		//printf(" Docnumdiff = %lld, bytes_needed = %d ", docnum_diff, bytes_needed);
-		// Write the first byte
-		bight = (byte)(wdnum);
-		if (bight == 255) {
-		  // We've come to the end of the valid postings in this chunk.
-		  // Shouldn't ever happen
-		  error_exit("Error:  invalid wdpos (AXE)\n"); // -------------------------------------------------------------------------------------------------->
-		}
-		sb_run_accumulator[sb_bytes_accumulated++] = bight;
-		// Need a loop and an array to be able to write the bytes
-		// in order of decreasing significance.
-		for (b = bytes_needed - 1; b >= 0; b--) {
-		  bight = docnum_diff & 0x7F;
-		  bight <<= 1;
-		  sb_run_accumulator[sb_bytes_accumulated + b] = bight;
-		  docnum_diff >>= 7;
-		}
-		sb_run_accumulator[sb_bytes_accumulated + bytes_needed - 1] |= 1;  // Signal last byte
-		sb_bytes_accumulated += bytes_needed;
-		histo[(bytes_needed + 1)]++;
-		sb_postings_accumulated++;
-		if (sb_postings_accumulated >= current_sb_postings_per_run) {
-		  // Need to output SB_MARKER, skipblock and run.
-		  sb_run_accumulator[0] = SB_MARKER;
-		  ullp = (unsigned long long *) (sb_run_accumulator + 1);
-		  if (list_elts >= count) {
-		    // If this run happens to end at the end of the list, write a length of zero.
-		    *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, 0ULL);
-		  }
-		  else {
-		    *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, (u_ll)sb_bytes_accumulated);
-		  }
-		  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, sb_run_accumulator, sb_bytes_accumulated, "SB full run");
-		  if_off += sb_bytes_accumulated;
-		  skip_blocks_written++;
-		  tot_skip_blocks_written++;
-		  sb_postings_accumulated = 0;
-		  sb_bytes_accumulated = SB_BYTES + 1;
-		}
-	      } // End of looping through payloads in a chunk.
-
-	      if (0) printf(" -- Loop over chunk %u finished. K = %u\n", chunkno, K);
-	      if (chunkno < 0xFFFF) chunkno++;
-	      // Get the next pointer --- Note that the NEXT field is now 6 bytes and is overloaded.  It is a next pointer
-	      // in all but the last chunk.  In the last chunk it contains a packed last_docno (37 bits) plus 
-	      // bytes_used (11 bits).
-
-	      if (currptr == tailptr) {
-		// This is how we detect the end of list now.
-		if (0) printf("Finished last chunk\n");
-		break;  //-------------------------------------------------------------------->  Drop out of loop.
-	      }
-
-	      // We know that NEXT actually is a pointer on this occasion.
-	      nextptrptr = currptr + payload_bytes_available;   // Have to calculate because chunk may have empties
-	      next = 0;
-	      for (b = (NEXT_POINTER_SIZE - 3); b >= 0; b--) {
-		next <<= 8;
-		next |= nextptrptr[b];
-	      }
-	      // We know that this is not the last chunk, so NEXT is actually a pointer
-	      byteoffset = next % header[2];
-	      blocknum = next / header[2];
-	      nextptr = pblock[blocknum] + byteoffset;
-	      currptr = nextptr;
-	      if (0) printf("Moving on to next chunk or next term.  Next = %llu\n", next);
-	    }  // End of zooming through the linked list of postings for this term
-
-	    // May need to write a partial run
-	    if (sb_postings_accumulated) {
-	      // Need to output SB_MARKER, skipblock and run.
-	      sb_run_accumulator[0] = SB_MARKER;
-	      ullp = (u_ll *)(sb_run_accumulator + 1);
-	      *ullp = sb_assemble(docnum, (u_ll)sb_postings_accumulated, 0ULL);  // Zero because this is the last one.
-	      if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, sb_run_accumulator, sb_bytes_accumulated, "SB part run");
-	      if_off += sb_bytes_accumulated;
-	      skip_blocks_written++;
-	      tot_skip_blocks_written++;
-	      sb_postings_accumulated = 0;
-	      sb_bytes_accumulated = SB_BYTES + 1;
-	    }
+	if (skip_blocks_written > max_sb_runs_per_list) max_sb_runs_per_list = skip_blocks_written;
+	if (sk_entry_used / (SK_ENTRY_ULLS * sizeof(u_ll)) > sk_entries_before)
+	  sk_append(&sk_dir_buf, &sk_dir_used, &sk_dir_capacity, list_off, sk_entries_before, 0, 2);
+	// ---------------------------- We've written skip blocks for this inverted file.  -----------
+      }
+      else {
+	// This is the old code path, used if we're not doing skip blocks
+	byte bytes[5];
 
+	if (verbose) printf("Old code path\n");
 
-	    if (skip_blocks_written > max_sb_runs_per_list) max_sb_runs_per_list = skip_blocks_written;
-	    // ---------------------------- We've written skip blocks for this inverted file.  -----------
+	while (pr_next(&reader, &docnum, &wdnum, (u_char *)key)) {
+	  if (head_answers_wanted) ha_note_posting(docnum);
+	  if (in_blocks) {
+	    bp_add_posting(docnum, wdnum);
+	    continue;
 	  }
-	  else {
-	    // This is the old code path, used if we're not doing skip blocks
-	    byte bight, bytes[5];
-	    docnum_t docnum, limit;
-	    int wdnum, bytes_needed;
-
-	    if (verbose) printf("Old code path\n");
-
-	    if (x_2postings_in_vocab  && count < 3) {
-	      // Note that the single posting case (count == 1) is handled specially at the top of this function.
-	      u_int c, p;
-	      u_ll dnwp[2];
-	      if (verbose) printf("Extracting %d postings for %s directly from the hash table entry\n", count, key);
-	      // Unpack the one or two postings into the dnwp array
-	      ve_unpack466(vep, &c, dnwp, dnwp + 1);
-	      last_docnum = 0;
-	      for (p = 0; p < count; p++) {
-		docnum = dnwp[p] >> WDPOS_BITS;
-		wdnum = dnwp[p] & WDPOS_MASK;
-
-		// Write a byte with the wordnum
-		bight = (byte)wdnum;
-		if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, &bight, 1, "if wdnum");
-		// Now vbyte encode the docnum_diff
-		docnum_diff = docnum - last_docnum;
-		last_docnum = docnum;
-
-		// How many bytes do we need to represent the diff?  Can't be more than 6 (allowing up to 100 billion)
-		limit = 1ULL << 7;
-		bytes_needed = 1;
-		while (docnum_diff >= limit) {
-		  bytes_needed++;
-		  limit <<= 7;
-		}
-		if (verbose || debug >= 4) printf(" Word '%s': wdnum = %d, docnum = %lld docnumdiff = %lld, bytes_needed = %d\n",
-						  key, bight, docnum, docnum_diff, bytes_needed);
-		// Need a loop and an array to be able to write the bytes
-		// in order of decreasing significance.
-		for (b = bytes_needed - 1; b >= 0; b--) {
-		  bight = docnum_diff & 0x7F;
-		  bight <<= 1;
-		  bytes[b] = bight;
-		  docnum_diff >>= 7;
-		  if (debug >= 4) printf(", (%d, %X)", b, bytes[b]);
-		}
-		bytes[bytes_needed - 1] |= 1;   // Set the termination bit on the last byte
-		if (debug >= 4) printf("\n");
-		if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, bytes, bytes_needed, "rest of multiple bytes");
-		if_off += (bytes_needed + 1);
-		histo[bytes_needed + 1]++;
-	      }
-	    }
-	    else {
-	      // No skip blocks, following the chunked linked list.
-	      u_int payload_bytes_available = K * PAYLOAD_SIZE;
-	      chunkno = 1;
-	      currptr = headptr;
-	      if (0) printf("Head of list for '%s' is %llu\n", key, head);
-	      while (currptr != NULL) {
-		if (chunkno > count_limit_for_current_k) {
-		  current_k++;
-		  count_limit_for_current_k = chunk_length_table[current_k];
-		  K = chunk_K_table[current_k];
-		  payload_bytes_available = K * PAYLOAD_SIZE;
-		  if (chunkno > count_limit_for_current_k) {
-		    error_exit("Chunking stuffed!\n");
-		  }
-		}
-		if (0)
-		  printf("'%s' looping through chunks.  chunk_count=%u list_elts=%llu, count=%u, K = %u\n", key, chunk_count, list_elts, count, K);
-
-		// Get all postings out of the current chunk.
-		payloadptr = currptr;
-		while (payloadptr < (currptr + payload_bytes_available)) {
-		  if (list_elts >= count) {
-		    if (0) printf("All needed elements found for %s\n", key);
-		    break;  // The whole list is finished.
-		  }
-		  // Get the wordnum - just a single byte.
-		  wdnum = payloadptr[0];
-		  if (wdnum == 0xFF)  {
-		    if (0) printf("Breaking out because of wdnum == 0xFF\n");
-		    break;  // --------------------------------------->
-		  }
-		  list_elts++;
-
-		  if (x_use_vbyte_in_chunks) {
-		    // Get the vbyte-encoded docnum_diff
-		    byte bight;
-		    b = 1;
-		    docnum_diff = 0;
-		    do {
-		      bight = payloadptr[b] >> 1;  // Continuation bit is LSB
-		      docnum_diff <<= 7;
-		      docnum_diff |= bight;
-		      b++;
-		    } while (!(payloadptr[b - 1] & 1));
-		    docnum = last_docnum + docnum_diff;
-		    payloadptr += b;
-		  }
-		  else {
-		    // Get the docnum out of five bytes
-		    docnum = 0;
-		    for (b = 5; b > 0; b--){
-		      docnum <<= 8;
-		      docnum |= payloadptr[b];
-		    }
-		    payloadptr += PAYLOAD_SIZE;
-		  }
-		  if (0) printf("Extracted a posting (%llu, %u) from list chunk %d for %s.\n",
-				docnum, wdnum, chunkno, key);
-		  if (docnum > x_max_docs) {
-		    printf("Error in postings for '%s': x-th payload out of chunk of %d. wdnum=%u, docnum = %llu\n",
-			   key, K, wdnum, docnum);
-		    printf("  -- list_elts=%llu, count = %u\n", list_elts, count);
-		    error_exit("Error: Erroneous docnum encountered while writing inverted file.\n");
-		  }
-
-		  // Write a byte with the wordnum
-		  bight = (byte)wdnum;
-		  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, &bight, 1, "if wdnum");
-		  // Now vbyte encode the docnum_diff
-		  docnum_diff = docnum - last_docnum;
-		  last_docnum = docnum;
-
-		  // How many bytes do we need to represent the diff?  Can't be more than 5
-		  limit = 1ULL << 7;
-		  bytes_needed = 1;
-		  while (docnum_diff >= limit) {
-		    bytes_needed++;
-		    limit <<= 7;
-		  }
-		  if (0) printf(" Word '%s': wdnum = %d, docnum = %lld docnumdiff = %lld, bytes_needed = %d\n",
-				key, bight, docnum, docnum_diff, bytes_needed);
-		  // Need a loop and an array to be able to write the bytes
-		  // in order of decreasing significance.
-		  for (b = bytes_needed - 1; b >= 0; b--) {
-		    bight = docnum_diff & 0x7F;
-		    bight <<= 1;
-		    bytes[b] = bight;
-		    docnum_diff >>= 7;
-		    if (debug >= 4) printf(", (%d, %X)", b, bytes[b]);
-		  }
-		  bytes[bytes_needed - 1] |= 1;   // Set the termination bit on the last byte
-		  if (debug >= 4) printf("\n");
-		  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, bytes, bytes_needed, "rest of multiple bytes");
-		  if_off += (bytes_needed + 1);
-		  histo[bytes_needed + 1]++;
-		}   // End of loop over payloads in a chunk
-
-		if (0) printf(" -- Loop over chunk %u finished. K = %u\n", chunkno, K);
-		if (chunkno < 0xFFFF) chunkno++;
-
-		// Get the next pointer --- Note that the NEXT field is now 6 bytes and is overloaded.  It is a next pointer
-		// in all but the last chunk. 
-
-		if (currptr == tailptr) {
-		  // This is how we detect the last chunk
-		  if (0) printf("Finished last chunk\n");
-		  break;  //-------------------------------------------------------------------->  Drop out of loop.
-		}
-
-		// We know that this is not the last chunk, so NEXT is actually a pointer
-		nextptrptr = currptr + K * PAYLOAD_SIZE;   // Have to calculate because chunk may have empties
-		next = 0;
-		for (b = (NEXT_POINTER_SIZE - 3); b >= 0; b--) {
-		  next <<= 8;
-		  next |= nextptrptr[b];
-		}
-		byteoffset = next % header[2];
-		blocknum = next / header[2];
-		nextptr = pblock[blocknum] + byteoffset;
-
-		currptr = nextptr;
 
-		if (0) printf("Moving on to next chunk or next term.  Next = %llu\n", next);
-	      }
-	    }
+	  // Write a byte with the wordnum
+	  bight = (byte)wdnum;
+	  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, &bight, 1, "if wdnum");
+	  // Now vbyte encode the docnum_diff
+	  docnum_diff = docnum - last_docnum;
+	  last_docnum = docnum;
+
+	  // How many bytes do we need to represent the diff?  Can't be more than 5
+	  limit = 1ULL << 7;
+	  bytes_needed = 1;
+	  while (docnum_diff >= limit) {
+	    bytes_needed++;
+	    limit <<= 7;
 	  }
+	  if (verbose || debug >= 4) printf(" Word '%s': wdnum = %d, docnum = %lld docnumdiff = %lld, bytes_needed = %d\n",
+					    key, bight, docnum, docnum_diff, bytes_needed);
+	  // Need a loop and an array to be able to write the bytes
+	  // in order of decreasing significance.
+	  for (b = bytes_needed - 1; b >= 0; b--) {
+	    bight = docnum_diff & 0x7F;
+	    bight <<= 1;
+	    bytes[b] = bight;
+	    docnum_diff >>= 7;
+	    if (debug >= 4) printf(", (%d, %X)", b, bytes[b]);
+	  }
+	  bytes[bytes_needed - 1] |= 1;   // Set the termination bit on the last byte
+	  if (debug >= 4) printf("\n");
+	  if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, bytes, bytes_needed, "rest of multiple bytes");
+	  if_off += (bytes_needed + 1);
+	  histo[bytes_needed + 1]++;
 	}
-
-	if (e && e % interval == 0) {
-	  printf("%d - %s (%u)\n", e, key, count);
-	  fflush(stdout);
-	  if (e % (10 * interval) == 0)  interval *= 10;
-	}
+	if (in_blocks) if_off += bp_write_list(if_handle, &if_buf, &if_buf_used);
       }
+      if (head_answers_wanted) ha_finish_term((byte *)key, count);
     }
 
+    if (e && e % interval == 0) {
+      printf("%d - %s (%u)\n", e, key, count);
+      fflush(stdout);
+      if (e % (10 * interval) == 0)  interval *= 10;
+    }
+  }
+
   // Write the length of the file into the last 8 bytes so we may be able to  tell if it's truncated
   if_off += sizeof(if_off);
   if (!x_minimize_io) buffered_write(if_handle, &if_buf, HUGEBUFSIZE, &if_buf_used, (byte *)&if_off, sizeof(if_off), ".if file length");
@@ -799,22 +1456,69 @@ double write_inverted_file(dahash_table_t *ht, u_char *fname_vocab, u_char *fnam
   printf("Maximum skip blocks per list: %lld\n", max_sb_runs_per_list);
   printf("=====================\n\n");
 
+  if (block_postings) {
+    printf("Postings block statistics\n=========================\n");
+    printf("Total blocks written: %lld\n", bp_tot_blocks);
+    printf("Maximum blocks per list: %lld\n", bp_max_blocks_per_list);
+    printf("Bits per docgap:\n");
+    for (b = 0; b < 64; b++) {
+      if (bp_bits_histo[b]) printf("  %2d: %lld blocks\n", b, bp_bits_histo[b]);
+    }
+    printf("=========================\n\n");
+  }
+
   printf("\nSignificant memory users\n==============================\n");
-  hashtable_MB = (double)ht->capacity * (double)entry_size / MEGA;
-  linkedlists_MB = (double)header[1] * (double)header[2] / MEGA;
-  chunks_allocated = header[4];
+  hashtable_MB = table_MB;
+  linkedlists_MB = 0.0;
+  chunks_allocated = 0;
+  for (k = 0; k < num_partitions; k++) {
+    if (partitions[k].ll_heap == NULL) continue;   // A run
+    header = (size_t *)partitions[k].ll_heap;
+    linkedlists_MB += (double)header[1] * (double)header[2] / MEGA;
+    chunks_allocated += header[4];
+  }
   printf("Hash table: %.1fMB\n", hashtable_MB);
   printf("Linked lists: %.1fMB (Total size of the %lld DOH blocks allocated)\n", linkedlists_MB, chunks_allocated);
-  printf("Permute Array: %.1fMB\n", (double)ht->entries_used * (double)sizeof(byte *) / MEGA);
+  printf("Permute Array: %.1fMB\n", permute_MB);
   printf("==============================\n\n");
 
   printf("\nIndex files needed for query processing\n=======================================\n");
   printf("QBASH.vocab file:    %8.1fMB\n", (double)vocab_file_size / MEGA);
   printf("QBASH.if file:       %8.1fMB\n", (double)if_off / MEGA);
+  if (!x_minimize_io) {
+    printf("QBASH.vocab.hash file: %6.1fMB\n", (double)write_vocab_hash_file(fname_vocab, permute, p, vocab_file_size) / MEGA);
+    printf("QBASH.if.skips file: %8.1fMB (%llu lists)\n", (double)write_skips_file(fname_if, if_off) / MEGA,
+	   (u_ll)(sk_dir_used / (2 * sizeof(u_ll))));
+    if (impact_file)
+      printf("QBASH.impact file:   %8.1fMB\n", (double)write_impact_file(fname_vocab, partitions, num_partitions, permute, p, cursors,
+									parts, veps, doccount, vocab_file_size) / MEGA);
+  }
   // This output block will be completed by the main program.
 
   // Clean up
-  free(permute);    // FRE600
+  for (k = 0; k < num_partitions; k++) {
+    free(partitions[k].sorted_keys);  // FRE600
+    partitions[k].sorted_keys = NULL;
+    if (partitions[k].run_vocab != NULL) unmap_and_remove_run(partitions + k);
+  }
+  free(permute);    // FRE605
+  free(cursors);    // FRE606
+  free(parts);      // FRE607
+  free(veps);       // FRE608
+  free(bp_list_buf);  // FRE602
+  free(bp_dir_buf);   // FRE602
+  bp_list_buf = NULL;
+  bp_dir_buf = NULL;
+  bp_list_capacity = 0;
+  bp_dir_capacity = 0;
+  free(sk_dir_buf);    // FRE602
+  free(sk_entry_buf);  // FRE602
+  sk_dir_buf = NULL;
+  sk_entry_buf = NULL;
+  sk_dir_used = 0;
+  sk_entry_used = 0;
+  sk_dir_capacity = 0;
+  sk_entry_capacity = 0;
   if (!x_minimize_io) {
     if (vocab_buf_used > 0) buffered_flush(vocab_handle, &vocab_buf, &vocab_buf_used, ".vocab", TRUE);
     if (if_buf_used > 0) buffered_flush(if_handle, &if_buf, &if_buf_used, ".if", TRUE);
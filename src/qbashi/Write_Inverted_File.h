@@ -13,5 +13,75 @@ void buffered_write(CROSS_PLATFORM_FILE_HANDLE wh, byte **buffer, size_t buffer_
 	byte *data, size_t bytes2write, char *label);
 
 
-double write_inverted_file(dahash_table_t *vht, u_char *vocab_fname, u_char *if_fname, doh_t ll_heap,
-	u_int SB_POSTINGS_PER_RUN, u_int SB_TRIGGER, docnum_t doccount, long long fsz, u_ll max_plist_len);
+// Everything accumulated while indexing one partition of the input records.  Normally there is
+// just one partition.  With -index_threads=N (N > 1) the records, in score order, are split into N
+// contiguous ranges, each indexed by its own thread into its own hash table and heap, using local
+// document numbers counting from zero.  write_inverted_file() merges the partitions' postings
+// lists, adding docnum_base to the document numbers from each.
+//
+// With -memory_budget_mb, whenever a partition's hash table and heap outgrow its share of the
+// budget, their postings lists are written to a run (see spill_partition_to_run()) and replaced by
+// empty ones.  A run is itself described by an index_partition_t, whose postings come from its
+// files rather than from a hash table and heap.  The runs for a partition hold its earlier
+// documents, so they are merged ahead of what's left in memory.
+
+typedef struct index_partition {
+	dahash_table_t *word_table;
+	doh_t ll_heap;
+	u_char *cpybuf;   // Copy of the trigger being indexed
+	BOOL this_trigger_was_truncated;
+	u_ll tot_postings, *doc_length_histo;
+	docnum_t doccount, docnum_base, ignored_docs, truncated_docs, incompletely_indexed_docs, empty_docs;
+
+	// The records to index, when indexing in score order: positions first_rec to end_rec - 1
+	// in the permuted order.  The .doctable entries for the documents indexed are kept in dt_entries.
+	u_char *forward, **recstarts;
+	u_ll *permute, first_rec, end_rec, *dt_entries;
+	size_t shard_fsz;   // With -shards, the size of the .forward written for this partition's shard
+
+	int partition_number;   // Used in the names of run files
+	struct index_partition *runs;
+	int num_runs;
+
+	// Only for a run: its file names, and while write_inverted_file() is running, its mapped files.
+	u_char *run_vocab_fname, *run_postings_fname;
+	byte *run_vocab, *run_postings;
+	size_t run_vocab_size, run_postings_size;
+	CROSS_PLATFORM_FILE_HANDLE run_vocab_FH, run_postings_FH;
+	HANDLE run_vocab_FMH, run_postings_FMH;
+
+	// Set up by sort_partition_vocabulary(), or for a run by write_inverted_file()
+	byte **sorted_keys;
+	size_t num_keys, key_size;
+} index_partition_t;
+
+
+void sort_partition_vocabulary(index_partition_t *ixp);
+
+void spill_partition_to_run(index_partition_t *ixp, index_partition_t *run);
+
+
+// When the index is written as shards (see QBASHER_common_definitions.h) each shard's .vocab is
+// written by a separate call to write_inverted_file().  So that the QIDFs agree across shards, the
+// counts of every term over all the shards are first gathered into a corpus_term_stats_t.
+
+typedef struct {
+	u_char term[MAX_WD_LEN + 1];
+	u_int count;
+} corpus_term_t;
+
+typedef struct {
+	corpus_term_t *terms;   // In .vocab order
+	size_t num_terms, cursor;
+	u_ll max_plist_len;
+} corpus_term_stats_t;
+
+corpus_term_stats_t *compute_corpus_term_stats(index_partition_t *partitions, int num_partitions);
+
+void free_corpus_term_stats(corpus_term_stats_t **ctsp);
+
+double write_inverted_file(index_partition_t *partitions, int num_partitions, u_char *vocab_fname, u_char *if_fname,
+	u_int SB_POSTINGS_PER_RUN, u_int SB_TRIGGER, docnum_t doccount, long long fsz, u_ll postings,
+	corpus_term_stats_t *cts, u_ll *max_plist_len, u_ll *vocab_size);
+
+u_ll write_head_answers_file(u_char *fname_if, u_char *fname_forward, u_char *fname_doctable);
@@ -33,12 +33,21 @@ arg_t args[] = {
 	{ "expect_cp1252", ABOOL, (void *)&expect_cp1252, "If text is likely to contain CodePage 1252 chars, extended punctuation should be token breaking.)" },
 	{ "min_wds", AINT, (void *)&min_wds, "Records with fewer than this number of words will not be indexed." },
 	{ "max_wds", AINT, (void *)&max_wds, "If greater than zero, records with more than this number of words will not be indexed." },
-	{ "max_raw_score", AFLOAT, (void *)&max_raw_score, "When indexing records in file order, scores in column 2 will be divided by this value." },
+	{ "max_raw_score", AFLOAT, (void *)&max_raw_score, "Scores in column 2 are quantized relative to this value rather than the max score seen.  Delta segments should use the base's value." },
 	{ "score_threshold", AFLOAT, (void *)&score_threshold, "Index only records whose scores in column 2 equals or exceeds the specified value." },
 	{ "sb_run_length", AINT, (void *)&SB_POSTINGS_PER_RUN, "How many compressed postings occur in a run between consecutive skip blocks. Zero means set dynamically." },
 	{ "sb_trigger", AINT, (void *)&SB_TRIGGER, "Skip blocks will only be inserted in a postings list with at least this number of postings.  Zero means no skip blocks." },
+	{ "block_postings", ABOOL, (void *)&block_postings, "Write postings lists of 128 or more postings as a directory plus bit-packed blocks of about 128 postings (index format 1.6).  sb_run_length and sb_trigger are then ignored." },
+	{ "impact_file", ABOOL, (void *)&impact_file, "Also write QBASH.impact, listing each term's documents in descending order of quantized BM25 weight, for QBASHQ -engine=saat_impact." },
 	{ "max_line_prefix", AINT, (void *)&max_line_prefix, "Index prefixes of the first word of a document up to this number of bytes." },
 	{ "max_line_prefix_postings", AINT, (void *)&max_line_prefix_postings, "Limit on how many postings are stored for each line_prefix. Ignored unless max_line_prefix > 0." },
+	{ "head_answers", AINT, (void *)&head_answers, "If > 0, write QBASH.if.head_answers holding this many answers for each line prefix with enough postings, for QBASHQ to use without reading postings." },
+	{ "head_answers_min_postings", AINT, (void *)&head_answers_min_postings, "Only line prefixes with at least this many postings are included in QBASH.if.head_answers." },
+	{ "bloom_bits", AINT, (void *)&bloom_bits, "If 16, 32 or 64, also write QBASH.bloom, holding a Bloom signature of that many bits per document from the first one and two bytes of its words, for QBASHQ's partial word matching." },
+	{ "normforward", ABOOL, (void *)&normforward, "Also write QBASH.normforward, holding each trigger lowercased, de-accented if conflate_accents, and split into words and term ids, saving QBASHQ doing that per candidate." },
+	{ "index_threads", AINT, (void *)&index_threads, "When sorting records by weight, split them into this many partitions and index them in parallel threads.  The index is the same whatever the value." },
+	{ "memory_budget_mb", AINT, (void *)&memory_budget_mb, "If > 0, postings held in memory are written to temporary sorted runs whenever they take more than about this many MB, and merged at the end.  Must be at least 4MB per index thread." },
+	{ "shards", AINT, (void *)&shards, "If > 1, split the records, in score order, into this many ranges and write each as a separate index in index_dir/shard<k>.  Shards are indexed in parallel." },
 	{ "debug", AINT, (void *)&debug, "Activate debugging output.  0 - none, 1 - low, 4 - highest. (Not fully implemented.)" },
 #ifndef QBASHER_LITE
 	{ "sort_records_by_weight", ABOOL, (void *)&sort_records_by_weight, "If FALSE, records will be indexed in file order, and col. 2 is assumed to contain integer scores in range 0 - max_raw_score." },
@@ -137,6 +146,8 @@ int store_arg_values(u_char *buffer, size_t buflen, BOOL show_experimentals) {
 
 	for (a = 0; args[a].type != AEOL; a++) {
 		if (!show_experimentals && !strncmp((char *)args[a].attr, "x_", 2)) continue;
+		if (args[a].valueptr == (void *)&index_threads
+			|| args[a].valueptr == (void *)&memory_budget_mb) continue;  // So that the .if header doesn't depend on them.
 		sprintf((char *)one_arg, "%s=", args[a].attr);
 		l = strlen((char *)one_arg);
 		switch (args[a].type) {
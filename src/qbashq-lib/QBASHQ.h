@@ -51,17 +51,34 @@
 #define MF_RELAX1 16
 #define MF_RELAX2 32
 
+// Results from different index segments are told apart by combining the segment number with the
+// docnum.  Docnums need at most 37 bits.  See SB_MAX_DOCNO in QBASHER_common_definitions.h
+#define SEGMENT_DOCID_SHIFT 40
+#define segment_docid(seg, d) (((docnum_t)(seg) << SEGMENT_DOCID_SHIFT) | (d))
+
+// The score of a candidate with t query terms missing is multiplied by this, t times.
+#define PARTIAL_MATCH_PENALTY 0.1
+
 #define FV_ELTS 9 
+
+// A candidate is kept to the fields needed to record, sort and merge it, so that a result block
+// of them is compact.  What's needed only for complex scoring is in a candidate_details_t, and
+// the classifier's feature vector is FV_ELTS doubles.  Both are held in arrays parallel to the
+// result blocks, qex->candidate_detailsa and qex->candidate_FVsa, which are only allocated
+// when they're needed.  See allocate_candidate_blocks()
 typedef struct {
   long long doc;
   double score;
   unsigned int terms_matched_bits;
+  byte match_flags;  // Used in classifier mode:  what type of match
+  byte segment;   // Which index segment doc belongs to.  0 is the base.  See load_indexes()
+} candidate_t;
+
+typedef struct {
   byte tf[MAX_WDS_IN_QUERY];  // TFs are maxed at 256
   byte qidf[MAX_WDS_IN_QUERY];  // Quantized to 256 values
   byte intervening_words;  // Used in calculating theta feature.
-  byte match_flags;  // Used in classifier mode:  what type of match
-  double FV[FV_ELTS];      // Used in classifier mode:  feature vector
-} candidate_t;
+} candidate_details_t;
 
 
 
@@ -80,7 +97,7 @@ LPCWSTR convert_str_to_wide(u_char *str);
 #endif
 
 
-#define NUM_OPS 9  // Must match code in setup_for_op_counting()
+#define NUM_OPS 11  // Must match code in setup_for_op_counting()
 
 enum {
   COUNT_DECO,   // Decompress a posting
@@ -92,6 +109,8 @@ enum {
   COUNT_ROLY,   // Check a rank-only term
   COUNT_TLKP,	// Lookup a term in a dictionary
   COUNT_BLOM,   // Check a candidate against a Bloom filter
+  COUNT_RANK,   // Compare curdocs while ordering terms in saat_relaxed_and().  Zero cost, for comparison only
+  COUNT_BLM2,   // Check a candidate against its QBASH.bloom signature
 };
 
 // Definition of a structure to facilitate recording and display of
@@ -112,11 +131,12 @@ typedef struct {
 
 
 
-byte *lookup_word(u_char *wd, byte *vocab, size_t vsz, int debug);
+struct query_arena;
 
 byte *get_doc(unsigned long long *docent, byte *forward, int *doclen_inwords, size_t fsz);
 
-u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol, u_char *bitmap_list);
+u_char *what_to_show(struct query_arena *arena, long long docoff, byte *doc, int *showlen, int displaycol,
+		     u_char *bitmap_list);
 
 
 
@@ -127,20 +147,68 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 // ************************************************************************************************************ //
 
 
-typedef struct {
+typedef struct index_environment {
   // Declarations of all the index structures.
   // Handles for the memory mapped index files: H for the mapped file and MH for the mapping
-  CROSS_PLATFORM_FILE_HANDLE doctable_H, forward_H, index_H, vocab_H ;
-  HANDLE doctable_MH, forward_MH, vocab_MH, index_MH;
+  CROSS_PLATFORM_FILE_HANDLE doctable_H, forward_H, index_H, vocab_H, vocab_hash_H;
+  HANDLE doctable_MH, forward_MH, vocab_MH, index_MH, vocab_hash_MH;
   byte *doctable, *vocab, *index, *forward,
     *other_token_breakers;
-  size_t dsz, vsz, isz, fsz;
+  u_ll *vocab_hash;  // NULL unless a valid .vocab.hash was found.  See QBASHER_common_definitions.h
+  size_t dsz, vsz, isz, fsz, vhsz;
   double index_format_d;
-  BOOL expect_cp1252;
+  BOOL expect_cp1252,
+    blocked_postings;  // TRUE if the postings lists are in INDEX_FORMAT_BLOCKED.  Set by check_if_header()
+  // Deleted documents, if this segment has a .tombstones file.  See QBASHER_common_definitions.h
+  CROSS_PLATFORM_FILE_HANDLE tombstones_H;
+  HANDLE tombstones_MH;
+  byte *tombstones;
+  size_t tsz;
+  // Impact-ordered postings, if this segment has a valid .impact file.  See QBASHER_common_definitions.h
+  CROSS_PLATFORM_FILE_HANDLE impact_H;
+  HANDLE impact_MH;
+  byte *impacts;
+  u_ll *impact_list_offsets;   // Indexed by .vocab record number
+  size_t imsz;
+  // Second-level skips, if this segment has a valid .if.skips file.  See QBASHER_common_definitions.h
+  CROSS_PLATFORM_FILE_HANDLE skips_H;
+  HANDLE skips_MH;
+  u_ll *skips;
+  size_t sksz;
+  // Precomputed answers for common line prefixes, if this segment has a valid .if.head_answers file.
+  CROSS_PLATFORM_FILE_HANDLE head_answers_H;
+  HANDLE head_answers_MH;
+  u_ll *head_answers;
+  size_t hasz;
+  // Stronger per-document Bloom signatures, if this segment has a valid QBASH.bloom file.
+  CROSS_PLATFORM_FILE_HANDLE blooms_H;
+  HANDLE blooms_MH;
+  u_ll *blooms;
+  size_t blsz;
+  int bloom_bits;
+  // Normalized triggers, if this segment has a valid QBASH.normforward file.
+  CROSS_PLATFORM_FILE_HANDLE normforward_H;
+  HANDLE normforward_MH;
+  u_ll *normforward, *normforward_offsets;
+  size_t nfsz;
+  BOOL normforward_accents_removed;
+  double N, tot_postings;   // From the .if header.  UNDEFINED_DOUBLE if not recorded there
+  BOOL score_ordered;   // TRUE if QBASHI assigned docnums in descending order of static score.
+  // Only set in the base.  segments[0] is the base itself and segments[1 .. num_segments - 1] are
+  // the other segments, in the order they're searched.  If the index is sharded, the base is shard0
+  // and segments[1 .. num_shards - 1] are the other shards.  Any deltas come after the shards.
+  int num_segments, num_shards;
+  struct index_environment **segments;
 } index_environment_t;
 
+byte *lookup_word(u_char *wd, index_environment_t *ixenv, int debug);
+
 // Next define an options environment for running one or more queries.  The same object can be used
-// for multiple queries as long as they use the same options.
+// for multiple queries as long as they use the same options.  Once load_indexes() has returned it is
+// not written during query processing, so it may be shared by any number of threads running queries
+// concurrently, each with its own query_thread_context_t (see below).
+
+struct query_thread_context;
 
 typedef struct {
   // ---- Settable options.
@@ -149,19 +217,21 @@ typedef struct {
     x_batch_testing, chatty;
   u_char *partial_query, *index_dir, *fname_forward, *fname_if, *fname_doctable, *fname_vocab,
     *fname_query_batch, *fname_output, *fname_config, *fname_substitution_rules,
-    *fname_segment_rules, *object_store_files, *language;
+    *fname_segment_rules, *object_store_files, *language, *engine;
   double rr_coeffs[NUM_COEFFS], cf_coeffs[NUM_CF_COEFFS], classifier_threshold;
   int relaxation_level, max_to_show, max_candidates_to_consider, max_length_diff, 
     timeout_kops, timeout_msec, displaycol, extracol, query_streams, duplicate_handling,
     classifier_mode, classifier_min_words, classifier_max_words, classifier_longest_wdlen_min,
     x_max_span_length, query_shortening_threshold, street_address_processing, street_specs_col,
-    debug, x_show_qtimes;
+    debug, x_show_qtimes, x_bulk_decode, result_cache_mb, segment_threads, impact_postings_budget;
+  BOOL early_termination, x_incremental_tpermute, x_single_term_fast_path, x_use_head_answers;
   double segment_intent_multiplier;
   double classifier_stop_thresh1, classifier_stop_thresh2;
   double location_lat, location_long, geo_filter_radius;
 
   // ---- Derived from settable options
-  BOOL scoring_needed, report_match_counts_only;
+  BOOL scoring_needed, report_match_counts_only,
+    use_impact_engine;  // engine is saat_impact
   FILE *query_output;  // File used to output debug and status information plus query and results
   // With static linking, it must be owned by the API library not by the main
   // program -- see msdn.microsoft.com/en-us/library/ms235460
@@ -173,12 +243,13 @@ typedef struct {
     generate_JO_path, conflate_accents;
   dahash_table_t *substitutions_hash, *segment_rules_hash;  
 
-  // ---- Statistics recorded across the batch of queries run with this set of options
+  // ---- Set up in load_indexes() if result_cache_mb > 0.  Shared by all threads.  See result_cache.h
+  struct result_cache *result_cache;
+
+  // ---- Statistics recorded across the batch of queries run with this set of options are
+  // ---- kept in per-thread contexts, chained from here, and merged when reported.
   double inthebeginning;
-  u_char slowest_q[MAX_QLINE];
-  long long queries_run, queries_without_answer, query_timeout_count, global_idf_lookups;
-  double total_elapsed_msec_d, max_elapsed_msec_d;
-  int elapsed_msec_histo[ELAPSED_MSEC_BUCKETS];
+  struct query_thread_context *thread_contexts;
 
   // ---- Index and properties used in BM25 document scoring  
   index_environment_t *ixenv;   // Initially only used when run from Object Store
@@ -187,6 +258,35 @@ typedef struct {
 } query_processing_environment_t;
 
 
+// Per-thread statistics and scratch storage.  Each thread which runs queries against a shared
+// qoenv should have its own context, obtained from new_query_thread_context() before any of the
+// threads start.  A NULL context may be passed instead, in which case no statistics are recorded.
+
+typedef struct query_thread_context {
+  FILE *query_output;  // Where present_results() writes for this thread.  NULL means qoenv->query_output
+  query_processing_environment_t *override_qoenv;  // Reused for queries with per-query options
+
+  // ---- Statistics recorded across the queries run in this thread
+  u_char slowest_q[MAX_QLINE];
+  long long queries_run, queries_without_answer, query_timeout_count, global_idf_lookups,
+    result_cache_hits, result_cache_misses;
+  double total_elapsed_msec_d, max_elapsed_msec_d;
+  int elapsed_msec_histo[ELAPSED_MSEC_BUCKETS];
+
+  // ---- Scratch storage for -engine=saat_impact, one workspace per index segment.  See saat_impact.c
+  struct impact_workspace **impact_workspaces;
+  int num_impact_workspaces;
+
+  // ---- Storage for the query being run, reset by handle_multi_query().  See query_arena.h
+  struct query_arena *arena;
+
+  // ---- Reused by apply_substitutions_rules_to_string() in this thread.  Created on first use.
+  pcre2_match_data *substitution_match_data;
+
+  struct query_thread_context *next;  // Next in the chain hanging off the qoenv
+} query_thread_context_t;
+
+
 QBASHQ_API int test_sb_macros();
 
 QBASHQ_API int test_isprefixmatch();
@@ -204,13 +304,14 @@ QBASHQ_API int run_bagsim_tests();
 
 QBASHQ_API void report_query_response_times(query_processing_environment_t *qoenv);
 
-QBASHQ_API void terse_show(query_processing_environment_t *qoenv, u_char **returned_strings, double *corresponding_scores, int how_many_results);
+QBASHQ_API void terse_show(FILE *out, u_char **returned_strings, double *corresponding_scores, int how_many_results);
 
-QBASHQ_API void experimental_show(query_processing_environment_t *qoenv, u_char *qstr,
+QBASHQ_API void experimental_show(FILE *out, u_char *qstr,
 				  u_char **returned_strings, double *corresponding_scores,
 				  int how_many_results, u_char *lblstr);
 
-QBASHQ_API void present_results(query_processing_environment_t *qoenv, u_char *qopstr, u_char *lblstr,
+QBASHQ_API void present_results(query_processing_environment_t *qoenv, query_thread_context_t *qtc,
+				u_char *qopstr, u_char *lblstr,
 				u_char **returned_strings, double *corresponding_scores, int how_many_results, double query_start_time);
 	
 QBASHQ_API void print_qbasher_version(FILE *f);
@@ -221,7 +322,7 @@ QBASHQ_API void print_qbasher_version(FILE *f);
 //				  BOOL *timed_out);
 
 QBASHQ_API int handle_multi_query(index_environment_t *ixenv, query_processing_environment_t *qoenv,
-				  u_char *multi_query_string, u_char ***returned_results,
+				  query_thread_context_t *qtc, u_char *multi_query_string, u_char ***returned_results,
 				  double **corresponding_scores, BOOL *timed_out);
 
 QBASHQ_API u_char *extract_result_at_rank(u_char **returned_results, double *scores, int rank, int *length, double *score);   // Just a convenience for C# access.
@@ -243,6 +344,8 @@ QBASHQ_API query_processing_environment_t *load_query_processing_environment();
 QBASHQ_API int finalize_query_processing_environment(query_processing_environment_t *qoenv,
 						     BOOL verbose, BOOL explain_errors);
 
+QBASHQ_API query_thread_context_t *new_query_thread_context(query_processing_environment_t *qoenv);
+
 QBASHQ_API void show_mode_settings(query_processing_environment_t *qoenv);
 
 QBASHQ_API void report_milestone(query_processing_environment_t *qoenv);
@@ -285,6 +388,13 @@ QBASHQ_API int NativeExecuteQueryAsync(LPWSTR query, query_processing_environmen
 #define SHORTEN_ALL_DIGITS 4
 #define SHORTEN_HIGH_FREQ 8
 
+// One entry in an open-addressing hash set of fingerprints of the text shown in the tl_ slots,
+// which is used to eliminate duplicate results.  See result_fingerprint()
+typedef struct {
+  unsigned long long fingerprint;   // Zero marks an empty entry
+  int slot;                         // The latest tl_ slot whose text has this fingerprint
+} shown_fingerprint_t;
+
 typedef struct {
   u_char *query, qcopy[MAX_QLINE + 1], query_as_processed[MAX_QLINE + 1],
     candidate_generation_query[MAX_QLINE + 1],
@@ -295,25 +405,52 @@ typedef struct {
   // For example: the query {[a "b c" "one two three"]} has a qwd_cnt of 1 but a q_max_mat_len of 3.
   int qwd_cnt, cg_qwd_cnt, tl_saat_blocks_allocated, tl_saat_blocks_used, partial_cnt, rank_only_cnt, q_max_mat_len;
   long long full_match_count;
-  unsigned long long q_signature;
-  int candidates_recorded[MAX_RELAX + 1];
+  unsigned long long q_signature,
+    q_strong_signature;   // Zero unless QBASH.bloom is to be checked.
+  int candidates_recorded[MAX_RELAX + 1],
+    segment_base[MAX_RELAX + 1];   // candidates_recorded[] before the current segment was searched
   candidate_t **candidatesa;
+  candidate_details_t **candidate_detailsa;  // NULL unless qoenv->scoring_needed
+  double **candidate_FVsa;    // NULL unless classifier_mode.  FV_ELTS per candidate
   byte **rank_only_countsa;
 
   u_char **tl_suggestions;
   double *tl_scores;
   docnum_t *tl_docids;
   int tl_returned;
-  BOOL timed_out, vertical_intent_signaled, query_contains_operators;
+  shown_fingerprint_t *shown_fingerprints;  // Allocated when first needed.  See remember_shown_fingerprint()
+  int shown_fingerprint_capacity, shown_fingerprint_count;
+  BOOL timed_out, vertical_intent_signaled, query_contains_operators,
+    early_termination,  // If TRUE, candidates are scored as they're recorded.  See saat_relaxed_and()
+    impact_engine;      // If TRUE, candidates come, already scored, from saat_impact_search()
+  struct impact_workspace **impact_workspaces;  // From qtc, or NULL.  Indexed by segment
   op_count_t op_count[NUM_OPS];
   int max_length_diff;
   double segment_intent_multiplier;
   int street_number;
   double start_time;   // Time of day when execution of this query started.
   u_char shortening_codes;  
+  index_environment_t *segment_ixenv;   // The index segment currently being searched
+  int segment;
+  // The term ids of qterms in the QBASH.normforward of qterm_ids_segment.  See query_term_ids()
+  index_environment_t *qterm_ids_segment;
+  u_int qterm_ids[MAX_WDS_IN_QUERY];
+  BOOL qterms_all_words;   // TRUE unless a query term is a phrase or a disjunction
+  query_thread_context_t *qtc;  // May be NULL.  Statistics are recorded here.
+  struct query_arena *arena;    // From qtc, or NULL.  Per-query storage, including this qex, comes from here
 } book_keeping_for_one_query_t;
 
 
 int kop_cost(book_keeping_for_one_query_t *qex);
 
+double score_candidate(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+		       index_environment_t *segment, candidate_t *candidate, candidate_details_t *details);
+
+double score_upper_bound(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+			 double score_from_doctable, double bm25_upper_bound);
+
+u_short *normalized_record_of_doc(index_environment_t *ixenv, docnum_t d);
+
+u_int *query_term_ids(book_keeping_for_one_query_t *qex, index_environment_t *segment);
+
 
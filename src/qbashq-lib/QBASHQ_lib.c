@@ -5,7 +5,8 @@
 
 // All of the indexes are mmapped into memory.
 // 
-// This version no longer handles multi-shard indexes
+// An index may be split into shards (written by QBASHI -shards=K) and may have delta
+// segments.  All of them are searched for each query, in parallel if segment_threads > 1.
 
 // Inputs are assumed to consist of a sequence of full words, separated
 // by single spaces (multiple spaces may actually be allowed.)  Also supported
@@ -18,11 +19,14 @@
 // Currently, we rely on static ordering of docnums in generating the
 // candidate set and return the first k documents which match the
 // full AND of the query term.  Candidates are then ranked
-// by a score computed from a linear combination of features.
+// by a score computed from a linear combination of features.  With
+// -engine=saat_impact, simple queries are instead ranked score-at-a-time
+// by summed BM25 impacts.  See saat_impact.c.
 
 // Each query word is looked up in the .vocab indexfile using binary 
 // search which should be plenty fast enough since the indexes are 
-// assumed to be in RAM.load
+// assumed to be in RAM.load  If there is a .vocab.hash file, a hash table
+// lookup is used instead.
 
 
 // -------------------------- Software Engineering -----------------------------
@@ -98,6 +102,7 @@
 #include <strsafe.h>
 #define WINPROTO _cdecl *
 #else
+#include <pthread.h>
 #define WINPROTO 
 #endif
 
@@ -107,12 +112,16 @@
 #include "../utils/dahash.h"
 #include "../utils/latlong.h"
 #include "../utils/street_addresses.h"
+#include "../imported/Fowler-Noll-Vo-hash/fnv.h"
 #include "QBASHQ.h"
 #include "saat.h"
+#include "query_arena.h"
 #include "../shared/substitutions.h"
 #include "arg_parser.h"
 #include "classification.h"
 #include "query_shortening.h"
+#include "result_cache.h"
+#include "saat_impact.h"
 
 
 // Shifts and masks calculated from the DTE_*_BITS definitions in QBASHI.h  (Set once from load_query_processing_environment()).
@@ -256,6 +265,61 @@ static unsigned long long calculate_signature_from_first_letters_of_partials(u_c
 }
 
 
+static unsigned long long calculate_strong_signature_of_partials(u_char **partials, int partial_cnt, int bits) {
+	// The equivalent of the above for QBASH.bloom.  A partial word can only match a document word
+	// which starts with the same one or two bytes, so the corresponding bits must be set in that
+	// document's signature.  This must be compatible with strong_signature() in QBASHI.c.
+	unsigned long long signature = 0;
+	int i;
+	u_char *p;
+
+	for (i = 0; i < partial_cnt; i++) {
+		p = partials[i];
+		if (p[0] == 0) continue;
+		signature |= BL_BIT(BL_KEY1(p[0]), bits);
+		if (p[1]) signature |= BL_BIT(BL_KEY2(p[0], p[1]), bits);
+	}
+	return signature;
+}
+
+
+static unsigned long long strong_signature_of_doc(index_environment_t *ixenv, docnum_t d) {
+	byte *sig = (byte *)(ixenv->blooms + BL_HEADER_ULLS) + d * (ixenv->bloom_bits / 8);
+	if (ixenv->bloom_bits == 16) return *(u_short *)sig;
+	if (ixenv->bloom_bits == 32) return *(u_int *)sig;
+	return *(unsigned long long *)sig;
+}
+
+
+u_short *normalized_record_of_doc(index_environment_t *ixenv, docnum_t d) {
+	// Return the QBASH.normforward record for document d.  See QBASHER_common_definitions.h
+	return (u_short *)((byte *)ixenv->normforward + ixenv->normforward_offsets[d]);
+}
+
+
+u_int *query_term_ids(book_keeping_for_one_query_t *qex, index_environment_t *segment) {
+	// Return the term ids in segment of qex->qterms, looking them up unless that's already been
+	// done for this segment since the query was parsed.  Terms which are too long to equal a
+	// document word, or aren't in the vocab, get NF_NO_QTERMID.  Phrases and disjunctions are
+	// looked up like words, so that comparing ids is the same as comparing strings, but
+	// qex->qterms_all_words is set FALSE if there are any.
+	int q;
+	byte *entry;
+
+	if (qex->qterm_ids_segment == segment) return qex->qterm_ids;  // -------------------------------->
+	qex->qterms_all_words = TRUE;
+	for (q = 0; q < qex->qwd_cnt && q < MAX_WDS_IN_QUERY; q++) {
+		qex->qterm_ids[q] = NF_NO_QTERMID;
+		if (qex->qterms[q][0] == '[' || qex->qterms[q][0] == '"') qex->qterms_all_words = FALSE;
+		if (strlen((char *)qex->qterms[q]) <= MAX_WD_LEN
+			&& (entry = lookup_word(qex->qterms[q], segment, 0)) != NULL)
+			qex->qterm_ids[q] = (u_int)((entry - segment->vocab) / VOCABFILE_REC_LEN);
+	}
+	qex->qterm_ids_segment = segment;
+	return qex->qterm_ids;
+}
+
+
 
 
 
@@ -297,6 +361,10 @@ static void setup_for_op_counting(book_keeping_for_one_query_t *qex) {
 	qex->op_count[COUNT_TLKP].cost = 1;
 	strcpy(qex->op_count[COUNT_BLOM].label, "Check_Bloom_filter");
 	qex->op_count[COUNT_BLOM].cost = 1;
+	strcpy(qex->op_count[COUNT_RANK].label, "curdoc_ranking_comparisons");
+	qex->op_count[COUNT_RANK].cost = 0;
+	strcpy(qex->op_count[COUNT_BLM2].label, "Check_strong_Bloom_filter");
+	qex->op_count[COUNT_BLM2].cost = 1;
 }
 
 
@@ -450,7 +518,7 @@ void show_doc(byte *doctable, byte *forward, size_t fsz, saat_control_t *pl_blok
 
 
 
-void terse_show(query_processing_environment_t *qoenv, u_char **returned_strings,
+void terse_show(FILE *out, u_char **returned_strings,
 	double *corresponding_scores, int how_many_results) {
 	// Given an array of result strings, and a corresponding array of scores, print one result per line
 	// comprising the suggestion and the score, with a tab between them.
@@ -459,29 +527,29 @@ void terse_show(query_processing_environment_t *qoenv, u_char **returned_strings
 	for (r = 0; r < how_many_results; r++) {
 		p = returned_strings[r];
 		while (*p && *p != '\n' && *p != '\r') {
-			fputc(*p, qoenv->query_output);
+			fputc(*p, out);
 			p++;
 		}
-		fprintf(qoenv->query_output, "\t%.5f\n", corresponding_scores[r]);
+		fprintf(out, "\t%.5f\n", corresponding_scores[r]);
 	}
 }
 
 
-void experimental_show(query_processing_environment_t *qoenv, u_char *multiqstr,
+void experimental_show(FILE *out, u_char *multiqstr,
 	u_char **returned_strings, double *corresponding_scores,
 	int how_many_results, u_char *lblstr) {
 	int r;
 	u_char *p;
 	for (r = 0; r < how_many_results; r++) {
-		fprintf(qoenv->query_output, "Query:\t%s\t%d\t", multiqstr, r + 1);
+		fprintf(out, "Query:\t%s\t%d\t", multiqstr, r + 1);
 		p = returned_strings[r];
 		while (*p && *p != '\n' && *p != '\r') {
-			fputc(*p, qoenv->query_output);
+			fputc(*p, out);
 			p++;
 		}
-		fprintf(qoenv->query_output, "\t%.5f", corresponding_scores[r]);
-		if (lblstr != NULL) fprintf(qoenv->query_output, "\t%s\n", lblstr);
-		else fputc('\n', qoenv->query_output);
+		fprintf(out, "\t%.5f", corresponding_scores[r]);
+		if (lblstr != NULL) fprintf(out, "\t%s\n", lblstr);
+		else fputc('\n', out);
 	}
 }
 
@@ -502,7 +570,8 @@ static void replace_controls_in_line(u_char *str) {
 }
 
 
-void present_results(query_processing_environment_t *qoenv, u_char *multiqstr, u_char *lblstr,
+void present_results(query_processing_environment_t *qoenv, query_thread_context_t *qtc,
+	u_char *multiqstr, u_char *lblstr,
 	u_char **returned_strings, double *corresponding_scores, int how_many_results,
 	double query_start_time) {
 
@@ -512,57 +581,64 @@ void present_results(query_processing_environment_t *qoenv, u_char *multiqstr, u
 	// replace ASCII controls with printable punctuation.  
 	// lblstr is a query-dependent label which will be appended (after a tab) to each result.  For example,
 	// it might show the expected answer for a query.
+	// Output goes to qtc->query_output if set, and response time statistics are recorded in qtc
+	// if it's not NULL.
 
 	double elapsed_msec_d;
 	int elapsed_msec, verbose = qoenv->debug;
+	FILE *out = qoenv->query_output;
+
+	if (qtc != NULL && qtc->query_output != NULL) out = qtc->query_output;
 
 	replace_controls_in_line(multiqstr);
 
 
 	if (qoenv->report_match_counts_only) {
-		fprintf(qoenv->query_output, "Match count for AND of\t%s\t%d\n", multiqstr, how_many_results);
+		fprintf(out, "Match count for AND of\t%s\t%d\n", multiqstr, how_many_results);
 	}
 	else if (qoenv->x_batch_testing) {
 		// Multiquery is shown on every result line, as is query label if there is one.
 		// If there are no results, the query and label only are shown
 		if (how_many_results > 0) {
-			experimental_show(qoenv, multiqstr, returned_strings, corresponding_scores, how_many_results,
+			experimental_show(out, multiqstr, returned_strings, corresponding_scores, how_many_results,
 				lblstr);
 		}
 		else {
 			if (lblstr != NULL)
-				fprintf(qoenv->query_output, "Query:\t%s\t%s\n", multiqstr, lblstr);
-			else  fprintf(qoenv->query_output, "Query: {%s}\n", multiqstr);
+				fprintf(out, "Query:\t%s\t%s\n", multiqstr, lblstr);
+			else  fprintf(out, "Query: {%s}\n", multiqstr);
 		}
 	}
 	else {
 		if (lblstr != NULL)
-			fprintf(qoenv->query_output, "Query: {%s}\tLabel: {%s}\n", multiqstr, lblstr);
-		else  fprintf(qoenv->query_output, "Query: {%s}\n", multiqstr);
+			fprintf(out, "Query: {%s}\tLabel: {%s}\n", multiqstr, lblstr);
+		else  fprintf(out, "Query: {%s}\n", multiqstr);
 		if (how_many_results > 0)
-			terse_show(qoenv, returned_strings, corresponding_scores, how_many_results);
+			terse_show(out, returned_strings, corresponding_scores, how_many_results);
 	}
 
 	elapsed_msec_d = 1000.0 *(what_time_is_it() - query_start_time);
-	if (verbose >= 1) fprintf(qoenv->query_output, "    Elapsed time %.0f msec for {%s}.\n\n",
+	if (verbose >= 1) fprintf(out, "    Elapsed time %.0f msec for {%s}.\n\n",
 		elapsed_msec_d, multiqstr);
-	qoenv->total_elapsed_msec_d += elapsed_msec_d;
 
 	if (verbose >= 1) {
-		if (elapsed_msec_d > 100) fprintf(qoenv->query_output, "Slow (%.0f msec) query {%s}\n",
+		if (elapsed_msec_d > 100) fprintf(out, "Slow (%.0f msec) query {%s}\n",
 			elapsed_msec_d, multiqstr);
 	}
-	if (elapsed_msec_d >= qoenv->max_elapsed_msec_d) {
-		if (verbose >= 1) fprintf(qoenv->query_output, "   New max: %.0f {%s}\n",
+	if (qtc == NULL) return;   // ------------------------------------> No statistics recording
+
+	qtc->total_elapsed_msec_d += elapsed_msec_d;
+	if (elapsed_msec_d >= qtc->max_elapsed_msec_d) {
+		if (verbose >= 1) fprintf(out, "   New max: %.0f {%s}\n",
 			elapsed_msec_d, multiqstr);
-		qoenv->max_elapsed_msec_d = elapsed_msec_d;
-		strcpy((char *)qoenv->slowest_q, (char *)multiqstr);
+		qtc->max_elapsed_msec_d = elapsed_msec_d;
+		strcpy((char *)qtc->slowest_q, (char *)multiqstr);
 	}
 	elapsed_msec = (int)(floor(elapsed_msec_d + 0.5));
 	if (elapsed_msec < 0) elapsed_msec = 0;
 	if (elapsed_msec >= ELAPSED_MSEC_BUCKETS) elapsed_msec = ELAPSED_MSEC_BUCKETS - 1;
-	qoenv->elapsed_msec_histo[elapsed_msec]++;
-	qoenv->queries_run++;
+	qtc->elapsed_msec_histo[elapsed_msec]++;
+	qtc->queries_run++;
 
 }
 
@@ -714,18 +790,234 @@ static int show_postings(byte *doctable, byte *index, byte *forward,
 
 
 
-byte *lookup_word(u_char *wd, byte *vocab, size_t vsz, int debug) {
+static byte *binary_search_vocab(u_char *wd, byte *vocab, size_t vsz) {
 	// Search for wd in vocab using binary search.
 	// Return a pointer to the vocab entry, or NULL if not found.
-	byte key[VOCABFILE_REC_LEN], *found_item;  // MAL0004 
-	u_ll occs, payload;
-	byte qidf;
+	byte key[VOCABFILE_REC_LEN];  // MAL0004 
 	strncpy((char *)key, (char *)wd, MAX_WD_LEN + 1);
-	if (debug >= 1) printf("Looking up %s among %lld vocab objects of size %d.\n", key,
-		(long long)(vsz / VOCABFILE_REC_LEN), VOCABFILE_REC_LEN);
-	found_item = (byte *)bsearch(key, vocab, vsz / VOCABFILE_REC_LEN, VOCABFILE_REC_LEN,
+	return (byte *)bsearch(key, vocab, vsz / VOCABFILE_REC_LEN, VOCABFILE_REC_LEN,
 		(int(*)(const void *, const void *))
 		strcmp);
+}
+
+
+static byte *hash_lookup_vocab(u_char *wd, index_environment_t *ixenv) {
+	// Search for wd using the .vocab.hash table, which load_vocab_hash() has checked.
+	// Return a pointer to the vocab entry, or NULL if not found.  Usually the only
+	// memory touched is one cache line of the table and the vocab entry itself.
+	u_ll h = fnv_64a_str((char *)wd, FNV1A_64_INIT), *slots = ixenv->vocab_hash + VH_HEADER_ULLS,
+		mask = ixenv->vocab_hash[0] - 1, s, slot;
+	byte *entry;
+
+	for (s = h & mask; (slot = slots[s]) != 0; s = (s + 1) & mask) {
+		if (vh_signature(slot) != vh_signature(h)) continue;
+		entry = ixenv->vocab + ((slot & VH_RECNO_MASK) - 1) * VOCABFILE_REC_LEN;
+		if (!strncmp((char *)entry, (char *)wd, MAX_WD_LEN + 1)) return entry;  // ---------------->
+	}
+	return NULL;
+}
+
+
+static void load_vocab_hash(index_environment_t *ixenv, u_char *fname_vocab, BOOL verbose) {
+	// If there's a .vocab.hash file corresponding to fname_vocab, and it matches the .vocab
+	// already loaded into ixenv, memory map it so that lookup_word() can use it.  Otherwise
+	// leave ixenv->vocab_hash NULL, and lookup_word() will use binary search.
+	u_char *fname;
+	u_ll slot_count;
+	int ec = 0;
+
+	if (!exists((char *)fname_vocab, VH_SUFFIX)) return;  // -------------------------------->
+	fname = (u_char *)malloc(strlen((char *)fname_vocab) + strlen(VH_SUFFIX) + 1);  // MAL803
+	if (fname == NULL) return;  // -------------------------------->
+	strcpy((char *)fname, (char *)fname_vocab);
+	strcat((char *)fname, VH_SUFFIX);
+	ixenv->vocab_hash = (u_ll *)mmap_all_of(fname, &(ixenv->vhsz), verbose, &(ixenv->vocab_hash_H),
+		&(ixenv->vocab_hash_MH), &ec);
+	if (ec < 0 || ixenv->vocab_hash == NULL) {
+		ixenv->vocab_hash = NULL;
+	}
+	else {
+		slot_count = (ixenv->vhsz >= VH_HEADER_ULLS * sizeof(u_ll)) ? ixenv->vocab_hash[0] : 0;
+		if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0
+			|| ixenv->vhsz != (slot_count + VH_HEADER_ULLS) * sizeof(u_ll)
+			|| ixenv->vocab_hash[1] != (u_ll)ixenv->vsz) {
+			if (verbose) printf("Warning: %s doesn't match the .vocab.  Binary search will be used.\n", fname);
+			unmmap_all_of(ixenv->vocab_hash, ixenv->vocab_hash_H, ixenv->vocab_hash_MH, ixenv->vhsz);
+			ixenv->vocab_hash = NULL;
+		}
+	}
+	free(fname);  // FRE803
+}
+
+
+static void load_skips(index_environment_t *ixenv, u_char *fname_if, BOOL verbose) {
+	// If there's a .if.skips file corresponding to fname_if, and it matches the .if already
+	// loaded into ixenv, memory map it so that saat_skipto() can use it.  Otherwise leave
+	// ixenv->skips NULL, and skip blocks will be followed one at a time.
+	u_char *fname;
+	u_ll lists, entries;
+	int ec = 0;
+
+	if (!exists((char *)fname_if, SK_SUFFIX)) return;  // -------------------------------->
+	fname = (u_char *)malloc(strlen((char *)fname_if) + strlen(SK_SUFFIX) + 1);  // MAL806
+	if (fname == NULL) return;  // -------------------------------->
+	strcpy((char *)fname, (char *)fname_if);
+	strcat((char *)fname, SK_SUFFIX);
+	ixenv->skips = (u_ll *)mmap_all_of(fname, &(ixenv->sksz), verbose, &(ixenv->skips_H),
+		&(ixenv->skips_MH), &ec);
+	if (ec < 0 || ixenv->skips == NULL) {
+		ixenv->skips = NULL;
+	}
+	else {
+		lists = (ixenv->sksz >= (SK_HEADER_ULLS + 2) * sizeof(u_ll)) ? ixenv->skips[0] : 0;
+		entries = (ixenv->sksz >= (SK_HEADER_ULLS + 2 * (lists + 1)) * sizeof(u_ll)) ? sk_dir(ixenv->skips)[2 * lists + 1] : 0;
+		if (ixenv->sksz != (SK_HEADER_ULLS + 2 * (lists + 1) + SK_ENTRY_ULLS * entries) * sizeof(u_ll)
+			|| ixenv->skips[1] != (u_ll)ixenv->isz) {
+			if (verbose) printf("Warning: %s doesn't match the .if.  Skip blocks will be followed one at a time.\n", fname);
+			unmmap_all_of(ixenv->skips, ixenv->skips_H, ixenv->skips_MH, ixenv->sksz);
+			ixenv->skips = NULL;
+		}
+	}
+	free(fname);  // FRE806
+}
+
+
+static void load_head_answers(index_environment_t *ixenv, u_char *fname_if, BOOL verbose) {
+	// If there's a .if.head_answers file corresponding to fname_if, and it matches the .if already
+	// loaded into ixenv, memory map it for head_answers_search().  Otherwise leave
+	// ixenv->head_answers NULL.
+	u_char *fname;
+	u_ll *ha;
+	int ec = 0;
+
+	if (!exists((char *)fname_if, HA_SUFFIX)) return;  // -------------------------------->
+	fname = (u_char *)malloc(strlen((char *)fname_if) + strlen(HA_SUFFIX) + 1);  // MAL807
+	if (fname == NULL) return;  // -------------------------------->
+	strcpy((char *)fname, (char *)fname_if);
+	strcat((char *)fname, HA_SUFFIX);
+	ha = (u_ll *)mmap_all_of(fname, &(ixenv->hasz), verbose, &(ixenv->head_answers_H),
+		&(ixenv->head_answers_MH), &ec);
+	if (ec >= 0 && ha != NULL) {
+		if (ixenv->hasz >= HA_HEADER_ULLS * sizeof(u_ll)
+			&& ixenv->hasz == (HA_HEADER_ULLS + HA_DIR_ENTRY_ULLS * ha[0] + HA_ANSWER_ULLS * ha[2]) * sizeof(u_ll) + ha[3]
+			&& ha[1] == (u_ll)ixenv->isz) {
+			ixenv->head_answers = ha;
+		}
+		else {
+			if (verbose) printf("Warning: %s doesn't match the .if.  It will be ignored.\n", fname);
+			unmmap_all_of(ha, ixenv->head_answers_H, ixenv->head_answers_MH, ixenv->hasz);
+		}
+	}
+	free(fname);  // FRE807
+}
+
+
+static void load_blooms(index_environment_t *ixenv, u_char *fname_bloom, BOOL verbose) {
+	// If fname_bloom exists, and it matches the .doctable already loaded into ixenv, memory map
+	// it so that possibly_record_candidate() can check the signatures in it.  Otherwise leave
+	// ixenv->blooms NULL.
+	u_ll *bl;
+	int ec = 0;
+
+	if (!exists((char *)fname_bloom, "")) return;  // -------------------------------->
+	bl = (u_ll *)mmap_all_of(fname_bloom, &(ixenv->blsz), verbose, &(ixenv->blooms_H), &(ixenv->blooms_MH), &ec);
+	if (ec < 0 || bl == NULL) return;  // -------------------------------->
+	if (ixenv->blsz >= BL_HEADER_ULLS * sizeof(u_ll)
+		&& (bl[0] == 16 || bl[0] == 32 || bl[0] == 64)
+		&& bl[1] == (u_ll)(ixenv->dsz / DTE_LENGTH)
+		&& ixenv->blsz == BL_HEADER_ULLS * sizeof(u_ll) + bl[1] * (bl[0] / 8)) {
+		ixenv->blooms = bl;
+		ixenv->bloom_bits = (int)bl[0];
+	}
+	else {
+		if (verbose) printf("Warning: %s doesn't match the .doctable.  It will be ignored.\n", fname_bloom);
+		unmmap_all_of(bl, ixenv->blooms_H, ixenv->blooms_MH, ixenv->blsz);
+	}
+}
+
+
+static void load_normforward(index_environment_t *ixenv, u_char *fname_normforward, BOOL verbose) {
+	// If fname_normforward exists, and it matches the .doctable already loaded into ixenv, memory
+	// map it so that possibly_record_candidate() can take normalized triggers from it.  Otherwise
+	// leave ixenv->normforward NULL.
+	u_ll *nf, D, *offsets;
+	int ec = 0;
+
+	if (!exists((char *)fname_normforward, "")) return;  // -------------------------------->
+	nf = (u_ll *)mmap_all_of(fname_normforward, &(ixenv->nfsz), verbose, &(ixenv->normforward_H),
+		&(ixenv->normforward_MH), &ec);
+	if (ec < 0 || nf == NULL) return;  // -------------------------------->
+	D = (u_ll)(ixenv->dsz / DTE_LENGTH);
+	if (ixenv->nfsz >= (NF_HEADER_ULLS + D + 1) * sizeof(u_ll) && ixenv->nfsz % sizeof(u_ll) == 0 && nf[1] == D) {
+		offsets = nf + ixenv->nfsz / sizeof(u_ll) - (D + 1);
+		if (offsets[0] == NF_HEADER_ULLS * sizeof(u_ll) && offsets[D] == (u_ll)((byte *)offsets - (byte *)nf)) {
+			ixenv->normforward = nf;
+			ixenv->normforward_offsets = offsets;
+			ixenv->normforward_accents_removed = ((nf[0] & NF_ACCENTS_REMOVED) != 0);
+			return;  // -------------------------------->
+		}
+	}
+	if (verbose) printf("Warning: %s doesn't match the .doctable.  It will be ignored.\n", fname_normforward);
+	unmmap_all_of(nf, ixenv->normforward_H, ixenv->normforward_MH, ixenv->nfsz);
+}
+
+
+static void load_tombstones(index_environment_t *ixenv, u_char *fname_tombstones, BOOL verbose) {
+	// If fname_tombstones exists, memory map it as the bitmap of deleted documents in ixenv.
+	// Otherwise leave ixenv->tombstones NULL, meaning that all the documents are live.
+	int ec = 0;
+
+	if (!exists((char *)fname_tombstones, "")) return;  // -------------------------------->
+	ixenv->tombstones = (byte *)mmap_all_of(fname_tombstones, &(ixenv->tsz), verbose, &(ixenv->tombstones_H),
+		&(ixenv->tombstones_MH), &ec);
+	if (ec < 0) ixenv->tombstones = NULL;
+	if (ixenv->tombstones == NULL) ixenv->tsz = 0;
+}
+
+
+static void load_impacts(index_environment_t *ixenv, u_char *fname_impact, BOOL verbose) {
+	// If fname_impact exists, and it matches the .vocab and .doctable already loaded into ixenv,
+	// memory map it for saat_impact_search().  Otherwise leave ixenv->impacts NULL, and queries
+	// will be processed by saat_relaxed_and().
+	u_ll *header, vocab_records = (u_ll)(ixenv->vsz / VOCABFILE_REC_LEN), file_length;
+	int ec = 0;
+
+	if (!exists((char *)fname_impact, "")) {
+		if (verbose) printf("Warning: %s not found.  Queries will be processed by relaxed_and.\n", fname_impact);
+		return;  // -------------------------------->
+	}
+	ixenv->impacts = (byte *)mmap_all_of(fname_impact, &(ixenv->imsz), verbose, &(ixenv->impact_H),
+		&(ixenv->impact_MH), &ec);
+	if (ec < 0 || ixenv->impacts == NULL) {
+		ixenv->impacts = NULL;
+		return;  // -------------------------------->
+	}
+	header = (u_ll *)ixenv->impacts;
+	file_length = (ixenv->imsz >= sizeof(u_ll)) ? *(u_ll *)(ixenv->impacts + ixenv->imsz - sizeof(u_ll)) : 0;
+	if (ixenv->imsz < (IM_HEADER_ULLS + vocab_records + 1) * sizeof(u_ll) || file_length != (u_ll)ixenv->imsz
+		|| header[0] != vocab_records || header[1] != (u_ll)ixenv->vsz
+		|| header[2] != (u_ll)(ixenv->dsz / DTE_LENGTH) || header[3] != IM_MAX_IMPACT) {
+		if (verbose) printf("Warning: %s doesn't match the index.  Queries will be processed by relaxed_and.\n", fname_impact);
+		unmmap_all_of(ixenv->impacts, ixenv->impact_H, ixenv->impact_MH, ixenv->imsz);
+		ixenv->impacts = NULL;
+		return;  // -------------------------------->
+	}
+	ixenv->impact_list_offsets = (u_ll *)(ixenv->impacts + ixenv->imsz - (vocab_records + 1) * sizeof(u_ll));
+}
+
+
+byte *lookup_word(u_char *wd, index_environment_t *ixenv, int debug) {
+	// Search for wd in the vocab of ixenv, using the .vocab.hash table if there is one, or
+	// binary search otherwise.
+	// Return a pointer to the vocab entry, or NULL if not found.
+	byte *found_item;
+	u_ll occs, payload;
+	byte qidf;
+	if (debug >= 1) printf("Looking up %s among %lld vocab objects of size %d, using %s.\n", wd,
+		(long long)(ixenv->vsz / VOCABFILE_REC_LEN), VOCABFILE_REC_LEN,
+		ixenv->vocab_hash != NULL ? "the hash table" : "binary search");
+	if (ixenv->vocab_hash != NULL) found_item = hash_lookup_vocab(wd, ixenv);
+	else found_item = binary_search_vocab(wd, ixenv->vocab, ixenv->vsz);
 	if (debug >= 1) {
 		if (found_item == NULL) {
 			printf("   NOT FOUND: '%s'\n", wd);
@@ -748,13 +1040,77 @@ byte *lookup_word(u_char *wd, byte *vocab, size_t vsz, int debug) {
 
 
 
+static void text_features_from_termids(u_int *dids, int dwd_cnt, u_int *qids, int qwd_cnt,
+	int *feat_phrase, int *feat_wds_in_seq, int *feat_primacy) {
+	// The equivalent of section B of extract_text_features(), comparing the term ids of document
+	// and query words rather than the words themselves.
+	int d = 0, q, failed;
+
+	*feat_phrase = 0;
+	*feat_wds_in_seq = 0;
+	*feat_primacy = 0;
+	if (dwd_cnt > 0) {
+		for (q = 0; q < qwd_cnt; q++) {
+			if (dids[0] == qids[q]) *feat_primacy = 1;
+		}
+	}
+
+	if (qwd_cnt < 2) {
+		*feat_wds_in_seq = 1;
+		*feat_phrase = 1;
+		return;  // -------------------------------->
+	}
+
+	while (d < dwd_cnt) {
+		if (dids[d] == qids[0]) {
+			d++;
+			failed = 0;
+			for (q = 1; q < qwd_cnt; q++) {
+				failed = 1;
+				while (d < dwd_cnt) {
+					if (dids[d] == qids[q]) {
+						failed = 0;
+						break;
+					}
+					d++;
+				}
+				if (failed) break;
+			}
+			if (!failed) {
+				*feat_wds_in_seq = 1;
+				break;
+			}
+		}
+		d++;
+	}
+
+	for (d = 0; d <= (dwd_cnt - qwd_cnt); d++) {
+		if (dids[d] == qids[0]) {
+			failed = 0;
+			for (q = 1; q < qwd_cnt; q++) {
+				if (dids[d + q] != qids[q]) {
+					failed = 1;
+					break;
+				}
+			}
+			if (!failed) {
+				*feat_phrase = 1;
+				break;
+			}
+		}
+	}
+}
+
+
 static void extract_text_features(u_char *doc_content, size_t dc_len, int dwd_cnt, u_char **qwds, int qwd_cnt,
 	int *feat_phrase, int *feat_wds_in_seq, int *feat_primacy, BOOL remove_accents,
-	int debug) {
+	u_short *nf_record, u_int *qids, int debug) {
 	// doc_content is the content of a document matching the query represented by qwds (an array of 
 	// query words) and qwd_cnt (how many words there are in the query.)
 	// This function first breaks up the document content into words and then calculates features which 
 	// can be used to calculate a score for the document.
+	// If nf_record isn't NULL, it's the document's QBASH.normforward record, with all its words in the
+	// vocab, and qids are the term ids of qwds.  The words are then compared as term ids.
 
 	u_char dc_copy[MAX_RESULT_LEN + 1], **dwds;
 	int d = 0, q, failed;
@@ -765,6 +1121,12 @@ static void extract_text_features(u_char *doc_content, size_t dc_len, int dwd_cn
 
 	if (dc_len > MAX_RESULT_LEN) return;
 
+	if (nf_record != NULL && (nf_record[2] < WDPOS_MASK || nf_record[2] >= dwd_cnt)) {
+		text_features_from_termids(nf_termids(nf_record), (nf_record[2] < dwd_cnt) ? nf_record[2] : dwd_cnt,
+			qids, qwd_cnt, feat_phrase, feat_wds_in_seq, feat_primacy);
+		return;  // -------------------------------->
+	}
+
 	dwds = (u_char **)malloc(dwd_cnt * sizeof(u_char **));  // MAL0007
 	if (dwds == NULL) {
 		return;   // Malloc failed is a very serious error, but what can we do?
@@ -883,7 +1245,7 @@ static void extract_text_features(u_char *doc_content, size_t dc_len, int dwd_cn
 static double score(byte *doctxt, int dwd_cnt, u_char **qwds, int qwd_cnt,
 	double *rr_coeffs, double wt_from_doctable, double bm25score,
 	double location_lat, double location_long,
-	BOOL remove_accents, byte intervening_words, int debug) {
+	BOOL remove_accents, byte intervening_words, u_short *nf_record, u_int *qids, int debug) {
 	// Assign a score to the candidate whose .forward string is passed as
 	// doctxt.  Score is currently a linear combination of:
 	//   alpha.   the applicable wt of the document
@@ -914,7 +1276,7 @@ static double score(byte *doctxt, int dwd_cnt, u_char **qwds, int qwd_cnt,
 	dc_len = end_of_doc_content - doc_content;
 
 	extract_text_features(doc_content, dc_len, dwd_cnt, qwds, qwd_cnt,
-		&feat_phrase, &feat_wds_in_seq, &feat_primacy, remove_accents, debug);
+		&feat_phrase, &feat_wds_in_seq, &feat_primacy, remove_accents, nf_record, qids, debug);
 
 	p++;
 
@@ -972,15 +1334,123 @@ static double score(byte *doctxt, int dwd_cnt, u_char **qwds, int qwd_cnt,
 
 
 
-static int score_cmp(const void *ip, const void *jp) {
-	candidate_t *cip = (candidate_t *)ip, *cjp = (candidate_t *)jp;
-	if (cjp->score < cip->score) return -1;
-	if (cjp->score > cip->score) return 1;
-	return 0;   // Not sure how to avoid returning zero.
+// rerank_and_record() keeps the best-ranked candidates in a bounded heap as it scores them.  seq
+// is a candidate's position in result block order, so that candidates with equal scores rank in
+// that order, as a stable sort of all the candidates would leave them.
+typedef struct {
+	candidate_t candidate;
+	int seq;
+} ranked_candidate_t;
+
+// The score of a candidate which matched rank_only terms is multiplied by this
+#define RANK_ONLY_MULTIPLIER 3.0
+
+
+static BOOL ranks_below(ranked_candidate_t *a, ranked_candidate_t *b) {
+	if (a->candidate.score != b->candidate.score) return a->candidate.score < b->candidate.score;
+	return a->seq > b->seq;
 }
 
 
-u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol, u_char *extra_fields) {
+static int ranked_cmp(const void *ip, const void *jp) {
+	// Best ranked first
+	ranked_candidate_t *rip = (ranked_candidate_t *)ip, *rjp = (ranked_candidate_t *)jp;
+	if (ranks_below(rip, rjp)) return 1;
+	if (ranks_below(rjp, rip)) return -1;
+	return 0;
+}
+
+
+static void heap_sift_down(ranked_candidate_t *heap, int n, int i) {
+	// The heap's root is its lowest ranked item.
+	ranked_candidate_t item = heap[i];
+	int c;
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && ranks_below(heap + c + 1, heap + c)) c++;
+		if (!ranks_below(heap + c, &item)) break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = item;
+}
+
+
+static void heap_sift_up(ranked_candidate_t *heap, int i) {
+	ranked_candidate_t item = heap[i];
+	int p;
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!ranks_below(&item, heap + p)) break;
+		heap[i] = heap[p];
+		i = p;
+	}
+	heap[i] = item;
+}
+
+
+static BOOL heap_offer(ranked_candidate_t *heap, int *n, int capacity, ranked_candidate_t *item) {
+	// Add item to a heap of at most capacity items, if it ranks above the lowest of them when the
+	// heap is full.  Return TRUE if an item was left out, either item or the one it displaced.
+	if (*n < capacity) {
+		heap[*n] = *item;
+		heap_sift_up(heap, *n);
+		(*n)++;
+		return FALSE;  // -------------------------------->
+	}
+	if (capacity > 0 && ranks_below(heap, item)) {
+		heap[0] = *item;
+		heap_sift_down(heap, *n, 0);
+	}
+	return TRUE;
+}
+
+
+static byte *locate_field(byte *record, int n, size_t *len) {
+	// Like extract_field_from_record() but return a pointer to the n-th field within record
+	// rather than a copy.  The field isn't null terminated.  If there's no such field, return
+	// an empty string.
+	int i;
+	byte *fs, *r = record;
+
+	*len = 0;
+	if (n < 1) return (byte *)"";  // ------------------------------------->
+	for (i = 1; i < n; i++) {		// Find n-1 TABS
+		while (*r && *r != '\t' && *r != '\n' && *r != '\r' && *r != ASCII_RS) r++;
+		if (*r != '\t') return (byte *)"";  // ------------------------------------->
+		r++;  // Skip over the tab
+	}
+	fs = r;
+	while (*r && *r != '\t' && *r != '\n' && *r != '\r' && *r != ASCII_RS) r++;
+	*len = r - fs;
+	return fs;
+}
+
+
+static int locate_fields_to_show(byte *doc, int displaycol, byte **fields, size_t *field_lens) {
+	// Locate in doc the fields which what_to_show() shows for displaycol >= 1, up to three of
+	// them, and return how many there are.  Each two decimal digits of displaycol, from the
+	// right, give a field number.
+	int this_field, f = 0, dcol = displaycol;
+
+	while (dcol > 0) {
+		this_field = dcol % 100;  // Get a field to display.
+		dcol /= 100;
+		// Locate this field in fields[f] and get its length in field_lens[f]
+		fields[f] = locate_field(doc, this_field, field_lens + f);
+		if (displaycol < 100 && field_lens[f] == 0) {
+			// Only one field to be displayed and it's empty -- fall back to column 1
+			fields[f] = locate_field(doc, 1, field_lens + f);
+		}
+		if (0) printf("Field %d located. '%.*s', %zd.\n",
+			this_field, (int)field_lens[f], fields[f], field_lens[f]);
+		f++;
+	}
+	return f;
+}
+
+
+u_char *what_to_show(query_arena_t *arena, long long docoff, byte *doc, int *showlen, int displaycol,
+		     u_char *extra_fields) {
 	// If displaycol is zero, we return a copy of the whole record.  If 1 we return a
 	// copy of the trigger, if -1 we show the document byte offset in QBASH.forward.
 	// Otherwise, check whether there is a non-empty display column in the TSV line.  If so, return 
@@ -989,7 +1459,8 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 	// of HTML in that column or another.  If displaycol is less than three or greater 
 	// than the number of columns actually present, we just return a pointer to the 
 	// start of the record.
-	// This function now mallocs the storage and makes a copy.  If terms_matched_bits NE zero,
+	// This function now allocates the storage from arena (malloc if it's NULL) and makes
+	// a copy.  The fields are located in place rather than copied.  If terms_matched_bits NE zero,
 	// then an additional column will be added to output, including a Hex representation of
 	// the bit pattern.
 	// If displaycol != 0, we squeeze out leading, trailing and multiple spaces.
@@ -997,13 +1468,14 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 	byte *p = doc, *what2show, *terminating_null;
 	byte *rp, *wp = NULL, last;
 	size_t tomalloc = 0, field_lens[3];
-	int l = 0, lbml = 0, f = 0, dcol = displaycol;
+	int l = 0, lbml = 0, f = 0, i;
 	byte *fields[3] = { NULL, NULL, NULL };
 
 	if (0) printf("what_to_show(%d '%s')\n", displaycol, extra_fields);
 
 	if (displaycol == -1) {
-		what2show = (byte *)malloc(30);  // MAL2006
+		what2show = (byte *)query_arena_alloc(arena, 30);  // MAL2006
+		if (what2show == NULL) return NULL;  // ---------------------------------------------->
 		sprintf((char *)what2show, "Off%lld", docoff);
 		return what2show;  // ---------------------------------------------->
 	}
@@ -1018,28 +1490,10 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 	}
 	else if (displaycol >= 1) {
 		// Can now display up to 3 columns
-		int this_field = 0;
-
-
-		while (dcol > 0) {
-			this_field = dcol % 100;  // Get a field to display.
-			dcol /= 100;
-			// Get a copy of this field in fields[f] and its length in field_lens[f]
-			fields[f] = extract_field_from_record(doc, this_field, field_lens + f);
-			if (displaycol < 100 && field_lens[f] == 0) {
-				// Only one field to be displayed and it's empty -- fall back to column 1
-				if (fields[f] != NULL) free(fields[f]);
-				fields[f] = extract_field_from_record(doc, 1, field_lens + f);
-			}
-			if (fields[f] == NULL) {
-				printf("Warning: Malloc MAL2006A failed.\n");
-				return NULL;
-			}
-			l += (field_lens[f]);
-			if (f != 0) l += 5;  // Allowing " +++ " separator
-			if (0) printf("Field %d extracted. '%s', %zd. L = %d\n",
-				this_field, fields[f], field_lens[f], l);
-			f++;
+		f = locate_fields_to_show(doc, displaycol, fields, field_lens);
+		for (i = 0; i < f; i++) {
+			l += (field_lens[i]);
+			if (i != 0) l += 5;  // Allowing " +++ " separator
 		}
 	}
 
@@ -1091,7 +1545,7 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 	}
 
 	tomalloc = l + lbml + 2;
-	what2show = (byte *)malloc(tomalloc);  // MAL2006
+	what2show = (byte *)query_arena_alloc(arena, tomalloc);  // MAL2006
 	if (what2show == NULL) {
 		printf("Warning: Malloc MAL2006 failed for %zd bytes (lbml was %d).\n", tomalloc, lbml);
 		return NULL;
@@ -1107,9 +1561,8 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 			p += 5;
 		}
 
-		strcpy((char *)p, (char *)fields[f]);
+		memcpy(p, fields[f], field_lens[f]);
 		p += field_lens[f];
-		free(fields[f]);
 		f--;
 	}
 	*p = 0;  // NULL terminate
@@ -1146,35 +1599,463 @@ u_char *what_to_show(long long docoff, byte *doc, int *showlen, int displaycol,
 }
 
 
+// ---------------------------------------------------------------------------------------
+// Recognizing duplicate results by fingerprint
+// ---------------------------------------------------------------------------------------
+
+// Two results are duplicates if isduplicate() would find their texts the same.  Rather than
+// comparing a result's text with those of all the results already placed, a 64-bit FNV hash of
+// the text, normalized as isduplicate() sees it, is looked up in a small open-addressing set in
+// qex.  When what's shown is made from fields of the document, the fingerprint is computed from
+// the fields themselves, so that a duplicate costs no copy.  Fingerprints are trusted: the chance
+// of two different texts among a query's results having the same one is negligible.
+
+#define FINGERPRINT_BUFLEN 256
+#define MIN_FINGERPRINT_SET 64   // Must be a power of two
+
+typedef struct {
+	Fnv64_t hash;
+	byte buf[FINGERPRINT_BUFLEN];
+	int used;
+	BOOL started, space_pending, ended;
+} fingerprinter_t;
+
+
+static void fingerprint_start(fingerprinter_t *fpr) {
+	fpr->hash = FNV1A_64_INIT;
+	fpr->used = 0;
+	fpr->started = FALSE;
+	fpr->space_pending = FALSE;
+	fpr->ended = FALSE;
+}
+
+
+static void fingerprint_add(fingerprinter_t *fpr, byte *text, size_t len) {
+	// Add up to len bytes of text to the fingerprint, stopping at a NUL.  As in isduplicate()
+	// everything from the first tab is ignored, as are leading and trailing spaces, and as in
+	// what_to_show() runs of spaces count as one.
+	size_t i;
+	for (i = 0; i < len && text[i] && !fpr->ended; i++) {
+		if (text[i] == '\t') fpr->ended = TRUE;
+		else if (text[i] == ' ') {
+			if (fpr->started) fpr->space_pending = TRUE;
+		}
+		else {
+			if (fpr->used > FINGERPRINT_BUFLEN - 2) {
+				fpr->hash = fnv_64a_buf(fpr->buf, fpr->used, fpr->hash);
+				fpr->used = 0;
+			}
+			if (fpr->space_pending) fpr->buf[fpr->used++] = ' ';
+			fpr->buf[fpr->used++] = text[i];
+			fpr->started = TRUE;
+			fpr->space_pending = FALSE;
+		}
+	}
+}
+
+
+static u_ll fingerprint_finish(fingerprinter_t *fpr) {
+	// Zero marks an empty entry in the fingerprint set, so it's never returned.
+	fpr->hash = fnv_64a_buf(fpr->buf, fpr->used, fpr->hash);
+	if (fpr->hash == 0) return 1;  // -------------------------------->
+	return fpr->hash;
+}
+
+
+static u_ll string_fingerprint(u_char *str) {
+	fingerprinter_t fpr;
+	fingerprint_start(&fpr);
+	fingerprint_add(&fpr, str, strlen((char *)str));
+	return fingerprint_finish(&fpr);
+}
+
+
+static u_ll document_fingerprint(byte *doc, int displaycol) {
+	// Return the fingerprint of what what_to_show() would show for doc, without making it.
+	// displaycol must be at least one.
+	fingerprinter_t fpr;
+	byte *fields[3];
+	size_t field_lens[3];
+	int f;
+
+	f = locate_fields_to_show(doc, displaycol, fields, field_lens);
+	fingerprint_start(&fpr);
+	f--;
+	while (f >= 0) {
+		if (fpr.started) fingerprint_add(&fpr, (byte *)" +++ ", 5);
+		fingerprint_add(&fpr, fields[f], field_lens[f]);
+		f--;
+	}
+	return fingerprint_finish(&fpr);
+}
+
+
+static int shown_fingerprint_slot(book_keeping_for_one_query_t *qex, u_ll fingerprint) {
+	// Return the latest tl_ slot holding a result with fingerprint, or -1 if there's none.
+	int mask = qex->shown_fingerprint_capacity - 1, e;
+	if (qex->shown_fingerprints == NULL) return -1;  // -------------------------------->
+	for (e = (int)(fingerprint & mask); qex->shown_fingerprints[e].fingerprint != 0; e = (e + 1) & mask) {
+		if (qex->shown_fingerprints[e].fingerprint == fingerprint) return qex->shown_fingerprints[e].slot;  // ------->
+	}
+	return -1;
+}
+
+
+static void remember_shown_fingerprint(book_keeping_for_one_query_t *qex, u_ll fingerprint, int slot) {
+	// Record that tl_ slot holds a result with fingerprint.  The set is kept at most half full.
+	// If it can't be allocated, the result just won't be recognized as a duplicate.
+	shown_fingerprint_t *old = qex->shown_fingerprints;
+	int mask, e, capacity = qex->shown_fingerprint_capacity;
+
+	if (old == NULL || 2 * (qex->shown_fingerprint_count + 1) > capacity) {
+		capacity = (old == NULL) ? MIN_FINGERPRINT_SET : 2 * capacity;
+		qex->shown_fingerprints = (shown_fingerprint_t *)query_arena_calloc(qex->arena, capacity,
+			sizeof(shown_fingerprint_t));  // MAL2007
+		if (qex->shown_fingerprints == NULL) {
+			qex->shown_fingerprints = old;
+			return;  // -------------------------------->
+		}
+		qex->shown_fingerprint_capacity = capacity;
+		qex->shown_fingerprint_count = 0;
+		if (old != NULL) {
+			for (e = 0; e < capacity / 2; e++)
+				if (old[e].fingerprint != 0) remember_shown_fingerprint(qex, old[e].fingerprint, old[e].slot);
+			query_arena_free(qex->arena, old);  // FRE2007
+		}
+	}
+
+	mask = capacity - 1;
+	for (e = (int)(fingerprint & mask); qex->shown_fingerprints[e].fingerprint != 0; e = (e + 1) & mask) {
+		if (qex->shown_fingerprints[e].fingerprint == fingerprint) {
+			qex->shown_fingerprints[e].slot = slot;
+			return;  // -------------------------------->
+		}
+	}
+	qex->shown_fingerprints[e].fingerprint = fingerprint;
+	qex->shown_fingerprints[e].slot = slot;
+	qex->shown_fingerprint_count++;
+}
+
+
+static void forget_shown_fingerprints(book_keeping_for_one_query_t *qex) {
+	if (qex->shown_fingerprints != NULL)
+		memset(qex->shown_fingerprints, 0, qex->shown_fingerprint_capacity * sizeof(shown_fingerprint_t));
+	qex->shown_fingerprint_count = 0;
+}
+
+
+static BOOL duplicates_a_shown_result(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	u_ll fingerprint, double score, int slot) {
+	// Would a result with fingerprint and score duplicate one placed in the tl_ slots before slot?
+	// If duplicate_handling is 1, only results placed since the last one with a higher score count.
+	int s = shown_fingerprint_slot(qex, fingerprint), t;
+
+	if (s < 0) return FALSE;  // -------------------------------->
+	if (qoenv->duplicate_handling > 1) return TRUE;  // -------------------------------->
+	for (t = slot - 1; t >= s; t--) {
+		if (qex->tl_scores[t] > score) return FALSE;  // -------------------------------->
+	}
+	return TRUE;
+}
+
+
+static BOOL record_result(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	docnum_t docid, byte *doc, long long docoff, double score, int *slot) {
+	// Place doc, whose QBASH.forward offset is docoff, in the next tl_ slot with score, unless
+	// duplicate_handling is set and it would duplicate a result already placed.  docid combines
+	// the doc's segment and docnum.  Return TRUE if it was placed.
+	u_char *what2show;
+	u_ll fingerprint = 0;
+	int showlen = 0;
+	BOOL check_dups = (qoenv->duplicate_handling > 0);
+
+	if (check_dups && qoenv->displaycol >= 1) {
+		fingerprint = document_fingerprint(doc, qoenv->displaycol);
+		if (duplicates_a_shown_result(qoenv, qex, fingerprint, score, *slot)) return FALSE;  // ---------->
+	}
+
+	what2show = what_to_show(qex->arena, docoff, doc, &showlen, qoenv->displaycol, NULL);
+	if (what2show == NULL) return FALSE;  // Could be NULL in case of memory failure in what_to_show() -->
+
+	if (check_dups && qoenv->displaycol < 1) {
+		fingerprint = string_fingerprint(what2show);
+		if (duplicates_a_shown_result(qoenv, qex, fingerprint, score, *slot)) {
+			query_arena_free(qex->arena, what2show);  // FRE2006
+			return FALSE;  // -------------------------------->
+		}
+	}
+
+	if (qoenv->debug >= 2) fprintf(qoenv->query_output, "record_result(): slot %d: doc %lld [%.3f] %s\n",
+		*slot, docid, score, what2show);
+	qex->tl_docids[*slot] = docid;
+	qex->tl_suggestions[*slot] = what2show;  // That's in the query's arena (MAL2006)
+	qex->tl_scores[*slot] = score;
+	if (check_dups) remember_shown_fingerprint(qex, fingerprint, *slot);
+	(*slot)++;
+	return TRUE;
+}
+
+
 #define BITMAP_LIST_LEN 10000
 
 #define okapi_k1 2.0
 #define okapi_b 0.75
 
 
+double score_candidate(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, candidate_t *candidate, candidate_details_t *details) {
+	// Return the score of a candidate recorded from segment, before any penalty for missing terms
+	// or multiplier for the query variant is applied.  That's the static score from the doctable,
+	// unless complex scoring is needed.  Return a negative value if the document can't be found.
+	// details are the candidate's entry in qex->candidate_detailsa, or NULL if scoring isn't needed.
+	docnum_t d = candidate->doc;
+	unsigned long long *dtent = (unsigned long long *)(segment->doctable + (d * DTE_LENGTH));
+	int dwd_cnt = (int)(*dtent & DTE_WDCNT_MASK), doclen_inwords;
+	double score_from_doctable, bm25score = 0.0;
+	byte *doc;
+	u_short *nf_record = NULL;
+	u_int *qids = NULL;
+
+	if (0) printf("dwd_cnt = %d\n", dwd_cnt);
+	// NOTE that in version 1.3+ indexes, only 5 bits are used to store document length in words, although up
+	// to 254 may be indexed.   If doclen_inwords is 31, that means >=31
+	if (dwd_cnt == 0) {
+		if (qoenv->debug >= 2) fprintf(qoenv->query_output, "Setting score to zeroq for doc %lld because dwd_cnt is zero.\n", d);
+		// Could be because suggestion is actually too long to represent in 8 bits
+		return 0.0;  // -------------------------------->
+	}
+
+	score_from_doctable = get_score_from_dtent(*dtent);
+	if (qoenv->debug >= 1)
+		fprintf(qoenv->query_output, "  score_candidate(): doc %lld, score_from_dt= %.4f\n",
+			d, score_from_doctable);
+	doc = get_doc(dtent, segment->forward, &doclen_inwords, segment->fsz);
+	if (doc == NULL) return -1.0;  // -------------------------------->
+
+	if (qoenv->debug >= 3) {
+		fprintf(qoenv->query_output, "  score_candidate(): score_from_doctable doc %lld: \n", d);
+		show_string_upto_nator(doc, '\n', 0);
+	}
+
+	if (!qoenv->scoring_needed) return score_from_doctable;  // -------------------------------->
+
+	if (qoenv->debug >= 3) {
+		fprintf(qoenv->query_output, "  score_candidate(): about to call score().  Fwd Offset = %lld\n",
+			(long long)(doc - segment->forward));
+		fprintf(qoenv->query_output, "  score_candidate(): dwds = %d, qwd_cnt = %d\n",
+			dwd_cnt, qex->qwd_cnt);
+	}
+	qex->op_count[COUNT_SCOR].count++;
+
+	if (qoenv->rr_coeffs[5] > 0.0) {
+		int k;
+		double tf, idf, doclen, lenratio;
+		if (dwd_cnt == 31) doclen = (double)utf8_count_words_in_string(doc, FALSE, FALSE, FALSE, FALSE);
+		else doclen = (double)dwd_cnt;
+
+		lenratio = doclen / qoenv->avdoclen;
+		for (k = 0; k < qex->qwd_cnt; k++) {
+			tf = (double)details->tf[k];
+			idf = get_idf_from_quantized(qoenv->N, 0xFF, details->qidf[k]);
+
+			bm25score += (tf * idf) / (tf + okapi_k1 *(1.0 - okapi_b + okapi_b * lenratio));
+			if (qoenv->debug) printf("BM25(doc %lld): tf = %.0f, idf = %.4f, len = %.0f lenratio = %.3f, dwd_cnt= %d: Cumul.Score = %.4f\n",
+				d, tf, idf, doclen, lenratio, dwd_cnt, bm25score);
+		}
+	}
+
+	// Text features can be computed from term ids if the document has a QBASH.normforward record
+	// normalized as score() would normalize it, with all its words in the vocab.
+	if (segment->normforward != NULL && qoenv->conflate_accents == segment->normforward_accents_removed
+		&& qoenv->debug < 1) {
+		nf_record = normalized_record_of_doc(segment, d);
+		if (nf_record[3] & NF_ALL_IN_VOCAB) qids = query_term_ids(qex, segment);
+		else nf_record = NULL;
+	}
+
+	return score(doc, dwd_cnt, qex->qterms, qex->qwd_cnt, qoenv->rr_coeffs,
+		score_from_doctable, bm25score, qoenv->location_lat, qoenv->location_long,
+		qoenv->conflate_accents, details->intervening_words, nf_record, qids, qoenv->debug);
+}
+
+
+double score_upper_bound(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	double score_from_doctable, double bm25_upper_bound) {
+	// Return a value which score_candidate() can't exceed for any document whose static score is
+	// at most score_from_doctable.  bm25_upper_bound must be at least the sum of the query terms'
+	// IDFs, which BM25 can't exceed.  Every other feature of score() is between zero and one.
+	double *c = qoenv->rr_coeffs, bound = 0.0;
+	int f;
+
+	if (!qoenv->scoring_needed) return score_from_doctable;  // -------------------------------->
+	if (c[0] > 0.0) bound += c[0] * score_from_doctable;
+	for (f = 1; f < NUM_COEFFS; f++) {
+		if (c[f] <= 0.0) continue;
+		if (f == 5) bound += c[f] * bm25_upper_bound;
+		else bound += c[f];
+	}
+	return bound;
+}
+
+
+// What rank_candidates() has done with each candidate, indexed by its position in result block order
+#define RR_UNSEEN 0
+#define RR_SCORED 1
+#define RR_UNSCORABLE 2
+#define RR_PRUNED 3
+
+// A candidate isn't scored if an upper bound on its score, stretched by this proportion to allow
+// for rounding, is still below the score of the lowest ranked candidate in a full heap.
+#define RR_BOUND_SLACK 1e-9
+
+
+static BOOL rerank_score(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *ixenv, candidate_t *candidate, candidate_details_t *details,
+	double penalty_multiplier, BOOL rank_only_matched, int r) {
+	// Set the score by which candidate will be ranked, returning FALSE if it can't be scored.
+	double unpenalized_score;
+
+	// If early termination was in force, saat_relaxed_and() has already scored the candidate, and
+	// saat_impact_search() always has.
+	if (qex->early_termination || qex->impact_engine) unpenalized_score = candidate->score;
+	else unpenalized_score = score_candidate(qoenv, qex, ixenv->segments[candidate->segment], candidate, details);
+	if (unpenalized_score < 0.0) return FALSE;  // -------------------------------->
+	candidate->score = unpenalized_score * penalty_multiplier;
+
+	// Adjustment for rank_only terms  -- This formula is just to test the mechanism.  Need to come up
+	// with a more sensible formula
+	if (rank_only_matched) {
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "Rank_only_terms(r = %d): Multiplying score of doc %lld by %.3f\n",
+			r, candidate->doc, RANK_ONLY_MULTIPLIER);
+		candidate->score *= RANK_ONLY_MULTIPLIER;
+	}
+	return TRUE;
+}
+
+
+static double rerank_upper_bound(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, candidate_t *candidate, candidate_details_t *details) {
+	// Return a value which score_candidate() can't exceed for candidate, or a negative value if
+	// there's no bound to be had without scoring it.
+	unsigned long long *dtent = (unsigned long long *)(segment->doctable + (candidate->doc * DTE_LENGTH));
+	double bm25_bound = 0.0, idf;
+	int k;
+
+	if (qoenv->rr_coeffs[5] > 0.0) {
+		if (details == NULL) return -1.0;  // -------------------------------->
+		for (k = 0; k < qex->qwd_cnt; k++) {
+			idf = get_idf_from_quantized(qoenv->N, 0xFF, details->qidf[k]);
+			if (idf > 0.0) bm25_bound += idf;
+		}
+	}
+	return score_upper_bound(qoenv, qex, get_score_from_dtent(*dtent), bm25_bound);
+}
+
+
+static int rank_candidates(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *ixenv, double score_multiplier, double penalty_multiplier_for_partial_matches,
+	int rbu, ranked_candidate_t *heap, int capacity, byte *fate, BOOL prune, BOOL *left_out) {
+	// Score the candidates in the first rbu result blocks and keep the best ranked capacity of
+	// them in heap, returning how many that is.  fate records what's been done with each candidate,
+	// so that a second call scores only those the first one didn't.  If prune is set, candidates
+	// which can't score well enough to enter the full heap are left unscored.  *left_out is set if
+	// any candidate which could be shown isn't in the heap.
+	candidate_t *candidates;
+	candidate_details_t *details = NULL;
+	byte *rank_only_counts = NULL;
+	ranked_candidate_t item;
+	double penalty_multiplier, bound;
+	BOOL rank_only_matched;
+	int rb, r, t, seq = 0, items = 0;
+
+	*left_out = FALSE;
+	for (rb = 0; rb < rbu; rb++) {    // ----------- Loop through all the result blocks, assigning scores
+		// Calculate the penalty multiplier to be applied for this number of terms missing
+		penalty_multiplier = score_multiplier;
+		for (t = 0; t < rb; t++)
+			penalty_multiplier *= penalty_multiplier_for_partial_matches;
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "Result block %d: terms missing %d:  penalty_multiplier %f\n",
+			rb, rb, penalty_multiplier);
+		candidates = qex->candidatesa[rb];
+		if (qex->candidate_detailsa != NULL) details = qex->candidate_detailsa[rb];
+		if (qex->rank_only_cnt) rank_only_counts = qex->rank_only_countsa[rb];
+		if (qoenv->debug >= 1) {
+			fprintf(qoenv->query_output, "Result block %d: %d candidates recorded; terms_missing = %d\n",
+				rb, qex->candidates_recorded[rb], rb);
+		}
+		// Assign scores to all the candidates at this level of relaxation
+		for (r = 0; r < qex->candidates_recorded[rb]; r++, seq++) {
+			if (fate[seq] == RR_UNSCORABLE) continue;
+			if (fate[seq] != RR_SCORED) {
+				// The test for NULL here should only succeed if a malloc() failed in process_query()
+				rank_only_matched = (qex->rank_only_cnt && rank_only_counts != NULL && rank_only_counts[r]);
+				if (prune && fate[seq] == RR_UNSEEN && items == capacity && penalty_multiplier > 0.0) {
+					bound = rerank_upper_bound(qoenv, qex, ixenv->segments[candidates[r].segment], candidates + r,
+						details == NULL ? NULL : details + r);
+					if (bound >= 0.0) {
+						bound *= penalty_multiplier;
+						if (rank_only_matched) bound *= RANK_ONLY_MULTIPLIER;
+						if (bound * (1.0 + RR_BOUND_SLACK) < heap[0].candidate.score) {
+							if (qoenv->debug >= 1) fprintf(qoenv->query_output,
+								"R-and-R(result block %d): %d - doc %llu not scored: bound %.3f < %.3f\n",
+								rb, r, candidates[r].doc, bound, heap[0].candidate.score);
+							fate[seq] = RR_PRUNED;
+							*left_out = TRUE;
+							continue;
+						}
+					}
+				}
+				if (!rerank_score(qoenv, qex, ixenv, candidates + r, details == NULL ? NULL : details + r,
+					penalty_multiplier, rank_only_matched, r)) {
+					// This is an error condition which shouldn't occur but which must be handled
+					candidates[r].score = -1.0;
+					fate[seq] = RR_UNSCORABLE;
+					continue;
+				}
+				fate[seq] = RR_SCORED;
+				if (qoenv->debug >= 1) fprintf(qoenv->query_output,
+					"R-and-R(result block %d): %d - doc %llu [%.3f]\n",
+					rb, r, candidates[r].doc, candidates[r].score);
+			}
+			item.candidate = candidates[r];
+			item.seq = seq;
+			if (heap_offer(heap, &items, capacity, &item)) *left_out = TRUE;
+		}
+	}
+	return items;
+}
+
+
 static void rerank_and_record(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
-	byte *forward, byte *doctable, size_t fsz, double score_multiplier,
+	index_environment_t *ixenv, double score_multiplier,
 	double penalty_multiplier_for_partial_matches) {
 	// *** This function isn't used in classifier_modes ***
 	// Record up to max_last_rank candidates in the 
 	// tl_suggestions and tl_scores arrays after some sort of reranking
 	//
+	// Candidates may come from any of the index segments of ixenv, and their doctable entries and
+	// text are looked up in the segment recorded in the candidate.
+	//
 	// Note that in the case of multi-query usage, we may arrive here with tl_suggestions slots
 	// already filled and qex-tl_returned > 0.   In that case, we fill in results at the
 	// in the unused slots.
 	// After each query variant is run, we zero qex->candidates_recorded[rb] for all the rbs.
-	// For each variant we create a new contiguous array of candidates.
-	byte *doc, *bmlp;
-	u_char terminator = '\t';
-	int doclen_inwords, r, rb, dwd_cnt, start_slot, slot, candidates_recorded_this_variant = 0,
-		t, terms_missing, rbu = 0,  // rbu - result blocks used
-		s;
+	//
+	// Only the best ranked candidates can fill the unused slots, so they're kept in a bounded heap
+	// as candidates are scored, and a candidate whose score can't be high enough to enter the full
+	// heap isn't scored at all.  The heap has room for as many candidates again as there are slots
+	// if duplicates are to be eliminated.  If it runs out before the slots are filled, all the
+	// candidates are scored and ranked, and showing continues from where the heap left off.
+	byte *doc, *forward, *doctable, *fate;
+	size_t fsz;
+	index_environment_t *segment;
+	int doclen_inwords, r, rb, start_slot, slot, candidates_recorded_this_variant = 0,
+		rbu = 0,  // rbu - result blocks used
+		s, capacity, ranked_cnt;
 	docnum_t d;
-	double score_from_doctable, bm25score = 0.0, penalty_multiplier = score_multiplier;
 	unsigned long long *dtent;  // Excluding the signature part
-	candidate_t *candidates, *contiguous_array_of_candidates;
-	byte *rank_only_counts = NULL;
-	BOOL zapadupe;
+	ranked_candidate_t *ranked;
+	BOOL zapadupe, left_out, prune;
 
 	if (0) printf("\nArriving in r_and_r() with tl_returned = %d\n\n",
 		qex->tl_returned);
@@ -1195,9 +2076,19 @@ static void rerank_and_record(query_processing_environment_t *qoenv, book_keepin
 		return;
 	}
 
-	contiguous_array_of_candidates = (candidate_t *)malloc(candidates_recorded_this_variant * sizeof(candidate_t));  // MAL1110
-	if (contiguous_array_of_candidates == NULL) {
-		fprintf(qoenv->query_output, "Warning: Malloc of contiguous_array_of_candidates failed.  No results will be displayed.\n");
+	start_slot = qex->tl_returned;  // May be non-zero in the case of multiqueries
+	slot = start_slot;
+	capacity = qoenv->max_to_show - start_slot;
+	if (qoenv->duplicate_handling > 0) capacity *= 2;
+	if (capacity > candidates_recorded_this_variant) capacity = candidates_recorded_this_variant;
+	if (capacity < 0) capacity = 0;
+
+	ranked = (ranked_candidate_t *)query_arena_alloc(qex->arena, capacity * sizeof(ranked_candidate_t));  // MAL1110
+	fate = (byte *)query_arena_calloc(qex->arena, candidates_recorded_this_variant, sizeof(byte));  // MAL1111
+	if (ranked == NULL || fate == NULL) {
+		fprintf(qoenv->query_output, "Warning: Malloc of ranked candidates failed.  No results will be displayed.\n");
+		query_arena_free(qex->arena, ranked);  // FRE1110
+		query_arena_free(qex->arena, fate);  // FRE1111
 		return;
 	}
 	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "  rerank_and_record(): Reranking %d candidates from %d result blocks\n",
@@ -1206,132 +2097,54 @@ static void rerank_and_record(query_processing_environment_t *qoenv, book_keepin
 	if (qoenv->scoring_needed && qoenv->debug >= 1)
 		fprintf(qoenv->query_output, "  rerank_and_record(): Complex scoring is needed.\n");
 
-	candidates_recorded_this_variant = 0;
-
-	for (rb = 0; rb < rbu; rb++) {    // ----------- Loop through all the result blocks, assigning scores
-	  // ----------- and copying into a contiguous array for sorting.
-		terms_missing = rb;
-		penalty_multiplier = score_multiplier;
-		// Calculate the penalty multiplier to be applied for this number of terms missing
-		for (t = 0; t < terms_missing; t++)
-			penalty_multiplier *= penalty_multiplier_for_partial_matches;
-		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "Result block %d: terms missing %d:  penalty_multiplier %f\n",
-			rb, terms_missing, penalty_multiplier);
-		candidates = qex->candidatesa[rb];
-		if (qex->rank_only_cnt) rank_only_counts = qex->rank_only_countsa[rb];
-		if (qoenv->debug >= 1) {
-			fprintf(qoenv->query_output, "Result block %d: %d candidates recorded; terms_missing = %d\n",
-				rb, qex->candidates_recorded[rb], terms_missing);
-		}
-		// Assign scores to all the candidates at this level of relaxation
-		for (r = 0; r < qex->candidates_recorded[rb]; r++) {
-			d = candidates[r].doc;
-			dtent = (unsigned long long *)(doctable + (d * DTE_LENGTH));
-			dwd_cnt = (int)(*dtent & DTE_WDCNT_MASK);
-			if (0) printf("dwd_cnt = %d\n", dwd_cnt);
-			// NOTE that in version 1.3+ indexes, only 5 bits are used to store document length in words, although up
-			// to 254 may be indexed.   If doclen_inwords is 31, that means >=31
-			if (dwd_cnt == 0) {
-				if (qoenv->debug >= 2) fprintf(qoenv->query_output, "Setting score to zeroq for doc %lld because dwd_cnt is zero.\n", d);
-				// Could be because suggestion is actually too long to represent in 8 bits
-				candidates[r].score = 0;
-			}
-			else {
-				score_from_doctable = get_score_from_dtent(*dtent);
-				if (qoenv->debug >= 1)
-					fprintf(qoenv->query_output, "  rerank_and_record(): candidate %d, doc %lld, score_from_dt= %.4f, plier = %.4f\n",
-						r, d, score_from_doctable, penalty_multiplier);
-				candidates[r].score = score_from_doctable * penalty_multiplier;  // Default, will be used if no complex scoring
-				doc = get_doc(dtent, forward, &doclen_inwords, fsz);
-				if (doc == NULL) {
-					// This is an error condition which shouldn't occur but which must be handled
-					// Set score to negative which may push this result output of the top-k
-					candidates[r].score = -1.0;
-					continue;
-				}
-
-				if (qoenv->debug >= 3) {
-					fprintf(qoenv->query_output, "  rerank_and_record(): score_from_doctable candidate %d, doc %lld: \n", r, d);
-					show_string_upto_nator(doc, '\n', 0);
-				}
-
-				if (qoenv->scoring_needed) {
-					if (qoenv->debug >= 3) {
-						fprintf(qoenv->query_output, "  rerank_and_record(): about to call score().  Fwd Offset = %lld\n",
-							(long long)(doc - forward));
-						fprintf(qoenv->query_output, "  rerank_and_record(): dwds = %d, qwd_cnt = %d\n",
-							(int)(*dtent & DTE_WDCNT_MASK), qex->qwd_cnt);
-					}
-					qex->op_count[COUNT_SCOR].count++;
-
-					if (qoenv->rr_coeffs[5] > 0.0) {
-						int k;
-						double tf, idf, doclen, lenratio;
-						bm25score = 0.0;
-						if (dwd_cnt == 31) doclen = (double)utf8_count_words_in_string(doc, FALSE, FALSE, FALSE, FALSE);
-						else doclen = (double)dwd_cnt;
-
-						lenratio = doclen / qoenv->avdoclen;
-						for (k = 0; k < qex->qwd_cnt; k++) {
-							tf = (double)candidates[r].tf[k];
-							idf = get_idf_from_quantized(qoenv->N, 0xFF, candidates[r].qidf[k]);
-
-							bm25score += (tf * idf) / (tf + okapi_k1 *(1.0 - okapi_b + okapi_b * lenratio));
-							if (qoenv->debug) printf("BM25(doc %lld): tf = %.0f, idf = %.4f, len = %.0f lenratio = %.3f, dwd_cnt= %d: Cumul.Score = %.4f\n",
-								d, tf, idf, doclen, lenratio, dwd_cnt, bm25score);
-						}
-
-					}
-
-					candidates[r].score = score(doc, dwd_cnt, qex->qterms, qex->qwd_cnt, qoenv->rr_coeffs,
-						score_from_doctable, bm25score, qoenv->location_lat, qoenv->location_long,
-						qoenv->conflate_accents, candidates[r].intervening_words, qoenv->debug)
-						* penalty_multiplier;
-				}
-			}
-
-			// Adjustment for rank_only terms  -- This formula is just to test the mechanism.  Need to come up
-			// with a more sensible formula
-			// The test for NULL here should only succeed if a malloc() failed in process_query()
-			if (qex->rank_only_cnt && rank_only_counts != NULL && rank_only_counts[r]) {
-				double plier = 3.0;
-				if (qoenv->debug >= 1) fprintf(qoenv->query_output, "Rank_only_terms(r = %d): Multiplying score of doc %lld by %.3f\n",
-					r, d, plier);
-				candidates[r].score *= plier;
-			}
-
-			memcpy(contiguous_array_of_candidates + candidates_recorded_this_variant, candidates + r, sizeof(candidate_t));
-			candidates_recorded_this_variant++;
-			if (qoenv->debug >= 1) fprintf(qoenv->query_output,
-				"R-and-R(result block %d): %d - doc %llu [%.3f]. Total now recorded = %d\n",
-				rb, r, candidates[r].doc, candidates[r].score, candidates_recorded_this_variant);
-		}
-	}
-
-
+	// Bounds are only worth using when scoring means more than looking up the static score
+	prune = qoenv->scoring_needed && !qex->early_termination && !qex->impact_engine;
+	ranked_cnt = 0;
+	left_out = FALSE;
+	if (capacity > 0) ranked_cnt = rank_candidates(qoenv, qex, ixenv, score_multiplier,
+		penalty_multiplier_for_partial_matches, rbu, ranked, capacity, fate, prune, &left_out);
 
 	// ------------- sorting by score ----  all other modes
-	if (qoenv->debug >= 2) fprintf(qoenv->query_output, "  rerank_and_record(): qsorting by score\n");
-	qsort(contiguous_array_of_candidates, candidates_recorded_this_variant, sizeof(candidate_t), score_cmp);
+	if (qoenv->debug >= 2) fprintf(qoenv->query_output, "  rerank_and_record(): sorting %d by score\n", ranked_cnt);
+	qsort(ranked, ranked_cnt, sizeof(ranked_candidate_t), ranked_cmp);
 	if (qoenv->debug >= 2) fprintf(qoenv->query_output, "  rerank_and_record(): displaying\n");
 
 
-	// Now loop through the contiguous array of candidates (which reference documents as numbers)
+	// Now loop through the ranked candidates (which reference documents as numbers)
 	// and work out what text to put in the result slot.  
 
-	r = 0; bmlp = NULL;
-	start_slot = qex->tl_returned;  // May be non-zero in the case of multiqueries
-	slot = start_slot;
+	r = 0;
 	if (0) printf("R&R: start_slot = %d, totcanrec = %d\n", start_slot, candidates_recorded_this_variant);
-	while (r < candidates_recorded_this_variant && slot < qoenv->max_to_show) {
-		d = contiguous_array_of_candidates[r].doc;
+	while (slot < qoenv->max_to_show) {
+		if (r >= ranked_cnt) {
+			// The heap has run out before the slots were filled.  If it didn't hold all the candidates
+			// which could be shown, rank them all.  Those it held will come first, in the same order.
+			if (!left_out) break;
+			if (qoenv->debug >= 1) fprintf(qoenv->query_output, "  rerank_and_record(): ranking all %d candidates\n",
+				candidates_recorded_this_variant);
+			query_arena_free(qex->arena, ranked);  // FRE1110
+			ranked = (ranked_candidate_t *)query_arena_alloc(qex->arena, candidates_recorded_this_variant * sizeof(ranked_candidate_t));  // MAL1110
+			if (ranked == NULL) {
+				fprintf(qoenv->query_output, "Warning: Malloc of ranked candidates failed.  No more results will be displayed.\n");
+				break;
+			}
+			ranked_cnt = rank_candidates(qoenv, qex, ixenv, score_multiplier, penalty_multiplier_for_partial_matches,
+				rbu, ranked, candidates_recorded_this_variant, fate, FALSE, &left_out);
+			qsort(ranked, ranked_cnt, sizeof(ranked_candidate_t), ranked_cmp);
+			continue;
+		}
+		d = ranked[r].candidate.doc;
+		segment = ixenv->segments[ranked[r].candidate.segment];
+		doctable = segment->doctable;
+		forward = segment->forward;
+		fsz = segment->fsz;
 		zapadupe = FALSE;
 
 		// First thing to do is to make sure that this candidate isn't the same
 		// document as one already placed by a previous query variant.
 		for (s = start_slot - 1; s >= 0; s--) { // Check those items
-			if (0) printf("     Checking CAC[%d] against docids[%d]\n", r, s);
-			if (d == qex->tl_docids[s]) zapadupe = TRUE;
+			if (0) printf("     Checking ranked[%d] against docids[%d]\n", r, s);
+			if (segment_docid(ranked[r].candidate.segment, d) == qex->tl_docids[s]) zapadupe = TRUE;
 		}
 		if (zapadupe) break;
 
@@ -1341,44 +2154,23 @@ static void rerank_and_record(query_processing_environment_t *qoenv, book_keepin
 		doc = get_doc(dtent, forward, &doclen_inwords, fsz);
 		if (0) printf("doclen_inwords = %d\n", doclen_inwords);
 		if (doc != NULL) {
-			int showlen = 0;
-			u_char *what2show = what_to_show((long long)(doc - forward), doc, &showlen, qoenv->displaycol, bmlp);
-			if (what2show != NULL) {  // Could be NULL in case of memory failure in what_to_show()
-
-				if (qoenv->debug >= 2) fprintf(qoenv->query_output, "Recording candidate %d (doc %lld, with score %.3f) in slot %d.\n",
-					r, d, contiguous_array_of_candidates[r].score, slot);
-
-				//  =============  Check for equal-score duplicates here  =======================
-				// Duplicates have the same first column of output and the same score
-
-				//Query:  x$9     4       Beehive, Molesworth St, Pipitea, Wellington 6011, New Zealand   0.38552
-				//Query:  x$9     5       Grawking Towers, 260 Creighton Siding Rd, Euroa 0.38552
-				//Query:  x$9     6       Beehive, Molesworth St, Pipitea, Wellington 6011, New Zealand   0.38552
-
-				if ((qoenv->duplicate_handling > 0) && (slot > 0)) {
-					for (s = slot - 1; s >= 0; s--) { // Check all the already placed items with equal score
-						if (qex->tl_scores[s] > contiguous_array_of_candidates[r].score) break;  // --->
-						zapadupe = isduplicate((char *)(qex->tl_suggestions[s]), (char *)what2show, FALSE);
-						if (zapadupe) break;
-					}
-				}
-
-				if (!zapadupe) {
-					//  Doesn't duplicate the previous answer
-					qex->tl_docids[slot] = d;
-					qex->tl_suggestions[slot] = what2show;  // That's in malloced storage (MAL2006)
-					if (qoenv->debug >= 2) {
-						fprintf(qoenv->query_output, "R_and_R: Slot %d: copied '%s' from: ", slot, qex->tl_suggestions[slot]);
-						show_string_upto_nator(what2show, terminator, 0);
-					}
-					qex->tl_scores[slot] = contiguous_array_of_candidates[r].score;
-					slot++;
-				}
-			}
+			//  =============  Check for equal-score duplicates here  =======================
+			// Duplicates have the same first column of output and the same score, unless
+			// duplicate_handling > 1, when any duplicate of an earlier result is skipped.  See record_result()
+
+			//Query:  x$9     4       Beehive, Molesworth St, Pipitea, Wellington 6011, New Zealand   0.38552
+			//Query:  x$9     5       Grawking Towers, 260 Creighton Siding Rd, Euroa 0.38552
+			//Query:  x$9     6       Beehive, Molesworth St, Pipitea, Wellington 6011, New Zealand   0.38552
+
+			if (!record_result(qoenv, qex, segment_docid(ranked[r].candidate.segment, d), doc,
+				(long long)(doc - forward), ranked[r].candidate.score, &slot) && qoenv->debug >= 2)
+				fprintf(qoenv->query_output, "R_and_R: candidate %d (doc %lld, with score %.3f) not recorded.\n",
+					r, d, ranked[r].candidate.score);
 		}  // Just ignore any erroneous doc
 		r++;
-	}  // end of while (r < candidates_recorded_this_variant && slot < qoenv->max_to_show)
-	free(contiguous_array_of_candidates);  // FRE1110
+	}  // end of while (slot < qoenv->max_to_show)
+	query_arena_free(qex->arena, ranked);  // FRE1110
+	query_arena_free(qex->arena, fate);  // FRE1111
 	memset(qex->candidates_recorded, 0, (MAX_RELAX + 1) * sizeof(int));  // Zero all the result block
 																		 // counts in case there's another variant.
 
@@ -1440,8 +2232,8 @@ static BOOL isprefixmatch(u_char *qstring, u_char *dstring) {
 
 
 
-static int possibly_store_in_order(double *cf_coeffs, long long candid8, double degree_of_match,
-	candidate_t *candidates, int max_to_show, int *recorded,
+static int possibly_store_in_order(double *cf_coeffs, long long candid8, int segment, double degree_of_match,
+	candidate_t *candidates, double *FVs, int max_to_show, int *recorded,
 	u_int terms_matched_bits, byte match_flags, double *FV) {
 	// This function is used only in classifier modes.
 	// candid8 is a document which has passed the classifier_threshold test.  It achieved a
@@ -1452,7 +2244,10 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 	//
 	//  - candidates is an array with max_to_show elements, numbered 0 - (max_to_show - 1).  
 	//  - *recorded says how many elements have been already inserted into candidates.
+	//  - FVs holds the feature vectors of the candidates, FV_ELTS doubles each, and is kept in step
 	//  - element zero is always the best (highest-scoring) item
+	//  - candid8 is a docnum within index segment number segment.  The candidates from all the segments
+	//    searched share the one list, so it ends up holding the best over the whole index.
 
 	// Return 1 if it was inserted, zero otherwise
 
@@ -1475,10 +2270,11 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 		if (ldebug) printf("Storing doc %lld with score %.4f as first entry.\n",
 			candid8, combined_score);
 		if (0) printf("Writing to candidates[%d]\n", *recorded);
-		memcpy(candidates[*recorded].FV, FV, FV_ELTS * sizeof(double));
+		memcpy(FVs + *recorded * FV_ELTS, FV, FV_ELTS * sizeof(double));
 		candidates[*recorded].score = combined_score;
 		candidates[*recorded].terms_matched_bits = terms_matched_bits;
 		candidates[*recorded].match_flags = match_flags;
+		candidates[*recorded].segment = (byte)segment;
 		candidates[(*recorded)++].doc = candid8;
 		return 1;
 	}
@@ -1495,10 +2291,11 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 			if (ldebug) printf("Storing doc %lld with score %.4f at tail position %d / %d.\n",
 				candid8, combined_score, *recorded, max_to_show - 1);
 			if (0) printf("Writing to candidates[%d]\n", *recorded);
-			memcpy(candidates[*recorded].FV, FV, FV_ELTS * sizeof(double));
+			memcpy(FVs + *recorded * FV_ELTS, FV, FV_ELTS * sizeof(double));
 			candidates[*recorded].score = combined_score;
 			candidates[*recorded].terms_matched_bits = terms_matched_bits;
 			candidates[*recorded].match_flags = match_flags;
+			candidates[*recorded].segment = (byte)segment;
 			candidates[(*recorded)++].doc = candid8;
 			return 1;
 		}
@@ -1524,14 +2321,16 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 					if (ldebug) printf("    Copying position %d to position %d\n", j - 1, j);
 					if (0) printf("Writing to candidates[%d]\n", j);
 					memcpy(candidates + j, candidates + (j - 1), sizeof(candidate_t));
+					memcpy(FVs + j * FV_ELTS, FVs + (j - 1) * FV_ELTS, FV_ELTS * sizeof(double));
 				}
 				if (ldebug) printf("Storing doc %lld with score %.4f at middle position %d / %d.\n",
 					candid8, combined_score, slot, max_to_show - 1);
 				if (0) printf("Writing to candidates[%d]\n", slot);
-				memcpy(candidates[slot].FV, FV, FV_ELTS * sizeof(double));
+				memcpy(FVs + slot * FV_ELTS, FV, FV_ELTS * sizeof(double));
 				candidates[slot].score = combined_score;
 				candidates[slot].terms_matched_bits = terms_matched_bits;
 				candidates[slot].match_flags = match_flags;
+				candidates[slot].segment = (byte)segment;
 				candidates[slot].doc = candid8;
 				if (*recorded != max_to_show) (*recorded)++;
 				if (ldebug) {
@@ -1551,14 +2350,16 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 			if (ldebug) printf("    Copying position %d to position %d\n", j - 1, j);
 			if (0) printf("Writing to candidates[%d]\n", j);
 			memcpy(candidates + j, candidates + (j - 1), sizeof(candidate_t));
+			memcpy(FVs + j * FV_ELTS, FVs + (j - 1) * FV_ELTS, FV_ELTS * sizeof(double));
 		}
 		if (ldebug) printf("Storing doc %lld with score %.4f at middle position %d / %d.\n",
 			candid8, combined_score, slot, max_to_show - 1);
 		if (0) printf("Writing to candidates[%d]\n", slot);
-		memcpy(candidates[slot].FV, FV, FV_ELTS * sizeof(double));
+		memcpy(FVs + slot * FV_ELTS, FV, FV_ELTS * sizeof(double));
 		candidates[slot].score = combined_score;
 		candidates[slot].terms_matched_bits = terms_matched_bits;
 		candidates[slot].match_flags = match_flags;
+		candidates[slot].segment = (byte)segment;
 		candidates[slot].doc = candid8;
 		if (*recorded != max_to_show) (*recorded)++;
 		if (ldebug) {
@@ -1571,6 +2372,13 @@ static int possibly_store_in_order(double *cf_coeffs, long long candid8, double
 }
 
 
+static pcre2_match_data **substitution_match_data(book_keeping_for_one_query_t *qex) {
+	// The match data for apply_substitutions_rules_to_string() to reuse, or NULL if there's no
+	// thread context to keep it in.
+	return (qex->qtc == NULL) ? NULL : &(qex->qtc->substitution_match_data);
+}
+
+
 int possibly_record_candidate(query_processing_environment_t *qoenv,
 	book_keeping_for_one_query_t *qex,
 	saat_control_t *pl_blox,
@@ -1613,6 +2421,7 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 	candidate_t *candidates = qex->candidatesa[result_block_to_use];
 	byte *rank_only_counts = NULL;
 	u_char dc_copy[MAX_RESULT_LEN + 1], *dwds[WDPOS_MASK + 1];
+	u_short *nf_record = NULL;   // This candidate's QBASH.normforward record, if one is to be used
 	double score = 0.0;
 	BOOL apply_geo_filtering = FALSE, explain_rejection = qoenv->debug;
 
@@ -1625,6 +2434,13 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 	// Unfortunately, the following bit setting doesn't work if the query has been shortened
 	candidates[*recorded].terms_matched_bits = 0;
 
+	if (ts_is_set(qex->segment_ixenv->tombstones, qex->segment_ixenv->tsz, candid8)) {
+		if (explain_rejection)
+			fprintf(qoenv->query_output, "possibly_record_candidate(): Rejection reason 'deleted' (segment %d)\n",
+				qex->segment);
+		return 0; // 0 -------------------------------------------->
+	}
+
 	if (qex->rank_only_cnt) rank_only_counts = qex->rank_only_countsa[result_block_to_use];
 	dtent = (unsigned long long *)(doctable + candid8 * DTE_LENGTH);
 	candid8_length = (int)(*dtent & DTE_WDCNT_MASK);
@@ -1645,6 +2461,20 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 		}
 	}
 
+	if (qex->q_strong_signature) {
+		// The second, stronger, Bloom filter from QBASH.bloom.  Unlike the first it doesn't depend on
+		// relaxation, since all the partials must match in any case.
+		unsigned long long s_signature = strong_signature_of_doc(qex->segment_ixenv, candid8);
+		qex->op_count[COUNT_BLM2].count++;
+		if ((s_signature & qex->q_strong_signature) != qex->q_strong_signature) {
+			if (explain_rejection)
+				fprintf(qoenv->query_output,
+					"possibly_record_candidate(): Rejection reason 'strong signature mismatch' %llX v. %llX\n",
+					s_signature, qex->q_strong_signature);
+			return 0; // 1a -------------------------------------------->
+		}
+	}
+
 	// NOTE that in version 1.3+ indexes, only 5 bits are used to store document length in words, although positions up
 	// to 254 may be indexed.   If doclen_inwords is 31, that means >=31.  This could lead to very long candidates not
 	// being rejected (in relatively uncommon circumstances).
@@ -1732,8 +2562,15 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 	if (qoenv->classifier_mode || qex->partial_cnt || qex->rank_only_cnt
 		|| apply_geo_filtering || qoenv->street_address_processing > 1) {
 		u_char *p = NULL;
+		index_environment_t *segment = qex->segment_ixenv;
 		if (0) printf("Partials, classifier or rank_only, *dtent = %llx\n", *dtent);
 
+		// QBASH.normforward saves lowercasing, removing accents and splitting, provided it was
+		// written with the accent treatment wanted, and there are no substitutions to make.
+		if (segment->normforward != NULL && !qoenv->use_substitutions
+			&& qoenv->conflate_accents == segment->normforward_accents_removed)
+			nf_record = normalized_record_of_doc(segment, candid8);
+
 		doc = get_doc(dtent, forward, &dc_len, fsz);
 		if (doc == NULL) {
 			return 0;
@@ -1751,9 +2588,12 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 		}
 
 		// 1. Make a copy of the doc in malloced memory  (Actually it's on the stack at the moment)
-		p = (u_char *)doc;
-		while (*p &&  *p >= ' ') p++;  // Skip to the tab
-		dc_len = (int)(p - (u_char *)doc);
+		if (nf_record != NULL) dc_len = nf_record[0];  // NF_TOO_LONG is > MAX_RESULT_LEN
+		else {
+			p = (u_char *)doc;
+			while (*p &&  *p >= ' ') p++;  // Skip to the tab
+			dc_len = (int)(p - (u_char *)doc);
+		}
 		if (qoenv->debug >= 3)
 			fprintf(qoenv->query_output, "possibly_record_candidate(): dc_len is %d c.f. %d\n",
 				dc_len, MAX_RESULT_LEN);
@@ -1765,12 +2605,16 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 
 		// Copy trigger to dc_copy, converting to lower case
 
-
-		utf8_lowering_ncopy(dc_copy, doc, dc_len);  // This function avoids a potential problem
-															// when dc_copy ends with an incomplete UTF-8
-															// sequence.  
-		if (qoenv->conflate_accents) utf8_remove_accents(dc_copy);
-		dc_copy[dc_len] = 0;
+		if (nf_record != NULL) {
+			memcpy(dc_copy, nf_text(nf_record), nf_record[1] + 1);
+		}
+		else {
+			utf8_lowering_ncopy(dc_copy, doc, dc_len);  // This function avoids a potential problem
+			// when dc_copy ends with an incomplete UTF-8
+			// sequence.  
+			if (qoenv->conflate_accents) utf8_remove_accents(dc_copy);
+			dc_copy[dc_len] = 0;
+		}
 
 		if (qoenv->debug >= 3) fprintf(qoenv->query_output, "possibly_record_candidate(): dc_copy is '%s'\n", dc_copy);
 
@@ -1779,7 +2623,7 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 			// Note: apply_substitutions_rules_to_string() applies limits to the input length, and to the output
 			// length.  If input > 256 no substitutions will occur.  Output is limited to 
 			apply_substitutions_rules_to_string(qoenv->substitutions_hash, qoenv->language, dc_copy,
-				TRUE, TRUE, qoenv->debug);
+				TRUE, TRUE, substitution_match_data(qex), qoenv->debug);
 
 			if (qoenv->debug >= 2)
 				fprintf(qoenv->query_output,
@@ -1808,7 +2652,8 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 			dwd_cnt = utf8_count_words_in_string(dc_copy, FALSE, FALSE, FALSE, FALSE);
 		}
 		if (0) printf(" -- dc_copy = '%s'\n", dc_copy);
-		score = classification_score(qoenv, qex, dtent, dc_copy, dc_len, dwd_cnt, &match_flags, FV, &terms_matched_bits);
+		score = classification_score(qoenv, qex, dtent, dc_copy, dc_len, dwd_cnt, nf_record, &match_flags, FV,
+			&terms_matched_bits);
 		qex->op_count[COUNT_SCOR].count++;
 
 		// A segment_intent_multiplier may be set if the original query contained intent words such as 'lyrics of'
@@ -1820,7 +2665,8 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 			return 0;  // 6 -------------------------------------------------------------------->
 		}
 
-		stored = possibly_store_in_order(qoenv->cf_coeffs, candid8, score, candidates, qoenv->max_to_show, recorded,
+		stored = possibly_store_in_order(qoenv->cf_coeffs, candid8, qex->segment, score, candidates,
+			qex->candidate_FVsa[result_block_to_use], qoenv->max_to_show, recorded,
 			terms_matched_bits, match_flags, FV);
 		if (0) printf("  CCC %d\n", qex->qwd_cnt);
 
@@ -1854,7 +2700,14 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 
 		// 2. Split the doc copy into words.
 
-		dwd_cnt = utf8_split_line_into_null_terminated_words(dc_copy, dwds, WDPOS_MASK, MAX_WD_LEN,
+		if (nf_record != NULL) {
+			// Overwrite dc_copy with the split copy, as if it had been split in place.
+			int L = nf_record[1];
+			dwd_cnt = nf_record[2];
+			memcpy(dc_copy, nf_split(nf_record), L + 1);
+			for (d = 0; d < dwd_cnt; d++) dwds[d] = dc_copy + nf_word_offsets(nf_record)[d];
+		}
+		else dwd_cnt = utf8_split_line_into_null_terminated_words(dc_copy, dwds, WDPOS_MASK, MAX_WD_LEN,
 			FALSE, FALSE, FALSE, FALSE);
 
 		// 3. If the doc is long enough to match, zap out the words corresponding to full word matches.
@@ -1966,19 +2819,29 @@ int possibly_record_candidate(query_processing_environment_t *qoenv,
 	if (qoenv->debug >= 1)
 		fprintf(qoenv->query_output, "possibly_record_candidate(): recording %lld in candidates[%d].  RB to use = %d.\n",
 			candid8, *recorded, result_block_to_use);
-	if (qoenv->rr_coeffs[5] > 0) {
-		// Passing over information for BM25 scoring
-		int k;
-		u_char tfb = 0;
-		for (k = 0; k < qex->qwd_cnt; k++) {
-			if (pl_blox[k].tf > 256) tfb = (u_char)256;
-			else tfb = (u_char)pl_blox[k].tf;
-			candidates[(*recorded)].tf[k] = tfb;
-			candidates[(*recorded)].qidf[k] = pl_blox[k].qidf;
+	if (qex->candidate_detailsa != NULL) {
+		candidate_details_t *details = qex->candidate_detailsa[result_block_to_use] + *recorded;
+		if (qoenv->rr_coeffs[5] > 0) {
+			// Passing over information for BM25 scoring.  Words beyond the SAAT blocks
+			// set up for this query (repeats and phrase words) get zeroes.
+			int k;
+			u_char tfb = 0;
+			for (k = 0; k < qex->qwd_cnt; k++) {
+				if (k >= qex->tl_saat_blocks_used) {
+					details->tf[k] = 0;
+					details->qidf[k] = 0;
+					continue;
+				}
+				if (pl_blox[k].tf > 256) tfb = (u_char)256;
+				else tfb = (u_char)pl_blox[k].tf;
+				details->tf[k] = tfb;
+				details->qidf[k] = pl_blox[k].qidf;
+			}
 		}
+		if (intervening_words > 255) intervening_words = 255;
+		details->intervening_words = (byte)intervening_words;  // zero in most cases
 	}
-	if (intervening_words > 255) intervening_words = 255;
-	candidates[(*recorded)].intervening_words = (byte)intervening_words;  // zero in most cases
+	candidates[(*recorded)].segment = (byte)qex->segment;
 	candidates[(*recorded)++].doc = candid8;
 	return 1;  // --------------------------------------->
 }
@@ -2500,6 +3363,7 @@ static int process_query_text(query_processing_environment_t *qoenv, book_keepin
 	q = qex->qcopy;
 	qex->qwd_cnt = 0;
 	qex->q_max_mat_len = 0;
+	qex->qterm_ids_segment = NULL;
 
 	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "process_query_text(%s)\n", qex->query);
 
@@ -2536,7 +3400,7 @@ static int process_query_text(query_processing_environment_t *qoenv, book_keepin
 		if (qoenv->segment_rules_hash != NULL) {
 			if (explain) printf("Applying segment rules\n");
 			yes = apply_substitutions_rules_to_string(qoenv->segment_rules_hash, qoenv->language,
-				q, TRUE, TRUE, qoenv->debug);
+				q, TRUE, TRUE, substitution_match_data(qex), qoenv->debug);
 		}
 
 		if (yes) {
@@ -2564,7 +3428,7 @@ static int process_query_text(query_processing_environment_t *qoenv, book_keepin
 		// a substitution rule has introduced an operator.
 		if (explain) printf("Applying general substitution rules\n");
 		apply_substitutions_rules_to_string(qoenv->substitutions_hash, qoenv->language,
-			q, TRUE, FALSE, qoenv->debug);
+			q, TRUE, FALSE, substitution_match_data(qex), qoenv->debug);
 		if (qoenv->display_parsed_query)
 			fprintf(qoenv->query_output,
 				"Query after application of %s substitutions is {%s}; Original query was {%s}\n",
@@ -2682,47 +3546,556 @@ static int process_query_text(query_processing_environment_t *qoenv, book_keepin
 				if (qex->qwd_cnt == MAX_WDS_IN_QUERY) break;
 			}
 		}
-		if (saveq) q++;
-		term_start = q;
-	}  // End of while (*q).
+		if (saveq) q++;
+		term_start = q;
+	}  // End of while (*q).
+
+
+	if (qoenv->debug >= 1)
+		fprintf(qoenv->query_output, "     Query terms: %d, Partials: %d\n",
+			qex->qwd_cnt, qex->partial_cnt);
+
+
+	// B. We now have an array of qwd_cnt query words.
+	if (qex->qwd_cnt == 0) {
+		if (qoenv->debug >= 1)  printf("  ***** Empty query\n");
+		return(0);  // ------------------------------------------------>
+	}
+	return(qex->qwd_cnt);
+}
+
+
+
+// ---------------------------------------------------------------------------------------
+// The single-term fast path
+// ---------------------------------------------------------------------------------------
+
+// The latency of queries comprising a single word, and in particular of the line prefix queries
+// like {>fac} described in doc/auto_suggest.txt, matters most.  If QBASHI assigned docnums in
+// descending order of static score and nothing but static score is used in ranking, the answer to
+// such a query is just the first max_to_show postings which survive the checks applied by
+// possibly_record_candidate(), so there's no need for saat_relaxed_and(), the candidate blocks or
+// the sort in rerank_and_record().  single_term_search() streams the postings list and records
+// results directly, fetching .forward text only for the survivors.
+
+static BOOL single_term_fast_path_usable(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *ixenv, double score_multiplier) {
+	// Return TRUE if single_term_search() would give the same results as the usual path.  Only an
+	// unsharded index is handled, so there's no need to merge results from different segments.
+	if (!qoenv->x_single_term_fast_path || qoenv->classifier_mode > 0 || qoenv->report_match_counts_only
+		|| qoenv->scoring_needed || qoenv->use_impact_engine || score_multiplier <= 0.0
+		|| ixenv->num_segments != 1 || !ixenv->score_ordered)
+		return FALSE;  // -------------------------------->
+	if (qex->qwd_cnt != 1 || qex->cg_qwd_cnt != 1 || qex->partial_cnt > 0 || qex->rank_only_cnt > 0
+		|| qex->query_contains_operators || qex->cg_qterms[0][0] == '[' || qex->cg_qterms[0][0] == '"')
+		return FALSE;  // -------------------------------->
+	// Geo-filtering and street number checks need the text of every candidate.
+	if (qoenv->geo_filter_radius > 0.0 && qoenv->location_lat != UNDEFINED_DOUBLE
+		&& qoenv->location_long != UNDEFINED_DOUBLE)
+		return FALSE;  // -------------------------------->
+	if (qoenv->street_address_processing > 1 && qex->street_number > 0) return FALSE;  // -------------------------------->
+	return TRUE;
+}
+
+
+static BOOL single_term_consider(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, docnum_t d, unsigned long long *dtent, byte *doc, double score_multiplier,
+	int start_slot, int *slot, int *candidates) {
+	// Apply the checks of possibly_record_candidate() and rerank_and_record() to document d, whose
+	// .doctable entry is *dtent, and record it in the next slot if it survives.  doc is the text of
+	// its record, or NULL to find it in .forward.  Return FALSE if d was placed by a previous query
+	// variant, meaning that the search should stop.
+	int dwd_cnt, doclen_inwords, s;
+	double score;
+
+	qex->op_count[COUNT_ACAN].count++;
+	if (ts_is_set(segment->tombstones, segment->tsz, d)) return TRUE;  // -------------------------------->
+	qex->op_count[COUNT_CONS].count++;
+	dwd_cnt = (int)(*dtent & DTE_WDCNT_MASK);
+	if (dwd_cnt - qex->q_max_mat_len > qex->max_length_diff) return TRUE;  // -------------------------------->
+	(*candidates)++;
+
+	// As in rerank_and_record(), stop at a document already placed by a previous query variant.
+	for (s = start_slot - 1; s >= 0; s--) {
+		if (segment_docid(0, d) == qex->tl_docids[s]) return FALSE;  // -------------------------------->
+	}
+
+	if (doc == NULL) doc = get_doc(dtent, segment->forward, &doclen_inwords, segment->fsz);
+	if (doc == NULL) return TRUE;  // -------------------------------->
+	score = get_score_from_dtent(*dtent) * score_multiplier;
+	record_result(qoenv, qex, segment_docid(0, d), doc, (long long)((*dtent & DTE_DOCOFF_MASK) >> DTE_DOCOFF_SHIFT),
+		score, slot);
+	return TRUE;
+}
+
+
+static int single_term_search(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, double score_multiplier, int *error_code) {
+	// Record the results for a query accepted by single_term_fast_path_usable() in the unused
+	// tl_ slots, exactly as saat_relaxed_and() followed by rerank_and_record() would have done.
+	// Those would have recorded the first max_candidates_to_consider candidates in docnum
+	// order, i.e. in descending score order, and then shown them in that order, so we stop when
+	// either that many candidates have been seen or all the slots are full.  The Bloom filter
+	// test of possibly_record_candidate() is omitted because, with no partial words, the query
+	// signature is zero.  Return 1 if the word occurs in segment, 0 if it doesn't, or a
+	// negative error code.
+	saat_control_t blok;
+	int start_slot = qex->tl_returned, slot = start_slot, candidates = 0;
+	docnum_t d;
+	long long possibles = 0;
+
+	qex->segment = 0;
+	qex->segment_ixenv = segment;
+	if (!saat_setup_single_word(qoenv, qex, segment, &blok, error_code)) {
+		saat_free_single_word(&blok);
+		if (*error_code < 0) return *error_code;  // -------------------------------->
+		return 0;  // -------------------------------->
+	}
+	if (qoenv->debug >= 1)
+		fprintf(qoenv->query_output, "single_term_search(%s): %lld postings\n", qex->cg_qterms[0], blok.occurrence_count);
+
+	while (!blok.exhausted && slot < qoenv->max_to_show && candidates < qoenv->max_candidates_to_consider) {
+		d = blok.curdoc;
+		if (!single_term_consider(qoenv, qex, segment, d, (unsigned long long *)(segment->doctable + (d * DTE_LENGTH)),
+			NULL, score_multiplier, start_slot, &slot, &candidates))
+			break;  // -------->
+
+		saat_skipto(qoenv->query_output, &blok, 0, d + 1, DONT_CARE, segment->index,
+			qex->op_count, qoenv->debug, error_code);
+		if (*error_code < -200000) break;  // -------->
+
+		possibles++;
+		// As in saat_relaxed_and(), check both deterministic and elapsed time timeouts every tenth possible.
+		if ((qoenv->timeout_kops > 0 || qoenv->timeout_msec > 0) && (possibles % 10) == 0) {
+			if ((qoenv->timeout_kops > 0 && kop_cost(qex) > qoenv->timeout_kops)
+				|| (qoenv->timeout_msec > 0
+					&& 1000.0 * (what_time_is_it() - qex->start_time) > (double)qoenv->timeout_msec)) {
+				qex->timed_out = TRUE;
+				if (qex->qtc != NULL) qex->qtc->query_timeout_count++;
+				break;  // -------->
+			}
+		}
+	}
+	saat_free_single_word(&blok);
+	qex->tl_returned = slot;
+	if (*error_code < -200000) return *error_code;  // -------------------------------->
+	return 1;
+}
+
+
+static int head_answers_search(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, double score_multiplier) {
+	// For a line prefix query accepted by single_term_fast_path_usable(), try to record the results
+	// from the answers stored in .if.head_answers, without reading the postings or .forward.  Return 1
+	// if that gave exactly what single_term_search() would have, or 0, with nothing recorded, if the
+	// prefix isn't there or its stored answers ran out before the results were complete.
+	u_ll *ha = segment->head_answers, *entry = NULL, *answer;
+	u_char *term = qex->cg_qterms[0];
+	shown_fingerprint_t *saved_fingerprints = NULL;
+	int start_slot = qex->tl_returned, slot = start_slot, candidates = 0, cmp, s,
+		saved_capacity = qex->shown_fingerprint_capacity, saved_count = qex->shown_fingerprint_count;
+	long long lo = 0, hi, mid, a, num_answers;
+	BOOL complete = FALSE;
+
+	if (ha == NULL) return 0;  // -------------------------------->
+	hi = (long long)ha[0] - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		cmp = strncmp((char *)term, (char *)ha_entry_term(ha_dir(ha) + mid * HA_DIR_ENTRY_ULLS), MAX_WD_LEN);
+		if (cmp == 0) {
+			entry = ha_dir(ha) + mid * HA_DIR_ENTRY_ULLS;
+			break;
+		}
+		if (cmp < 0) hi = mid - 1;
+		else lo = mid + 1;
+	}
+	if (entry == NULL) return 0;  // -------------------------------->
+
+	// Results placed from the stored answers may have to be withdrawn, and the fingerprints they
+	// add would then make single_term_search() skip the same documents as duplicates.
+	if (qex->shown_fingerprints != NULL) {
+		saved_fingerprints = (shown_fingerprint_t *)query_arena_alloc(qex->arena,
+			saved_capacity * sizeof(shown_fingerprint_t));  // MAL2008
+		if (saved_fingerprints == NULL) return 0;  // -------------------------------->
+		memcpy(saved_fingerprints, qex->shown_fingerprints, saved_capacity * sizeof(shown_fingerprint_t));
+	}
+
+	num_answers = (long long)ha_entry_answers(entry);
+	answer = ha_answers(ha) + ha_entry_first(entry) * HA_ANSWER_ULLS;
+	for (a = 0; a < num_answers; a++, answer += HA_ANSWER_ULLS) {
+		if (slot >= qoenv->max_to_show || candidates >= qoenv->max_candidates_to_consider) break;  // -------->
+		if (!single_term_consider(qoenv, qex, segment, (docnum_t)ha_answer_docnum(answer), &ha_answer_dtent(answer),
+			ha_text(ha) + ha_answer_text(answer), score_multiplier, start_slot, &slot, &candidates)) {
+			complete = TRUE;
+			break;  // -------->
+		}
+	}
+	if (slot >= qoenv->max_to_show || candidates >= qoenv->max_candidates_to_consider
+		|| (u_ll)num_answers == ha_entry_postings(entry))
+		complete = TRUE;
+	if (!complete) {
+		for (s = start_slot; s < slot; s++) {
+			query_arena_free(qex->arena, qex->tl_suggestions[s]);  // FRE2006
+			qex->tl_suggestions[s] = NULL;
+		}
+		if (saved_fingerprints != NULL) {
+			query_arena_free(qex->arena, qex->shown_fingerprints);  // FRE2007
+			qex->shown_fingerprints = saved_fingerprints;
+			qex->shown_fingerprint_capacity = saved_capacity;
+			qex->shown_fingerprint_count = saved_count;
+		} else {
+			forget_shown_fingerprints(qex);
+		}
+		return 0;  // -------------------------------->
+	}
+	if (saved_fingerprints != NULL) query_arena_free(qex->arena, saved_fingerprints);  // FRE2008
+	if (qoenv->debug >= 1)
+		fprintf(qoenv->query_output, "head_answers_search(%s): %d results from %lld stored answers\n",
+			term, slot - start_slot, num_answers);
+	qex->tl_returned = slot;
+	return 1;
+}
+
+
+static int search_one_segment(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *segment, int s, int *error_code) {
+	// Generate candidates from segment s of the index and record them in qex.  Return 1 if
+	// saat_relaxed_and() or saat_impact_search() was run, 0 if too many terms were missing from the
+	// segment, or a negative error code if the query must be abandoned.  Otherwise *error_code is
+	// as left by saat_relaxed_and().
+	int terms_not_present = 0, rslt = 0;
+	saat_control_t *plists;
+	impact_workspace_t *workspace = NULL;
+
+	qex->segment = s;
+	qex->segment_ixenv = segment;
+	if (qex->impact_engine) {
+		// The workspace is kept for later queries if there's a thread context to keep it in.
+		if (qex->impact_workspaces != NULL) return saat_impact_search(qoenv, qex, segment, qex->impact_workspaces + s);  // ------->
+		rslt = saat_impact_search(qoenv, qex, segment, &workspace);
+		free_impact_workspace(&workspace);
+		return rslt;   // ------------------------------------------------>
+	}
+	plists = saat_setup(qoenv, qex, segment, &terms_not_present, error_code);
+
+	if (*error_code < 0) {
+		// An error return from saat_setup()
+		return(*error_code);   // ------------------------------------------------>
+	}
+	if (qoenv->debug >= 1 && terms_not_present) {
+		fprintf(qoenv->query_output, "%d word(s) in this %d-word query never occurred in segment %d.\n",
+			terms_not_present, qex->qwd_cnt, s);
+	}
+
+	if (terms_not_present <= qoenv->relaxation_level) {
+		qex->q_signature = calculate_signature_from_first_letters_of_partials(qex->partials,
+			qex->partial_cnt,
+			DTE_BLOOM_BITS,
+			error_code);
+		if (*error_code < -200000) return(*error_code);   // -------------------------------------------------->
+		if (qoenv->debug >= 2)
+			fprintf(qoenv->query_output, "Query signature = %llx. (bits = %d)\n",
+				qex->q_signature, DTE_BLOOM_BITS);
+		// The QBASH.bloom check is only valid when partial words must match the unaltered text.
+		qex->q_strong_signature = 0;
+		if (segment->blooms != NULL && qex->partial_cnt > 0 && qoenv->classifier_mode == 0 && !qoenv->use_substitutions)
+			qex->q_strong_signature = calculate_strong_signature_of_partials(qex->partials, qex->partial_cnt,
+				segment->bloom_bits);
+
+		// NOTE: The following calls saat_relaxed_and() in all cases.  This makes sense for code simplicity
+		//       and because the old saat_and() achieved only half the throughput because its algorithms
+		//       for choosing candidates and advancing had not been optimized in the way the relaxed
+		//       version have been.
+		saat_relaxed_and(qoenv->query_output, qoenv, qex, plists, segment->forward,
+			segment->index, segment->doctable, segment->fsz, error_code);
+		if (*error_code < -200000) rslt = *error_code;
+		else rslt = 1;
+	}
+	free_querytree_memory(qex->arena, &plists, qex->tl_saat_blocks_allocated);
+	return rslt;
+}
+
+
+// The state of the search of one segment, when the segments of a multi-segment index are searched
+// in parallel.  qex is a copy of the query's book keeping, except that its candidate slots are the
+// segment's share of the query's.  Each thread searches every stride-th segment, starting from its own.
+
+typedef struct {
+	query_processing_environment_t *qoenv;
+	book_keeping_for_one_query_t qex;
+	candidate_t *candidatesa[MAX_RELAX + 1];
+	candidate_details_t *candidate_detailsa[MAX_RELAX + 1];
+	byte *rank_only_countsa[MAX_RELAX + 1];
+	index_environment_t *segment;
+	int s, num_searches, stride, rslt, error_code;
+} segment_search_t;
+
+
+#ifdef WIN64
+static DWORD WINAPI segment_search_thread(LPVOID arg) {
+#else
+static void *segment_search_thread(void *arg) {
+#endif
+	segment_search_t *ss = (segment_search_t *)arg, *searches = ss - ss->s;
+	int s;
+
+	for (s = ss->s; s < ss->num_searches; s += ss->stride) {
+		ss = searches + s;
+		ss->rslt = search_one_segment(ss->qoenv, &(ss->qex), ss->segment, s, &(ss->error_code));
+	}
+	return 0;
+}
+
+
+static int search_segments_in_parallel(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *ixenv, int num_segments, BOOL *candidates_generated, int *error_code) {
+	// Search segments 0 .. num_segments - 1 of ixenv using up to segment_threads threads, then
+	// gather the candidates recorded for each segment into qex, in segment order, so that the
+	// results are exactly as if the segments had been searched one after another.  Return zero, or
+	// the first negative error code from search_one_segment().  *error_code is set as by the last
+	// segment.
+	segment_search_t *searches, *ss;
+	int s, rb, n, num_threads = qoenv->segment_threads, rslt = 0, op_count_before[NUM_OPS];
+	size_t slots_per_segment = qoenv->max_candidates_to_consider;
+#ifdef WIN64
+	HANDLE threads[SEG_MAX_SHARDS];
+#else
+	pthread_t threads[SEG_MAX_SHARDS];
+#endif
+
+	if (num_threads > num_segments) num_threads = num_segments;
+	if (num_threads > SEG_MAX_SHARDS) num_threads = SEG_MAX_SHARDS;
+	searches = (segment_search_t *)query_arena_alloc(qex->arena, num_segments * sizeof(segment_search_t));  // MAL1120
+	if (searches == NULL) return -220085;  // -------------------------------->
+
+	for (s = 0; s < num_segments; s++) {
+		ss = searches + s;
+		ss->qoenv = qoenv;
+		memcpy(&(ss->qex), qex, sizeof(book_keeping_for_one_query_t));
+		ss->qex.qtc = NULL;   // Timeouts are counted below.
+		ss->qex.arena = NULL; // The arena belongs to this thread.  Helper threads use malloc().
+		ss->qex.timed_out = FALSE;
+		ss->qex.full_match_count = 0;
+		memset(ss->qex.candidates_recorded, 0, (MAX_RELAX + 1) * sizeof(int));
+		memset(ss->qex.segment_base, 0, (MAX_RELAX + 1) * sizeof(int));
+		if (qex->candidatesa != NULL) {
+			for (rb = 0; rb <= MAX_RELAX; rb++) ss->candidatesa[rb] = qex->candidatesa[rb] + s * slots_per_segment;
+			ss->qex.candidatesa = ss->candidatesa;
+		}
+		if (qex->candidate_detailsa != NULL) {
+			for (rb = 0; rb <= MAX_RELAX; rb++) ss->candidate_detailsa[rb] = qex->candidate_detailsa[rb] + s * slots_per_segment;
+			ss->qex.candidate_detailsa = ss->candidate_detailsa;
+		}
+		if (qex->rank_only_countsa != NULL) {
+			for (rb = 0; rb <= MAX_RELAX; rb++) ss->rank_only_countsa[rb] = qex->rank_only_countsa[rb] + s * slots_per_segment;
+			ss->qex.rank_only_countsa = ss->rank_only_countsa;
+		}
+		ss->segment = ixenv->segments[s];
+		ss->s = s;
+		ss->num_searches = num_segments;
+		ss->stride = num_threads;
+		ss->rslt = 0;
+		ss->error_code = 0;
+	}
+
+#ifdef WIN64
+	for (s = 0; s < num_threads; s++) {
+		threads[s] = CreateThread(NULL, 0, segment_search_thread, (LPVOID)(searches + s), 0, NULL);
+		if (threads[s] == NULL) segment_search_thread((LPVOID)(searches + s));   // Do it in this thread instead
+	}
+	for (s = 0; s < num_threads; s++) {
+		if (threads[s] == NULL) continue;
+		WaitForSingleObject(threads[s], INFINITE);
+		CloseHandle(threads[s]);
+	}
+#else
+	for (s = 0; s < num_threads; s++) {
+		if (pthread_create(threads + s, NULL, segment_search_thread, (void *)(searches + s))) {
+			segment_search_thread((void *)(searches + s));   // Do it in this thread instead
+			threads[s] = pthread_self();
+		}
+	}
+	for (s = 0; s < num_threads; s++) {
+		if (!pthread_equal(threads[s], pthread_self())) pthread_join(threads[s], NULL);
+	}
+#endif
+
+	// Gather the results.  Segment s's candidates are moved down to follow those of earlier segments.
+	// Each search started with a copy of the op counts so far, so only its increments are added.
+	for (n = 0; n < NUM_OPS; n++) op_count_before[n] = qex->op_count[n].count;
+	for (s = 0; s < num_segments; s++) {
+		ss = searches + s;
+		if (ss->rslt < 0 && rslt == 0) rslt = ss->rslt;
+		if (ss->rslt > 0) *candidates_generated = TRUE;
+		*error_code = ss->error_code;
+		qex->full_match_count += ss->qex.full_match_count;
+		if (ss->qex.timed_out) {
+			qex->timed_out = TRUE;
+			if (qex->qtc != NULL) qex->qtc->query_timeout_count++;
+		}
+		for (n = 0; n < NUM_OPS; n++) qex->op_count[n].count += ss->qex.op_count[n].count - op_count_before[n];
+		if (qex->candidatesa == NULL) continue;
+		for (rb = 0; rb <= MAX_RELAX; rb++) {
+			n = ss->qex.candidates_recorded[rb];
+			if (n == 0) continue;
+			memmove(qex->candidatesa[rb] + qex->candidates_recorded[rb], ss->candidatesa[rb], n * sizeof(candidate_t));
+			if (qex->candidate_detailsa != NULL)
+				memmove(qex->candidate_detailsa[rb] + qex->candidates_recorded[rb], ss->candidate_detailsa[rb],
+					n * sizeof(candidate_details_t));
+			if (qex->rank_only_countsa != NULL)
+				memmove(qex->rank_only_countsa[rb] + qex->candidates_recorded[rb], ss->rank_only_countsa[rb], n);
+			qex->candidates_recorded[rb] += n;
+		}
+	}
+	query_arena_free(qex->arena, searches);  // FRE1120
+	return rslt;
+}
 
 
-	if (qoenv->debug >= 1)
-		fprintf(qoenv->query_output, "     Query terms: %d, Partials: %d\n",
-			qex->qwd_cnt, qex->partial_cnt);
+static void **allocate_parallel_blocks(query_arena_t *arena, size_t elt_size, int slots) {
+	// Allocate and zero MAX_RELAX + 1 blocks of slots elements of elt_size bytes, to run in parallel
+	// with the result blocks.  Return NULL if an allocation fails.
+	void **blocks;
+	int rb, fi;
+
+	blocks = (void **)query_arena_alloc(arena, sizeof(void *) * (MAX_RELAX + 1));  // MAL0013
+	if (blocks == NULL) return NULL;  // -------------------------------->
+	for (rb = 0; rb <= MAX_RELAX; rb++) {
+		blocks[rb] = query_arena_calloc(arena, slots, elt_size);  // MAL0014
+		if (blocks[rb] == NULL) {
+			for (fi = 0; fi < rb; fi++) query_arena_free(arena, blocks[fi]);  // FRE0014
+			query_arena_free(arena, blocks);  // FRE0013
+			return NULL;  // -------------------------------->
+		}
+	}
+	return blocks;
+}
 
 
-	// B. We now have an array of qwd_cnt query words.
-	if (qex->qwd_cnt == 0) {
-		if (qoenv->debug >= 1)  printf("  ***** Empty query\n");
-		return(0);  // ------------------------------------------------>
+static void free_parallel_blocks(query_arena_t *arena, void **blocks) {
+	int rb;
+	if (blocks == NULL) return;
+	for (rb = 0; rb <= MAX_RELAX; rb++) query_arena_free(arena, blocks[rb]);  // FRE0014
+	query_arena_free(arena, blocks);  // FRE0013
+}
+
+
+static int allocate_candidate_details(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	int slots) {
+	// The parts of candidates which only complex scoring or the classifier need are held apart
+	// from the result blocks, so that autosuggest queries, which need neither, don't allocate or
+	// touch them.  Return zero or a negative error code.
+	if (qoenv->classifier_mode) {
+		if (qex->candidate_FVsa == NULL)
+			qex->candidate_FVsa = (double **)allocate_parallel_blocks(qex->arena, FV_ELTS * sizeof(double), slots);
+		if (qex->candidate_FVsa == NULL) return -220088;  // -------------------------------->
 	}
-	return(qex->qwd_cnt);
+	else if (qoenv->scoring_needed) {
+		if (qex->candidate_detailsa == NULL)
+			qex->candidate_detailsa = (candidate_details_t **)allocate_parallel_blocks(qex->arena, sizeof(candidate_details_t), slots);
+		if (qex->candidate_detailsa == NULL) return -220088;  // -------------------------------->
+	}
+	return 0;
 }
 
 
+static int allocate_candidate_blocks(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+	index_environment_t *ixenv) {
+	// Allocate the result blocks in which candidates are recorded for rerank_and_record() or
+	// classifier(), unless that was done for an earlier variant of this multi-query.  They aren't
+	// needed by queries which single_term_search() can answer, so they're not allocated by
+	// load_book_keeping_for_one_query().  Return zero or a negative error code.
+	int rl, rbn = MAX_RELAX + 1, slots;
+
+	// Each index segment searched may contribute up to max_candidates_to_consider
+	// candidates to each result block.  See process_query()
+	slots = qoenv->max_candidates_to_consider;
+	if (!qoenv->classifier_mode) slots *= ixenv->num_segments;
+
+	if (qex->candidatesa != NULL) return allocate_candidate_details(qoenv, qex, slots);  // -------------------------------->
+
+	qex->candidatesa = (candidate_t **)query_arena_alloc(qex->arena, sizeof(candidate_t *) * rbn);  // MAL0009
+	if (qex->candidatesa == NULL) {
+		if (qoenv->debug >= 1)
+			fprintf(qoenv->query_output, "Warning: Malloc failure (qex->candidatesa) in allocate_candidate_blocks()\n");
+		return -220042;  // ----------------------------------------------------------->
+	}
+
+	memset(qex->candidatesa, 0, sizeof(candidate_t *) * rbn);  // Zero all the result blocks
+
+	qex->rank_only_countsa = (byte **)query_arena_alloc(qex->arena, sizeof(byte *) * rbn);   // MAL0012
+
+	if (qex->rank_only_countsa == NULL) {
+		query_arena_free(qex->arena, qex->candidatesa);    // FRE0009
+		qex->candidatesa = NULL;
+		if (qoenv->debug >= 1)
+			fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa) in allocate_candidate_blocks()\n");
+		return -220043;  // ----------------------------------------------------------->
+	}
+
+	for (rl = 0; rl < rbn; rl++) {
+		if (0) printf("Mallocing for result block %d (%d elements)\n", rl, slots);
+		qex->candidatesa[rl] = (candidate_t *)query_arena_alloc(qex->arena, sizeof(candidate_t) * slots);  // MAL0010
+		if (qex->candidatesa[rl] == NULL) {
+			int fi;
+			for (fi = 0; fi < rl; fi++) query_arena_free(qex->arena, qex->candidatesa[fi]);
+			query_arena_free(qex->arena, qex->candidatesa);    // FRE0009
+			qex->candidatesa = NULL;
+			query_arena_free(qex->arena, qex->rank_only_countsa);
+			qex->rank_only_countsa = NULL;
+			if (qoenv->debug >= 1)
+				fprintf(qoenv->query_output,
+					"Warning: Malloc failure (candidatesa[%d]) in allocate_candidate_blocks()\n", rl);
+			return -220044;  // ----------------------------------------------------------->
+		}
+		memset(qex->candidatesa[rl], 0, sizeof(candidate_t) * slots);
+
+		qex->rank_only_countsa[rl] = (byte *)query_arena_alloc(qex->arena, sizeof(byte) * slots);  // MAL0011
+		if (qex->rank_only_countsa[rl] == NULL) {
+			fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa[%d]) in allocate_candidate_blocks()\n", rl);
+			int fi;
+			for (fi = 0; fi < rbn; fi++) query_arena_free(qex->arena, qex->candidatesa[fi]);  // All of them were allocated.
+			for (fi = 0; fi < rl; fi++) query_arena_free(qex->arena, qex->rank_only_countsa[fi]);
+			query_arena_free(qex->arena, qex->candidatesa);    // FRE0009
+			qex->candidatesa = NULL;
+			query_arena_free(qex->arena, qex->rank_only_countsa);
+			qex->rank_only_countsa = NULL;
+			if (qoenv->debug >= 1)
+				fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa[%d]) in allocate_candidate_blocks()\n", rl);
+			return -220045;  // ----------------------------------------------------------->
+		}
+		memset(qex->rank_only_countsa[rl], 0, sizeof(byte) * slots);
+	}
+	return allocate_candidate_details(qoenv, qex, slots);
+}
+
 
 static int process_query(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
-	byte *doctable, byte *vocab, byte *index, byte *forward, size_t vsz,
-	size_t fsz, double score_multiplier) {
+	index_environment_t *ixenv, double score_multiplier) {
 	//  -------- This is called once per query variant (in a multi_query_string) --------------------
 	// Processes the query so far typed by a user (represented by qtext)
 	//  - breaks the query into an array of words (assuming whitespace separation)
-	//  - calls saat_setup() to setup the data structures to control saat 
-	//    (Query-document At A Time) processing.
-	//  - calls saat_relaxed_and to generate a filtered list of up to 
-	//    max_candidates_to_consider candidates
-	//  - calls rerank_and_record to record up to max_to_show ranked suggestions.
+	//  - answers a query of a single plain word with single_term_search() if it can.  Otherwise:
+	//  - for each index segment (the base, any other shards, then any deltas), possibly
+	//    in parallel (see search_segments_in_parallel()):
+	//     - calls saat_setup() to setup the data structures to control saat 
+	//       (Query-document At A Time) processing.
+	//     - calls saat_relaxed_and to generate a filtered list of up to 
+	//       max_candidates_to_consider candidates
+	//  - calls rerank_and_record to record up to max_to_show ranked suggestions from
+	//    the candidates of all the segments together.
+	//
+	// In classifier modes only the base segment is searched.
 	//  
 	//  Returns zero on success and a negative error cqde (see error_explanations.cpp) otherwise.
 
-	int terms_not_present = 0, error_code = 0;
-	double penalty_multiplier_for_partial_matches = 0.1;
-	saat_control_t *plists;
+	int error_code = 0, s, segments_to_search, rslt;
+	double penalty_multiplier_for_partial_matches = PARTIAL_MATCH_PENALTY;
+	BOOL candidates_generated = FALSE;
 
 	if (qex->qwd_cnt == 0) return(-41);   // ----------------------------------------------->
 
-	qex->max_length_diff = qoenv->max_length_diff;  // For each query set it back to what the user specified
+	// qex->max_length_diff was set for this query by handle_one_query(), possibly lowered in classifier modes.
 	if (qex->max_length_diff >= 100 && qex->max_length_diff < 1000) {
 		int length_cutoff = qex->max_length_diff / 100;   // No length limit applies to queries longer than this.
 		int addon = qex->max_length_diff % 100;
@@ -2763,45 +4136,64 @@ static int process_query(query_processing_environment_t *qoenv, book_keeping_for
 
 
 
-	plists = saat_setup(qoenv, qex, &terms_not_present, &error_code);
-
-	if (error_code < 0) {
-		// An error return from saat_setup()
+	if (single_term_fast_path_usable(qoenv, qex, ixenv, score_multiplier)) {
+		if (qoenv->x_use_head_answers && qex->cg_qterms[0][0] == '>'
+			&& head_answers_search(qoenv, qex, ixenv, score_multiplier)) {
+			if (qoenv->debug >= 1) printf("process_query() --> tl_returned = %d (head answers)\n", qex->tl_returned);
+			return(error_code);   // ------------------------------------------------>
+		}
+		rslt = single_term_search(qoenv, qex, ixenv, score_multiplier, &error_code);
+		if (rslt < 0) return(rslt);   // ------------------------------------------------>
+		if (qoenv->debug >= 1) printf("process_query() --> tl_returned = %d (single-term fast path)\n", qex->tl_returned);
 		return(error_code);   // ------------------------------------------------>
 	}
-	if (qoenv->debug >= 1 && terms_not_present) {
-		fprintf(qoenv->query_output, "%d word(s) in this %d-word query never occurred.\n",
-			terms_not_present, qex->qwd_cnt);
-	}
-
 
-	if (terms_not_present <= qoenv->relaxation_level) {
-		qex->q_signature = calculate_signature_from_first_letters_of_partials(qex->partials,
-			qex->partial_cnt,
-			DTE_BLOOM_BITS,
-			&error_code);
-		if (error_code < -200000) return(error_code);   // -------------------------------------------------->
-		if (qoenv->debug >= 2)
-			fprintf(qoenv->query_output, "Query signature = %llx. (bits = %d)\n",
-				qex->q_signature, DTE_BLOOM_BITS);
+	if (!qoenv->report_match_counts_only) {
+		rslt = allocate_candidate_blocks(qoenv, qex, ixenv);
+		if (rslt < 0) return(rslt);   // ------------------------------------------------>
+	}
+
+	// Early termination depends on knowing how rerank_and_record() will score candidates.  Rank-only
+	// terms and a non-positive multiplier for this variant would upset the bounds.
+	qex->early_termination = qoenv->early_termination && qoenv->classifier_mode == 0
+		&& !qoenv->report_match_counts_only && qex->rank_only_cnt == 0 && score_multiplier > 0.0;
+
+	segments_to_search = ixenv->num_segments;
+	qex->impact_engine = saat_impact_usable(qoenv, qex, ixenv, segments_to_search);
+	if (qex->impact_engine && qex->qtc != NULL) {
+		// Set up the thread's workspaces before any parallel searches, which each use the one for their segment.
+		if (qex->qtc->impact_workspaces == NULL) {
+			qex->qtc->impact_workspaces = (impact_workspace_t **)calloc(ixenv->num_segments, sizeof(impact_workspace_t *));  // MAL1134
+			if (qex->qtc->impact_workspaces != NULL) qex->qtc->num_impact_workspaces = ixenv->num_segments;
+		}
+		qex->impact_workspaces = qex->qtc->impact_workspaces;
+	}
+	// In classifier modes, all the segments add to the same lists of best candidates, in
+	// possibly_store_in_order(), so they're searched one after another.
+	if (segments_to_search > 1 && qoenv->segment_threads > 1 && qoenv->classifier_mode == 0) {
+		rslt = search_segments_in_parallel(qoenv, qex, ixenv, segments_to_search, &candidates_generated, &error_code);
+		if (rslt < 0) return(rslt);   // ------------------------------------------------>
+	}
+	else {
+		for (s = 0; s < segments_to_search; s++) {
+			// Each segment may record up to max_candidates_to_consider candidates in each result block
+			memcpy(qex->segment_base, qex->candidates_recorded, (MAX_RELAX + 1) * sizeof(int));
+			rslt = search_one_segment(qoenv, qex, ixenv->segments[s], s, &error_code);
+			if (rslt < 0) return(rslt);   // ------------------------------------------------>
+			if (rslt > 0) candidates_generated = TRUE;
+		}
+	}
 
-		// NOTE: The following calls saat_relaxed_and() in all cases.  This makes sense for code simplicity
-		//       and because the old saat_and() achieved only half the throughput because its algorithms
-		//       for choosing candidates and advancing had not been optimized in the way the relaxed
-		//       version have been.
-		saat_relaxed_and(qoenv->query_output, qoenv, qex, plists, forward,
-			index, doctable, fsz, &error_code);
-		if (error_code < -200000) return(error_code);
 
+	if (candidates_generated) {
 		if (qoenv->report_match_counts_only) {
 			// Special behaviour triggered by max_to_show == 0
-			free_querytree_memory(&plists, qex->tl_saat_blocks_allocated);
 			return 0;   // ---------------------------------------------------------->
 		}
 
 		if (qoenv->classifier_mode > 0) {
 			// ---- we're classifying ----
-			classifier(qoenv, qex, forward, doctable, fsz, score_multiplier);
+			classifier(qoenv, qex, ixenv, score_multiplier);
 			// The results of classifier() are returned in the following elements of qex:
 			//  docnum_t *tl_docids;    - The docid of each result
 			//  u_char **tl_suggestions; - Copies of the relevant document text in malloced memory
@@ -2812,7 +4204,7 @@ static int process_query(query_processing_environment_t *qoenv, book_keeping_for
 		else {
 			// ---- normal operations ----
 
-			rerank_and_record(qoenv, qex, forward, doctable, fsz, score_multiplier,
+			rerank_and_record(qoenv, qex, ixenv, score_multiplier,
 				penalty_multiplier_for_partial_matches);
 			// The results of rerank_and_record() are returned in the following elements of qex:
 			//  docnum_t *tl_docids;    - The docid of each result
@@ -2825,8 +4217,6 @@ static int process_query(query_processing_environment_t *qoenv, book_keeping_for
 		if (qoenv->debug >= 1) printf("process_query() --> tl_returned = %d\n", qex->tl_returned);
 	}
 
-
-	free_querytree_memory(&plists, qex->tl_saat_blocks_allocated);
 	if (qoenv->debug >= 1) {
 		fprintf(qoenv->query_output, "  Everything is beautiful, in it's own way ...\n");
 	}
@@ -2834,13 +4224,13 @@ static int process_query(query_processing_environment_t *qoenv, book_keeping_for
 }
 
 
-static void analyze_response_times(query_processing_environment_t *qoenv) {
+static void analyze_response_times(query_processing_environment_t *qoenv, query_thread_context_t *totals) {
 	// Analyse the response times accumulated in histo and report
 	// median, 90, 95 and 99 th percentiles
 	int h, median = -1, rt90 = -1, rt95 = -1, rt99 = -1, rt999 = -1;
-	double total = (double)qoenv->queries_run, cumulator = 0.0;
+	double total = (double)totals->queries_run, cumulator = 0.0;
 	for (h = 0; h < ELAPSED_MSEC_BUCKETS; h++) {
-		cumulator += qoenv->elapsed_msec_histo[h];
+		cumulator += totals->elapsed_msec_histo[h];
 		if (cumulator >= 0.5 * total) {
 			if (median < 0) median = h;  // -1 means undefined
 			if (cumulator >= 0.9 * total) {
@@ -2983,7 +4373,7 @@ static u_char *check_if_header(index_environment_t *ixenv, query_processing_envi
 		while (*p && *p != ' ') p++;
 		index_format_d = strtod((char *)p, NULL);
 
-		if (strcmp((char *)value, INDEX_FORMAT)) {
+		if (strcmp((char *)value, INDEX_FORMAT) && strcmp((char *)value, INDEX_FORMAT_BLOCKED)) {
 			if (verbose) printf("\nWarning: %s indexes are not in current (%s) format; They are in (%s).\n", index_label, INDEX_FORMAT, value);
 			*error_code = -26;
 
@@ -2995,6 +4385,8 @@ static u_char *check_if_header(index_environment_t *ixenv, query_processing_envi
 		}
 
 		ixenv->index_format_d = index_format_d;
+		// The format determines how saat_setup() reads postings lists.
+		ixenv->blocked_postings = !strcmp((char *)value, INDEX_FORMAT_BLOCKED);
 		free(value);
 
 		// version will be returned as the result of this function.
@@ -3075,7 +4467,9 @@ static u_char *check_if_header(index_environment_t *ixenv, query_processing_envi
 			free(value);
 			value = get_value_from_header_line(line, (u_char *)"Number of documents:", &line);
 			if (value != NULL) {
-				qoenv->N = (double)strtoll((char *)value, NULL, 10);
+				ixenv->N = (double)strtoll((char *)value, NULL, 10);
+				ixenv->tot_postings = tot_postings;
+				qoenv->N = ixenv->N;
 				qoenv->avdoclen = tot_postings / qoenv->N;
 			}
 			free(value);
@@ -3091,6 +4485,9 @@ static u_char *check_if_header(index_environment_t *ixenv, query_processing_envi
 				else if (verbose) printf("Left expect_cp1252 at TRUE\n");
 			}
 
+			// Early termination relies on docnums being in descending static score order.
+			ixenv->score_ordered = (strstr((char *)if_in_memory, "\nsort_records_by_weight=TRUE") != NULL);
+
 
 
 
@@ -3107,16 +4504,39 @@ static u_char *check_if_header(index_environment_t *ixenv, query_processing_envi
 	return(version);
 }
 
+static void load_rules_files(query_processing_environment_t *qoenv, u_char *index_stem, size_t stemlen,
+	int *error_code) {
+	// Load the substitution and segment rules, if they're needed, from <index_stem>.substitution_rules
+	// and <index_stem>.segment_rules.  index_stem has room to append up to 29 characters.
+	u_char *suffix = index_stem + stemlen;
+
+	if (qoenv->use_substitutions) {
+		strcpy((char *)suffix, ".substitution_rules");
+		load_substitution_rules(index_stem, &qoenv->substitutions_hash, qoenv->debug, -220082, error_code);
+	}
+	if (*error_code < 0) return;  // -------------------------------->
+
+	if (qoenv->classifier_mode != 0) {
+		strcpy((char *)suffix, ".segment_rules");
+		if (0) printf("Attempting to load segment rules from index_dir\n");
+		load_substitution_rules(index_stem, &(qoenv->segment_rules_hash), qoenv->debug, -220081, error_code);
+	}
+}
+
+
 static u_char *open_and_check_index_set(query_processing_environment_t *qoenv,
 	index_environment_t *ixenv,
 	u_char *index_stem, size_t stemlen,
-	BOOL verbose, BOOL run_tests,
+	BOOL verbose, BOOL run_tests, BOOL is_delta,
 	int *error_code) {
 	// This version of the function is used in Case 1, where an index_dir is specified. index_stem
 	// comprises <index_dir>/QBASH, and has room to append up to 29 characters.
 	// Open all four QBASH index files and read them into memory.  Return pointers to the
 	// memory blocks and the sizes.
 	// Stem is usually "QBASH".
+	// For a shard or a delta segment, index_stem is <index_dir>/shard<n>/QBASH or
+	// <index_dir>/delta<n>/QBASH, and is_delta is TRUE so that the substitution and segment rules
+	// are not loaded.  Those in index_dir apply.
 	u_char *fname = index_stem, *suffix, *other_token_breakers = NULL, *version, unknown[] = "<unknown>";
 
 	suffix = index_stem + stemlen;
@@ -3129,26 +4549,29 @@ static u_char *open_and_check_index_set(query_processing_environment_t *qoenv,
 	ixenv->index = (byte *)mmap_all_of(fname, &(ixenv->isz), verbose, &(ixenv->index_H),
 		&(ixenv->index_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
+	load_skips(ixenv, fname, verbose);
+	load_head_answers(ixenv, fname, verbose);
 	strcpy((char *)suffix, ".vocab");
 	ixenv->vocab = (byte *)mmap_all_of(fname, &(ixenv->vsz), verbose, &(ixenv->vocab_H),
 		&(ixenv->vocab_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
+	load_vocab_hash(ixenv, fname, verbose);
 	strcpy((char *)suffix, ".doctable");
 	ixenv->doctable = (byte *)mmap_all_of(fname, &ixenv->dsz, verbose, &ixenv->doctable_H,
 		&(ixenv->doctable_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
-
-	if (qoenv->use_substitutions) {
-		strcpy((char *)suffix, ".substitution_rules");
-		load_substitution_rules(fname, &qoenv->substitutions_hash, qoenv->debug, -220082, error_code);
-	}
-	if (*error_code < 0) return NULL;  // -------------------------------->
-
-	if (qoenv->classifier_mode != 0) {
-		strcpy((char *)suffix, ".segment_rules");
-		if (0) printf("Attempting to load segment rules from index_dir\n");
-		load_substitution_rules(fname, &(qoenv->segment_rules_hash), qoenv->debug, -220081, error_code);
-	}
+	strcpy((char *)suffix, TS_SUFFIX);
+	load_tombstones(ixenv, fname, verbose);
+	strcpy((char *)suffix, BL_SUFFIX);
+	load_blooms(ixenv, fname, verbose);
+	strcpy((char *)suffix, NF_SUFFIX);
+	load_normforward(ixenv, fname, verbose);
+	if (qoenv->use_impact_engine) {
+		strcpy((char *)suffix, IM_SUFFIX);
+		load_impacts(ixenv, fname, verbose);
+	}
+
+	if (!is_delta) load_rules_files(qoenv, index_stem, stemlen, error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
 
 	version = check_if_header(ixenv, qoenv, &other_token_breakers, index_stem, error_code);
@@ -3170,6 +4593,8 @@ static u_char *open_and_check_index_set(query_processing_environment_t *qoenv,
 		*error_code = test_doctable_n_forward(ixenv->doctable, ixenv->forward,
 			ixenv->dsz, ixenv->fsz);
 		if (*error_code < 0) return NULL;  // -------------------------------->
+		// show_postings() only understands the skip block postings format
+		if (ixenv->blocked_postings) return other_token_breakers;  // -------------------------------->
 		*error_code = test_postings_list((u_char *)"goteborgsposten", ixenv->doctable, ixenv->index, ixenv->forward, ixenv->fsz,
 			ixenv->vocab, ixenv->vsz, 10000);
 		*error_code = test_postings_list((u_char *)"se", ixenv->doctable, ixenv->index, ixenv->forward, ixenv->fsz,
@@ -3213,9 +4638,12 @@ static u_char *open_and_check_index_set_aether(query_processing_environment_t *q
 	ixenv->index = (byte *)mmap_all_of(qoenv->fname_if, &(ixenv->isz), verbose, &(ixenv->index_H),
 		&(ixenv->index_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
+	load_skips(ixenv, qoenv->fname_if, verbose);
+	load_head_answers(ixenv, qoenv->fname_if, verbose);
 	ixenv->vocab = (byte *)mmap_all_of(qoenv->fname_vocab, &(ixenv->vsz), verbose, &(ixenv->vocab_H),
 		&(ixenv->vocab_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
+	load_vocab_hash(ixenv, qoenv->fname_vocab, verbose);
 	ixenv->doctable = (byte *)mmap_all_of(qoenv->fname_doctable, &(ixenv->dsz), verbose, &(ixenv->doctable_H),
 		&(ixenv->doctable_MH), error_code);
 	if (*error_code < 0) return NULL;  // -------------------------------->
@@ -3250,6 +4678,8 @@ static u_char *open_and_check_index_set_aether(query_processing_environment_t *q
 		*error_code = test_doctable_n_forward(ixenv->doctable, ixenv->forward,
 			ixenv->dsz, ixenv->fsz);
 		if (*error_code < 0) return NULL;  // -------------------------------->
+		// show_postings() only understands the skip block postings format
+		if (ixenv->blocked_postings) return other_token_breakers;  // -------------------------------->
 		*error_code = test_postings_list((u_char *)"to", ixenv->doctable, ixenv->index, ixenv->forward, ixenv->fsz,
 			ixenv->vocab, ixenv->vsz, 100);
 		if (*error_code < 0) return NULL;  // -------------------------------->
@@ -3288,18 +4718,24 @@ static byte touch_all_pages(byte *mem, size_t memsz) {
 
 int warmup_indexes(query_processing_environment_t *qoenv, index_environment_t *ixenv) {
 	byte b;
+	int s;
+	index_environment_t *segment;
 
 	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "\nWarming up ...\n");
-	// Do the .forwards first. 
-	b = touch_all_pages(ixenv->forward, ixenv->fsz);
-	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .forward: %X\n", b);
+	for (s = 0; s < ixenv->num_segments; s++) {
+		segment = ixenv->segments[s];
+		if (qoenv->debug >= 1 && s > 0) fprintf(qoenv->query_output, "  Delta segment %d\n", s);
+		// Do the .forwards first. 
+		b = touch_all_pages(segment->forward, segment->fsz);
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .forward: %X\n", b);
 
-	b = touch_all_pages((byte *)ixenv->doctable, ixenv->dsz);
-	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .doctable: %X\n", b);
-	b = touch_all_pages(ixenv->vocab, ixenv->vsz);
-	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .vocab: %X\n", b);
-	b = touch_all_pages(ixenv->index, ixenv->isz);
-	if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .if: %X\n", b);
+		b = touch_all_pages((byte *)segment->doctable, segment->dsz);
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .doctable: %X\n", b);
+		b = touch_all_pages(segment->vocab, segment->vsz);
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .vocab: %X\n", b);
+		b = touch_all_pages(segment->index, segment->isz);
+		if (qoenv->debug >= 1) fprintf(qoenv->query_output, "   .if: %X\n", b);
+	}
 
 
 	return 0;
@@ -3307,14 +4743,15 @@ int warmup_indexes(query_processing_environment_t *qoenv, index_environment_t *i
 
 
 static book_keeping_for_one_query_t *load_book_keeping_for_one_query(query_processing_environment_t *qoenv,
-	int *error_code) {
+	index_environment_t *ixenv, query_arena_t *arena, int *error_code) {
 	book_keeping_for_one_query_t *qex;
-	int t, rl, rbn = MAX_RELAX + 1;
+	int t;
 
-	// Called once per multi-query
+	// Called once per multi-query.  qex, and the per-query storage hung off it, is allocated
+	// from arena, or malloced if arena is NULL.
 
 	*error_code = 0;
-	qex = (book_keeping_for_one_query_t *)malloc(sizeof(book_keeping_for_one_query_t));
+	qex = (book_keeping_for_one_query_t *)query_arena_alloc(arena, sizeof(book_keeping_for_one_query_t));
 	if (qex == NULL) {
 		if (qoenv->debug >= 1)
 			fprintf(qoenv->query_output, "Warning: malloc of book_keeping structure failed.  This query will be ignored.\n");
@@ -3322,28 +4759,34 @@ static book_keeping_for_one_query_t *load_book_keeping_for_one_query(query_proce
 		return NULL;
 	}
 
-	// Embarrassingly the +1 below is because of a memory overwriting problem observed
+	// Note that max_candidates_to_consider is now settled by finalize_query_processing_environment().
+	// Embarrassingly the +1 there is because of a memory overwriting problem observed
 	// in classifier mode with some query sets and some indexes. ("Random" SEGFAULTs,
 	// loops etc.)  I've been unable to track down the cause so far.
-	// In classifier mode, max_candidates must be at least max_to_show,
-	// and there's no point in it being much bigger.
-	if (qoenv->classifier_mode || qoenv->max_candidates_to_consider == IUNDEF)
-		qoenv->max_candidates_to_consider = qoenv->max_to_show + 1;
 
 
+	qex->arena = arena;
 	qex->query = NULL;
 	for (t = 0; t < MAX_WDS_IN_QUERY; t++) {
 		qex->qterms[t] = NULL;
 		qex->partials[t] = NULL;
 	}
 	qex->qwd_cnt = 0;
+	qex->qterm_ids_segment = NULL;
+	qex->qterms_all_words = TRUE;
 	qex->partial_cnt = 0;
 	qex->rank_only_cnt = 0;
 	qex->tl_suggestions = NULL;
 	qex->tl_docids = NULL;
 	qex->tl_scores = NULL;
 	qex->tl_returned = 0;
+	qex->shown_fingerprints = NULL;
+	qex->shown_fingerprint_capacity = 0;
+	qex->shown_fingerprint_count = 0;
 	qex->timed_out = FALSE;
+	qex->early_termination = FALSE;
+	qex->impact_engine = FALSE;
+	qex->impact_workspaces = NULL;
 	qex->vertical_intent_signaled = FALSE;
 	qex->segment_intent_multiplier = 1.0;
 	qex->query_contains_operators = FALSE;
@@ -3352,67 +4795,14 @@ static book_keeping_for_one_query_t *load_book_keeping_for_one_query(query_proce
 	qex->start_time = what_time_is_it();
 
 	memset(qex->candidates_recorded, 0, (MAX_RELAX + 1) * sizeof(int));
-
-	qex->candidatesa = NULL;
-	if (!qoenv->report_match_counts_only) {
-		// Only allocate memory if we're going to use it
-		qex->candidatesa = (candidate_t **)malloc(sizeof(candidate_t *) * rbn);  // MAL0009
-		if (qex->candidatesa == NULL) {
-			if (qoenv->debug >= 1)
-				fprintf(qoenv->query_output, "Warning: Malloc failure (qex->candidatesa) in load_book_keeping...()\n");
-			*error_code = -220042;
-			return NULL;  // ----------------------------------------------------------->
-		}
-
-		memset(qex->candidatesa, 0, sizeof(candidate_t *) * rbn);  // Zero all the result blocks
-
-		qex->rank_only_countsa = (byte **)malloc(sizeof(byte *) * rbn);   // MAL0012
-
-		if (qex->rank_only_countsa == NULL) {
-			free(qex->candidatesa);    // FRE0009
-			qex->candidatesa = NULL;
-			if (qoenv->debug >= 1)
-				fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa) in load_book_keeping...()\n");
-			*error_code = -220043;
-			return NULL;  // ----------------------------------------------------------->
-		}
-
-		for (rl = 0; rl < rbn; rl++) {
-			if (0) printf("Mallocing for result block %d (%d elements)\n", rl, qoenv->max_candidates_to_consider);
-			qex->candidatesa[rl] = (candidate_t *)malloc(sizeof(candidate_t) * qoenv->max_candidates_to_consider);  // MAL0010
-			if (qex->candidatesa[rl] == NULL) {
-				int fi;
-				for (fi = 0; fi < rl; fi++) free(qex->candidatesa[fi]);
-				free(qex->candidatesa);    // FRE0009
-				qex->candidatesa = NULL;
-				free(qex->rank_only_countsa);
-				qex->rank_only_countsa = NULL;
-				if (qoenv->debug >= 1)
-					fprintf(qoenv->query_output,
-						"Warning: Malloc failure (candidatesa[%d]) in load_book_keeping...()\n", rl);
-				*error_code = -220044;
-				return NULL;  // ----------------------------------------------------------->
-			}
-			memset(qex->candidatesa[rl], 0, sizeof(candidate_t) * qoenv->max_candidates_to_consider);
-
-			qex->rank_only_countsa[rl] = (byte *)malloc(sizeof(byte) * qoenv->max_candidates_to_consider);  // MAL0011
-			if (qex->rank_only_countsa[rl] == NULL) {
-				fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa[%d]) in load_book_keeping...()\n", rl);
-				int fi;
-				for (fi = 0; fi < rbn; fi++) free(qex->candidatesa[fi]);  // All of them were allocated.
-				for (fi = 0; fi < rl; fi++) free(qex->rank_only_countsa[fi]);
-				free(qex->candidatesa);    // FRE0009
-				qex->candidatesa = NULL;
-				free(qex->rank_only_countsa);
-				qex->rank_only_countsa = NULL;
-				if (qoenv->debug >= 1)
-					fprintf(qoenv->query_output, "Warning: Malloc failure (rank_only_countsa[%d]) in load_book_keeping...()\n", rl);
-				*error_code = -220045;
-				return NULL;  // ----------------------------------------------------------->
-			}
-			memset(qex->rank_only_countsa[rl], 0, sizeof(byte) * qoenv->max_candidates_to_consider);
-		}
-	}
+	memset(qex->segment_base, 0, (MAX_RELAX + 1) * sizeof(int));
+	qex->segment_ixenv = ixenv;
+	qex->segment = 0;
+
+	qex->candidatesa = NULL;   // Allocated when first needed.  See allocate_candidate_blocks()
+	qex->candidate_detailsa = NULL;
+	qex->candidate_FVsa = NULL;
+	qex->rank_only_countsa = NULL;
 	return qex;
 }
 
@@ -3420,31 +4810,37 @@ static book_keeping_for_one_query_t *load_book_keeping_for_one_query(query_proce
 
 static void unload_book_keeping_for_one_query(book_keeping_for_one_query_t **qexp) {
 	book_keeping_for_one_query_t *qex = *qexp;
+	query_arena_t *arena;
 	int rb;
 	// Called once per multi-query.
 	if (qex == NULL) return;
+	arena = qex->arena;
 	// Don't free qterms or partials because they are pointers to storage within qex, not
 	// to malloced memory.
-	if (qex->tl_docids != NULL) free(qex->tl_docids);            // FRE2005
-	if (qex->tl_scores != NULL) free(qex->tl_scores);            // FRE2004
-	if (qex->tl_suggestions != NULL) free(qex->tl_suggestions);       // FRE2003
+	if (qex->tl_docids != NULL) query_arena_free(arena, qex->tl_docids);            // FRE2005
+	if (qex->tl_scores != NULL) query_arena_free(arena, qex->tl_scores);            // FRE2004
+	if (qex->tl_suggestions != NULL) query_arena_free(arena, qex->tl_suggestions);       // FRE2003
+	if (qex->shown_fingerprints != NULL) query_arena_free(arena, qex->shown_fingerprints);  // FRE2007
 
 	if (qex->candidatesa != NULL) {
 		for (rb = 0; rb <= MAX_RELAX; rb++) {
-			if (qex->candidatesa[rb] != NULL) free(qex->candidatesa[rb]);
+			if (qex->candidatesa[rb] != NULL) query_arena_free(arena, qex->candidatesa[rb]);
 		}
-		free(qex->candidatesa);
+		query_arena_free(arena, qex->candidatesa);
 	}
 
 	if (qex->candidatesa != NULL) {
 		for (rb = 0; rb <= MAX_RELAX; rb++) {
-			if (qex->rank_only_countsa[rb] != NULL) free(qex->rank_only_countsa[rb]);
+			if (qex->rank_only_countsa[rb] != NULL) query_arena_free(arena, qex->rank_only_countsa[rb]);
 		}
 
-		free(qex->rank_only_countsa);
+		query_arena_free(arena, qex->rank_only_countsa);
 	}
 
-	free(qex);
+	free_parallel_blocks(arena, (void **)qex->candidate_detailsa);
+	free_parallel_blocks(arena, (void **)qex->candidate_FVsa);
+
+	query_arena_free(arena, qex);
 	*qexp = NULL;
 }
 
@@ -3453,7 +4849,7 @@ int test_postings_list(u_char *word, byte *doctable, byte *index, byte *forward,
 	byte *vocab, size_t vsz, int max_to_show) {
 	byte *dicent;
 	int ec = 0, verbose = 1;
-	dicent = lookup_word(word, vocab, vsz, 0);
+	dicent = binary_search_vocab(word, vocab, vsz);
 	if (dicent == NULL) {
 		if (verbose) printf("Test_postings_list: Word '%s' not found in vocab\n", word);
 		return(0);  // Not fatal because the test words are in English but the index may not be. --------------->
@@ -3479,27 +4875,75 @@ void print_qbasher_version(FILE *f) {
 
 
 
+static void derive_settings_for_queries(query_processing_environment_t *qoenv, index_environment_t *ixenv) {
+	// Work out the settings which depend upon the options and the index.  This is done once
+	// for the global environment when the indexes are loaded, and again for each query whose
+	// options are overridden.  (Until 1.5.142 it was done at the start of every query, which
+	// meant writing to an environment which may be shared by several query threads.)
+
+	if (qoenv->ixenv == NULL) qoenv->ixenv = ixenv;  // Just make sure we can access indexes through qoenv
+
+	if (qoenv->max_to_show == 0) {
+		// Special mode to report match counts without returning any actual results
+		qoenv->report_match_counts_only = TRUE;
+		qoenv->max_candidates_to_consider = A_BILLION_AND_ONE;
+		if (0) printf("# Entering special result counting mode with max_candidates = %d\n",
+			qoenv->max_candidates_to_consider);
+	}
+
+	if (qoenv->relaxation_level != 0) {
+		// In these special modes, deactivate features only useful in AutoSuggest experiments
+		// These are no longer important because of the development of RevIdx.
+		qoenv->auto_partials = FALSE;
+		qoenv->auto_line_prefix = FALSE;
+	}
+
+	if (qoenv->classifier_mode) qoenv->auto_partials = FALSE;
+
+	// Can only do line_prefixing with an appropriate index.
+	if (ixenv->other_token_breakers == NULL
+		|| strstr((char *)ixenv->other_token_breakers, "<=??") == NULL) qoenv->auto_line_prefix = FALSE;
+
+	// Check whether we need to score candidates
+	qoenv->scoring_needed = normalise(qoenv->rr_coeffs, NUM_COEFFS);
+	normalise(qoenv->cf_coeffs, NUM_CF_COEFFS);
+}
+
+
+static void discard_override_qoenv(query_processing_environment_t **local_qenvp) {
+	// Free a copy of a query processing environment made by handle_one_query() to apply
+	// per-query options.  Most of its strings and hashes belong to the environment it was
+	// copied from and must not be freed.
+	query_processing_environment_t *local_qenv = *local_qenvp;
+	if (local_qenv == NULL) return;
+	if (local_qenv->vptra != NULL) {
+		free_overridable_option_strings(local_qenv);
+		free(local_qenv->vptra);
+	}
+	free(local_qenv);  // FRE1953
+	*local_qenvp = NULL;
+}
+
+
 static int handle_one_query(index_environment_t *ixenv, query_processing_environment_t *qoenv,
 	book_keeping_for_one_query_t *qex, u_char *query_string, u_char *options_string,
 	double score_multiplier, u_char **returned_results, double *corresponding_scores,
 	double vweight, BOOL *timed_out) {
 
-	//  --- this is called once per query variant  -- NO LONGER SUPPORTS SHARDS ----
+	//  --- this is called once per query variant  ----
 	//  --- No longer called directly, only through handle_multi_query()
 	//
 	// Returns the number of results found, or a negative error code.
 	//
 	// The steps in this function:
-	//  1. Optional option overriding
-	//  2. If applicable, set up for result-count-only mode
-	//  3. Set number of candidates to consider and, in classifier mode, thoroughly clean the query string
-	//  4. Special settings for relaxation and special matching modes
-	//  5. Disable line_prefixing if index doesn't include line prefix words
+	//  1. Optional option overriding, into the calling thread's scratch copy of qoenv
+	//  2-5,9. If options were overridden, re-derive the settings which depend on them
+	//         (see derive_settings_for_queries())
+	//  3. In classifier mode, thoroughly clean the query string
 	//  6. Query pre-processing
 	//  7. Loading query book-keeping
 	//  8. Setting up for deterministic time-out counting
 	//  ----------------------------------------------------------------------
-	//  9. Check whether we need to score candidates and normalise coefficients
 	//  10. Process query text and exit on empty query or error
 	//  11. In classifier modes, validate settings and bail out if answer can't be yes.
 	//  --> HMQ 12. Allocate memory and deal with failures unless we want result_counts only
@@ -3514,6 +4958,7 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 
 	int error_code = 0, words_in_query = 0;
 	query_processing_environment_t *local_qenv = NULL;
+	BOOL unload_local_qenv = FALSE;
 
 	if (re_match((u_char *)EASTER_EGG_PATTERN, query_string,
 		PCRE2_CASELESS, qoenv->debug)) {
@@ -3524,7 +4969,7 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 		//  double *tl_scores;    - Scores associated with the each result
 		//  int tl_returned;  - A count of the number or results returned.
 		qex->tl_docids[0] = 1;
-		qex->tl_suggestions[0] = malloc(1000);
+		qex->tl_suggestions[0] = query_arena_alloc(qex->arena, 1000);
 		sprintf((char *)qex->tl_suggestions[0], "Easter-Egg: %s%s - %.0f documents",
 			INDEX_FORMAT, QBASHER_VERSION, qoenv->N);
 		qex->tl_scores[0] = 0.00001;  // Very low so downstream processors can flick it
@@ -3547,7 +4992,23 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 			printf("Options string received in handle_one_query: %s\n", options_string);
 			fflush(stdout);
 		}
-		local_qenv = (query_processing_environment_t *)malloc(sizeof(query_processing_environment_t));  // MAL1953
+		if (qex->qtc != NULL && qex->qtc->override_qoenv != NULL) {
+			// Reuse this thread's scratch copy rather than malloc-ing a new one for every query.
+			local_qenv = qex->qtc->override_qoenv;
+		}
+		else {
+			local_qenv = (query_processing_environment_t *)malloc(sizeof(query_processing_environment_t));  // MAL1953
+			if (local_qenv != NULL) {
+				memset(local_qenv, 0, sizeof(query_processing_environment_t));
+				error_code = initialize_qoenv_mappings(local_qenv);  // Must set up the option mappings vector.
+				if (error_code < -200000) {
+					free(local_qenv);  // FRE1953
+					return(error_code);  // Fatal ------------------------------------>
+				}
+				if (qex->qtc != NULL) qex->qtc->override_qoenv = local_qenv;  // Freed by unload_query_processing_environment()
+				else unload_local_qenv = TRUE;
+			}
+		}
 		if (local_qenv == NULL) {
 			if (qoenv->debug >= 1) fprintf(qoenv->query_output, "Warning: Malloc failed in handle_one_query().  Ignore local options and go global\n");
 			local_qenv = qoenv;
@@ -3555,12 +5016,14 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 		}
 		else {
 			u_char *p, *q, saveq;
-			memcpy(local_qenv, qoenv, sizeof(query_processing_environment_t));
-			error_code = initialize_qoenv_mappings(local_qenv);  // Must set up the option mappings vector.
-			if (error_code < -200000) {
-				if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
-				return(error_code);  // Fatal ------------------------------------>
-			}
+			void **vptra = local_qenv->vptra;
+			// Start from the global settings.  The copy is shallow:  Apart from the strings which may be
+			// overridden, strings and hashes are still owned by qoenv.  Its own vptra must be kept, though.
+			free_overridable_option_strings(local_qenv);  // Left over from the previous use, if any
+			*local_qenv = *qoenv;
+			local_qenv->vptra = vptra;
+			local_qenv->thread_contexts = NULL;
+			own_overridable_option_strings(local_qenv);
 			p = options_string;
 			while (*p == '-') p++;  // skip leading hyphens
 			while (*p) {
@@ -3574,7 +5037,7 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 						if (0) printf("Assigning '%s'\n", p);
 						error_code = assign_one_arg(local_qenv, p, FALSE, TRUE, FALSE);  // Not initialising, Enforce limits, don't explain
 						if (error_code < -200000) {
-							if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
+							if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 							return(error_code);   // Fatal ------------------------------------>
 						}
 						*q = saveq;  // Put back what was disturbed
@@ -3591,17 +5054,9 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 		}  //  end of else branch in which local_qenv is created
 	}
 
-	// The following all happens whether options have been overwridden or not.
-
-	if (local_qenv->ixenv == NULL) local_qenv->ixenv = ixenv;  // Just make sure we can access indexes through qoenv
-
-	if (local_qenv->max_to_show == 0) {
-		// Special mode to report match counts without returning any actual results
-		local_qenv->report_match_counts_only = TRUE;
-		local_qenv->max_candidates_to_consider = A_BILLION_AND_ONE;
-		if (0) printf("# Entering special result counting mode with max_candidates = %d\n",
-			local_qenv->max_candidates_to_consider);
-	}
+	// Settings derived from the options were worked out for qoenv by load_indexes(), but
+	// must be re-derived if they've been overridden for this query.
+	if (local_qenv != qoenv) derive_settings_for_queries(local_qenv, ixenv);
 
 
 	if (local_qenv->classifier_mode) {
@@ -3617,47 +5072,36 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 			fprintf(qoenv->query_output,
 				"Query after stripping punctuation and controls is {%s}\n",
 				qex->query);
-		if (l <= 0) return(0);  // -----------------------------------------------> Empty Query
-		if (local_qenv->classifier_min_words > 0
-			&& original_query_words < local_qenv->classifier_min_words) return(0);  //-----------> Query too short
-				// It's not an error, we're just saving ourselves a lot of work
-		if (local_qenv->classifier_longest_wdlen_min > 0
-			&& max_word_length_in_bytes < local_qenv->classifier_longest_wdlen_min)
-			return(0);  //-----------> All query words are too short
-			  // It's not an error, we're just avoiding embarrassing false positives.
-	}
-
-
-	if (local_qenv->relaxation_level != 0) {
-		// In these special modes, deactivate features only useful in AutoSuggest experiments
-		// These are no longer important because of the development of RevIdx.
-		local_qenv->auto_partials = FALSE;
-		local_qenv->auto_line_prefix = FALSE;
+		if (l <= 0
+			|| (local_qenv->classifier_min_words > 0
+				&& original_query_words < local_qenv->classifier_min_words)  // Query too short
+			|| (local_qenv->classifier_longest_wdlen_min > 0
+				&& max_word_length_in_bytes < local_qenv->classifier_longest_wdlen_min)) {  // All query words are too short
+			// It's not an error, we're just saving ourselves a lot of work and avoiding
+			// embarrassing false positives.
+			if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
+			return(0);  // -----------------------------------------------> Empty Query
+		}
 	}
 
 
-	// Can only do line_prefixing with an appropriate index.
-	if (strstr((char *)ixenv->other_token_breakers, "<=??") == NULL) local_qenv->auto_line_prefix = FALSE;
-
-	// Check whether we need to score candidates
-	local_qenv->scoring_needed = normalise(local_qenv->rr_coeffs, NUM_COEFFS);
-	normalise(local_qenv->cf_coeffs, NUM_CF_COEFFS);
-
 	words_in_query = process_query_text(local_qenv, qex);
 	if (0) printf("Query text processed.  words_in_query = %d\n", words_in_query);
 	if (words_in_query == 0) {
 		// unload_book_keeping_for_one_query(&qex);  Don't do this in multi-query environment
-		if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
+		if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 		return(0);  // -----------------------------------------------> Empty Query
 	}
 	if (words_in_query < -200000) {  // Negative signals an error
 	  // unload_book_keeping_for_one_query(&qex);  Don't do this in multi-query environment
-		if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
+		if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 		return(error_code);  // ----------------------------------------------->  Error
 	}
+	qex->max_length_diff = local_qenv->max_length_diff;  // For each query set it back to what the user specified
 	if (local_qenv->classifier_mode > 0) {
 		classifier_validate_settings(local_qenv, qex);
 		if (qex->qwd_cnt > local_qenv->classifier_max_words) {
+			if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 			return 0;   // ------------------------------------------------------> No results
 						// It's not an error, we're just saving ourselves a lot of work
 		}
@@ -3665,17 +5109,16 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 
 	// 2. Call process_query()
 	if (0) printf("calling process_query()\n");
-	error_code = process_query(local_qenv, qex, ixenv->doctable, ixenv->vocab, ixenv->index,
-		ixenv->forward, ixenv->vsz, ixenv->fsz, score_multiplier);
+	error_code = process_query(local_qenv, qex, ixenv, score_multiplier);
 
 	if (error_code < -200000) {
-		if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
+		if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 		return(error_code);  // -------------------------------------------->
 	}
 
 	// When we return to handle_multi_query() qex will be all set up with result_count,
 	// results array and corresponding scores.
-	if (local_qenv != qoenv) unload_query_processing_environment(&local_qenv, FALSE, FALSE);  // FRE1953
+	if (unload_local_qenv) discard_override_qoenv(&local_qenv);  // FRE1953
 	return qex->tl_returned;
 }
 
@@ -3754,7 +5197,7 @@ static int handle_one_query(index_environment_t *ixenv, query_processing_environ
 
 
 int handle_multi_query(index_environment_t *ixenv, query_processing_environment_t *qoenv,
-	u_char *multi_query_string, u_char ***returned_results,
+	query_thread_context_t *qtc, u_char *multi_query_string, u_char ***returned_results,
 	double **corresponding_scores, BOOL *timed_out) {
 
 	// This is the one-and-only interface to QBASHER query processing.  What is sent in
@@ -3762,6 +5205,7 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	// noted in that comment, the MQS may in fact be just a single query.
 	//
 	// This function:
+	//   0. If there is a result cache and it holds results for this MQS, returns copies of them.
 	//   1. Allocates storage for returned_results and corresponding_scores.
 	//   2. Splits multi_query_strings into individual query strings, and for each:
 	//      2.1 Splits the query string into query, options, weight, and post-test strings
@@ -3769,7 +5213,10 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	//      2.3 Applies the post-test to the results returned and breaks if not true
 	//   3. Sort results, eliminate adjacent duplicates and set up result and score arrays
 	//   4. If required, display query processing statistics
-	//   5. Clean up and return results and scores
+	//   5. Clean up, add the results to the result cache (if any), and return results and scores
+	//
+	// qoenv is only read, so it may be shared by concurrent callers as long as each passes
+	// its own qtc (or NULL, in which case no statistics are recorded).
 
 	//     **** VITAL:  It is the callers responsibility to call free_results_memory()  !!!!
 	//     **** VITAL:  to avoid memory leaks.                                          !!!!
@@ -3777,10 +5224,11 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	BOOL isadupe, explain = (qoenv->debug >= 1);
 	book_keeping_for_one_query_t *qex = NULL;
 	// local variables corresponding to the last two parameters
-	u_char **lrr = NULL, *p, *q, *query, *options, *weight, *post_test;
+	u_char **lrr = NULL, *p, *q, *query, *options, *weight, *post_test, *cache_key = NULL;
 	double *lcs = NULL, qweight = 1.0;
 	int rslt_count = 0, shown = 0, i, j, error_code;
 	size_t clen;
+	u_ll fingerprint;
 
 	// Make sure these are null if not otherwise assigned.
 	*returned_results = NULL;
@@ -3792,10 +5240,33 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	*p = 0;
 
 	if (explain) printf("Handle_multi_query(%s).\n", multi_query_string);
-	qex = load_book_keeping_for_one_query(qoenv, &error_code);
+
+	if (qoenv->result_cache != NULL && !qoenv->report_match_counts_only) {
+		// The cache is consulted before anything else is done, and a hit is returned in the
+		// form set up below.  No per-query cost statistics are displayed for a hit.
+		cache_key = result_cache_make_key(multi_query_string);  // MAL2103
+		if (cache_key != NULL
+			&& result_cache_lookup(qoenv->result_cache, cache_key, qoenv->max_to_show, returned_results,
+				corresponding_scores, &shown)) {
+			if (explain) fprintf(qoenv->query_output, "Result cache hit: %d results\n", shown);
+			free(cache_key);  // FRE2103
+			if (qtc != NULL) {
+				qtc->result_cache_hits++;
+				if (shown == 0) qtc->queries_without_answer++;
+			}
+			return shown;   // ------------------------------------------------------>
+		}
+		if (qtc != NULL) qtc->result_cache_misses++;
+	}
+
+	// Everything allocated from the thread's arena for its previous query is finished with.
+	if (qtc != NULL) query_arena_reset(qtc->arena);
+	qex = load_book_keeping_for_one_query(qoenv, ixenv, (qtc == NULL) ? NULL : qtc->arena, &error_code);
 	if (error_code < -200000) {
+		if (cache_key != NULL) free(cache_key);  // FRE2103
 		return error_code;  //  ------------------------------------------------------>
 	}
+	qex->qtc = qtc;
 
 	setup_for_op_counting(qex);
 
@@ -3803,9 +5274,9 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 		// Don't allocate memory if we're in the max_to_show == 0 special case
 
 		// 1.  Allocate memory and deal with failures
-		qex->tl_suggestions = (u_char **)malloc(qoenv->max_to_show * sizeof(u_char *));  // MAL2003
-		qex->tl_scores = (double *)malloc(qoenv->max_to_show * sizeof(double));          // MAL2004
-		qex->tl_docids = (docnum_t *)malloc(qoenv->max_to_show * sizeof(docnum_t));      // MAL2005
+		qex->tl_suggestions = (u_char **)query_arena_alloc(qex->arena, qoenv->max_to_show * sizeof(u_char *));  // MAL2003
+		qex->tl_scores = (double *)query_arena_alloc(qex->arena, qoenv->max_to_show * sizeof(double));          // MAL2004
+		qex->tl_docids = (docnum_t *)query_arena_alloc(qex->arena, qoenv->max_to_show * sizeof(docnum_t));      // MAL2005
 		lrr = (u_char **)malloc(qoenv->max_to_show * sizeof(u_char *));   // MAL701
 		lcs = (double *)malloc(qoenv->max_to_show * sizeof(double)); // MAL702
 		if (0) printf("Mallocs done -- max_to_show = %d\n", qoenv->max_to_show);
@@ -3818,6 +5289,7 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 			lrr = NULL;
 			lcs = NULL;
 			unload_book_keeping_for_one_query(&qex);
+			if (cache_key != NULL) free(cache_key);  // FRE2103
 			error_code = -220040;
 			return(error_code);   // -------------------------------------------->
 		}
@@ -3951,6 +5423,7 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 			fprintf(qoenv->query_output, "Initialised the lrr & lcs memory\n");
 		shown = 0;
 		i = 0;
+		forget_shown_fingerprints(qex);  // They'll be of the tl_ slots, not of what's shown
 
 		// i is the index into qex->tl_returned,
 		// shown is the index into lrr and lcs -- the results which will actually be shown
@@ -3961,20 +5434,18 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 			isadupe = FALSE;
 			if (qoenv->duplicate_handling > 1) {
 				// We don't want to eliminate duplicates when told not too
-				// Check this hasn't already been shown.
-				// qbash_timing_check.pl with and without this duplicate detection shows little difference
-				for (j = i - 1; j >= 0; j--) {
-					if (0) printf("Dup checking: j = %d\n", j);
-					isadupe = isduplicate((char *)qex->tl_suggestions[i], (char *)qex->tl_suggestions[j],
-						explain);
-					if (isadupe) {
-						if (explain) {
-							fprintf(qoenv->query_output, "Duplicate suppressed.  '%s'(%d) v. '%s'(%d)\n", qex->tl_suggestions[i],
-								i, (char *)qex->tl_suggestions[j], j);
-						}
-						break;
+				// Check this hasn't already been shown.  rerank_and_record() has already skipped
+				// duplicates, but the classifier modes don't.
+				fingerprint = string_fingerprint(qex->tl_suggestions[i]);
+				j = shown_fingerprint_slot(qex, fingerprint);
+				if (j >= 0) {
+					isadupe = TRUE;
+					if (explain) {
+						fprintf(qoenv->query_output, "Duplicate suppressed.  '%s'(%d) v. '%s'(%d)\n", qex->tl_suggestions[i],
+							i, (char *)qex->tl_suggestions[j], j);
 					}
 				}
+				else remember_shown_fingerprint(qex, fingerprint, i);
 			}
 			if (isadupe) {
 				i++;  // Have to advance this in all cases
@@ -4010,7 +5481,7 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	if (!qoenv->report_match_counts_only) {
 		for (i = 0; i < qoenv->max_to_show; i++) {
 			if (qex->tl_suggestions[i] != NULL) {
-				free((void *)qex->tl_suggestions[i]);   // FRE2006
+				query_arena_free(qex->arena, (void *)qex->tl_suggestions[i]);   // FRE2006
 				qex->tl_suggestions[i] = NULL;
 			}
 		}
@@ -4020,6 +5491,11 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 		if (explain) printf("TIMED OUT: %s\n", qex->query_as_processed);
 		*timed_out = TRUE;
 	}
+	else if (cache_key != NULL) {
+		// Timed out results depend on machine load and aren't cached.
+		result_cache_insert(qoenv->result_cache, cache_key, lrr, lcs, shown);
+	}
+	if (cache_key != NULL) free(cache_key);  // FRE2103
 	unload_book_keeping_for_one_query(&qex);
 	*returned_results = lrr;
 
@@ -4027,7 +5503,7 @@ int handle_multi_query(index_environment_t *ixenv, query_processing_environment_
 	if (explain)
 		fprintf(qoenv->query_output,
 			"Reached the end of handle_multi_query() with %d\n", shown);
-	if (shown == 0) qoenv->queries_without_answer++;
+	if (shown == 0 && qtc != NULL) qtc->queries_without_answer++;
 	return shown;
 }
 
@@ -4159,11 +5635,22 @@ int finalize_query_processing_environment(query_processing_environment_t *qoenv,
 	}
 
 
-	if (qoenv->x_show_qtimes) {
-		// Force single-stream running to get sensible times per query
+	if (qoenv->x_show_qtimes || qoenv->debug >= 1 || qoenv->display_parsed_query) {
+		// Force single-stream running to get sensible times per query, and to keep per-query
+		// diagnostic output (which goes straight to query_output) next to the query it relates to.
 		qoenv->query_streams = 1;
 	}
 
+	// In classifier mode, max_candidates must be at least max_to_show,
+	// and there's no point in it being much bigger.  (Until 1.5.142 this was
+	// done for every query in load_book_keeping_for_one_query().)
+	if (qoenv->classifier_mode || qoenv->max_candidates_to_consider == IUNDEF)
+		qoenv->max_candidates_to_consider = qoenv->max_to_show + 1;
+
+	if (qoenv->engine == NULL || !strcmp((char *)qoenv->engine, "relaxed_and")) qoenv->use_impact_engine = FALSE;
+	else if (!strcmp((char *)qoenv->engine, "saat_impact")) qoenv->use_impact_engine = TRUE;
+	else return -200087;
+
 
 	if (verbose) {
 		fprintf(qoenv->query_output, "Feature weighting coefficients: %.3f %.3f %.3f %.3f %.3f %.3f %.3f %.3f\n",
@@ -4179,6 +5666,49 @@ int finalize_query_processing_environment(query_processing_environment_t *qoenv,
 }
 
 
+query_thread_context_t *new_query_thread_context(query_processing_environment_t *qoenv) {
+	// Create a zeroed context for a thread which will run queries against qoenv, and chain it
+	// onto qoenv so that its statistics can be reported.  Contexts are freed by
+	// unload_query_processing_environment().  Not thread-safe:  Create all the contexts
+	// before starting the threads which use them.
+	query_thread_context_t *qtc;
+	qtc = (query_thread_context_t *)malloc(sizeof(query_thread_context_t));  // MAL0904
+	if (qtc == NULL) return NULL;
+	memset(qtc, 0, sizeof(query_thread_context_t));
+	qtc->query_output = NULL;
+	qtc->override_qoenv = NULL;
+	qtc->impact_workspaces = NULL;
+	qtc->num_impact_workspaces = 0;
+	qtc->arena = query_arena_create(0);  // If that fails, per-query storage will be malloced.
+	qtc->next = qoenv->thread_contexts;
+	qoenv->thread_contexts = qtc;
+	return qtc;
+}
+
+
+static void merge_thread_statistics(query_processing_environment_t *qoenv, query_thread_context_t *totals) {
+	// Sum the statistics from all of qoenv's thread contexts into totals.
+	query_thread_context_t *qtc;
+	int b;
+	memset(totals, 0, sizeof(query_thread_context_t));
+	for (qtc = qoenv->thread_contexts; qtc != NULL; qtc = qtc->next) {
+		totals->queries_run += qtc->queries_run;
+		totals->queries_without_answer += qtc->queries_without_answer;
+		totals->query_timeout_count += qtc->query_timeout_count;
+		totals->global_idf_lookups += qtc->global_idf_lookups;
+		totals->result_cache_hits += qtc->result_cache_hits;
+		totals->result_cache_misses += qtc->result_cache_misses;
+		totals->total_elapsed_msec_d += qtc->total_elapsed_msec_d;
+		if (qtc->max_elapsed_msec_d >= totals->max_elapsed_msec_d) {
+			totals->max_elapsed_msec_d = qtc->max_elapsed_msec_d;
+			strcpy((char *)totals->slowest_q, (char *)qtc->slowest_q);
+		}
+		for (b = 0; b < ELAPSED_MSEC_BUCKETS; b++)
+			totals->elapsed_msec_histo[b] += qtc->elapsed_msec_histo[b];
+	}
+}
+
+
 #ifdef WIN64
 static double report_pagefile_usage_in_kb() {
 	// Return current pagefile usage in kilobytes
@@ -4190,43 +5720,60 @@ static double report_pagefile_usage_in_kb() {
 
 
 void report_milestone(query_processing_environment_t *qoenv) {
+	query_thread_context_t totals;
+	merge_thread_statistics(qoenv, &totals);
 	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time %.0f sec.  Pagefile usage %.0fKB\n",
-		qoenv->queries_run, what_time_is_it() - qoenv->inthebeginning,
+		totals.queries_run, what_time_is_it() - qoenv->inthebeginning,
 		report_pagefile_usage_in_kb());
 }
 #else
 void report_milestone(query_processing_environment_t *qoenv) {
+	query_thread_context_t totals;
+	merge_thread_statistics(qoenv, &totals);
 	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time %.0f sec.\n",
-		qoenv->queries_run, what_time_is_it() - qoenv->inthebeginning);
+		totals.queries_run, what_time_is_it() - qoenv->inthebeginning);
 }
 #endif
 
 
 void report_query_response_times(query_processing_environment_t *qoenv) {
+	// Statistics from all the thread contexts are merged before reporting.  Don't call this
+	// while queries are still running in other threads.
+	query_thread_context_t totals;
 	double macro_total_time = what_time_is_it() - qoenv->inthebeginning;
+	merge_thread_statistics(qoenv, &totals);
 #ifdef WIN64
 	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time: Macro %.1f sec; Micro %.1f sec. Pagefile usage %.0fKB -- %.1f QPS\n",
-		qoenv->queries_run, macro_total_time, qoenv->total_elapsed_msec_d / 1000.0, report_pagefile_usage_in_kb(),
-		qoenv->queries_run / macro_total_time);
+		totals.queries_run, macro_total_time, totals.total_elapsed_msec_d / 1000.0, report_pagefile_usage_in_kb(),
+		totals.queries_run / macro_total_time);
 #else
 	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time: Macro %.1f sec; Micro %.1f sec. -- %.1f QPS\n",
-		qoenv->queries_run, macro_total_time, qoenv->total_elapsed_msec_d / 1000.0,
-		qoenv->queries_run / macro_total_time);
+		totals.queries_run, macro_total_time, totals.total_elapsed_msec_d / 1000.0,
+		totals.queries_run / macro_total_time);
 #endif
 
 
 	fprintf(qoenv->query_output, "\n\nInputs processed: %lld.  Inputs with zero results: %lld\n",
-		qoenv->queries_run, qoenv->queries_without_answer);
+		totals.queries_run, totals.queries_without_answer);
 	fprintf(qoenv->query_output, "Deterministic timeout was set at: %d kilo-cost-units\n", qoenv->timeout_kops);
 	fprintf(qoenv->query_output, "Elapsed time timeout was set at: %d msec\n", qoenv->timeout_msec);
-	fprintf(qoenv->query_output, "  Query timeout count (from either cause): %lld\n", qoenv->query_timeout_count);
-	fprintf(qoenv->query_output, "  Global_IDF Lookups: %lld\n", qoenv->global_idf_lookups);
+	fprintf(qoenv->query_output, "  Query timeout count (from either cause): %lld\n", totals.query_timeout_count);
+	fprintf(qoenv->query_output, "  Global_IDF Lookups: %lld\n", totals.global_idf_lookups);
+	if (qoenv->result_cache != NULL) {
+		long long lookups = totals.result_cache_hits + totals.result_cache_misses, entries;
+		size_t bytes;
+		result_cache_get_occupancy(qoenv->result_cache, &entries, &bytes);
+		fprintf(qoenv->query_output, "Result cache: %lld hits, %lld misses (hit rate %.1f%%).  %lld entries occupying %.1fMB of %dMB\n",
+			totals.result_cache_hits, totals.result_cache_misses,
+			lookups > 0 ? 100.0 * (double)totals.result_cache_hits / (double)lookups : 0.0,
+			entries, (double)bytes / MEGA, qoenv->result_cache_mb);
+	}
 
 
-	fprintf(qoenv->query_output, "Average elapsed msec per query: %.3f\n", qoenv->total_elapsed_msec_d / qoenv->queries_run);
-	fprintf(qoenv->query_output, "Maximum elapsed msec per query: %.0f  (%s)\n", qoenv->max_elapsed_msec_d, qoenv->slowest_q);
+	fprintf(qoenv->query_output, "Average elapsed msec per query: %.3f\n", totals.total_elapsed_msec_d / totals.queries_run);
+	fprintf(qoenv->query_output, "Maximum elapsed msec per query: %.0f  (%s)\n", totals.max_elapsed_msec_d, totals.slowest_q);
 
-	analyze_response_times(qoenv);
+	analyze_response_times(qoenv, &totals);
 }
 
 
@@ -4235,27 +5782,144 @@ void show_mode_settings(query_processing_environment_t *qoenv) {
 	if (qoenv->auto_partials) fprintf(qoenv->query_output, "Auto partials active\n");
 	fprintf(qoenv->query_output, "Relaxation level: %d\n", qoenv->relaxation_level);
 	fprintf(qoenv->query_output, "Column to display: %d\n", qoenv->displaycol);
-	if (!qoenv->scoring_needed) fprintf(qoenv->query_output, "Scoring is NOT needed\n");
+	if (qoenv->debug >= 1 && !qoenv->scoring_needed) fprintf(qoenv->query_output, "Scoring is NOT needed\n");
 	fprintf(qoenv->query_output, "Degree of parallelism: %d\n", qoenv->query_streams);
 	fprintf(qoenv->query_output, "----------------------------------\n\n");
-#ifdef WIN64
-	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time %.0f sec.  Pagefile usage %.0fKB\n",
-		qoenv->queries_run, what_time_is_it() - qoenv->inthebeginning, report_pagefile_usage_in_kb());
-#else
-	fprintf(qoenv->query_output, "Milestone: %lld queries run; Total elapsed time %.0f sec.\n",
-		qoenv->queries_run, what_time_is_it() - qoenv->inthebeginning);
-#endif
+	report_milestone(qoenv);
 }
 
 
 
+static index_environment_t *new_index_environment() {
+	index_environment_t *ixenv;
+	ixenv = (index_environment_t *)malloc(sizeof(index_environment_t));   // MAL801
+	if (ixenv == NULL) return NULL;  // -------------------------------->
+	ixenv->doctable = NULL;
+	ixenv->vocab = NULL;
+	ixenv->vocab_hash = NULL;
+	ixenv->index = NULL;
+	ixenv->forward = NULL;
+	ixenv->other_token_breakers = NULL;
+	ixenv->expect_cp1252 = TRUE;
+	ixenv->blocked_postings = FALSE;
+	ixenv->tombstones = NULL;
+	ixenv->tsz = 0;
+	ixenv->impacts = NULL;
+	ixenv->impact_list_offsets = NULL;
+	ixenv->imsz = 0;
+	ixenv->skips = NULL;
+	ixenv->sksz = 0;
+	ixenv->head_answers = NULL;
+	ixenv->hasz = 0;
+	ixenv->blooms = NULL;
+	ixenv->blsz = 0;
+	ixenv->bloom_bits = 0;
+	ixenv->normforward = NULL;
+	ixenv->normforward_offsets = NULL;
+	ixenv->nfsz = 0;
+	ixenv->normforward_accents_removed = FALSE;
+	ixenv->N = UNDEFINED_DOUBLE;
+	ixenv->tot_postings = UNDEFINED_DOUBLE;
+	ixenv->score_ordered = FALSE;
+	ixenv->num_segments = 0;
+	ixenv->num_shards = 1;
+	ixenv->segments = NULL;
+	return ixenv;
+}
+
+
+static BOOL load_one_segment(query_processing_environment_t *qoenv, index_environment_t *ixenv,
+	u_char *index_stem, char *prefix, int n, BOOL verbose, BOOL run_tests, int *error_code) {
+	// If there's an index in <index_dir>/<prefix><n>, load it and add it to ixenv->segments.  Return
+	// FALSE if there isn't, or if it can't be loaded, in which case *error_code is set.
+	index_environment_t *segment;
+
+	sprintf((char *)index_stem, "%s/%s%d", qoenv->index_dir, prefix, n);
+	if (!is_a_directory((char *)index_stem)) return FALSE;  // -------------------------------->
+	strcat((char *)index_stem, "/QBASH");
+	if (!exists((char *)index_stem, ".if")) return FALSE;  // -------------------------------->
+	segment = new_index_environment();
+	if (segment == NULL) {
+		*error_code = -220063;
+		return FALSE;  // -------------------------------->
+	}
+	ixenv->segments[ixenv->num_segments++] = segment;   // So unload_indexes() can clean up after errors
+	open_and_check_index_set(qoenv, segment, index_stem, strlen((char *)index_stem), verbose, run_tests, TRUE, error_code);
+	if (*error_code < 0) {
+		fprintf(qoenv->query_output, "Error: Unable to load segment %s\n", index_stem);
+		return FALSE;  // -------------------------------->
+	}
+	if (verbose) fprintf(qoenv->query_output, "Segment %s%d loaded from %s: %lld docs, %s deletions.\n",
+		prefix, n, index_stem, (long long)(segment->dsz / DTE_LENGTH), segment->tombstones == NULL ? "without" : "with");
+	return TRUE;
+}
+
+
+static void load_other_segments(query_processing_environment_t *qoenv, index_environment_t *ixenv,
+	BOOL sharded, BOOL verbose, BOOL run_tests, int *error_code) {
+	// Set up ixenv->segments, with the base index ixenv first.  If the index is sharded, the base
+	// is shard0, and it's followed by shard1, shard2, ...  Then come any delta segments found in
+	// <index_dir>/delta1, <index_dir>/delta2, ...  Each search stops at the first missing number.
+	// Failure to load a segment is an error.  A delta's records may have been tombstoned in
+	// earlier segments, and a missing shard would silently lose documents.
+	u_char *index_stem;
+	size_t idplen = strlen((char *)qoenv->index_dir);
+	int n;
+
+	ixenv->segments = (index_environment_t **)malloc((SEG_MAX_SHARDS + SEG_MAX_DELTAS) * sizeof(index_environment_t *));  // MAL805
+	if (ixenv->segments == NULL) {
+		*error_code = -220063;
+		return;  // -------------------------------->
+	}
+	ixenv->segments[0] = ixenv;
+	ixenv->num_segments = 1;
+	ixenv->num_shards = 1;
+
+	// Room for "/delta99/QBASH" plus the 29 characters open_and_check_index_set() may append
+	index_stem = (u_char *)malloc(idplen + 50);    // MAL804
+	if (index_stem == NULL) {
+		*error_code = -220063;
+		return;  // -------------------------------->
+	}
+	for (n = 1; sharded && n < SEG_MAX_SHARDS; n++) {
+		if (!load_one_segment(qoenv, ixenv, index_stem, SHARD_PREFIX, n, verbose, run_tests, error_code)) break;
+		ixenv->num_shards++;
+	}
+	for (n = 1; *error_code >= 0 && n <= SEG_MAX_DELTAS; n++) {
+		if (!load_one_segment(qoenv, ixenv, index_stem, SEG_DELTA_PREFIX, n, verbose, run_tests, error_code)) break;
+	}
+	free(index_stem);  // FRE804
+}
+
+
+static void set_collection_statistics(query_processing_environment_t *qoenv, index_environment_t *ixenv) {
+	// Set N and avdoclen, used in BM25 scoring, for the collection.  For a sharded index they're
+	// totalled over all the shards, as the QIDFs were by QBASHI, so that a document scores the same
+	// whichever shard it's in.  Deltas don't count.  If the headers don't record the numbers, leave
+	// the values set by check_if_header().
+	double N = 0.0, tot_postings = 0.0;
+	int s;
+
+	for (s = 0; s < ixenv->num_shards; s++) {
+		if (ixenv->segments[s]->N == UNDEFINED_DOUBLE || ixenv->segments[s]->tot_postings == UNDEFINED_DOUBLE)
+			return;  // -------------------------------->
+		N += ixenv->segments[s]->N;
+		tot_postings += ixenv->segments[s]->tot_postings;
+	}
+	qoenv->N = N;
+	qoenv->avdoclen = tot_postings / N;
+}
+
+
 index_environment_t *load_indexes(query_processing_environment_t *qoenv, BOOL verbose, BOOL run_tests,
 	int *error_code) {
 	// No longer Chdir to the index directory  -  it's not threadsafe
 	//
 	// There are two usage cases: 
-	// Case 1 - qoenv->index_dir is not NULL.   This is the old mode but it no longer supports multiple shards on a single server.
-	//				Memorymap the index files in the specified directory path
+	// Case 1 - qoenv->index_dir is not NULL.   This is the old mode.
+	//				Memorymap the index files in the specified directory path, or if it's sharded,
+	//				those in its shard<n> sub-directories, together with any delta segments in its
+	//				delta<n> sub-directories.  See QBASHER_common_definitions.h
 	// Case 2 - qoenv-index_dir is NULL.  This is the Aether mode
 	//		Just open and memorymap the files specified in qoenv->fname_*
 	// 
@@ -4269,48 +5933,58 @@ index_environment_t *load_indexes(query_processing_environment_t *qoenv, BOOL ve
 		return NULL;
 	}
 	// - - - - - - - - - - - - - - - - - - - - - - - Common to both cases - - - - - - - - - - - - - - - - - - - - - - - 
-	ixenv = (index_environment_t *)malloc(sizeof(index_environment_t));   // MAL801
+	ixenv = new_index_environment();
 	if (ixenv == NULL) {
 		*error_code = -220063;
 		return NULL;
 	}
-	ixenv->doctable = NULL;
-	ixenv->vocab = NULL;
-	ixenv->index = NULL;
-	ixenv->forward = NULL;
-	ixenv->other_token_breakers = NULL;
-	ixenv->expect_cp1252 = TRUE;
 
 
 	if (qoenv->index_dir != NULL) {
 		// - - - - - - - - - - - - - - - - - - - - - - - - - - Case 1 - - - - - - - - - - - - - - - - - - - - - - - - - -
 		u_char  *index_stem;
-		size_t idplen, stemlen;
+		size_t idplen;
+		BOOL sharded;
 		idplen = strlen((char *)qoenv->index_dir);
 
 		if (verbose) fprintf(qoenv->query_output, " -- loading indexes from index_dir %s --\n", qoenv->index_dir);
 
 		// Malloc space for longest file path =
-		//  strlen(index_directory_path) + strlen("/0/") + strlen("QBASH.doctable");   // 17 extra chars
-		index_stem = (u_char *)malloc(idplen + 30);    // MAL800
+		//  strlen(index_directory_path) + strlen("/shard0/QBASH") + strlen(".substitution_rules");   // 32 extra chars
+		index_stem = (u_char *)malloc(idplen + 50);    // MAL800
 		if (index_stem == NULL) {
 			free(ixenv);
 			*error_code = -220063;
 			return NULL;
 		}
-		strcpy((char *)index_stem, (char *)qoenv->index_dir);
 
-		strcpy((char *)index_stem + idplen + 3, "QBASH");
-		stemlen = idplen + 3 + 5;  // 3 for \.\  and 5 for QBASH
-		index_stem[idplen] = '/';
-
-		if (verbose) fprintf(qoenv->query_output, "Falling back to single QBASH.* index\n");
-		strcpy((char *)index_stem + idplen, "/QBASH");
-		stemlen = idplen + 6;
-		other_token_breakers = open_and_check_index_set(qoenv, ixenv, index_stem, stemlen, verbose, run_tests, error_code);
+		// A sharded index has no QBASH.* index of its own.  Its base is shard0, but the rules files
+		// are still in index_dir.
+		sprintf((char *)index_stem, "%s/QBASH", qoenv->index_dir);
+		sharded = !exists((char *)index_stem, ".if");
+		if (sharded) {
+			sprintf((char *)index_stem, "%s/%s0/QBASH", qoenv->index_dir, SHARD_PREFIX);
+			sharded = exists((char *)index_stem, ".if");
+			if (!sharded) sprintf((char *)index_stem, "%s/QBASH", qoenv->index_dir);
+		}
+		if (verbose) {
+			if (sharded) fprintf(qoenv->query_output, "Loading sharded index\n");
+			else fprintf(qoenv->query_output, "Falling back to single QBASH.* index\n");
+		}
+		other_token_breakers = open_and_check_index_set(qoenv, ixenv, index_stem, strlen((char *)index_stem),
+			verbose, run_tests, sharded, error_code);
+		if (sharded && other_token_breakers != NULL) {
+			sprintf((char *)index_stem, "%s/QBASH", qoenv->index_dir);
+			load_rules_files(qoenv, index_stem, strlen((char *)index_stem), error_code);
+		}
 		free(index_stem);  // FRE800
-		if (other_token_breakers != NULL) {
+		if (other_token_breakers != NULL && *error_code >= 0) {
 			if (ixenv->other_token_breakers == NULL) ixenv->other_token_breakers = other_token_breakers;
+			load_other_segments(qoenv, ixenv, sharded, verbose, run_tests, error_code);
+			if (*error_code < 0) {
+				unload_indexes(&ixenv);
+				return NULL;
+			}
 		}
 	}
 	else {
@@ -4321,10 +5995,31 @@ index_environment_t *load_indexes(query_processing_environment_t *qoenv, BOOL ve
 		free(ixenv);
 		return NULL;
 	}
+	if (ixenv->segments == NULL) {
+		// No deltas.  The base is the only segment.
+		ixenv->segments = (index_environment_t **)malloc(sizeof(index_environment_t *));  // MAL805
+		if (ixenv->segments == NULL) {
+			*error_code = -220063;
+			unload_indexes(&ixenv);
+			return NULL;
+		}
+		ixenv->segments[0] = ixenv;
+		ixenv->num_segments = 1;
+	}
+	set_collection_statistics(qoenv, ixenv);
 
 
 	// - - - - - - - - - - - - - - - - - - - - - - - Common to both cases - - - - - - - - - - - - - - - - - - - - - - -
 
+	derive_settings_for_queries(qoenv, ixenv);  // From now on qoenv is only read during query processing.
+	saat_select_run_decoder(qoenv->x_bulk_decode);
+	result_cache_destroy(&qoenv->result_cache);   // In case indexes are being reloaded
+	if (qoenv->result_cache_mb > 0) {
+		qoenv->result_cache = result_cache_create((size_t)qoenv->result_cache_mb * 1048576);
+		if (qoenv->result_cache == NULL) {
+			fprintf(qoenv->query_output, "Warning: Unable to allocate the result cache.  Queries will run without it.\n");
+		}
+	}
 
 	if (verbose) {
 		fprintf(qoenv->query_output, "Indexes loaded.\n");
@@ -4353,6 +6048,32 @@ void unload_indexes(index_environment_t **ixenvp) {
 	if (ixenv->vocab != NULL) {
 		unmmap_all_of(ixenv->vocab, ixenv->vocab_H, ixenv->vocab_MH, ixenv->vsz);
 	}
+	if (ixenv->vocab_hash != NULL) {
+		unmmap_all_of(ixenv->vocab_hash, ixenv->vocab_hash_H, ixenv->vocab_hash_MH, ixenv->vhsz);
+	}
+	if (ixenv->tombstones != NULL) {
+		unmmap_all_of(ixenv->tombstones, ixenv->tombstones_H, ixenv->tombstones_MH, ixenv->tsz);
+	}
+	if (ixenv->impacts != NULL) {
+		unmmap_all_of(ixenv->impacts, ixenv->impact_H, ixenv->impact_MH, ixenv->imsz);
+	}
+	if (ixenv->skips != NULL) {
+		unmmap_all_of(ixenv->skips, ixenv->skips_H, ixenv->skips_MH, ixenv->sksz);
+	}
+	if (ixenv->head_answers != NULL) {
+		unmmap_all_of(ixenv->head_answers, ixenv->head_answers_H, ixenv->head_answers_MH, ixenv->hasz);
+	}
+	if (ixenv->blooms != NULL) {
+		unmmap_all_of(ixenv->blooms, ixenv->blooms_H, ixenv->blooms_MH, ixenv->blsz);
+	}
+	if (ixenv->normforward != NULL) {
+		unmmap_all_of(ixenv->normforward, ixenv->normforward_H, ixenv->normforward_MH, ixenv->nfsz);
+	}
+	if (ixenv->segments != NULL) {
+		int s;
+		for (s = 1; s < ixenv->num_segments; s++) unload_indexes(ixenv->segments + s);  // The other shards and the deltas
+		free(ixenv->segments);  // FRE805
+	}
 	free(ixenv);   // FRE801
 	*ixenvp = NULL;
 }
@@ -4398,6 +6119,17 @@ void unload_query_processing_environment(query_processing_environment_t **qoenvp
 		qoenv->query_output = NULL;
 	}
 
+	while (qoenv->thread_contexts != NULL) {
+		query_thread_context_t *qtc = qoenv->thread_contexts;
+		qoenv->thread_contexts = qtc->next;
+		discard_override_qoenv(&qtc->override_qoenv);  // FRE1953
+		free_impact_workspaces(&qtc->impact_workspaces, qtc->num_impact_workspaces);
+		query_arena_destroy(&qtc->arena);
+		if (qtc->substitution_match_data != NULL) pcre2_match_data_free(qtc->substitution_match_data);
+		free(qtc);   // FRE0904
+	}
+	result_cache_destroy(&qoenv->result_cache);
+
 	if (full_clean) free_options_memory(qoenv);
 	if (qoenv->vptra != NULL) free(qoenv->vptra);
 
@@ -4529,7 +6261,7 @@ QBASHQ_API int NativeExecuteQueryAsync(LPWSTR pQuery, query_processing_environme
 	}
 
 
-	how_many_results = handle_multi_query(qoenv->ixenv, qoenv, qstring, &returned_results, &corresponding_scores, &timed_out);
+	how_many_results = handle_multi_query(qoenv->ixenv, qoenv, NULL, qstring, &returned_results, &corresponding_scores, &timed_out);
 
 	if (how_many_results > 0) {
 		wresult_buflen = (how_many_results + 1)*(MAX_RESULT_LEN + 1);
@@ -45,7 +45,7 @@
 //   6. Later in the same function assign the new value to a good default, or remove an obsolete
 //	    assignment.
 
-#define NUMBER_OF_ARGS 64
+#define NUMBER_OF_ARGS 73
 
 arg_t args[] = {
   // ------------- If you edit these initialisations, be sure to follow the INSTRUCTIONS above --------------
@@ -114,7 +114,16 @@ arg_t args[] = {
   /* 60 */{ "street_address_processing", AINT, FALSE, 0, 10000, "if > 0, delete suite part and street number from query. If > 1, reject candidates for which this street number is not valid." },
   /* 61 */{ "street_specs_col", AINT, FALSE, 0, 10000, "The column in the .forward file containing a list specifying valid street numbers for this doc (assumed to be a street)." },
   /* 62 */{ "query_shortening_threshold", AINT, FALSE, 0, 100, "Queries with more terms than the given value will be shortened to this length. 0 => no shortening" },
-  /* 63 */{ "", AEOL, FALSE, 0, 0, "" }
+  /* 63 */{ "x_bulk_decode", AINT, TRUE, 0, 3, "How skipto decodes postings in skip-block runs: 0 - one at a time, 1 - whole run, scalar, 2 - whole run, SSE2, 3 - whole run, fastest available (AVX2 if supported)" },
+  /* 64 */{ "result_cache_mb", AINT, TRUE, 0, 1048576, "If > 0, the final results of up to this many MB of distinct queries are cached and reused when a query is repeated. Least recently used entries are evicted." },
+  /* 65 */{ "segment_threads", AINT, TRUE, 1, 64, "The segments of an index with shards or deltas are searched by up to this many threads per query. 1 means one after another." },
+  /* 66 */{ "early_termination", ABOOL, FALSE, 0, 0, "If TRUE, stop searching a score-ordered index once no later document could make the top max_to_show. Results are unchanged." },
+  /* 67 */{ "engine", ASTRING, TRUE, 0, 0, "relaxed_and (default) or saat_impact: score-at-a-time disjunctive ranking by summed BM25 impacts from QBASH.impact (QBASHI -impact_file=TRUE). Queries with operators or partials use relaxed_and." },
+  /* 68 */{ "impact_postings_budget", AINT, FALSE, 0, 1000000000, "With engine=saat_impact, stop processing a query in each segment after this many postings, keeping the best results so far. 0 means no limit." },
+  /* 69 */{ "x_incremental_tpermute", ABOOL, FALSE, 0, 0, "If TRUE (default), saat_relaxed_and() repairs the curdoc ordering of terms after each candidate rather than resorting it. Only matters for relaxation_level > 3." },
+  /* 70 */{ "x_single_term_fast_path", ABOOL, FALSE, 0, 0, "If TRUE (default), single-word queries such as >fac are answered by streaming the first suitable postings, if only static score is used in ranking and the index is score-ordered and unsharded." },
+  /* 71 */{ "x_use_head_answers", ABOOL, FALSE, 0, 0, "If TRUE (default), the single-term fast path answers line prefix queries from QBASH.if.head_answers (QBASHI -head_answers=N) when the stored answers suffice." },
+  /* 72 */{ "", AEOL, FALSE, 0, 0, "" }
 };
 
 
@@ -188,12 +197,20 @@ int initialize_qoenv_mappings(query_processing_environment_t *qoenv) {
   vptra[60] = (void *)&(qoenv->street_address_processing);
   vptra[61] = (void *)&(qoenv->street_specs_col);
   vptra[62] = (void *)&(qoenv->query_shortening_threshold);
+  vptra[63] = (void *)&(qoenv->x_bulk_decode);
+  vptra[64] = (void *)&(qoenv->result_cache_mb);
+  vptra[65] = (void *)&(qoenv->segment_threads);
+  vptra[66] = (void *)&(qoenv->early_termination);
+  vptra[67] = (void *)&(qoenv->engine);
+  vptra[68] = (void *)&(qoenv->impact_postings_budget);
+  vptra[69] = (void *)&(qoenv->x_incremental_tpermute);
+  vptra[70] = (void *)&(qoenv->x_single_term_fast_path);
+  vptra[71] = (void *)&(qoenv->x_use_head_answers);
   return 0;
 } 
 
 
 void set_qoenv_defaults(query_processing_environment_t *qoenv) {
-  int i;
   qoenv->index_dir = NULL;
   qoenv->fname_forward = NULL;
   qoenv->fname_if = NULL;
@@ -256,23 +273,28 @@ void set_qoenv_defaults(query_processing_environment_t *qoenv) {
   qoenv->street_address_processing = 0;
   qoenv->street_specs_col = 5;  
   qoenv->query_shortening_threshold = 0;  // No shortening.
+  qoenv->x_bulk_decode = 3;  // Fastest available
+  qoenv->result_cache_mb = 0;  // No result cache
+  qoenv->segment_threads = 8;
+  qoenv->early_termination = FALSE;
+  qoenv->engine = make_a_copy_of((u_char *)"relaxed_and");
+  qoenv->impact_postings_budget = 0;  // No limit
+  qoenv->x_incremental_tpermute = TRUE;
+  qoenv->x_single_term_fast_path = TRUE;
+  qoenv->x_use_head_answers = TRUE;
 
   // Not directly settable
   qoenv->scoring_needed = TRUE;
   qoenv->report_match_counts_only = FALSE;
+  qoenv->use_impact_engine = FALSE;
   qoenv->query_output = stdout;
   qoenv->substitutions_hash = NULL;
   qoenv->segment_rules_hash = NULL;
+  qoenv->result_cache = NULL;
 
   // Setting up for statistics recording for the batch of queries run with these options
   qoenv->inthebeginning = what_time_is_it();  //Probably not in the right place. Reset in QBASHQ.c
-  qoenv->queries_run = 0;
-  qoenv->query_timeout_count = 0;
-  qoenv->global_idf_lookups = 0;
-  qoenv->total_elapsed_msec_d = 0.0;
-  qoenv->max_elapsed_msec_d = 0.0;
-  for (i = 0; i < ELAPSED_MSEC_BUCKETS; i++)
-    qoenv->elapsed_msec_histo[i] = 0;
+  qoenv->thread_contexts = NULL;  // The statistics themselves are in the thread contexts
 
   // ---- Index and properties used in BM25 document scoring  	
   qoenv->ixenv = NULL;
@@ -556,3 +578,31 @@ void free_options_memory(query_processing_environment_t *qoenv) {
   }
   if (qoenv->debug >= 1) printf("Memory malloced for string-valued options has been freed.\n");
 }
+
+
+void own_overridable_option_strings(query_processing_environment_t *qoenv) {
+  // qoenv is a shallow copy of another options environment, into which per-query options are
+  // about to be assigned.  Give it private copies of the string-valued options which may be
+  // overridden, so that assign_one_arg() doesn't free memory belonging to the original.
+  // If the copying fails the option is just left unset.
+  int a;
+  for (a = 0; args[a].type != AEOL; a++) {
+    if (args[a].type == ASTRING && !args[a].immutable
+	&& *((u_char **)qoenv->vptra[a]) != NULL) {
+      *((u_char **)qoenv->vptra[a]) = make_a_copy_of(*((u_char **)qoenv->vptra[a]));  // MAL0905
+    }
+  }
+}
+
+
+void free_overridable_option_strings(query_processing_environment_t *qoenv) {
+  // Counterpart of own_overridable_option_strings().
+  int a;
+  for (a = 0; args[a].type != AEOL; a++) {
+    if (args[a].type == ASTRING && !args[a].immutable
+	&& *((u_char **)qoenv->vptra[a]) != NULL) {
+      free(*((u_char **)qoenv->vptra[a]));   // FRE0905
+      *((u_char **)qoenv->vptra[a]) = NULL;
+    }
+  }
+}
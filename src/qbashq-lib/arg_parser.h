@@ -28,6 +28,10 @@ int initialize_qoenv_mappings(query_processing_environment_t *qoenv);
 
 void set_qoenv_defaults(query_processing_environment_t *qoenv);
 
+void own_overridable_option_strings(query_processing_environment_t *qoenv);
+
+void free_overridable_option_strings(query_processing_environment_t *qoenv);
+
 int assign_args_from_config_file(query_processing_environment_t *qoenv, u_char *config_filename,
 				 BOOL initializing, BOOL explain_errors);
 
@@ -22,6 +22,7 @@
 #include "../utils/dahash.h"
 #include "QBASHQ.h"
 #include "classification.h"
+#include "query_arena.h"
 
 #if 0  //  Slated for removal
 
@@ -319,12 +320,13 @@ void classifier_validate_settings(query_processing_environment_t *local_qenv, bo
   // Various combinations of options don't make sense when operating as a classifier.  Let's make sure
   // everything is set appropriately.
   // 
-  // Note that the local_qenv may in fact be the global one.
+  // Note that the local_qenv may in fact be the global one, shared across threads, so it
+  // must not be modified here.  The per-query max_length_diff is lowered in qex instead.
+  // (auto_partials is now turned off for classifier modes by derive_settings_for_queries().)
   int mld;
 
   //local_qenv->max_to_show = 1;  // No. leave that to the driver
 
-  local_qenv->auto_partials = FALSE;
   if (!qex->query_contains_operators && (local_qenv->classifier_mode == 1 || local_qenv->classifier_mode == 3)) {
     // The lexical similarity function is essentially query-length divided by a denominator.  The denominator
     // is a sum including document-length.  No candidate will be included if this fraction is less than 
@@ -338,41 +340,58 @@ void classifier_validate_settings(query_processing_environment_t *local_qenv, bo
 
     mld = (int)(qex->qwd_cnt / local_qenv->classifier_threshold + 0.999999) - qex->qwd_cnt;
     if (0) printf("Max_length_diff changed from %d to %d for %d query words and threshold of %.3f\n",
-		  local_qenv->max_length_diff, mld, qex->qwd_cnt, local_qenv->classifier_threshold);
-    if (mld < local_qenv->max_length_diff) {
-      local_qenv->max_length_diff = mld;
+		  qex->max_length_diff, mld, qex->qwd_cnt, local_qenv->classifier_threshold);
+    if (mld < qex->max_length_diff) {
+      qex->max_length_diff = mld;
     }
   }
 }
 
 
-double get_global_idf(query_processing_environment_t *qoenv, u_char *wd) {
+static double get_global_idf_of_vocab_entry(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+					    byte *vocab_entry);
+
+double get_global_idf(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex, u_char *wd) {
   // NOTE: wd is looked up case-sensitively, assuming wd is UTF8-lowercased prior to call
 
   // Since version 1.5.0 we use a field in the .vocab file to get a quantized idf and make no use at
   // all of the .global_idfs file.
 
   byte *vocab_entry, lwd[MAX_WD_LEN + 1];
-  double idf, N;
-  u_ll ig1, ig2;
-  byte qidf; 
+  double idf;
+  int s;
 
-  N = (double)(qoenv->ixenv->dsz / DTE_LENGTH);  // Relatively quick way to determine no. of documents
   strncpy((char *)lwd, (char *)wd, MAX_WD_LEN);
   lwd[MAX_WD_LEN] = 0;
 
-  vocab_entry = lookup_word(wd, qoenv->ixenv->vocab, qoenv->ixenv->vsz, qoenv->debug);
-  if (vocab_entry == NULL) idf = log(N);   // Same as a term which occurs only once.
-  else { 
-    vocabfile_entry_unpacker(vocab_entry, MAX_WD_LEN + 1, &ig1, &qidf, &ig2);
-    idf = get_idf_from_quantized(N, 0XFF, qidf);
-  }
-  qoenv->global_idf_lookups++;
+  vocab_entry = lookup_word(wd, qoenv->ixenv, qoenv->debug);
+  // The QIDFs of a sharded index are over all the shards, but a word may not occur in shard0.
+  for (s = 1; vocab_entry == NULL && s < qoenv->ixenv->num_shards; s++)
+    vocab_entry = lookup_word(wd, qoenv->ixenv->segments[s], qoenv->debug);
+  idf = get_global_idf_of_vocab_entry(qoenv, qex, vocab_entry);
   if (0) printf("global_idf(%s) = %.4f\n", wd, idf);
   return idf;
 }
 
 
+static double get_global_idf_of_vocab_entry(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+					    byte *vocab_entry) {
+  // vocab_entry is an entry in the vocab of qoenv->ixenv or another shard, or NULL for a word which
+  // isn't in any of them.
+  double N = 0.0;
+  u_ll ig1, ig2;
+  byte qidf; 
+  int s;
+
+  // Relatively quick way to determine no. of documents, totalled over the shards like the QIDFs.
+  for (s = 0; s < qoenv->ixenv->num_shards; s++) N += (double)(qoenv->ixenv->segments[s]->dsz / DTE_LENGTH);
+  if (qex->qtc != NULL) qex->qtc->global_idf_lookups++;
+  if (vocab_entry == NULL) return log(N);   // Same as a term which occurs only once.
+  vocabfile_entry_unpacker(vocab_entry, MAX_WD_LEN + 1, &ig1, &qidf, &ig2);
+  return get_idf_from_quantized(N, 0XFF, qidf);
+}
+
+
 
 #define MATCHES_WORD_IN_PHRASE (u_char *)1000
 
@@ -536,9 +555,77 @@ static int term_match(u_char **dwds, int dwd_cnt, int *d, u_char *qterm, int deb
 }
 
 
+static void match_counts_from_termids(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+				      u_short *nf_record, int dwd_cnt, u_int *qids, double *Q, double *D, double *I,
+				      double *M, double *S, u_int *terms_matched_bits) {
+  // The equivalent of the matching of document words against query words in classification_score(),
+  // for a query whose terms are all words, with term ids qids, and the first dwd_cnt words of the
+  // document whose QBASH.normforward record is nf_record.  Compares term ids rather than strings,
+  // and takes the IDFs of document words straight from the vocab entries.  The caller must ensure
+  // that the record is from one of the shards if IDFs are used.
+  u_int *dids = nf_termids(nf_record), thisbit;
+  int d, q, effective_q = 0, span_start = dwd_cnt, span_end = -1, index_within_span = 0, iI = 0;
+  short qmatch[WDPOS_MASK + 1];  // -1 for an unmatched document word, else the effective_q of the match
+  BOOL found, use_idfs = (qoenv->classifier_mode == 2 || qoenv->classifier_mode == 4);
+  byte *vocab = qex->segment_ixenv->vocab;
+
+  *Q = 0;
+  *D = 0;
+  *I = 0;
+  *M = 0;
+  *S = 0;
+  for (d = 0; d < dwd_cnt; d++) {
+    qmatch[d] = -1;
+    if (use_idfs) *D += (float)get_global_idf_of_vocab_entry(qoenv, qex, vocab + (size_t)dids[d] * VOCABFILE_REC_LEN);
+  }
+  if (!use_idfs) *D = (float)dwd_cnt;
+
+  thisbit = 1 << (qex->qwd_cnt - 1);  
+  for (q = 0; q < qex->qwd_cnt; q++) {
+    found = FALSE;
+    for (d = 0; d < dwd_cnt; d++) {
+      if (qmatch[d] < 0 && dids[d] == qids[q]) {
+	qmatch[d] = (short)effective_q++;
+	found = TRUE;
+	if (d > span_end) span_end = d;
+	if (d < span_start) span_start = d;
+	break;
+      }
+    }
+    if (found) *terms_matched_bits |= thisbit;
+    thisbit >>= 1;
+    if (use_idfs) {
+      if (found) *Q += (float)get_global_idf(qoenv, qex, qex->qterms[q]);
+      else *M += (float)get_global_idf(qoenv, qex, qex->qterms[q]);
+    }
+    else {
+      if (found) (*Q)++; else (*M)++;
+    }
+  }
+
+  // Insertions and out-of-order pairs within the span, as in classification_score()
+  for (d = span_start; d <= span_end; d++) {
+    if (qmatch[d] < 0) {
+      if (use_idfs) {
+	*I += (float)get_global_idf_of_vocab_entry(qoenv, qex, vocab + (size_t)dids[d] * VOCABFILE_REC_LEN);
+	qex->op_count[COUNT_TLKP].count++;
+      }
+      else {
+	(*I)++;
+      }
+      iI++;
+    }
+    else if (qmatch[d] != (index_within_span - iI)) {
+      *S += 0.5;
+    }
+    index_within_span++;
+  }
+}
+
+
 double classification_score(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
 			    unsigned long long *dtent, u_char *dc_copy,	size_t dc_len, int dwd_cnt,
-			    byte *match_flags, double *FV, u_int *terms_matched_bits) {
+			    u_short *nf_record, byte *match_flags, double *FV, u_int *terms_matched_bits) {
   // dc_copy is the copied, case-folded and substituted content of a document matching 
   // the query represented by qwds (an array of query words) and qwd_cnt (how many words there are in the query.)
   // This function first breaks up the document content into words then finds the segment of the document which 
@@ -579,6 +666,7 @@ double classification_score(query_processing_environment_t *qoenv, book_keeping_
   //   7 - Jaccard DOLM  (using counts or IDFs depending upon mode)
   //   8 - Non-Jaccard DOLM (using counts or IDFs depending upon mode)%
   // This function expects FV to be zero on entry
+  // nf_record is the document's QBASH.normforward record, if dc_copy came from it, or NULL.
 
   u_char **dwds = NULL, *doc, **qwds = qex->qterms;
   int d = 0, q = 0, effective_q = 0, span_start = 0, span_end = 0, index_within_span = 0, 
@@ -590,9 +678,9 @@ double classification_score(query_processing_environment_t *qoenv, book_keeping_
   double denom = 0.0, denom_limit = 0.0;
 #endif
   
-  BOOL found = FALSE, explain = (qoenv->debug >= 1);
+  BOOL found = FALSE, explain = (qoenv->debug >= 1), use_termids;
   double score_from_doctable = 0.0, rectype_score = 0.0;
-  u_int thisbit;
+  u_int thisbit, *qids = NULL;
   //if (qoenv->classifier_mode == 2) test_get_global_idf(qoenv);
 
 
@@ -614,163 +702,181 @@ double classification_score(query_processing_environment_t *qoenv, book_keeping_
   if (dc_len > MAX_RESULT_LEN) return 0.0;
 
 
-  // ====================== This block of code copied from extract_text_features() and modded ==================
+  // Document words can be compared with query words as integers if the document has a QBASH.normforward
+  // record with all its words in the vocab, and the query terms are all words.  The IDFs of the
+  // document words are only taken from the record if they'd be looked up in the same vocab.
+  use_termids = (nf_record != NULL && !explain && (nf_record[3] & NF_ALL_IN_VOCAB)
+		 && (nf_record[2] < WDPOS_MASK || nf_record[2] >= dwd_cnt)
+		 && ((qoenv->classifier_mode != 2 && qoenv->classifier_mode != 4)
+		     || qex->segment < qoenv->ixenv->num_shards));
+  if (use_termids) {
+    qids = query_term_ids(qex, qex->segment_ixenv);
+    use_termids = qex->qterms_all_words;
+  }
 
-  dwds = (u_char **)malloc(dwd_cnt * sizeof(u_char **));  // MAL0007
-  if (dwds == NULL) {
-    return 0.0;   // Malloc failed is a very serious error, but what can we do?
+  if (use_termids) {
+    if (nf_record[2] < dwd_cnt) dwd_cnt = nf_record[2];
+    match_counts_from_termids(qoenv, qex, nf_record, dwd_cnt, qids, &Q, &D, &I, &M, &S, terms_matched_bits);
   }
+  else {
+    // ====================== This block of code copied from extract_text_features() and modded ==================
 
-  if (explain) printf("classification_score(%s): dwd_cnt = %d\n",
-				dc_copy, dwd_cnt);
-
-  if (0) printf(" classy dc_copy = '%s'\n", dc_copy);
-  // dc_copy is already case folded
-  actual_dwd_cnt = utf8_split_line_into_null_terminated_words(dc_copy, dwds, dwd_cnt,
-							      MAX_WD_LEN,
-							      FALSE, FALSE, FALSE, FALSE);
-  if (actual_dwd_cnt != dwd_cnt) {
-    int doclen_inwords;
-    if (qoenv->debug >= 1) {
-      printf("Warning: dwd_cnt, expected %d, got %d in '%s'\n",
-	     dwd_cnt, actual_dwd_cnt, dc_copy);
-      doc = get_doc(dtent, qoenv->ixenv->forward, &doclen_inwords, qoenv->ixenv->fsz);
-
-      show_string_upto_nator(doc, '\t', 0);
-
-      for (d = 0; d < actual_dwd_cnt; d++) printf(" %3d: %s\n", d, dwds[d]);
-      exit(0);  // Can't exit except in debug mode.
+    dwds = (u_char **)malloc(dwd_cnt * sizeof(u_char **));  // MAL0007
+    if (dwds == NULL) {
+      return 0.0;   // Malloc failed is a very serious error, but what can we do?
     }
-    dwd_cnt = actual_dwd_cnt;
-  }
 
+    if (explain) printf("classification_score(%s): dwd_cnt = %d\n",
+  				dc_copy, dwd_cnt);
 
-  if (0) {
-    printf("Doc split into: \n");
-    for (d = 0; d < dwd_cnt; d++) printf("  %s\n", dwds[d]);
-  }
-  // =====================================================================================================
-  Q = 0;
-  D = 0;
-  if (qoenv->classifier_mode == 2 || qoenv->classifier_mode == 4) {
-    // Note: dwds[i] have been lower-cased.
-    for (d = 0; d < dwd_cnt; d++) D += (float)get_global_idf(qoenv, dwds[d]);
-  }
-  else {
-    D = (float)dwd_cnt;
-  }
-  iI = 0;
-  I = 0;
-  M = 0;
-  S = 0;
-  span_start = dwd_cnt;
-  span_end = -1;
-
-  //  ---- These nested loops find a span of words in the document which includes one occurrence of each
-  // of the words in the intersection of the query and the document.   Unfortunately this block of code
-  // needs to be replaced so as to find the best span rather than the first one.   However, in the meantime,
-  // we can use it to develop the rest of the machinery.
-  effective_q = 0;
+    if (0) printf(" classy dc_copy = '%s'\n", dc_copy);
+    // dc_copy is already case folded
+    actual_dwd_cnt = utf8_split_line_into_null_terminated_words(dc_copy, dwds, dwd_cnt,
+  							      MAX_WD_LEN,
+  							      FALSE, FALSE, FALSE, FALSE);
+    if (actual_dwd_cnt != dwd_cnt) {
+      int doclen_inwords;
+      if (qoenv->debug >= 1) {
+        printf("Warning: dwd_cnt, expected %d, got %d in '%s'\n",
+  	     dwd_cnt, actual_dwd_cnt, dc_copy);
+        doc = get_doc(dtent, qex->segment_ixenv->forward, &doclen_inwords, qex->segment_ixenv->fsz);
 
-  thisbit = 1 << (qex->qwd_cnt - 1);  
-  for (q = 0; q < qex->qwd_cnt; q++) {
-    if (explain) printf("Query term[%d] = '%s'. Thisbit= %X\n", q, qwds[q], thisbit);
-    found = FALSE;
-    for (d = 0; d < dwd_cnt; d++) {
-      if (dwds[d] <= (u_char *)MATCHES_WORD_IN_PHRASE) continue;   // Avoid looking at a document word which has already been matched
-      if (0) printf("  Attempting to match against doc word %d '%s'\n", d, dwds[d]);
-      // term_match() takes care of matching complex terms e.g. disjunction containing phrase(s)
-      // as well as simple word matching
-      if ((dwds_matched = term_match(dwds, dwd_cnt, &d, qwds[q], qoenv->debug))) {
-	//    ***NOTE: The value of d is potentially increased by the term_match() call.  ***
-	// We've found the first occurrence of this query term in the doc.  Mark the corresponding
-	// document words so we don't match them again if we have repeated query words
-	int w;
-	if (explain) printf("dwds_matched = %d, d = %d, Q = %.0f\n", dwds_matched, d, Q);
-	// mark the matched word, or the last word in a matched phrase with the effective index within the query
-	dwds[d] = (u_char *)(long long)effective_q;  // This is the index of the matching word within the query (excluding missings), cast as a pointer
-	effective_q++;
-	for (w = 1; w < dwds_matched; w++) {
-	  dwds[d - w] = MATCHES_WORD_IN_PHRASE;  // Mark the leading words in the phrase
-	}
-	found = TRUE;
-	if (d > span_end) span_end = d;
-	w = d - dwds_matched + 1;
-	if (w < span_start) span_start = w;
-	if (0) printf(" ....... matched! dwds_matched = %d\n", dwds_matched);
-	break;
+        show_string_upto_nator(doc, '\t', 0);
+
+        for (d = 0; d < actual_dwd_cnt; d++) printf(" %3d: %s\n", d, dwds[d]);
+        exit(0);  // Can't exit except in debug mode.
       }
+      dwd_cnt = actual_dwd_cnt;
     }
 
-    if (found) *terms_matched_bits |= thisbit;
-    thisbit >>= 1;
+
+    if (0) {
+      printf("Doc split into: \n");
+      for (d = 0; d < dwd_cnt; d++) printf("  %s\n", dwds[d]);
+    }
+    // =====================================================================================================
+    Q = 0;
+    D = 0;
     if (qoenv->classifier_mode == 2 || qoenv->classifier_mode == 4) {
-      if (found) Q += (float)get_global_idf(qoenv, qwds[q]);
-      else M += (float)get_global_idf(qoenv, qwds[q]);
-      if (0) printf(" g_g_i(%s) = %.4f\n", qwds[q], get_global_idf(qoenv, qwds[q]));
+      // Note: dwds[i] have been lower-cased.
+      for (d = 0; d < dwd_cnt; d++) D += (float)get_global_idf(qoenv, qex, dwds[d]);
     }
     else {
-      if (found) Q += dwds_matched; else M++;
-      if (0) printf("       Q = %.3f, M = %.3f, dwds_matched = %d\n", Q, M, dwds_matched);
+      D = (float)dwd_cnt;
     }
-  }
-
-  // At this point, we have:
-  //  - accurate values for D, Q and M
-  //  - Indexes of a sub_sequence of the doc containing the first occurrence of each of the query words which are matched.
-  // Now lets count I and S
-
-#if 0  // Not sure that this saves any worthwhile time
-  denom_limit = Q / thresh + (float) 0.1;  // Once the denominator exceeds this value we can take an early exit (0.1 is a safety allowance)
-  denom = D + M;
-  if ((qoenv->classifier_mode == 1 || qoenv->classifier_mode == 3)
-      && denom > denom_limit) {
-    if (explain) printf(" - Early exit because %.3f (= %.3f + %.3f) > %.3f (= %.3f / (%.3f + 0.1))\n",
-				  denom, D, M, denom_limit, Q, thresh);
-    free(dwds);
-    return 0.0;   // --------------------------------------------------> 
-  }
-#endif
-
-  if (explain) printf("  found a span from %d to %d\n", span_start, span_end);
+    iI = 0;
+    I = 0;
+    M = 0;
+    S = 0;
+    span_start = dwd_cnt;
+    span_end = -1;
+
+    //  ---- These nested loops find a span of words in the document which includes one occurrence of each
+    // of the words in the intersection of the query and the document.   Unfortunately this block of code
+    // needs to be replaced so as to find the best span rather than the first one.   However, in the meantime,
+    // we can use it to develop the rest of the machinery.
+    effective_q = 0;
+
+    thisbit = 1 << (qex->qwd_cnt - 1);  
+    for (q = 0; q < qex->qwd_cnt; q++) {
+      if (explain) printf("Query term[%d] = '%s'. Thisbit= %X\n", q, qwds[q], thisbit);
+      found = FALSE;
+      for (d = 0; d < dwd_cnt; d++) {
+        if (dwds[d] <= (u_char *)MATCHES_WORD_IN_PHRASE) continue;   // Avoid looking at a document word which has already been matched
+        if (0) printf("  Attempting to match against doc word %d '%s'\n", d, dwds[d]);
+        // term_match() takes care of matching complex terms e.g. disjunction containing phrase(s)
+        // as well as simple word matching
+        if ((dwds_matched = term_match(dwds, dwd_cnt, &d, qwds[q], qoenv->debug))) {
+  	//    ***NOTE: The value of d is potentially increased by the term_match() call.  ***
+  	// We've found the first occurrence of this query term in the doc.  Mark the corresponding
+  	// document words so we don't match them again if we have repeated query words
+  	int w;
+  	if (explain) printf("dwds_matched = %d, d = %d, Q = %.0f\n", dwds_matched, d, Q);
+  	// mark the matched word, or the last word in a matched phrase with the effective index within the query
+  	dwds[d] = (u_char *)(long long)effective_q;  // This is the index of the matching word within the query (excluding missings), cast as a pointer
+  	effective_q++;
+  	for (w = 1; w < dwds_matched; w++) {
+  	  dwds[d - w] = MATCHES_WORD_IN_PHRASE;  // Mark the leading words in the phrase
+  	}
+  	found = TRUE;
+  	if (d > span_end) span_end = d;
+  	w = d - dwds_matched + 1;
+  	if (w < span_start) span_start = w;
+  	if (0) printf(" ....... matched! dwds_matched = %d\n", dwds_matched);
+  	break;
+        }
+      }
 
-  index_within_span = 0;
-  for (d = span_start; d <= span_end; d++) {
-    // dwds[d] is one of three things:
-    //	  Case 1. a pointer to the original document word in dc_copy  (an unmatched word)
-    //	  Case 2. the index of a word within the query (cast as a pointer), e.g. 3
-    //    Case 3. a code MATCHES_WORD_IN_PHRASE (cast as a pointer)
-    if (dwds[d] >= dc_copy) {
-      // It's still a pointer to the document word, so it must be an insertion.
+      if (found) *terms_matched_bits |= thisbit;
+      thisbit >>= 1;
       if (qoenv->classifier_mode == 2 || qoenv->classifier_mode == 4) {
-	// Note: dwds[i] have been lower-cased.
-	I += (float)get_global_idf(qoenv, dwds[d]);
-	qex->op_count[COUNT_TLKP].count++;
+        if (found) Q += (float)get_global_idf(qoenv, qex, qwds[q]);
+        else M += (float)get_global_idf(qoenv, qex, qwds[q]);
+        if (0) printf(" g_g_i(%s) = %.4f\n", qwds[q], get_global_idf(qoenv, qex, qwds[q]));
       }
       else {
-	I++;
+        if (found) Q += dwds_matched; else M++;
+        if (0) printf("       Q = %.3f, M = %.3f, dwds_matched = %d\n", Q, M, dwds_matched);
       }
-      iI++;
-      index_within_span++;
     }
-    else if (dwds[d] == MATCHES_WORD_IN_PHRASE) {
-      // It's one of the leading words of a phrase.
 
-    } else {
-      // It's a query word occurrence 
-      if ((long long)dwds[d] != (index_within_span - iI)) {
-	// This is half of an out-of-order pair.   Don't know what the penalty should be when we're summing 
-	// IDFs
-	S += 0.5;
-	if (explain)printf("d = %d index_within_span = %d dwds[d] = %lld iI = %d, S = %.4f\n",
-				     d, index_within_span, (long long)dwds[d], iI, S);
+    // At this point, we have:
+    //  - accurate values for D, Q and M
+    //  - Indexes of a sub_sequence of the doc containing the first occurrence of each of the query words which are matched.
+    // Now lets count I and S
+
+  #if 0  // Not sure that this saves any worthwhile time
+    denom_limit = Q / thresh + (float) 0.1;  // Once the denominator exceeds this value we can take an early exit (0.1 is a safety allowance)
+    denom = D + M;
+    if ((qoenv->classifier_mode == 1 || qoenv->classifier_mode == 3)
+        && denom > denom_limit) {
+      if (explain) printf(" - Early exit because %.3f (= %.3f + %.3f) > %.3f (= %.3f / (%.3f + 0.1))\n",
+  				  denom, D, M, denom_limit, Q, thresh);
+      free(dwds);
+      return 0.0;   // --------------------------------------------------> 
+    }
+  #endif
+
+    if (explain) printf("  found a span from %d to %d\n", span_start, span_end);
+
+    index_within_span = 0;
+    for (d = span_start; d <= span_end; d++) {
+      // dwds[d] is one of three things:
+      //	  Case 1. a pointer to the original document word in dc_copy  (an unmatched word)
+      //	  Case 2. the index of a word within the query (cast as a pointer), e.g. 3
+      //    Case 3. a code MATCHES_WORD_IN_PHRASE (cast as a pointer)
+      if (dwds[d] >= dc_copy) {
+        // It's still a pointer to the document word, so it must be an insertion.
+        if (qoenv->classifier_mode == 2 || qoenv->classifier_mode == 4) {
+  	// Note: dwds[i] have been lower-cased.
+  	I += (float)get_global_idf(qoenv, qex, dwds[d]);
+  	qex->op_count[COUNT_TLKP].count++;
+        }
+        else {
+  	I++;
+        }
+        iI++;
+        index_within_span++;
+      }
+      else if (dwds[d] == MATCHES_WORD_IN_PHRASE) {
+        // It's one of the leading words of a phrase.
+
+      } else {
+        // It's a query word occurrence 
+        if ((long long)dwds[d] != (index_within_span - iI)) {
+  	// This is half of an out-of-order pair.   Don't know what the penalty should be when we're summing 
+  	// IDFs
+  	S += 0.5;
+  	if (explain)printf("d = %d index_within_span = %d dwds[d] = %lld iI = %d, S = %.4f\n",
+  				     d, index_within_span, (long long)dwds[d], iI, S);
+        }
+        index_within_span++;
       }
-      index_within_span++;
     }
-  }
 
 
-  free(dwds);    // FRE0007
+    free(dwds);    // FRE0007
+  }
 
 
   if (qoenv->classifier_mode == 3 || qoenv->classifier_mode == 4) {
@@ -833,8 +939,8 @@ double classification_score(query_processing_environment_t *qoenv, book_keeping_
       }
       rectype_score = 0;
     } else {
-      rectype_score = get_rectype_score_from_forward(dtent, qoenv->ixenv->forward,
-						     qoenv->ixenv->fsz, qoenv->extracol);
+      rectype_score = get_rectype_score_from_forward(dtent, qex->segment_ixenv->forward,
+						     qex->segment_ixenv->fsz, qoenv->extracol);
     }
   }
   if (0) printf("   result:  %.5f\n", rslt);
@@ -928,10 +1034,11 @@ int run_bagsim_tests() {
 
 static u_char *code_flags_and_terms_which_matched(query_processing_environment_t *local_qenv,
 						  book_keeping_for_one_query_t *qex, 
-						  candidate_t *candy, u_char *doc) {
+						  candidate_t *candy, double *FV, u_char *doc) {
   // Caller's responsibility to free the returned string.
   //
   // Now also responsible for displaying the featre
+  // vector FV, which is candy's entry in qex->candidate_FVsa
   size_t space_needed = 15, code_len, space_needed_for_field_3 = 0,
     space_needed_for_jo = 0;
   int q;
@@ -1083,12 +1190,12 @@ static u_char *code_flags_and_terms_which_matched(query_processing_environment_t
     // Guaranteed not to overflow the generous FV_ELTS * 12 bytes allocated, including null termination.
 #ifdef WIN64
     sprintf_s((char *)w, (size_t)(FV_ELTS * 12), "\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f",
-	      candy->FV[0], candy->FV[1], candy->FV[2], candy->FV[3], 
-	      candy->FV[4], candy->FV[5], candy->FV[6], candy->FV[7], candy->FV[8]);
+	      FV[0], FV[1], FV[2], FV[3], 
+	      FV[4], FV[5], FV[6], FV[7], FV[8]);
 #else
     sprintf((char *)w, "\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f\t%.5f",
-	    candy->FV[0], candy->FV[1], candy->FV[2], candy->FV[3], 
-	    candy->FV[4], candy->FV[5], candy->FV[6], candy->FV[7], candy->FV[8]);
+	    FV[0], FV[1], FV[2], FV[3], 
+	    FV[4], FV[5], FV[6], FV[7], FV[8]);
 #endif
   }
 
@@ -1098,13 +1205,13 @@ static u_char *code_flags_and_terms_which_matched(query_processing_environment_t
 }
 
 void classifier(query_processing_environment_t *local_qenv, book_keeping_for_one_query_t *qex,
-		byte *forward, byte *doctable, size_t fsz, double score_multiplier) {
+		index_environment_t *ixenv, double score_multiplier) {
   // I think this is only called if there is at least one candidate.
   //
   // We've run saat_relaxed_and and put the candidates in the result blocks
   // of candidatesa.  Possibly_record_candidate() has actually calculated the classification
   // score and recorded it in the .score members of the candidates (assuming the DOLM exceeds
-  // the specified threshold.)
+  // the specified threshold.)  The candidates may come from any segment of ixenv.
 
   // Ignore rank_only stuff.
 
@@ -1115,8 +1222,9 @@ void classifier(query_processing_environment_t *local_qenv, book_keeping_for_one
   int r, s, doclen_inwords, showlen, rb, best_rb, total_candidates = 0, *pos_in_rb;
   unsigned long long *dtent;  // Excluding the signature part
   docnum_t d;
-  byte *doc, *what2show, *details = NULL;
+  byte *doc, *what2show, *details = NULL, *forward;
   double best_score, highest_score;
+  index_environment_t *segment;
 
 
   if (0) local_qenv->debug = 2;
@@ -1162,21 +1270,24 @@ void classifier(query_processing_environment_t *local_qenv, book_keeping_for_one
 
     s = pos_in_rb[best_rb];
     d = candidates_to_use[s].doc;
-    dtent = (unsigned long long *)(doctable + (d * DTE_LENGTH));
-    doc = get_doc(dtent, forward, &doclen_inwords, fsz);
-    details = code_flags_and_terms_which_matched(local_qenv, qex, candidates_to_use + s, doc);
+    segment = ixenv->segments[candidates_to_use[s].segment];
+    forward = segment->forward;
+    dtent = (unsigned long long *)(segment->doctable + (d * DTE_LENGTH));
+    doc = get_doc(dtent, forward, &doclen_inwords, segment->fsz);
+    details = code_flags_and_terms_which_matched(local_qenv, qex, candidates_to_use + s,
+						 qex->candidate_FVsa[best_rb] + s * FV_ELTS, doc);
     if (local_qenv->debug >= 1) printf("Details:  %s\n", details);
     if (local_qenv->include_result_details) {
-      what2show = what_to_show((long long)(doc - forward), doc, &showlen, local_qenv->displaycol, details);
+      what2show = what_to_show(qex->arena, (long long)(doc - forward), doc, &showlen, local_qenv->displaycol, details);
       if (0) printf("    what2show: %s\n", what2show);
       if (details != NULL) free(details);
       details = NULL;
     }
     else
-      what2show = what_to_show((long long)(doc - forward), doc, &showlen, local_qenv->displaycol, NULL);
+      what2show = what_to_show(qex->arena, (long long)(doc - forward), doc, &showlen, local_qenv->displaycol, NULL);
     if (what2show != NULL)  {  // Could be NULL in case of memory failure in what_to_show
-      qex->tl_docids[qex->tl_returned] = d;
-      qex->tl_suggestions[qex->tl_returned] = what2show;  // That's in malloced storage (MAL2006)
+      qex->tl_docids[qex->tl_returned] = segment_docid(candidates_to_use[s].segment, d);
+      qex->tl_suggestions[qex->tl_returned] = what2show;  // That's in the query's arena (MAL2006)
       qex->tl_scores[qex->tl_returned++] = candidates_to_use[s].score * score_multiplier;
       if (0) printf("    r = %d, s = %d, best_rb = %d.  Score: %.4f\n", r, s, best_rb, candidates_to_use[s].score);
     }
@@ -1213,7 +1324,7 @@ void classifier(query_processing_environment_t *local_qenv, book_keeping_for_one
 	  size_t len;
 	  byte *old = qex->tl_suggestions[0];
 	  len = strlen((char *)old);
-	  qex->tl_suggestions[0] = (u_char *)malloc(len + 13);
+	  qex->tl_suggestions[0] = (u_char *)query_arena_alloc(qex->arena, len + 13);
 	  if (qex->tl_suggestions[0] == NULL) {
 	    // Curses - leave well alone!
 	    qex->tl_suggestions[0] = old;
@@ -1221,6 +1332,7 @@ void classifier(query_processing_environment_t *local_qenv, book_keeping_for_one
 	  else {
 	    strcpy((char *)qex->tl_suggestions[0], "AMBIGUOUS: ");
 	    strcpy((char *)qex->tl_suggestions[0] + 11, (char *)old);
+	    query_arena_free(qex->arena, old);  // FRE2006
 	    break;
 	  }
 	}
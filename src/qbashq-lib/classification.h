@@ -20,9 +20,9 @@ int apply_amazon_specific_rules(char *qstring);
 
 double classification_score(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
 			    unsigned long long *dtent, u_char *doc_content, size_t dc_len,
-			    int dwd_cnt, byte *match_flags, double *FV, u_int *terms_matched_bits);
+			    int dwd_cnt, u_short *nf_record, byte *match_flags, double *FV, u_int *terms_matched_bits);
 
 void classifier(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
-		byte *forward, byte *doctable, size_t fsz, double score_multiplier);
+		index_environment_t *ixenv, double score_multiplier);
 
 double get_rectype_score_from_forward(u_ll *dtent, byte *forward, size_t fsz, int rectype_field);
@@ -42,7 +42,7 @@
 #include "../utils/dahash.h"
 #include "QBASHQ.h"
 
-#define MAX_QBASHER_DEFINED_ERROR_CODE 83
+#define MAX_QBASHER_DEFINED_ERROR_CODE 87
 
 // Severity (0, 1, 2) * 100000 + Category (0, 1, 2, 3, 4) * 10000 + error number % 10000
 // 
@@ -134,6 +134,11 @@ err_desc_t error_code_explanations[] = {
 	{ 220081, "Object Store: malloc failure for segment_rules in NativeInitializeSharedFiles().\n" },
 	{ 220082, "Object Store: malloc failure for subsitution_rules in NativeInitializeSharedFiles().\n" },
 	{ 40083, "Language lookup failed while loading segment or substitution rules.\n" },
+	{ 220084, "Failed to allocate memory for a decoded postings block in setup_word_node().\n" },
+	{ 220085, "Failed to allocate memory for parallel segment searches in process_query().\n" },
+	{ 220086, "Failed to allocate memory for accumulators in saat_impact_search().\n" },
+	{ 200087, "Unrecognized value for the engine option.  It must be relaxed_and or saat_impact.\n" },
+	{ 220088, "Failed to allocate memory for candidate details or feature vectors in allocate_candidate_blocks().\n" },
 };
 
 
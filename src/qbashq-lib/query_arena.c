@@ -0,0 +1,137 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// A per-thread bump allocator for per-query storage.  See query_arena.h.
+//
+// Storage is carved from a chunk, in multiples of QA_ALIGN bytes.  When a query needs more than
+// the current chunk holds, a chunk twice the size (or bigger if need be) is malloced and the
+// old one is kept until the next reset.  If the arena had to grow, the reset replaces all its
+// chunks with a single one big enough for everything the last query used, so a thread soon
+// settles on one chunk and stops allocating.  Chunks bigger than QA_MAX_RETAINED aren't kept
+// across resets, so that one huge query doesn't tie up memory for the life of the thread.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../shared/unicode.h"
+#include "query_arena.h"
+
+#define QA_ALIGN 16
+#define QA_MIN_CHUNK (64 * 1024)
+#define QA_MAX_RETAINED (64 * 1024 * 1024)
+
+typedef struct qa_chunk {
+  struct qa_chunk *prev;   // The chunk filled before this one since the last reset, or NULL
+  size_t size;             // Bytes available for allocation, following the header
+} qa_chunk_t;
+
+// Allocations start this far into a chunk, keeping them aligned.
+#define QA_HEADER_BYTES ((sizeof(qa_chunk_t) + QA_ALIGN - 1) & ~(size_t)(QA_ALIGN - 1))
+
+struct query_arena {
+  qa_chunk_t *chunk;       // The chunk currently being allocated from
+  size_t used;             // Bytes of chunk already allocated
+};
+
+
+static qa_chunk_t *new_chunk(size_t size) {
+  qa_chunk_t *c;
+  c = (qa_chunk_t *)malloc(QA_HEADER_BYTES + size);  // MAL1140
+  if (c == NULL) return NULL;
+  c->prev = NULL;
+  c->size = size;
+  return c;
+}
+
+
+static void free_chunks(qa_chunk_t *c) {
+  qa_chunk_t *prev;
+  while (c != NULL) {
+    prev = c->prev;
+    free(c);  // FRE1140
+    c = prev;
+  }
+}
+
+
+query_arena_t *query_arena_create(size_t initial_bytes) {
+  // Return a new arena with a first chunk of at least initial_bytes, or NULL if malloc fails.
+  query_arena_t *arena;
+  arena = (query_arena_t *)malloc(sizeof(query_arena_t));  // MAL1141
+  if (arena == NULL) return NULL;
+  if (initial_bytes < QA_MIN_CHUNK) initial_bytes = QA_MIN_CHUNK;
+  arena->chunk = new_chunk(initial_bytes);
+  arena->used = 0;
+  if (arena->chunk == NULL) {
+    free(arena);  // FRE1141
+    return NULL;  // -------------------------------->
+  }
+  return arena;
+}
+
+
+void query_arena_destroy(query_arena_t **arenap) {
+  query_arena_t *arena = *arenap;
+  if (arena == NULL) return;
+  free_chunks(arena->chunk);
+  free(arena);  // FRE1141
+  *arenap = NULL;
+}
+
+
+void query_arena_reset(query_arena_t *arena) {
+  // Make all the arena's storage available again.  Nothing previously allocated from it may be
+  // used after this.
+  qa_chunk_t *c;
+  size_t total = 0;
+  if (arena == NULL) return;
+  if (arena->chunk != NULL && arena->chunk->prev != NULL) {
+    // The last query overflowed the first chunk.  Consolidate.
+    for (c = arena->chunk; c != NULL; c = c->prev) total += c->size;
+    free_chunks(arena->chunk);
+    if (total > QA_MAX_RETAINED) total = QA_MIN_CHUNK;
+    arena->chunk = new_chunk(total);  // If this fails, query_arena_alloc() will try again.
+  }
+  arena->used = 0;
+}
+
+
+void *query_arena_alloc(query_arena_t *arena, size_t bytes) {
+  // Return storage for bytes bytes, aligned to QA_ALIGN, or NULL if it can't be had.
+  qa_chunk_t *c;
+  size_t size;
+  void *p;
+
+  if (arena == NULL) return malloc(bytes);  // -------------------------------->
+
+  bytes = (bytes + QA_ALIGN - 1) & ~(size_t)(QA_ALIGN - 1);
+  if (bytes == 0) bytes = QA_ALIGN;   // Like malloc(0), return a distinct pointer
+  if (arena->chunk == NULL || arena->used + bytes > arena->chunk->size) {
+    size = (arena->chunk == NULL) ? QA_MIN_CHUNK : 2 * arena->chunk->size;
+    if (size < bytes) size = bytes;
+    c = new_chunk(size);
+    if (c == NULL) return NULL;  // -------------------------------->
+    c->prev = arena->chunk;
+    arena->chunk = c;
+    arena->used = 0;
+  }
+  p = (byte *)arena->chunk + QA_HEADER_BYTES + arena->used;
+  arena->used += bytes;
+  return p;
+}
+
+
+void *query_arena_calloc(query_arena_t *arena, size_t count, size_t size) {
+  void *p;
+  if (arena == NULL) return calloc(count, size);  // -------------------------------->
+  p = query_arena_alloc(arena, count * size);
+  if (p != NULL) memset(p, 0, count * size);
+  return p;
+}
+
+
+void query_arena_free(query_arena_t *arena, void *p) {
+  // Storage from an arena is only reclaimed by query_arena_reset()
+  if (arena == NULL) free(p);
+}
@@ -0,0 +1,26 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// A bump allocator for the memory used in processing one query.  Each query_thread_context_t
+// has one, which handle_multi_query() resets at the start of every query, so that storage
+// allocated from it lasts until the thread's next query and query_arena_free() does nothing.
+// Once the arena has grown to what the thread's queries need, allocating from it costs no
+// system allocations.
+//
+// All the functions accept a NULL arena, meaning that malloc() and free() are to be used.
+// That's the case for callers of handle_multi_query() without a thread context, and for the
+// helper threads which search segments in parallel.  See query_arena.c
+
+typedef struct query_arena query_arena_t;
+
+query_arena_t *query_arena_create(size_t initial_bytes);
+
+void query_arena_destroy(query_arena_t **arenap);
+
+void query_arena_reset(query_arena_t *arena);
+
+void *query_arena_alloc(query_arena_t *arena, size_t bytes);
+
+void *query_arena_calloc(query_arena_t *arena, size_t count, size_t size);
+
+void query_arena_free(query_arena_t *arena, void *p);
@@ -138,7 +138,7 @@ void create_candidate_generation_query(query_processing_environment_t *qoenv,
       for (u = 0; u < qex->qwd_cnt; u++) {
 	wd = qex->qterms[u];
 	if (*wd == '"' || *wd == '[') continue;  // Never zap phrases or disjunctions
-	vocab_entry = lookup_word(wd, qoenv->ixenv->vocab, qoenv->ixenv->vsz, qoenv->debug);
+	vocab_entry = lookup_word(wd, qoenv->ixenv, qoenv->debug);
 	if (vocab_entry == NULL) {
 	  // Term not found.  Zap it!
 	  zap[u] = TRUE;
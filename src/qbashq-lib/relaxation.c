@@ -135,6 +135,24 @@ static inline long long nCr(int n, int r) {
 
 #endif   // No longer used but might be useful in future
 
+#define ET_MAX_RESULTS 1000  // The maximum value of max_to_show.  See arg_parser.c
+
+static void note_score_for_early_termination(double *best, int *count, int k, double s) {
+  // best[0 .. *count - 1] are the highest k distinct scores so far, in descending order.  Add s.
+  // Distinct values are kept because rerank_and_record() may suppress a result which has the
+  // same score as one it has already placed, but never two different scores.
+  int i, j;
+  if (*count == k && s <= best[k - 1]) return;
+  for (j = 0; j < *count; j++) {
+    if (fabs(best[j] - s) <= 1e-12 * fabs(s)) return;  // Not distinct
+    if (best[j] < s) break;
+  }
+  if (*count < k) (*count)++;
+  for (i = *count - 1; i > j; i--) best[i] = best[i - 1];
+  best[j] = s;
+}
+
+
 static inline int count_one_bits(unsigned int x) {
 	int cnt = 0;
 	while (x) {
@@ -150,6 +168,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 		      int *error_code) {
   // Implements relaxed saat functionality
   //  - attempts to insert up to max_candidates_to_consider candidates into the candidates array
+  //    from qex->segment_ixenv, after any recorded from earlier segments (see qex->segment_base)
   //  - Returns zero if there are no words in the query (obviously)
   //  - Returns zero if there are more than MAX_WDS_IN_QUERY words
   //  - works even if there is only one word in the query.
@@ -168,11 +187,12 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
   //		 c. If such terms are encountered fpermute order is sort of undefined
   //       d. Maybe phrases should be put at head of list (assume low frequency) and disjunctions at tail (assume high freq, high cost)
   //   - tpermute reorders terms by increasing index of the document they currently reference.  Notes:
-  //       e. This permutation is currently calculated each time a new candidate is considered. 
+  //       e. This permutation is recalculated each time a new candidate is considered. 
   //	     f. Re-calculation of tpermute definitely pays off by reducing the number of calls to saat_skipto() and
   //          by increasing the magnitude of the skips (allowing more benefit to be obtained from skip blocks)
-  //       g. It might be possible to work out how to maintain tpermute[t] without resorting from scratch each
-  //          time but I haven't done so yet.
+  //       g. With x_incremental_tpermute (the default) tpermute isn't resorted from scratch.  Only the lists
+  //          advanced in S1 and S3 can be out of place and their curdocs can only have increased, so each of
+  //          them is moved right to a place found by binary search.  See S4.
   //
   // The algorithm starts by choosing the first candidate 'c'.   It does this by setting up tpermute and
   // choosing element q-m-1 as the candidate term, where 'm' is the relaxation level.  This is the right
@@ -198,16 +218,26 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
   //         we may repeatedly accept d.
   //
   //	   S4: Select a new candidate.  Recompute tpermute and use tpermute[q-m-1] as the next candidate
+  //
+  // Early termination (qex->early_termination):  Each candidate is scored by score_candidate() as it's
+  // recorded, and the highest max_to_show distinct scores are kept, after the penalty for missing terms.
+  // If QBASHI assigned docnums in descending order of static score, no later candidate can have a higher
+  // static score than the one chosen in S4, so score_upper_bound() on that static score bounds the score
+  // of every candidate still to come.  Once that bound is below the lowest of the kept scores, nothing
+  // still to come can reach the top max_to_show and we stop, with the same results but less postings work.
 
   int total_recorded = 0, k, l, candid8, code = 0, t = qex->tl_saat_blocks_used, pivot,
     curdoc_ranking[MAX_WDS_IN_QUERY], fpermute[MAX_WDS_IN_QUERY], u, m = qoenv->relaxation_level,
     terms_missing, terms_exhausted = 0, it_was_recorded, candidates_considered = 0, skips = 0,
     rbn = qoenv->relaxation_level + 1, rb_to_use;
+  u_int advanced_bits;  // Bit l is set if list l has been advanced since curdoc_ranking was last ordered
 
   docnum_t candidoc;
   long long possibles = 0;  // For enforcing a timeout on this thread.
   u_int rbit, terms_matched_bits;
-  BOOL finished = FALSE;
+  BOOL finished = FALSE, et_active;
+  double et_best[ET_MAX_RESULTS], et_bm25_bound = 0.0, et_bound;
+  int et_count = 0;
 
   *error_code = 0;
   if (qoenv->debug >=2)
@@ -242,6 +272,17 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 
   pivot = u - 1; 
 
+  et_active = qex->early_termination && qex->segment_ixenv->score_ordered
+    && qoenv->max_to_show > 0 && qoenv->max_to_show <= ET_MAX_RESULTS;
+  if (et_active && qoenv->rr_coeffs[5] > 0.0) {
+    // BM25 can't exceed the sum of the positive IDFs of the query terms.  See score_candidate()
+    double idf;
+    for (k = 0; k < qex->qwd_cnt; k++) {
+      idf = get_idf_from_quantized(qoenv->N, 0xFF, pl_blox[k].qidf);
+      if (idf > 0.0) et_bm25_bound += idf;
+    }
+  }
+
   if (qoenv->debug >= 2)
     fprintf(out, "saat_relaxed_and().  qex->cg_qwd_cnt = %d. R_level was %d, is %d.  "
 	    "Min terms = %d.  Looking for up to %d candidates.\n", 
@@ -296,6 +337,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 
     candidates_considered++;
     qex->op_count[COUNT_ACAN].count += qex->tl_saat_blocks_used;
+    advanced_bits = 0;
     // For a single term query, the conditional inside this loop will never be executed
     terms_missing = 0;  // How many terms are not matched by this candidate.
     terms_exhausted = 0;
@@ -319,6 +361,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	    return;  // ------------------------------------->
 	  }
 	  skips++;
+	  advanced_bits |= (1U << l);
 	}
 
 	if (qoenv->debug >= 2) fprintf(out, "    Skipped term %d.  Code is %d\n", l, code);
@@ -367,11 +410,13 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 
       if (qoenv->report_match_counts_only) {
 	//  --------------------- Special behaviour activated when max_to_show == 0 ------------------
-	if (terms_missing == 0) {
-	  qex->full_match_count++;  // Only count full matches.
+	if (terms_missing == 0 && !ts_is_set(qex->segment_ixenv->tombstones, qex->segment_ixenv->tsz,
+					      pl_blox[candid8].curdoc)) {
+	  qex->full_match_count++;  // Only count full matches of live documents.
 	  if (0) printf("FMC:  %lld\n", qex->full_match_count);
 	}
-      } else if (qex->candidates_recorded[rb_to_use] < qoenv->max_candidates_to_consider || qoenv->classifier_mode) {  // ..................................  Test on RB .....
+      } else if (qex->candidates_recorded[rb_to_use] - qex->segment_base[rb_to_use] < qoenv->max_candidates_to_consider
+		 || qoenv->classifier_mode) {  // ..................................  Test on RB .....
 	// Acceptable degree of  match, and we haven't filled up all the slots at this level of
 	// match, or we're doing the classifier pseudo-heap thing.
 
@@ -434,6 +479,19 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	if (it_was_recorded) {
 	  int stopping_condition = 2;
 
+	  if (qex->early_termination) {
+	    candidate_t *recorded = qex->candidatesa[rb_to_use] + qex->candidates_recorded[rb_to_use] - 1;
+	    double penalized;
+	    candidate_details_t *details = (qex->candidate_detailsa == NULL) ? NULL
+	      : qex->candidate_detailsa[rb_to_use] + qex->candidates_recorded[rb_to_use] - 1;
+	    recorded->score = score_candidate(qoenv, qex, qex->segment_ixenv, recorded, details);
+	    if (et_active) {
+	      penalized = recorded->score;
+	      for (k = 0; k < rb_to_use; k++) penalized *= PARTIAL_MATCH_PENALTY;
+	      note_score_for_early_termination(et_best, &et_count, qoenv->max_to_show, penalized);
+	    }
+	  }
+
 	  //  ------------------------ Stopping condition rules are different in CLASSIFIER MODES ------------------------------------
 	  if (qoenv->classifier_mode) {
 	    // There are two different early termination conditions, one which applies to the highest scoring candidate
@@ -474,7 +532,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 
 	    if (stopping_condition == 0 || m == 0) {
 	      // Stop when the first tier is full
-	      if (qex->candidates_recorded[0] >= qoenv->max_candidates_to_consider) {
+	      if (qex->candidates_recorded[0] - qex->segment_base[0] >= qoenv->max_candidates_to_consider) {
 		if (qoenv->debug >= 1) fprintf(out, "Stopping: candidates considered: %d; skips = %d\n",
 					       candidates_considered, skips);
 		return;  // FILLED ALL THE FULL MATCH SLOTS -------------------------------------------------------------->
@@ -493,7 +551,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	    else {  //  -------------- Non-trivial stopping condition 
 	      finished = TRUE;
 		
-	      if (qex->candidates_recorded[rb_to_use] >= qoenv->max_candidates_to_consider) {
+	      if (qex->candidates_recorded[rb_to_use] - qex->segment_base[rb_to_use] >= qoenv->max_candidates_to_consider) {
 		// We've just filled up a result list.  Can we now tighten up the relaxation level?
 		if (m && rb_to_use == m) {
 		  if (qoenv->debug >= 1) fprintf(out, "Shrinking relaxation_level to %d\n", m - 1);
@@ -504,7 +562,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	      for (k = 0; k < rbn; k++) {
 		if (0) fprintf(out, "Result block %d - recorded = %d / %d\n",
 			       k, qex->candidates_recorded[k], qoenv->max_candidates_to_consider);
-		if (qex->candidates_recorded[k] < qoenv->max_candidates_to_consider) {
+		if (qex->candidates_recorded[k] - qex->segment_base[k] < qoenv->max_candidates_to_consider) {
 		  finished = FALSE;
 		  break;
 		}
@@ -551,6 +609,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	  return;  // ------------------------------------->
 	}
 	skips++;
+	advanced_bits |= (1U << k);
 
 	if (qoenv->debug >= 2) fprintf(out, "  saat_relaxed_and(): Advanced term %d to (%lld, %d). Code is %d\n",
 				       k, pl_blox[k].curdoc, pl_blox[k].curwpos, code);
@@ -640,14 +699,43 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 	// Avoiding the function call by repeating the code inline here, makes some difference
 	// to speed.  There seems to be some very slight advantage to avoiding the call for one-word queries.
 	int tmp;
-	for (k = 0; k < (qex->tl_saat_blocks_used - 1); k++) {
-	  for (l = k + 1; l < qex->tl_saat_blocks_used; l++) {
-	    if (pl_blox[curdoc_ranking[l]].curdoc < pl_blox[curdoc_ranking[k]].curdoc) {
-	      tmp = curdoc_ranking[l];
-	      curdoc_ranking[l] = curdoc_ranking[k];
-	      curdoc_ranking[k] = tmp;
+	if (qoenv->x_incremental_tpermute) {
+	  // curdoc_ranking was in order before S1.  Since then, only the lists in advanced_bits have
+	  // moved, and only to higher curdocs.  Working from the right, so that everything to the right
+	  // of k is always in order, move each advanced list right to its proper place.  That costs
+	  // O(log t) comparisons per advanced list rather than O(t^2) for the whole sort.
+	  int lo, hi, mid;
+	  docnum_t cd;
+	  for (k = qex->tl_saat_blocks_used - 2; k >= 0; k--) {
+	    tmp = curdoc_ranking[k];
+	    if (!(advanced_bits & (1U << tmp))) continue;
+	    cd = pl_blox[tmp].curdoc;
+	    // Find the first place to the right of k whose curdoc is not less than cd
+	    lo = k + 1;
+	    hi = qex->tl_saat_blocks_used;
+	    while (lo < hi) {
+	      mid = (lo + hi) / 2;
+	      qex->op_count[COUNT_RANK].count++;
+	      if (pl_blox[curdoc_ranking[mid]].curdoc < cd) lo = mid + 1;
+	      else hi = mid;
+	    }
+	    if (lo > k + 1) {
+	      memmove(curdoc_ranking + k, curdoc_ranking + k + 1, (lo - k - 1) * sizeof(int));
+	      curdoc_ranking[lo - 1] = tmp;
 	    }
 	  }
+	} else {
+	  for (k = 0; k < (qex->tl_saat_blocks_used - 1); k++) {
+	    for (l = k + 1; l < qex->tl_saat_blocks_used; l++) {
+	      if (pl_blox[curdoc_ranking[l]].curdoc < pl_blox[curdoc_ranking[k]].curdoc) {
+		tmp = curdoc_ranking[l];
+		curdoc_ranking[l] = curdoc_ranking[k];
+		curdoc_ranking[k] = tmp;
+	      }
+	    }
+	  }
+	  qex->op_count[COUNT_RANK].count +=
+	    (qex->tl_saat_blocks_used * (qex->tl_saat_blocks_used - 1)) / 2;
 	}
 	candid8 = curdoc_ranking[pivot];
       }
@@ -661,6 +749,19 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 
     if (0) fprintf(out, "Chose candidate %d(u - 1 = %d) docnum is %lld.  posting_num = %lld\n", candid8, u - 1, 
 		   pl_blox[candid8].curdoc, pl_blox[candid8].posting_num);
+
+    if (et_active && et_count == qoenv->max_to_show) {
+      // Could this candidate, or any later one, make the top max_to_show?
+      et_bound = score_upper_bound(qoenv, qex, 
+				   get_score_from_dtent(*(unsigned long long *)(doctable + pl_blox[candid8].curdoc * DTE_LENGTH)),
+				   et_bm25_bound);
+      if (et_bound < et_best[et_count - 1]) {
+	if (qoenv->debug >= 1)
+	  fprintf(out, "Early termination: bound %.5f < %.5f. candidates considered: %d; skips = %d\n",
+		  et_bound, et_best[et_count - 1], candidates_considered, skips);
+	return;  // NOTHING STILL TO COME CAN MAKE THE TOP max_to_show ------------------------->
+      }
+    }
     possibles++;
 
     // If in force, check both deterministic and elapsed time timeouts every tenth possible.
@@ -670,7 +771,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 				       kop_cost(qex), qoenv->timeout_kops);
 	if (kop_cost(qex) > qoenv->timeout_kops) {
 	  qex->timed_out = TRUE;
-	  qoenv->query_timeout_count++;
+	  if (qex->qtc != NULL) qex->qtc->query_timeout_count++;
 	  if (qoenv->debug >= 1) {
 	    fprintf(out, "Timed out!(%s). Total recorded = %d.  Timeout KOPS: %d\n", 
 		    qex->query_as_processed, total_recorded, qoenv->timeout_kops);
@@ -686,7 +787,7 @@ void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_kee
 		      elapsed, qoenv->timeout_msec);
 	if (elapsed > (double)qoenv->timeout_msec) {
 	  qex->timed_out = TRUE;
-	  qoenv->query_timeout_count++;
+	  if (qex->qtc != NULL) qex->qtc->query_timeout_count++;
 	  if (qoenv->debug >= 1) {
 	    fprintf(out, "Timed out!(%s). Total recorded = %d.  Timeout msec: %d\n", 
 		    qex->query_as_processed, total_recorded, qoenv->timeout_msec);
@@ -0,0 +1,280 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// A cache of the final results of handle_multi_query().  See result_cache.h.
+//
+// Entries are chained from a fixed array of hash buckets, and are also on a doubly linked list
+// in order of last use.  Each entry is a single malloced block holding the entry header, the
+// scores, the result pointers, the key and the result strings, so its size is known exactly and
+// it can be freed in one go.  When an insertion would take the total over max_bytes, entries are
+// evicted from the least recently used end of the list.
+//
+// Cached results are copied out, rather than shared, because callers free what
+// handle_multi_query() returns with free_results_memory().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN64
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "../shared/unicode.h"
+#include "../shared/utility_nodeps.h"
+#include "../shared/QBASHER_common_definitions.h"
+#include "../imported/Fowler-Noll-Vo-hash/fnv.h"
+#include "result_cache.h"
+
+#define RC_MIN_BUCKETS 1024
+#define RC_BYTES_PER_BUCKET 512   // Roughly the size of a small entry
+
+#ifdef WIN64
+#define rc_lock(rc) AcquireSRWLockExclusive(&((rc)->lock))
+#define rc_unlock(rc) ReleaseSRWLockExclusive(&((rc)->lock))
+#else
+#define rc_lock(rc) pthread_mutex_lock(&((rc)->lock))
+#define rc_unlock(rc) pthread_mutex_unlock(&((rc)->lock))
+#endif
+
+typedef struct rc_entry {
+  struct rc_entry *chain_next, *lru_prev, *lru_next;
+  u_ll hash;
+  size_t bytes;
+  int result_count;
+  double *scores;
+  u_char **results, *key;
+} rc_entry_t;
+
+struct result_cache {
+#ifdef WIN64
+  SRWLOCK lock;
+#else
+  pthread_mutex_t lock;
+#endif
+  rc_entry_t **buckets;
+  u_ll bucket_mask;
+  rc_entry_t *lru_head, *lru_tail;   // The head is the most recently used
+  size_t max_bytes, bytes_used;
+  long long entries;
+};
+
+
+result_cache_t *result_cache_create(size_t max_bytes) {
+  // Return an empty cache which will hold up to max_bytes of entries, or NULL if memory
+  // can't be allocated.
+  result_cache_t *rc;
+  u_ll num_buckets = RC_MIN_BUCKETS;
+
+  while (num_buckets * RC_BYTES_PER_BUCKET < max_bytes) num_buckets <<= 1;
+  rc = (result_cache_t *)malloc(sizeof(result_cache_t));  // MAL2100
+  if (rc == NULL) return NULL;  // -------------------------------->
+  rc->buckets = (rc_entry_t **)calloc(num_buckets, sizeof(rc_entry_t *));  // MAL2101
+  if (rc->buckets == NULL) {
+    free(rc);  // FRE2100
+    return NULL;  // -------------------------------->
+  }
+  rc->bucket_mask = num_buckets - 1;
+  rc->lru_head = NULL;
+  rc->lru_tail = NULL;
+  rc->max_bytes = max_bytes;
+  rc->bytes_used = 0;
+  rc->entries = 0;
+#ifdef WIN64
+  InitializeSRWLock(&(rc->lock));
+#else
+  pthread_mutex_init(&(rc->lock), NULL);
+#endif
+  return rc;
+}
+
+
+static void unlink_from_lru(result_cache_t *rc, rc_entry_t *e) {
+  if (e->lru_prev == NULL) rc->lru_head = e->lru_next;
+  else e->lru_prev->lru_next = e->lru_next;
+  if (e->lru_next == NULL) rc->lru_tail = e->lru_prev;
+  else e->lru_next->lru_prev = e->lru_prev;
+}
+
+
+static void link_at_lru_head(result_cache_t *rc, rc_entry_t *e) {
+  e->lru_prev = NULL;
+  e->lru_next = rc->lru_head;
+  if (rc->lru_head != NULL) rc->lru_head->lru_prev = e;
+  rc->lru_head = e;
+  if (rc->lru_tail == NULL) rc->lru_tail = e;
+}
+
+
+static rc_entry_t *find_entry(result_cache_t *rc, u_char *key, u_ll hash) {
+  rc_entry_t *e;
+  for (e = rc->buckets[hash & rc->bucket_mask]; e != NULL; e = e->chain_next) {
+    if (e->hash == hash && !strcmp((char *)e->key, (char *)key)) return e;  // -------------------------------->
+  }
+  return NULL;
+}
+
+
+static void evict_lru_entry(result_cache_t *rc) {
+  // Remove the least recently used entry from the cache and free it.  Must be called with the lock held.
+  rc_entry_t *e = rc->lru_tail, **pp;
+  if (e == NULL) return;  // -------------------------------->
+  pp = rc->buckets + (e->hash & rc->bucket_mask);
+  while (*pp != e) pp = &((*pp)->chain_next);
+  *pp = e->chain_next;
+  unlink_from_lru(rc, e);
+  rc->bytes_used -= e->bytes;
+  rc->entries--;
+  free(e);  // FRE2102
+}
+
+
+void result_cache_destroy(result_cache_t **rcp) {
+  result_cache_t *rc = *rcp;
+  if (rc == NULL) return;  // -------------------------------->
+  while (rc->lru_tail != NULL) evict_lru_entry(rc);
+#ifndef WIN64
+  pthread_mutex_destroy(&(rc->lock));
+#endif
+  free(rc->buckets);  // FRE2101
+  free(rc);  // FRE2100
+  *rcp = NULL;
+}
+
+
+u_char *result_cache_make_key(u_char *multi_query_string) {
+  // Return a malloced copy of multi_query_string, up to the first CR or LF, in which the query
+  // part of each variant has been lower cased.  (process_query_text() lower cases it first thing,
+  // so that doesn't change the results.)  Options, weights and post-tests are kept as they are.
+  // The string is temporarily modified.  Return NULL if malloc fails.
+  u_char *key, *k, *p = multi_query_string, *q, *end, saveq;
+
+  end = multi_query_string;
+  while (*end && *end != '\r' && *end != '\n') end++;
+  key = (u_char *)malloc(end - multi_query_string + 1);  // MAL2103
+  if (key == NULL) return NULL;  // -------------------------------->
+  k = key;
+  while (p < end) {
+    q = p;
+    while (q < end && *q != '\t' && *q != ASCII_RS) q++;
+    // Lower casing never lengthens a string.  See initialize_unicode_conversion_arrays().
+    saveq = *q;
+    *q = 0;
+    k += utf8_lowering_ncopy(k, p, q - p);
+    *q = saveq;
+    while (q < end && *q != ASCII_RS) *k++ = *q++;   // The rest of the variant
+    if (q < end) *k++ = *q++;   // The RS
+    p = q;
+  }
+  *k = 0;
+  return key;
+}
+
+
+BOOL result_cache_lookup(result_cache_t *rc, u_char *key, int max_to_show, u_char ***returned_results,
+			 double **corresponding_scores, int *result_count) {
+  // If key is in the cache, make it the most recently used entry, set *returned_results and
+  // *corresponding_scores to malloced copies of its results, in the form returned by
+  // handle_multi_query(), set *result_count and return TRUE.  Otherwise, or if memory can't
+  // be allocated, return FALSE.
+  u_ll hash = fnv_64a_str((char *)key, FNV1A_64_INIT);
+  rc_entry_t *e;
+  u_char **lrr;
+  double *lcs;
+  int r, slots;
+
+  rc_lock(rc);
+  e = find_entry(rc, key, hash);
+  if (e == NULL) {
+    rc_unlock(rc);
+    return FALSE;  // -------------------------------->
+  }
+  unlink_from_lru(rc, e);
+  link_at_lru_head(rc, e);
+
+  slots = (e->result_count > max_to_show) ? e->result_count : max_to_show;
+  lrr = (u_char **)calloc(slots, sizeof(u_char *));  // Freed by free_results_memory()
+  lcs = (double *)calloc(slots, sizeof(double));  // Freed by free_results_memory()
+  if (lrr == NULL || lcs == NULL) {
+    rc_unlock(rc);
+    free(lrr);
+    free(lcs);
+    return FALSE;  // -------------------------------->
+  }
+  for (r = 0; r < e->result_count; r++) {
+    lrr[r] = make_a_copy_of(e->results[r]);
+    if (lrr[r] == NULL) {
+      rc_unlock(rc);
+      *returned_results = lrr;
+      *corresponding_scores = lcs;
+      *result_count = r;
+      return TRUE;  // -------------------------------->  Fewer results, as with malloc failures in handle_multi_query()
+    }
+    lcs[r] = e->scores[r];
+  }
+  *result_count = e->result_count;
+  rc_unlock(rc);
+  *returned_results = lrr;
+  *corresponding_scores = lcs;
+  return TRUE;
+}
+
+
+void result_cache_insert(result_cache_t *rc, u_char *key, u_char **results, double *scores, int result_count) {
+  // Add a copy of key and results to the cache, evicting least recently used entries to make
+  // room.  Do nothing if the key is already there (another thread may have just added it), if
+  // the entry would be bigger than the whole cache, or if memory can't be allocated.
+  u_ll hash = fnv_64a_str((char *)key, FNV1A_64_INIT);
+  size_t bytes, keylen = strlen((char *)key), len;
+  rc_entry_t *e;
+  u_char *strings;
+  int r;
+
+  bytes = sizeof(rc_entry_t) + result_count * (sizeof(double) + sizeof(u_char *)) + keylen + 1;
+  for (r = 0; r < result_count; r++) bytes += strlen((char *)results[r]) + 1;
+  if (bytes > rc->max_bytes) return;  // -------------------------------->
+
+  // Build the entry before taking the lock.  The doubles come straight after the header, then
+  // the pointers, so both are aligned.
+  e = (rc_entry_t *)malloc(bytes);  // MAL2102
+  if (e == NULL) return;  // -------------------------------->
+  e->hash = hash;
+  e->bytes = bytes;
+  e->result_count = result_count;
+  e->scores = (double *)(e + 1);
+  e->results = (u_char **)(e->scores + result_count);
+  e->key = (u_char *)(e->results + result_count);
+  memcpy(e->key, key, keylen + 1);
+  strings = e->key + keylen + 1;
+  for (r = 0; r < result_count; r++) {
+    len = strlen((char *)results[r]) + 1;
+    memcpy(strings, results[r], len);
+    e->results[r] = strings;
+    e->scores[r] = scores[r];
+    strings += len;
+  }
+
+  rc_lock(rc);
+  if (find_entry(rc, key, hash) != NULL) {
+    rc_unlock(rc);
+    free(e);  // FRE2102
+    return;  // -------------------------------->
+  }
+  while (rc->bytes_used + bytes > rc->max_bytes) evict_lru_entry(rc);
+  e->chain_next = rc->buckets[hash & rc->bucket_mask];
+  rc->buckets[hash & rc->bucket_mask] = e;
+  link_at_lru_head(rc, e);
+  rc->bytes_used += bytes;
+  rc->entries++;
+  rc_unlock(rc);
+}
+
+
+void result_cache_get_occupancy(result_cache_t *rc, long long *entries, size_t *bytes) {
+  rc_lock(rc);
+  *entries = rc->entries;
+  *bytes = rc->bytes_used;
+  rc_unlock(rc);
+}
@@ -0,0 +1,21 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// A cache of the final results of handle_multi_query(), keyed by a normalized form of the
+// multi-query string, bounded by bytes, and evicting in least-recently-used order.  All
+// operations lock the cache, so one cache may be shared by concurrent query streams.
+
+typedef struct result_cache result_cache_t;
+
+result_cache_t *result_cache_create(size_t max_bytes);
+
+void result_cache_destroy(result_cache_t **rcp);
+
+u_char *result_cache_make_key(u_char *multi_query_string);
+
+BOOL result_cache_lookup(result_cache_t *rc, u_char *key, int max_to_show, u_char ***returned_results,
+			 double **corresponding_scores, int *result_count);
+
+void result_cache_insert(result_cache_t *rc, u_char *key, u_char **results, double *scores, int result_count);
+
+void result_cache_get_occupancy(result_cache_t *rc, long long *entries, size_t *bytes);
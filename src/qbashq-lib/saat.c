@@ -21,6 +21,7 @@
 #include "../utils/dahash.h"
 #include "QBASHQ.h"
 #include "saat.h"
+#include "query_arena.h"
 
 
 // ---------------------------------------------------------------------------------------
@@ -75,17 +76,436 @@
 //        B. Set docnum from lastdocnum
 //        C. Add count to the posting count in the control block
 //        D. Increment the indexpointer to the next SB_MARKER byte and keep going.
+//     Before B - D, if the list has second-level skips, they're used to pass over many blocks at
+//     once.  See skip_with_second_level().
 
-static int setup_phrase_node(FILE *out, u_char *term, saat_control_t *blok, byte *index, byte *vocab, size_t vsz,
+static int setup_phrase_node(FILE *out, u_char *term, saat_control_t *blok, index_environment_t *ixenv,
 			     int *terms_not_present, op_count_t *op_count, double N, int debug);   // Forward decln
 
 
-static int leaf_peek_tf(byte *ixptr, docnum_t docno) {
+// Bulk decoding of skip-block runs
+// --------------------------------
+// When saat_skipto() meets a skip block whose run may contain the target, it decodes the
+// whole run at once into the leaf's decoded_run_t: the docnum and wpos of each posting and
+// the offset of the byte following it.  That skipto, and any later ones which land in the
+// same run, then gallop through the docnums rather than decoding posting by posting.
+// curpsting, posting_num, curdoc and curwpos are maintained exactly as by the
+// posting-by-posting code, so the functions which peek or step through postings in the
+// same doc without using the decoded run are unaffected.  Because they may have moved
+// curpsting, the position within the decoded run is always re-derived from curpsting.
+// Op counts are also the same:  COUNT_DECO is incremented once per posting passed over.
+//
+// Most docgaps within a run are less than 128 and are stored in a single vbyte, making a
+// two-byte posting: the wpos followed by gap << 1 | 1.   The SIMD decoders check 16 (SSE2)
+// or 32 (AVX2) bytes at a time for that pattern and de-interleave them.  Anything else is
+// decoded by the scalar code.  The decoder is chosen at run time by saat_select_run_decoder().
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define RUN_DECODER_SSE2
+#define RUN_DECODER_AVX2
+#elif defined(_M_X64)
+#include <emmintrin.h>
+#define RUN_DECODER_SSE2   // Always available on x64
+#endif
+
+typedef int (*two_byte_decoder_t)(byte *ixptr, byte *wposs_and_gaps);
+
+static int run_decoder_level = 0;    // 0 - don't decode runs in bulk.  See saat_select_run_decoder()
+static two_byte_decoder_t two_byte_decoder = NULL;
+static int two_byte_postings_per_call = 0;
+
+
+#ifdef RUN_DECODER_SSE2
+static int sse2_decode_two_byte_postings(byte *ixptr, byte *wposs_and_gaps) {
+  // If the 16 bytes at ixptr are 8 two-byte postings, store their wposs in the first 8 bytes
+  // of wposs_and_gaps and their docgaps in the next 8, and return 8.  Otherwise return 0.
+  __m128i v = _mm_loadu_si128((__m128i *)ixptr), wposs, gaps;
+  // Shifting each 16-bit lane left by 7 puts the LSB of each byte into its MSB, where movemask
+  // can see it.  The odd bytes must all be final vbytes.
+  if ((_mm_movemask_epi8(_mm_slli_epi16(v, 7)) & 0xAAAA) != 0xAAAA) return 0;
+  wposs = _mm_and_si128(v, _mm_set1_epi16(0xFF));
+  gaps = _mm_srli_epi16(v, 9);
+  _mm_storeu_si128((__m128i *)wposs_and_gaps, _mm_packus_epi16(wposs, gaps));
+  return 8;
+}
+#endif
+
+
+#ifdef RUN_DECODER_AVX2
+__attribute__((target("avx2")))
+static int avx2_decode_two_byte_postings(byte *ixptr, byte *wposs_and_gaps) {
+  // As for sse2_decode_two_byte_postings() but 16 postings in 32 bytes.
+  __m256i v = _mm256_loadu_si256((__m256i *)ixptr), wposs, gaps, packed;
+  if (((u_int)_mm256_movemask_epi8(_mm256_slli_epi16(v, 7)) & 0xAAAAAAAAU) != 0xAAAAAAAAU) return 0;
+  wposs = _mm256_and_si256(v, _mm256_set1_epi16(0xFF));
+  gaps = _mm256_srli_epi16(v, 9);
+  // packus works within 128-bit lanes, giving wposs 0-7, gaps 0-7, wposs 8-15, gaps 8-15
+  packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(wposs, gaps), 0xD8);
+  _mm256_storeu_si256((__m256i *)wposs_and_gaps, packed);
+  return 16;
+}
+#endif
+
+
+void saat_select_run_decoder(int level) {
+  // level is the value of the x_bulk_decode option.  0 - no bulk decoding, 1 - scalar,
+  // 2 - SSE2, 3 - the fastest available.  Requests for unavailable decoders fall back.
+  // Must be called before any queries are run, as it's not thread-safe.
+  two_byte_decoder = NULL;
+  two_byte_postings_per_call = 0;
+  run_decoder_level = level;
+#ifdef RUN_DECODER_AVX2
+  if (level >= 3 && __builtin_cpu_supports("avx2")) {
+    two_byte_decoder = avx2_decode_two_byte_postings;
+    two_byte_postings_per_call = 16;
+    return;
+  }
+#endif
+#ifdef RUN_DECODER_SSE2
+  if (level >= 2) {
+    two_byte_decoder = sse2_decode_two_byte_postings;
+    two_byte_postings_per_call = 8;
+    return;
+  }
+#endif
+  if (run_decoder_level > 1) run_decoder_level = 1;
+}
+
+
+static BOOL decode_run(query_arena_t *arena, byte *run_start, int count, docnum_t docnum,
+		       decoded_run_t *dr) {
+  // Decode all count postings in the run starting at run_start.  docnum is that of the
+  // posting before the run.  Return FALSE if memory can't be allocated, in which case the
+  // caller just carries on decoding one posting at a time.
+  byte *ixptr = run_start, wposs_and_gaps[32];
+  int p = 0, k, n;
+  docnum_t docgap;
+  byte bight;
+
+  if (count > dr->capacity) {
+    // The three arrays share one block, from the query's arena if it has one.
+    query_arena_free(arena, dr->docnums);   // FRE0030
+    dr->docnums = (docnum_t *)query_arena_alloc(arena, count * (sizeof(docnum_t) + sizeof(unsigned short) + 1));  // MAL0030
+    if (dr->docnums == NULL) {
+      dr->capacity = 0;
+      dr->count = 0;
+      dr->run_start = NULL;
+      return FALSE;  // --------------------------------------------------->
+    }
+    dr->capacity = count;
+    dr->ends = (unsigned short *)(dr->docnums + count);
+    dr->wposs = (byte *)(dr->ends + count);
+  }
+  dr->run_start = run_start;
+  dr->count = count;
+
+  while (p < count) {
+    if (two_byte_decoder != NULL && count - p >= two_byte_postings_per_call
+	&& (n = two_byte_decoder(ixptr, wposs_and_gaps)) > 0) {
+      // Because there are at least n more postings, all the bytes read lie within the run.
+      unsigned short end = (unsigned short)(ixptr - run_start);
+      for (k = 0; k < n; k++) {
+	docnum += wposs_and_gaps[n + k];
+	end += 2;
+	dr->docnums[p + k] = docnum;
+	dr->wposs[p + k] = wposs_and_gaps[k];
+	dr->ends[p + k] = end;
+      }
+      p += n;
+      ixptr += 2 * n;
+      continue;
+    }
+
+    // Scalar decoding of one posting.  See saat_skipto()
+    dr->wposs[p] = *ixptr++;
+    docgap = 0;
+    do {
+      docgap <<= 7;
+      bight = *ixptr++;
+      docgap |= (bight >> 1);
+    } while (!(bight & 1));
+    docnum += docgap;
+    dr->docnums[p] = docnum;
+    dr->ends[p] = (unsigned short)(ixptr - run_start);
+    p++;
+  }
+  dr->hint = 0;
+  return TRUE;
+}
+
+
+static int position_in_decoded_run(decoded_run_t *dr, byte *curpsting) {
+  // If curpsting points to the start of a posting in the decoded run dr, other than the
+  // first, return the index of the posting before it.  Otherwise return -1.
+  int lo = 0, hi, mid;
+  unsigned short offset;
+  if (dr->run_start == NULL || curpsting <= dr->run_start) return -1;
+  hi = dr->count - 2;  // The end of the last posting isn't the start of one
+  if (hi < 0 || curpsting > dr->run_start + dr->ends[hi]) return -1;
+  offset = (unsigned short)(curpsting - dr->run_start);
+  if (dr->ends[dr->hint] == offset) return dr->hint;  // Nothing else has moved curpsting
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (dr->ends[mid] < offset) lo = mid + 1;
+    else hi = mid;
+  }
+  return (dr->ends[lo] == offset) ? lo : -1;
+}
+
+
+static int gallop(docnum_t *docnums, int count, int from, docnum_t desired_docnum) {
+  // Return the index of the first of the count docnums at or after from which is >= desired_docnum,
+  // or count if there isn't one.
+  int lo = from, hi, step = 1;
+  if (from >= count || docnums[from] >= desired_docnum) return from;
+  // Invariant: docnums[lo] < desired_docnum
+  while (lo + step < count && docnums[lo + step] < desired_docnum) {
+    lo += step;
+    step <<= 1;
+  }
+  hi = lo + step;
+  if (hi > count) hi = count;
+  // Now docnums[lo] < desired_docnum <= docnums[hi] (treating docnums[count] as infinite)
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (docnums[mid] < desired_docnum) lo = mid;
+    else hi = mid;
+  }
+  return hi;
+}
+
+
+static BOOL skip_within_decoded_run(saat_control_t *blok, int from, docnum_t desired_docnum,
+				    op_count_t *op_count) {
+  // Move blok forward over the postings in its decoded run, starting with posting number from,
+  // up to and including the first whose docnum is >= desired_docnum, or to the end of the run
+  // if there's none.  Return FALSE if there is nothing to move over.
+  decoded_run_t *dr = blok->run;
+  int to;
+  if (from >= dr->count) return FALSE;
+  to = gallop(dr->docnums, dr->count, from, desired_docnum);
+  if (to >= dr->count) to = dr->count - 1;
+  op_count[COUNT_DECO].count += (to - from + 1);
+  blok->posting_num += (to - from + 1);
+  blok->curdoc = dr->docnums[to];
+  blok->curwpos = dr->wposs[to];
+  blok->curpsting = dr->run_start + dr->ends[to];
+  dr->hint = to;
+  return TRUE;
+}
+
+
+static BOOL decode_run_for_leaf(saat_control_t *blok, byte *run_start, int count) {
+  // Decode the run starting at run_start into blok's decoded_run_t, allocating it if necessary.
+  if (blok->run == NULL) {
+    blok->run = (decoded_run_t *)query_arena_alloc(blok->arena, sizeof(decoded_run_t));  // MAL0031
+    if (blok->run == NULL) return FALSE;
+    blok->run->docnums = NULL;
+    blok->run->capacity = 0;
+  }
+  return decode_run(blok->arena, run_start, count, blok->curdoc, blok->run);
+}
+
+
+static void free_decoded_run(query_arena_t *arena, decoded_run_t **drp) {
+  if (*drp == NULL) return;
+  query_arena_free(arena, (*drp)->docnums);   // FRE0030
+  query_arena_free(arena, *drp);              // FRE0031
+  *drp = NULL;
+}
+
+
+
+// Postings lists in blocks (INDEX_FORMAT_BLOCKED)
+// ----------------------------------------------
+// If the index is in INDEX_FORMAT_BLOCKED, setup_word_node() gives each leaf whose list is in
+// blocks a decoded_block_t and decodes the list's first block into it.  (Shorter lists are
+// read in the same way as for INDEX_FORMAT.)  The leaf's current
+// posting is then always docnums[pos] of the decoded block, and curpsting (the start of the list)
+// is only used to show that the postings aren't in the .vocab entry.  saat_skipto() gallops
+// through the block directory and then within the decoded block.  Because a block never splits
+// the postings for a doc, the functions which look at or step to postings in the current doc never
+// need to look beyond the decoded block.   Op counts: COUNT_SKIP is incremented for each
+// directory entry examined, and COUNT_DECO for each posting passed over.
+
+static void decode_block(decoded_block_t *db, long long blockno, long long occurrence_count) {
+  // Decode block number blockno of the list described by db, and make its first posting current.
+  byte *dirent = bp_dirent(db->directory, blockno), *block, *packed_gaps;
+  unsigned int postings_before = bp_dirent_postings_before(dirent);
+  int i, bits, bitpos = 0;
+  unsigned long long mask;
+
+  if (blockno + 1 < db->num_blocks)
+    db->count = (int)(bp_dirent_postings_before(bp_dirent(db->directory, blockno + 1)) - postings_before);
+  else
+    db->count = (int)(occurrence_count - postings_before);
+  block = db->blocks + bp_dirent_offset(dirent);
+  bits = block[0];
+  mask = (1ULL << bits) - 1;
+  db->wposs = block + BP_BLOCK_HEADER_BYTES;
+  packed_gaps = db->wposs + db->count;
+
+  // Unpack the docgaps, then turn them into docnums.  The first loop has no dependencies between
+  // iterations, so the compiler is free to vectorize it.
+  db->docnums[0] = (docnum_t)bp_get40(block + 1);
+  for (i = 1; i < db->count; i++) {
+    db->docnums[i] = (docnum_t)((*(unsigned long long *)(packed_gaps + (bitpos >> 3)) >> (bitpos & 7)) & mask);
+    bitpos += bits;
+  }
+  for (i = 1; i < db->count; i++) db->docnums[i] += db->docnums[i - 1];
+  db->blockno = blockno;
+  db->pos = 0;
+}
+
+
+static void set_current_from_block(saat_control_t *blok) {
+  decoded_block_t *db = blok->block;
+  blok->curdoc = db->docnums[db->pos];
+  blok->curwpos = db->wposs[db->pos];
+  blok->posting_num = (long long)bp_dirent_postings_before(bp_dirent(db->directory, db->blockno)) + db->pos + 1;
+}
+
+
+static long long find_block(decoded_block_t *db, docnum_t desired_docnum, op_count_t *op_count) {
+  // Return the number of the first block after the current one whose last docnum is >=
+  // desired_docnum, or of the last block if there's none.  There must be a later block.
+  long long lo = db->blockno + 1, hi, step = 1, mid;
+  op_count[COUNT_SKIP].count++;
+  if ((docnum_t)bp_dirent_lastdocnum(bp_dirent(db->directory, lo)) >= desired_docnum) return lo;
+  // Invariant: block lo ends before desired_docnum
+  while (lo + step < db->num_blocks
+	 && (docnum_t)bp_dirent_lastdocnum(bp_dirent(db->directory, lo + step)) < desired_docnum) {
+    op_count[COUNT_SKIP].count++;
+    lo += step;
+    step <<= 1;
+  }
+  hi = lo + step;
+  if (hi >= db->num_blocks) hi = db->num_blocks - 1;  // Block hi may also end before desired_docnum
+  while (hi - lo > 1) {
+    op_count[COUNT_SKIP].count++;
+    mid = (lo + hi) / 2;
+    if ((docnum_t)bp_dirent_lastdocnum(bp_dirent(db->directory, mid)) < desired_docnum) lo = mid;
+    else hi = mid;
+  }
+  return hi;
+}
+
+
+static void skip_within_blocks(saat_control_t *blok, docnum_t desired_docnum, op_count_t *op_count) {
+  // Move blok to the first posting after the current one whose docnum is >= desired_docnum, or
+  // to the last posting in the list if there's none.  The current posting must not be the last.
+  decoded_block_t *db = blok->block;
+  int to;
+
+  if (db->pos + 1 < db->count
+      && (desired_docnum <= db->docnums[db->count - 1] || db->blockno + 1 >= db->num_blocks)) {
+    // It's in this block, if it's anywhere
+    to = gallop(db->docnums, db->count, db->pos + 1, desired_docnum);
+    if (to >= db->count) to = db->count - 1;
+    op_count[COUNT_DECO].count += (to - db->pos);
+  }
+  else {
+    decode_block(db, find_block(db, desired_docnum, op_count), blok->occurrence_count);
+    to = gallop(db->docnums, db->count, 0, desired_docnum);
+    if (to >= db->count) to = db->count - 1;
+    op_count[COUNT_DECO].count += (to + 1);
+  }
+  db->pos = to;
+  set_current_from_block(blok);
+}
+
+
+static int setup_blocked_list(saat_control_t *blok, byte *list) {
+  // Set up blok to process the list in blocks starting at list.  Return 0 or a -ve error code.
+  decoded_block_t *db;
+  db = (decoded_block_t *)query_arena_alloc(blok->arena, sizeof(decoded_block_t));  // MAL0032
+  if (db == NULL) return -220084;  // ---------------------------------------->
+  db->directory = list + BP_LIST_HEADER_BYTES;
+  db->num_blocks = bp_get_block_count(list);
+  db->blocks = db->directory + db->num_blocks * BP_DIRENT_BYTES;
+  decode_block(db, 0, blok->occurrence_count);
+  blok->block = db;
+  blok->curpsting = list;
+  set_current_from_block(blok);
+  return 0;
+}
+
+
+// Second-level skips.  If the segment has a .if.skips file (see QBASHER_common_definitions.h),
+// a list with enough skip blocks has an entry for every SK_INTERVAL-th one.  When saat_skipto()
+// finds that the target is beyond the current run, it gallops through the entries ahead of the
+// current position to the last skip block which can't be passed over without missing the target,
+// rather than following the chain of SB_MARKERs one at a time.
+
+static void setup_skips(saat_control_t *blok, index_environment_t *ixenv, u_ll list_offset) {
+  // Find the .if.skips entries, if any, for the list at list_offset.
+  u_ll *dir = sk_dir(ixenv->skips), lo = 0, hi = ixenv->skips[0], mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (dir[2 * mid] < list_offset) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo >= ixenv->skips[0] || dir[2 * lo] != list_offset) return;  // -------------------------------->
+  blok->skips = sk_entries(ixenv->skips) + SK_ENTRY_ULLS * dir[2 * lo + 1];
+  blok->num_skips = (int)(dir[2 * lo + 3] - dir[2 * lo + 1]);
+  blok->next_skip = 0;
+}
+
+
+#define skip_entry(blok, k) ((blok)->skips + SK_ENTRY_ULLS * (k))
+
+static BOOL skip_with_second_level(saat_control_t *blok, byte *index, docnum_t desired_docnum,
+				   op_count_t *op_count) {
+  // blok is positioned on an SB_MARKER whose run ends before desired_docnum.  Move it to the
+  // SB_MARKER of the furthest skip block with an entry whose predecessor also ends before
+  // desired_docnum.  Return FALSE if there's no such entry ahead of the current position.
+  u_ll current = (u_ll)(blok->curpsting - index), *e;
+  int lo, hi, mid, step = 1;
+
+  // Entries at or behind the current position are of no use, now or later in this query.
+  while (blok->next_skip < blok->num_skips && sk_entry_offset(skip_entry(blok, blok->next_skip)) <= current)
+    blok->next_skip++;
+  lo = blok->next_skip;
+  if (lo >= blok->num_skips || (docnum_t)sk_entry_docnum(skip_entry(blok, lo)) >= desired_docnum) return FALSE;  // -------------------------------->
+
+  // Invariant: entry lo's predecessor block ends before desired_docnum
+  while (lo + step < blok->num_skips && (docnum_t)sk_entry_docnum(skip_entry(blok, lo + step)) < desired_docnum) {
+    lo += step;
+    step <<= 1;
+  }
+  hi = lo + step;
+  if (hi > blok->num_skips) hi = blok->num_skips;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if ((docnum_t)sk_entry_docnum(skip_entry(blok, mid)) < desired_docnum) lo = mid;
+    else hi = mid;
+  }
+
+  e = skip_entry(blok, lo);
+  op_count[COUNT_SKIP].count++;
+  blok->curpsting = index + sk_entry_offset(e);
+  blok->curdoc = (docnum_t)sk_entry_docnum(e);
+  blok->curwpos = -1;  // As when a single skip block is passed over
+  blok->posting_num = (long long)sk_entry_postings(e);
+  blok->next_skip = lo + 1;
+  return TRUE;
+}
+
+
+
+static int leaf_peek_tf(saat_control_t *leaf) {
   // Called from saat_skipto() to count the tf of a top-level word.
-  // I'm assuming that ixptr points to the first byte of the next posting for this term,
+  // I'm assuming that curpsting points to the first byte of the next posting for this term,
   // or to a skip block.  The first byte of the posting is the wdnum
   int tf = 1;
-  byte bight;
+  byte bight, *ixptr = leaf->curpsting;
+
+  if (leaf->block != NULL) {
+    decoded_block_t *db = leaf->block;
+    while (db->pos + tf < db->count && db->docnums[db->pos + tf] == leaf->curdoc) tf++;
+    return tf;  // ---------------------------------------->
+  }
 
   if (ixptr == NULL) {
     // Just a safeguard.
@@ -110,7 +530,7 @@ static int leaf_peek_tf(byte *ixptr, docnum_t docno) {
       tf++;
       ixptr += 2;
     } else {
-      if (0 && tf > 1) printf("    leaf_peek_tf(docno = %lld) - returning tf = %d\n", docno, tf);
+      if (0 && tf > 1) printf("    leaf_peek_tf(docno = %lld) - returning tf = %d\n", leaf->curdoc, tf);
       return tf;  //  ---------------------------------------->
     }
   }
@@ -118,7 +538,7 @@ static int leaf_peek_tf(byte *ixptr, docnum_t docno) {
 }
 
 
-static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, byte *index, byte *vocab, size_t vsz,
+static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, index_environment_t *ixenv,
 			   int *terms_not_present, op_count_t *op_count, double N, int debug) {
   // A word node must be a leaf in the query tree.  It has no children but controls the processing
   // of a single postings list.  This function looks up the word and, if found, sets up blok to
@@ -131,6 +551,10 @@ static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, byte *
   blok->type = SAAT_WORD;
   blok->num_children = 0;
   blok->children = NULL;
+  blok->run = NULL;
+  blok->block = NULL;
+  blok->skips = NULL;
+  blok->num_skips = 0;
   blok->repetition_count = 1;  // How many times this word is repeated within the query.
 
   len = strlen((char *)word);
@@ -140,7 +564,7 @@ static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, byte *
   }
 
 
-  blok->dicent = lookup_word(word, vocab, vsz, debug);
+  blok->dicent = lookup_word(word, ixenv, debug);
   op_count[COUNT_TLKP].count++;
   if (blok->dicent == NULL) {
     // If one word is not found no suggestion can be made
@@ -166,15 +590,25 @@ static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, byte *
       blok->posting_num = 1;
       if (0) printf("Extracted single posting: doc = %lld , wpos=%d\n", blok->curdoc, blok->curwpos);
     }
+    else if (ixenv->blocked_postings && blok->occurrence_count >= BP_MIN_POSTINGS_IN_BLOCKS) {
+      int code = setup_blocked_list(blok, ixenv->index + payload);
+      if (code < 0) {
+	blok->exhausted = TRUE;
+	blok->curdoc = CURDOC_EXHAUSTED;
+	(*terms_not_present)++;
+	return code;  // ------------------------------------->
+      }
+    }
     else {
       // payload references a chunk of the index file
-      byte *ixptr = index + payload;
+      byte *ixptr = ixenv->index + payload;
 
       // ----- HANDLE SKIP BLOCK HERE ------
       // Just skip over it.
       if (*ixptr == SB_MARKER) {
 	if (debug >= 2) fprintf(out, "setup_word_node() - skipping skipblock\n");
 	ixptr += (SB_BYTES + 1);
+	if (ixenv->skips != NULL) setup_skips(blok, ixenv, payload);
       }
 
       blok->curwpos = *ixptr;  // Word pos is now a full byte.
@@ -206,14 +640,14 @@ static int setup_word_node(FILE *out, u_char *word, saat_control_t *blok, byte *
 //   1. A disjunction is exhausted iff all of its descendants are
 //   2. The (curdoc, curwpos) of a disjunction is the minimum of those of its descendants
 
-static int setup_disjunction_node(FILE *out, u_char *interm, saat_control_t *blok, byte *index, byte *vocab, size_t vsz,
+static int setup_disjunction_node(FILE *out, u_char *interm, saat_control_t *blok, index_environment_t *ixenv,
 				  int *terms_not_present, op_count_t *op_count, double N, int debug) {
   // Return 0 on success, -ve on error  (No errors defined yet.)
   u_char *term, *p, *start, savep;
   int children = 0, ltnp = 0, code;  // lntp - Local terms not present
   saat_control_t *child;
 
-  term = make_a_copy_of(interm);   // It has to be a copy because other shard threads may operate on interm. NO LONGER TRUE
+  term = make_a_copy_of(interm);   // It has to be a copy because threads searching other segments may operate on interm.
   if (term == NULL) {
     return(-220052);  // -------------------------------------------->
   }
@@ -260,12 +694,14 @@ static int setup_disjunction_node(FILE *out, u_char *interm, saat_control_t *blo
 
 
   blok->num_children = children;
-  blok->children = (struct saat_struct *) malloc(children * sizeof(struct saat_struct));
+  blok->children = (struct saat_struct *) query_arena_calloc(blok->arena, children, sizeof(struct saat_struct));  // Zeroed, in case we bail out part way through
   if (blok->children == NULL) {
     free(term);
     (*terms_not_present)++;
     return(-220054);  // ---------------------------------->
   }
+  for (children = 0; children < blok->num_children; children++)
+    blok->children[children].arena = blok->arena;
   // Now set up the children
   children = 0;
   p = term + 1;  // Skip '[' 
@@ -280,7 +716,7 @@ static int setup_disjunction_node(FILE *out, u_char *interm, saat_control_t *blo
       savep = *p;
       *p = 0;
       child = blok->children + children;
-      code = setup_phrase_node(out, start, child, index, vocab, vsz, &ltnp, op_count, N, debug);
+      code = setup_phrase_node(out, start, child, ixenv, &ltnp, op_count, N, debug);
       *p = savep;
       if (code < 0) return(code);  // ------------------------------------------>
       children++;
@@ -290,7 +726,7 @@ static int setup_disjunction_node(FILE *out, u_char *interm, saat_control_t *blo
       savep = *p;
       *p = 0;
       child = blok->children + children;
-      code = setup_word_node(out, start, child, index, vocab, vsz, &ltnp, op_count, N, debug);
+      code = setup_word_node(out, start, child, ixenv, &ltnp, op_count, N, debug);
       *p = savep;
       if (code < 0) return(code);  // ------------------------------------------>
       children++;
@@ -336,7 +772,7 @@ static int freq_comparator(const void *bloki, const void *blokj)  {
 //   2. The (curdoc, curwpos) of a phrase is the minimum of those of its descendants (only relevant if not exhausted.)
 
 
-static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, byte *index, byte *vocab, size_t vsz,
+static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, index_environment_t *ixenv,
 			     int *terms_not_present, op_count_t *op_count, double N, int debug) {
   // Return 0 on success, -ve on error
   u_char *p, *start, savep, *term;
@@ -346,7 +782,7 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
   blok->exhausted = FALSE;  // Assume the best
   blok->dicent = NULL;
   blok->children = NULL;
-  term = make_a_copy_of(interm);   // It has to be a copy because other shard threads may operate on interm.  NO LONGER TRUE
+  term = make_a_copy_of(interm);   // It has to be a copy because threads searching other segments may operate on interm.
   if (term == NULL) {
     if (debug) fprintf(out, "Malloc failed in setup_phrase_node\n");
     return(-220055);
@@ -382,11 +818,13 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
   }
 
   blok->num_children = children;
-  blok->children = (struct saat_struct *) malloc(children * sizeof(struct saat_struct));
+  blok->children = (struct saat_struct *) query_arena_calloc(blok->arena, children, sizeof(struct saat_struct));  // Zeroed, in case we bail out part way through
   if (blok->children == NULL) {
     free(term);
     return(-220057);  // ------------------------------------>
   }
+  for (children = 0; children < blok->num_children; children++)
+    blok->children[children].arena = blok->arena;
 
   // Now set up the children
   children = 0;
@@ -402,8 +840,7 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
       p++;
       savep = *p;
       *p = 0;
-      setup_disjunction_node(out, start, blok->children + children, index, vocab,
-			     vsz, &ltnp, op_count, N, debug);
+      setup_disjunction_node(out, start, blok->children + children, ixenv, &ltnp, op_count, N, debug);
       *p = savep;
       children++;
     }
@@ -411,7 +848,7 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
       while (*p && *p != '"' && *p != ' ') p++;
       savep = *p;
       *p = 0;
-      setup_word_node(out, start, blok->children + children, index, vocab, vsz,
+      setup_word_node(out, start, blok->children + children, ixenv,
 		      &ltnp, op_count, N, debug);
       *p = savep;
       children++;
@@ -440,7 +877,7 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
       for (c = 1; c < blok->num_children; c++) {
 	code = saat_skipto(out, blok->children + c, -1, first_phrase_element->curdoc, 
 			   first_phrase_element->curwpos - first_phrase_element->offset_within_phrase 
-			   + blok->children[c].offset_within_phrase, index,
+			   + blok->children[c].offset_within_phrase, ixenv->index,
 			   op_count, debug, &error_code);
 	if (error_code < -200000) return(error_code);  // ----------------------------------->
 	if (debug >= 1) fprintf(out, "Phrase setup: Child %d advanced to (%lld, %d). Code was %d\n", 
@@ -461,7 +898,7 @@ static int setup_phrase_node(FILE *out, u_char *interm, saat_control_t *blok, by
 				blok->children[failed_child].curdoc);
 	code = saat_skipto(out, first_phrase_element, -1, blok->children[failed_child].curdoc,
 			   blok->children[failed_child].curwpos - blok->children[failed_child].offset_within_phrase 
-			   + first_phrase_element->offset_within_phrase, index,
+			   + first_phrase_element->offset_within_phrase, ixenv->index,
 			   op_count, debug, &error_code);
 	if (0) printf("Advanced first phrase element. Doesn't matter what the code was.\n");
 	if (error_code < -200000) return(error_code);  // ----------------------------------->
@@ -508,11 +945,11 @@ static BOOL find_and_update_prior_instance(u_char *qword, saat_control_t *blox,
 
 
 saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
-			   int *terms_not_present, int *error_code) {
+			   index_environment_t *ixenv, int *terms_not_present, int *error_code) {
 
   // Set up the control structures for processing of multiple
   // postings lists in malloced storage.  Return a pointer to that array
-  // as the function result.
+  // as the function result.  ixenv is the index segment to be searched.
   
   // qterm_cnt counts the number of top level terms, not the total number of literals, 
   // or the total number of terms in the tree.
@@ -524,10 +961,9 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
   // Return NULL in case of error, e.g. erroneous input parameters
 
   saat_control_t *blox = NULL;
-  int w, tnp = 0, n;
+  int w, tnp = 0, n, p;
   
-  byte *index = qoenv->ixenv->index, *vocab = qoenv->ixenv->vocab;
-  size_t vsz = qoenv->ixenv->vsz;
+  byte *index = ixenv->index, *vocab = ixenv->vocab;
   
   *error_code = 0;
   qex->tl_saat_blocks_allocated = 0;
@@ -540,7 +976,7 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
   // Note that if some of the terms are disjunctions or phrases, they will 
   // cause further mallocs of their children. Eventually the allocated storage
   // will be freed by the recursive function free_querytree_memory()
-  blox = (saat_control_t *)malloc(qex->cg_qwd_cnt * sizeof(saat_control_t));  // MAL0005
+  blox = (saat_control_t *)query_arena_calloc(qex->arena, qex->cg_qwd_cnt, sizeof(saat_control_t));  // MAL0005
   if (blox == NULL) {
     *error_code = -220047;
     return NULL;
@@ -553,17 +989,21 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
   for (w = 0; w < qex->cg_qwd_cnt; w++) {
     blox[w].type = SAAT_NOT_USED;  // Make sure all blocks have a type.
     blox[w].num_children = 0;      // and don't have children unless they're given them.
+    blox[w].run = NULL;
+    blox[w].block = NULL;
+    blox[w].skips = NULL;
+    blox[w].arena = qex->arena;
     
     if (qoenv->debug >= 2)
       fprintf(qoenv->query_output, " saat_setup(): Setting up control block for '%s'\n", qex->cg_qterms[w]);
 
     if (qex->cg_qterms[w][0] == '[') {
-      *error_code = setup_disjunction_node(qoenv->query_output, qex->cg_qterms[w], blox + n, index, vocab,
-					   vsz, &tnp, qex->op_count, qoenv->N, qoenv->debug);
+      *error_code = setup_disjunction_node(qoenv->query_output, qex->cg_qterms[w], blox + n, ixenv,
+					   &tnp, qex->op_count, qoenv->N, qoenv->debug);
       n++;
     }
     else if (qex->cg_qterms[w][0] == '"') {
-      *error_code = setup_phrase_node(qoenv->query_output, qex->cg_qterms[w], blox + n, index, vocab, vsz,
+      *error_code = setup_phrase_node(qoenv->query_output, qex->cg_qterms[w], blox + n, ixenv,
 				      &tnp, qex->op_count, qoenv->N, qoenv->debug);
       n++;
     }
@@ -572,15 +1012,19 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
       // of one which has gone before.  If it is we just update the word count.
       BOOL seen_before = FALSE;
       seen_before = find_and_update_prior_instance(qex->cg_qterms[w], blox, n);
+      // A repetition of a word which isn't in this segment has no block to update, but
+      // mustn't be counted as missing again, or the segment may be wrongly skipped.
+      for (p = 0; !seen_before && p < w; p++)
+	if (!strcmp((char *)qex->cg_qterms[p], (char *)qex->cg_qterms[w])) seen_before = TRUE;
       if (!seen_before) {
-	*error_code = setup_word_node(qoenv->query_output, qex->cg_qterms[w], blox + n, index, vocab, vsz,
+	*error_code = setup_word_node(qoenv->query_output, qex->cg_qterms[w], blox + n, ixenv,
 				      &tnp, qex->op_count, qoenv->N, qoenv->debug);
 	n++;
       }
 
     }
     if (*error_code < 0) {
-      free_querytree_memory(&blox, w - 1);   // Have to avoid leaving memory allocated.
+      free_querytree_memory(qex->arena, &blox, w - 1);   // Have to avoid leaving memory allocated.
       return NULL;
     }
   }
@@ -610,10 +1054,10 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
 	  blox[w].exhausted = TRUE;
 	  blox[w].curdoc = CURDOC_EXHAUSTED;
 	}
-      } else if (leaf_peek_tf(blox[w].curpsting, blox[w].curdoc) < blox[w].repetition_count) {
+      } else if (leaf_peek_tf(blox + w) < blox[w].repetition_count) {
 	if (qoenv->debug >= 1) printf("Calling preliminary skipto()\n");
 	saat_skipto(qoenv->query_output, blox + w, w, blox[w].curdoc + 1, DONT_CARE,
-		    qoenv->ixenv->index,qex->op_count, qoenv->debug, error_code);
+		    ixenv->index, qex->op_count, qoenv->debug, error_code);
       }
     }
   }
@@ -623,6 +1067,31 @@ saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_f
 }
 
 
+int saat_setup_single_word(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+			   index_environment_t *ixenv, saat_control_t *blok, int *error_code) {
+  // The equivalent of saat_setup() for single_term_search() in QBASHQ_lib.c.  Set up the caller's
+  // control block for qex->cg_qterms[0], which must be a plain word, without malloc()ing a query
+  // tree.  Return 1 if the word occurs in ixenv, zero if it doesn't or in case of error.  Anything
+  // attached to blok must be freed by saat_free_single_word().
+  int tnp = 0;
+
+  qex->tl_saat_blocks_allocated = 0;
+  qex->tl_saat_blocks_used = 1;
+  blok->arena = qex->arena;
+  *error_code = setup_word_node(qoenv->query_output, qex->cg_qterms[0], blok, ixenv,
+				&tnp, qex->op_count, qoenv->N, qoenv->debug);
+  if (*error_code < 0 || tnp > 0) return 0;
+  return 1;
+}
+
+
+void saat_free_single_word(saat_control_t *blok) {
+  free_decoded_run(blok->arena, &(blok->run));
+  query_arena_free(blok->arena, blok->block);   // FRE0032
+  blok->block = NULL;
+}
+
+
 static int leaf_peek_ahead_in_same_doc(FILE *out, saat_control_t *leaf, byte *index, int debug) {
   // Check whether the next posting for leaf is within the same document, and if so, return
   // its wordpos.  Otherwise return -1;
@@ -637,6 +1106,12 @@ static int leaf_peek_ahead_in_same_doc(FILE *out, saat_control_t *leaf, byte *in
 
   if (0) printf("leaf_peek_ahead_in_same_doc(%lld, %d)\n", leaf->curdoc, leaf->curwpos);
 
+  if (leaf->block != NULL) {
+    decoded_block_t *db = leaf->block;
+    if (db->pos + 1 < db->count && db->docnums[db->pos + 1] == leaf->curdoc) return db->wposs[db->pos + 1];
+    return -1;  // ----------------->
+  }
+
   ixptr = leaf->curpsting;
 
   // ----- HANDLE SKIP BLOCK HERE ------
@@ -679,6 +1154,15 @@ static int disjunction_peek_ahead_in_same_doc(FILE *out, saat_control_t *dj, byt
     ixptr = child->curpsting;
     if (child->curdoc > dj->curdoc) break;  // A component of a disjunction may be beyond the doc we're looking at.
 
+    if (child->block != NULL) {
+      int wpos = leaf_peek_ahead_in_same_doc(out, child, index, debug);
+      if (wpos >= 0 && wpos < min_wpos) {
+	min_wpos = wpos;
+	best_c = c;
+      }
+      continue;
+    }
+
     // ----- HANDLE SKIP BLOCK HERE ------
     // Just skip over it.
     if (*ixptr == SB_MARKER) {
@@ -717,6 +1201,37 @@ static int disjunction_peek_ahead_in_same_doc(FILE *out, saat_control_t *dj, byt
 }
 
 
+static int blocked_phrase_peek_ahead_in_same_doc(saat_control_t *phrase) {
+  // As for phrase_peek_ahead_in_same_doc() (below) but for a phrase whose anchor has a decoded
+  // block.  The remaining postings for the current doc are all in the decoded blocks.
+  saat_control_t *anchor = phrase->children, *leaf;
+  decoded_block_t *adb = anchor->block, *db;
+  int a, c, i, anchor_start, start;
+  BOOL try_a_new_anchor = FALSE;
+
+  for (a = adb->pos + 1; a < adb->count && adb->docnums[a] == anchor->curdoc; a++) {
+    anchor_start = adb->wposs[a] - anchor->offset_within_phrase;
+    try_a_new_anchor = FALSE;
+    for (c = 1; c < phrase->num_children && !try_a_new_anchor; c++) {
+      leaf = phrase->children + c;
+      db = leaf->block;
+      if (db == NULL) return -1;  // A word with only one posting, or not a word.  ---------->
+      for (i = db->pos + 1; ; i++) {
+	if (i >= db->count || db->docnums[i] != leaf->curdoc) return -1;   // ---------->
+	start = db->wposs[i] - leaf->offset_within_phrase;
+	if (start == anchor_start) break;  // Phrase-compatible
+	if (start > anchor_start) {
+	  try_a_new_anchor = TRUE;
+	  break;
+	}
+      }
+    }
+    if (!try_a_new_anchor) return anchor_start;  // Success ---------------------->
+  }
+  return -1;
+}
+
+
 static int phrase_peek_ahead_in_same_doc(FILE *out, saat_control_t *phrase, byte *index, int debug) {
   // *** This is necessarily more complex than the leaf version. ***
   
@@ -732,6 +1247,8 @@ static int phrase_peek_ahead_in_same_doc(FILE *out, saat_control_t *phrase, byte
 
   if (0) printf("phrase_peek_ahead_in_same_doc(%lld, %d)\n", phrase->curdoc, phrase->curwpos);
   anchor = phrase->children;
+  if (anchor->block != NULL) return blocked_phrase_peek_ahead_in_same_doc(phrase);  // -------------->
+  if (anchor->type == SAAT_WORD && anchor->curpsting == NULL) return -1;  // Its only posting is in .vocab  -------------->
   anchor_ixptr = anchor->curpsting;
   while (1) {   // Loop over all the possible anchor positions within this doc.
       // ----- HANDLE ANCHOR SKIP BLOCK HERE ------
@@ -967,6 +1484,15 @@ int saat_advance_within_doc(FILE *out, saat_control_t *blok, byte *index, op_cou
 
     if (blok->posting_num >= blok->occurrence_count) return 0;  // ----------------->
 
+    if (blok->block != NULL) {
+      decoded_block_t *db = blok->block;
+      if (db->pos + 1 >= db->count || db->docnums[db->pos + 1] != blok->curdoc) return 0;  // ----------------->
+      db->pos++;
+      blok->curwpos = db->wposs[db->pos];
+      blok->posting_num++;
+      return 1;  // ----------------->
+    }
+
     ixptr = blok->curpsting;
 
     // ----- HANDLE SKIP BLOCK HERE ------
@@ -1139,14 +1665,26 @@ int saat_skipto(FILE *out, saat_control_t *blok, int blokno, docnum_t desired_do
     while (blok->curdoc < desired_docnum
 	   || (blok->curdoc == desired_docnum && desired_wpos != DONT_CARE && blok->curwpos < desired_wpos)
 	   || (blok->type == SAAT_WORD && blok->repetition_count > 1
-	       && leaf_peek_tf(blok->curpsting, blok->curdoc) < blok->repetition_count)) {
+	       && leaf_peek_tf(blok) < blok->repetition_count)) {
       if (blok->posting_num >= blok->occurrence_count) {
 	blok->exhausted = TRUE;
 	blok->curdoc = CURDOC_EXHAUSTED;
 	if (explain) fprintf(out, "    Exhausted\n");
 	return -1;  // ------------------------------------------------------------>
       }
+      if (blok->block != NULL) {
+	skip_within_blocks(blok, desired_docnum, op_count);
+	continue;
+      }
+
       ixptr = blok->curpsting;
+
+      if (blok->run != NULL) {
+	// If we're part way through a run which has been decoded in bulk, gallop within it.
+	int p = position_in_decoded_run(blok->run, ixptr);
+	if (p >= 0 && skip_within_decoded_run(blok, p + 1, desired_docnum, op_count)) continue;
+      }
+
       // ----- HANDLE SKIP BLOCK HERE ------
       // This is where we actually want to take notice of the skip block
       // saat_skipto() - if an SB_MARKER byte is encountered, then the skipblock is read.  The target docnum
@@ -1168,6 +1706,7 @@ int saat_skipto(FILE *out, saat_control_t *blok, int blokno, docnum_t desired_do
 		       desired_docnum, sb_last_docnum);
 	if (desired_docnum > sb_last_docnum) {
 	  if (0) fprintf(out, "    ... skipping!\n");
+	  if (blok->skips != NULL && skip_with_second_level(blok, index, desired_docnum, op_count)) continue;
 	  sb_count = sb_get_count(*sbp);
 	  sb_length = sb_get_length(*sbp);
 	  if (sb_length == 0) {
@@ -1188,10 +1727,15 @@ int saat_skipto(FILE *out, saat_control_t *blok, int blokno, docnum_t desired_do
 	  continue;
 	}
 	else {
-	  // the target may be in this run, just skip the skip block and continue as per normal
+	  // the target may be in this run, just skip the skip block and continue as per normal,
+	  // unless we can decode the whole run and gallop within it.
 	  if (0) fprintf(out, "      SEARCHING WITHIN RUN\n");
 	  ixptr += (SB_BYTES + 1);
 	  blok->curpsting = ixptr;
+	  sb_count = sb_get_count(*sbp);
+	  if (run_decoder_level > 0 && sb_count > 1
+	      && decode_run_for_leaf(blok, ixptr, (int)sb_count)
+	      && skip_within_decoded_run(blok, 0, desired_docnum, op_count)) continue;
 	}
       }
 
@@ -1236,7 +1780,9 @@ int saat_skipto(FILE *out, saat_control_t *blok, int blokno, docnum_t desired_do
 }
 
 
-void free_querytree_memory(saat_control_t **plists, int blok_count) {
+void free_querytree_memory(query_arena_t *arena, saat_control_t **plists, int blok_count) {
+  // Free the tree of control blocks rooted in the array *plists, which was allocated from arena.
+  // Each block records the arena its own storage came from.
   int n;
   saat_control_t *blok;
   if (0) printf("free_querytree_memory(%d)\n", blok_count);
@@ -1244,9 +1790,14 @@ void free_querytree_memory(saat_control_t **plists, int blok_count) {
   for (n = 0; n < blok_count; n++) {
     blok = (*plists) + n;
     if (blok != NULL && blok->num_children)
-      free_querytree_memory(&(blok->children), blok->num_children); // RECURSION
+      free_querytree_memory(blok->arena, &(blok->children), blok->num_children); // RECURSION
+    else if (blok != NULL && blok->type == SAAT_WORD) {
+      free_decoded_run(blok->arena, &(blok->run));
+      query_arena_free(blok->arena, blok->block);   // FRE0032
+      blok->block = NULL;
+    }
   }
-  free(*plists);
+  query_arena_free(arena, *plists);
   *plists = NULL;
 }
 
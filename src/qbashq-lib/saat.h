@@ -9,6 +9,31 @@ typedef enum {
 } saat_node_type_t;
 
 
+// A skip-block run decoded in bulk by saat_skipto().  See the comments in saat.c
+typedef struct {
+  byte *run_start;         // Index address of the first posting in the run
+  int count;               // Number of postings in the run
+  int capacity;            // Number of elements allocated in each of the arrays below
+  docnum_t *docnums;       // Docnum of each posting
+  byte *wposs;             // Word position of each posting
+  unsigned short *ends;    // Offset from run_start of the byte following each posting
+  int hint;                // Index of the posting most recently moved to
+} decoded_run_t;
+
+
+// The current block of a postings list in INDEX_FORMAT_BLOCKED.  See the comments in saat.c
+typedef struct {
+  byte *directory;         // The list's block directory
+  byte *blocks;            // Index address of the first block, i.e. the end of the directory
+  long long num_blocks;    // Number of blocks in the list
+  long long blockno;       // Which block is decoded below, counting from zero
+  int count;               // Number of postings in the block
+  int pos;                 // Index of the current posting within the block
+  byte *wposs;             // Word position of each posting (points into the index)
+  docnum_t docnums[BP_MAX_POSTINGS_PER_BLOCK];   // Docnum of each posting
+} decoded_block_t;
+
+
 typedef struct saat_struct{
   saat_node_type_t type;
   byte *dicent;   // Vocab entry                       [ONLY FOR SAAT_WORD]
@@ -23,8 +48,13 @@ typedef struct saat_struct{
   docnum_t curdoc;       // Doc number of last decoded posting
   int curwpos;            // Word pos of last decoded posting
   BOOL exhausted;         // Set when we attempt to advance beyond the end of the list
+  decoded_run_t *run;     // Bulk-decoded run, or NULL        [ONLY FOR SAAT_WORD]
+  decoded_block_t *block; // Non-NULL iff list is in blocks   [ONLY FOR SAAT_WORD]
+  u_ll *skips;            // The list's .if.skips entries, or NULL   [ONLY FOR SAAT_WORD]
+  int num_skips, next_skip;  // Number of entries, and the first not known to be behind curpsting
   int num_children;       //                            [0 FOR SAAT_WORD]
   struct saat_struct *children;  // An array of immediate descendents [FOR ALL BUT SAAT_WORD]
+  struct query_arena *arena;     // Where run, block and children are allocated.  See query_arena.h
 } saat_control_t;
 
 
@@ -60,8 +90,10 @@ if (!child->exhausted && child->curdoc <= blok->curdoc) {\
   }									\
  }									\
 
+void saat_select_run_decoder(int level);
+
 saat_control_t *saat_setup(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
-			   int *terms_not_present, int *error_code);
+			   index_environment_t *ixenv, int *terms_not_present, int *error_code);
 
 int saat_advance_within_doc(FILE *out, saat_control_t *pl_blok, byte *index, op_count_t *op_count, int debug);
 
@@ -70,7 +102,12 @@ int saat_get_tf(FILE *out, saat_control_t *blok, byte *index, op_count_t *op_cou
 int saat_skipto(FILE *out, saat_control_t *pl_blok, int blokno, docnum_t desired_docnum, int desired_wpos,
 	byte *index, op_count_t *op_count, int debug, int *error_code);
 
-void free_querytree_memory(saat_control_t **plists, int blok_count);
+void free_querytree_memory(struct query_arena *arena, saat_control_t **plists, int blok_count);
+
+int saat_setup_single_word(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+			   index_environment_t *ixenv, saat_control_t *blok, int *error_code);
+
+void saat_free_single_word(saat_control_t *blok);
 
 void saat_relaxed_and(FILE *out, query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
 		      saat_control_t *pl_blox, byte *forward, byte *index, byte *doctable, size_t fsz,
@@ -0,0 +1,312 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// An alternative to saat_relaxed_and(), used when QBASHQ is run with -engine=saat_impact and the
+// index was built with QBASHI -impact_file=TRUE.  It's SATIRE's score-at-a-time algorithm
+// (satire/src/q/q.c), applied to the QBASH.impact file of a segment:  The query is treated as a
+// disjunction of its terms.  Each term has a control block pointing at the next run of its
+// impact-ordered list, and the run with the highest impact among all the terms is always
+// processed next, adding its impact to the accumulator of each of its documents.  A document's
+// score is thus the sum of its impacts for the query terms.  The top k documents so far are kept
+// in the fake heap, a short array in descending score order.  Because the highest impacts come
+// first, processing can stop once impact_postings_budget postings have been processed, and the
+// results are then the best approximation available in that time.
+//
+// The accumulators are divided into blocks, each with a dirty flag, so that only the blocks
+// touched by a query need to be zeroed afterwards.  Accumulators and the fake heap live in an
+// impact_workspace_t, one for each segment in each query_thread_context_t, so they're allocated
+// once rather than per query.
+//
+// Up to max_candidates_to_consider documents are recorded, in result block 0, with their
+// scores already set.  rerank_and_record() uses those scores instead of score_candidate().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+#include <math.h>
+#ifdef WIN64
+#include <windows.h>
+#include <tchar.h>
+#include <strsafe.h>
+#else
+#include <errno.h>
+#endif
+
+#include "../shared/QBASHER_common_definitions.h"
+#include "../shared/utility_nodeps.h"
+#include "../utils/dahash.h"
+#include "QBASHQ.h"
+#include "saat_impact.h"
+
+
+#define ACC_BLOCK_SIZE 1024  // The accumulator array is divided into blocks containing ACC_BLOCK_SIZE accumulators
+
+typedef struct {
+  int highest_unprocessed_score;
+  int current_run_len;
+  int postings_remaining;
+  byte *if_pointer;
+} term_control_block_t;
+
+struct impact_workspace {
+  docnum_t num_docs;   // In the segment
+  int *accumulators, num_acc_blocks, heap_capacity, items_in_fake_heap;
+  docnum_t *fake_heap;
+  byte *acc_block_dirty_flags;
+};
+
+
+static impact_workspace_t *new_impact_workspace(docnum_t num_docs) {
+  impact_workspace_t *ws;
+  ws = (impact_workspace_t *)malloc(sizeof(impact_workspace_t));  // MAL1130
+  if (ws == NULL) return NULL;  // -------------------------------->
+  ws->num_docs = num_docs;
+  ws->num_acc_blocks = (int)((num_docs + ACC_BLOCK_SIZE - 1) / ACC_BLOCK_SIZE);
+  // The last block is always a full one, with some accumulators at the end never being used.
+  ws->accumulators = (int *)calloc((size_t)ws->num_acc_blocks * ACC_BLOCK_SIZE, sizeof(int));  // MAL1131
+  ws->acc_block_dirty_flags = (byte *)calloc(ws->num_acc_blocks + 1, sizeof(byte));  // MAL1132
+  ws->fake_heap = NULL;
+  ws->heap_capacity = 0;
+  ws->items_in_fake_heap = 0;
+  if (ws->accumulators == NULL || ws->acc_block_dirty_flags == NULL) {
+    free(ws->accumulators);  // FRE1131
+    free(ws->acc_block_dirty_flags);  // FRE1132
+    free(ws);  // FRE1130
+    return NULL;  // -------------------------------->
+  }
+  return ws;
+}
+
+
+void free_impact_workspace(impact_workspace_t **wsp) {
+  impact_workspace_t *ws = *wsp;
+  if (ws == NULL) return;
+  free(ws->accumulators);  // FRE1131
+  free(ws->acc_block_dirty_flags);  // FRE1132
+  free(ws->fake_heap);  // FRE1133
+  free(ws);  // FRE1130
+  *wsp = NULL;
+}
+
+
+void free_impact_workspaces(impact_workspace_t ***workspacesp, int num_workspaces) {
+  // Free the workspaces of a query_thread_context_t, and the array of them.
+  int s;
+  if (*workspacesp == NULL) return;
+  for (s = 0; s < num_workspaces; s++) free_impact_workspace(*workspacesp + s);
+  free(*workspacesp);  // FRE1134
+  *workspacesp = NULL;
+}
+
+
+static void zero_accumulators(impact_workspace_t *ws) {
+  // Each block of ACC_BLOCK_SIZE accumulators is guarded by a dirty flag.  If the dirty flag is
+  // not set, it may be safely assumed that all the accumulators in the block are already zero.
+  int b;
+  for (b = 0; b < ws->num_acc_blocks; b++) {
+    if (ws->acc_block_dirty_flags[b]) {
+      memset((void *)(ws->accumulators + (size_t)b * ACC_BLOCK_SIZE), 0, ACC_BLOCK_SIZE * sizeof(int));
+      ws->acc_block_dirty_flags[b] = 0;
+    }
+  }
+}
+
+
+static void insert_in_fake_heap(impact_workspace_t *ws, int k, docnum_t docid, int score) {
+  // The fake heap is just an array of up to k docids, sorted in descending order of the partial
+  // scores associated with those docids.  Unlike SATIRE, ties go to the document which reached the
+  // score first, which in a run is the one with the lower docnum, and so the higher static score.
+  int i, j, lowest;
+  docnum_t *fake_heap = ws->fake_heap;
+  int *accumulators = ws->accumulators;
+
+  // Skip a whole lot of unnecessary work if the heap is full and this docid can't get in.  The
+  // caller has already raised its accumulator, so that doesn't hold if it's the last one in the heap:
+  // it must be moved up.  (One higher up the heap must now score above the last one anyway.)
+  if (ws->items_in_fake_heap == k && fake_heap[k - 1] != docid
+      && score <= accumulators[fake_heap[k - 1]]) return;  // --------------------------------->
+
+  // This docid may already be in the heap with a partial score.  Is it?
+  for (i = 0; i < ws->items_in_fake_heap; i++) {
+    if (fake_heap[i] == docid) {
+      // Yes it is.  Remove it.
+      for (j = i + 1; j < ws->items_in_fake_heap; j++) fake_heap[j - 1] = fake_heap[j];
+      ws->items_in_fake_heap--;
+      break;
+    }
+  }
+
+  if (ws->items_in_fake_heap == 0) {  // Empty fake heap
+    fake_heap[ws->items_in_fake_heap++] = docid;
+    return;   // --------------------------------->
+  }
+
+  if (ws->items_in_fake_heap == k) {  // It's full
+    // Is there going to be a slot for this one?
+    for (i = 0; i < ws->items_in_fake_heap; i++) {
+      if (score > accumulators[fake_heap[i]]) {
+	// push down and insert this new docid at position i, dropping off
+	// the current lowest scoring item.
+	for (j = k - 1; j > i; j--) fake_heap[j] = fake_heap[j - 1];
+	fake_heap[i] = docid;
+	return;   // --------------------------------->
+      }
+    }
+    return;   // --------------------------------->
+  }
+
+  // The fake heap is only partly full, this one's going to go in somewhere
+  for (i = 0; i < ws->items_in_fake_heap; i++) {
+    if (score > accumulators[fake_heap[i]]) {
+      // push down and insert this new docid at position i.
+      lowest = ws->items_in_fake_heap;
+      for (j = lowest; j > i; j--) fake_heap[j] = fake_heap[j - 1];
+      fake_heap[i] = docid;
+      ws->items_in_fake_heap++;
+      return;   // --------------------------------->
+    }
+  }
+  // Must insert it at the end.
+  fake_heap[ws->items_in_fake_heap++] = docid;
+}
+
+
+BOOL saat_impact_usable(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+			index_environment_t *ixenv, int segments_to_search) {
+  // Return TRUE if this query can be run by saat_impact_search().  It can't if it needs anything
+  // which only saat_relaxed_and() provides, or if any of the segments to be searched has no .impact
+  // file, because the scores of the two engines can't be mixed.
+  int s;
+  if (!qoenv->use_impact_engine || qoenv->classifier_mode > 0 || qoenv->report_match_counts_only
+      || qex->query_contains_operators || qex->partial_cnt > 0 || qex->rank_only_cnt > 0
+      || qex->candidatesa == NULL)
+    return FALSE;  // -------------------------------->
+  for (s = 0; s < segments_to_search; s++) {
+    if (ixenv->segments[s]->impacts == NULL) return FALSE;  // -------------------------------->
+  }
+  return TRUE;
+}
+
+
+int saat_impact_search(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+		       index_environment_t *segment, impact_workspace_t **workspacep) {
+  // Run the query against the .impact file of segment, and record up to max_candidates_to_consider
+  // of the highest scoring documents in qex.  *workspacep is the workspace for this segment, which
+  // is created if it's NULL.  Return 1 if any query term occurs in the segment, 0 if none does, or
+  // a negative error code.
+  term_control_block_t term_control_block[MAX_WDS_IN_QUERY];
+  u_ll term_recnos[MAX_WDS_IN_QUERY], recno, postings_processed = 0;
+  docnum_t num_docs = (docnum_t)(segment->dsz / DTE_LENGTH), docid;
+  int k = qoenv->max_candidates_to_consider, q, q_len = 0, terms_still_going, t, p, block;
+  impact_workspace_t *ws = *workspacep;
+  candidate_t *candidate;
+  byte *ve, *list;
+
+  if (ws != NULL && ws->num_docs != num_docs) free_impact_workspace(workspacep);
+  if (*workspacep == NULL) {
+    *workspacep = new_impact_workspace(num_docs);
+    if (*workspacep == NULL) return -220086;  // -------------------------------->
+  }
+  ws = *workspacep;
+  if (ws->heap_capacity < k) {
+    free(ws->fake_heap);  // FRE1133
+    ws->fake_heap = (docnum_t *)malloc(k * sizeof(docnum_t));  // MAL1133
+    if (ws->fake_heap == NULL) {
+      ws->heap_capacity = 0;
+      return -220086;  // -------------------------------->
+    }
+    ws->heap_capacity = k;
+  }
+  ws->items_in_fake_heap = 0;
+
+  // Set up a control block for each distinct query term which has a list in this segment.
+  for (t = 0; t < qex->qwd_cnt; t++) {
+    qex->op_count[COUNT_TLKP].count++;
+    ve = lookup_word(qex->qterms[t], segment, qoenv->debug);
+    if (ve == NULL) continue;
+    recno = (u_ll)(ve - segment->vocab) / VOCABFILE_REC_LEN;
+    for (q = 0; q < q_len; q++) if (term_recnos[q] == recno) break;
+    if (q < q_len || segment->impact_list_offsets[recno] == 0) continue;   // A repeat, or a line prefix
+    list = segment->impacts + segment->impact_list_offsets[recno];
+    term_recnos[q_len] = recno;
+    term_control_block[q_len].postings_remaining = (int)im_get_list_count(list);
+    list += IM_LIST_HEADER_BYTES;
+    term_control_block[q_len].highest_unprocessed_score = (int)im_get_run_impact(list);
+    term_control_block[q_len].current_run_len = (int)im_get_run_count(list);
+    term_control_block[q_len].if_pointer = list + IM_RUN_HEADER_BYTES;
+    if (qoenv->debug >= 1)
+      fprintf(qoenv->query_output, "saat_impact_search(): term '%s' has %d postings, highest impact %d\n",
+	      qex->qterms[t], term_control_block[q_len].postings_remaining,
+	      term_control_block[q_len].highest_unprocessed_score);
+    q_len++;
+  }
+  if (q_len == 0) return 0;  // -------------------------------->
+
+  // ---------- Now process the query in SAAT fashion -----------
+  terms_still_going = q_len;
+  while (terms_still_going > 0) {
+    // find the highest current score.
+    int max_qscore = -1, chosen = -1;
+    term_control_block_t *tcb;
+    for (q = 0; q < q_len; q++) {
+      if (term_control_block[q].postings_remaining > 0
+	  && term_control_block[q].highest_unprocessed_score > max_qscore) {
+	max_qscore = term_control_block[q].highest_unprocessed_score;
+	chosen = q;
+      }
+    }
+    tcb = term_control_block + chosen;
+
+    // Process the run from the chosen one
+    for (p = 0; p < tcb->current_run_len; p++) {
+      docid = (docnum_t)bp_get40(tcb->if_pointer);
+      tcb->if_pointer += IM_DOCNUM_BYTES;
+      if (ts_is_set(segment->tombstones, segment->tsz, docid)) continue;
+      // Dealing with the accumulators
+      block = (int)(docid / ACC_BLOCK_SIZE);
+      ws->acc_block_dirty_flags[block] = 1;
+      ws->accumulators[docid] += max_qscore;
+      insert_in_fake_heap(ws, k, docid, ws->accumulators[docid]);
+    }
+    tcb->postings_remaining -= tcb->current_run_len;
+    postings_processed += tcb->current_run_len;
+    qex->op_count[COUNT_DECO].count += tcb->current_run_len;
+
+    if (qoenv->impact_postings_budget > 0 && postings_processed >= (u_ll)qoenv->impact_postings_budget) {
+      if (qoenv->debug >= 1)
+	fprintf(qoenv->query_output, "saat_impact_search(): Stopping after %llu postings (budget %d)\n",
+		postings_processed, qoenv->impact_postings_budget);
+      break;  // Early termination --------------------------------------------->
+    }
+
+    if (tcb->postings_remaining > 0) {
+      // Read the impact and length of the next run from its header
+      tcb->highest_unprocessed_score = (int)im_get_run_impact(tcb->if_pointer);
+      tcb->current_run_len = (int)im_get_run_count(tcb->if_pointer);
+      tcb->if_pointer += IM_RUN_HEADER_BYTES;
+    }
+    else terms_still_going--;
+  }
+
+  // ------ now record the candidates ---------
+  for (t = 0; t < ws->items_in_fake_heap; t++) {
+    docid = ws->fake_heap[t];
+    candidate = qex->candidatesa[0] + qex->candidates_recorded[0];
+    memset(candidate, 0, sizeof(candidate_t));
+    candidate->doc = docid;
+    candidate->score = (double)ws->accumulators[docid] / (double)IM_MAX_IMPACT;
+    candidate->segment = (byte)qex->segment;
+    qex->candidates_recorded[0]++;
+    qex->op_count[COUNT_CONS].count++;
+    if (qoenv->debug >= 1)
+      fprintf(qoenv->query_output, "saat_impact_search(): recorded doc %lld from segment %d with score %d\n",
+	      docid, qex->segment, ws->accumulators[docid]);
+  }
+  zero_accumulators(ws);
+  return 1;
+}
@@ -0,0 +1,17 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// Score-at-a-time ranked retrieval over the impact-ordered postings in QBASH.impact, selected by
+// -engine=saat_impact.  The algorithm is SATIRE's (satire/src/q/q.c).  See saat_impact.c.
+
+typedef struct impact_workspace impact_workspace_t;
+
+BOOL saat_impact_usable(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+			index_environment_t *ixenv, int segments_to_search);
+
+int saat_impact_search(query_processing_environment_t *qoenv, book_keeping_for_one_query_t *qex,
+		       index_environment_t *segment, impact_workspace_t **workspacep);
+
+void free_impact_workspace(impact_workspace_t **wsp);
+
+void free_impact_workspaces(impact_workspace_t ***workspacesp, int num_workspaces);
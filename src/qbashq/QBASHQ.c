@@ -1,6 +1,8 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT license.
 
+#define _POSIX_C_SOURCE 200809L  // To get access to open_memstream() in gcc while using std=c11
+
 // QBASHQ - A main program to run queries from standard input against a QBASH
 // index, consisting of files (QBASH.doctable, .vocab, .if, .forward).  It uses
 // the QBASHQ-LIB library.
@@ -24,7 +26,6 @@
 #include <Psapi.h>
 #else
 #include <pthread.h>
-#include <time.h>  // For nanosleep()
 #endif
 
 #include "../shared/unicode.h"
@@ -48,6 +49,7 @@ long long input_offset = 0;   // Byte offset into the file of input queries
 typedef struct {
 	index_environment_t *ixenv;
 	query_processing_environment_t *qoenv;
+	query_thread_context_t *qtc;
   u_char multi_query_string[MAX_QLINE + 1],
     mqs_copy[MAX_QLINE + 1],
     query_label[MAX_QLINE + 1];
@@ -113,6 +115,7 @@ static void print_usage(query_processing_environment_t *qoenv) {
 #ifdef WIN64   
 HANDLE h_output_mutex;
 HANDLE work_item_finished_event[MAX_QUERY_PARALLELISM];
+static long long queries_presented = 0;   // Only accessed while h_output_mutex is held
 
 static void WINAPI thread_run_query(PTP_CALLBACK_INSTANCE instance, void *context, PTP_WORK work)  {
   // Used as a callback via the threadpool
@@ -148,7 +151,7 @@ static void WINAPI thread_run_query(PTP_CALLBACK_INSTANCE instance, void *contex
   // may be set in options_string.  Options set there, only affect a local qoenv which only lives for the
   // duration of the query.  When we return from that handle_multi_query(), ms->qoenv still refers to the
   // global version which means we can correctly record response time statistics.
-  how_many_results = handle_multi_query(mscon->ixenv, mscon->qoenv, qopstring,
+  how_many_results = handle_multi_query(mscon->ixenv, mscon->qoenv, mscon->qtc, qopstring,
 				      &returned_results, &corresponding_scores, &timed_out);
   if (0) printf("returned from h_m_q() with %d results\n", how_many_results);
   // WaitForSingleObject apparently assigns the mutex to us when it stops timing out.
@@ -162,10 +165,10 @@ static void WINAPI thread_run_query(PTP_CALLBACK_INSTANCE instance, void *contex
   }
   // -----------------------------  Mutex Acquired ----------------------------------------------
   if (mscon->qoenv->chatty) {
-    present_results(mscon->qoenv, mscon->mqs_copy, mscon->query_label, returned_results, corresponding_scores, 
+    present_results(mscon->qoenv, mscon->qtc, mscon->mqs_copy, mscon->query_label, returned_results, corresponding_scores, 
 		    how_many_results, start);
   } else {
-    terse_show(mscon->qoenv, returned_results, corresponding_scores, how_many_results);
+    terse_show(query_output, returned_results, corresponding_scores, how_many_results);
   }
 
   if (0) printf("About to call F_R_M\n");
@@ -176,7 +179,8 @@ static void WINAPI thread_run_query(PTP_CALLBACK_INSTANCE instance, void *contex
     // This is just an experimental feature to enable finding the slowest queries in a batch (e.g.)
     fprintf(mscon->qoenv->query_output, "QTIME: %s\t%.1f msec.\n", mscon->mqs_copy, (what_time_is_it() - start) * 1000.0);
 
-  if (mscon->qoenv->queries_run % 1000 == 0) {
+  queries_presented++;
+  if (queries_presented % 1000 == 0) {
     report_milestone(mscon->qoenv);
     fprintf(mscon->qoenv->query_output, "Milestone: Input file offset (approximate): %lld\n", input_offset);
   }
@@ -206,156 +210,205 @@ static multistream_context_t work_context[MAX_QUERY_PARALLELISM];
 
 
 #else
-// Here's the POSIX version of the parallel code.  In this model, we create a
-// a fixed number of threads.  Each thread is controlled by an array element
-// comprising a state variable, a mutex, and potentially a work item.
-// The thread code has a loop which repeatedly waits on the mutex, tests
-// the state, performs the action appropriate to the state, and releases the mutex.
+// Here's the POSIX version of the parallel code.  The main thread reads queries with fgets()
+// and appends them to a bounded ring of work items.  A fixed pool of worker threads takes items
+// from the ring, sleeping on a condition variable when there is nothing to do.  All the workers
+// share the read-only qoenv and ixenv.  Each has its own query_thread_context_t, in which its
+// statistics are recorded and whose query_output is an in-memory stream, so that no locking is
+// needed while a query is processed or its results are formatted.  The main thread writes out the buffered output of finished items strictly
+// in input order, so the output is the same as that from a single stream.
+
+#define WORK_SLOTS_PER_THREAD 4   // Lets workers run ahead of the item at the head of the ring
 
 typedef enum {
-  NO_WORK_TO_DO,
-  WORK_WAITING,
-  KNOCK_OFF_WORK,
-} work_state_t;
+  SLOT_EMPTY,
+  SLOT_QUEUED,
+  SLOT_RUNNING,
+  SLOT_DONE
+} slot_state_t;
 
-static struct thread_control {
-  work_state_t state;
+typedef struct {
+  slot_state_t state;
+  u_char *multi_query_string;   // Malloced.  Query label (if any) follows the NUL.
+  u_char *query_label;
+  char *output;                 // Malloced by open_memstream()
+  size_t output_len;
+} work_slot_t;
+
+static struct {
   pthread_mutex_t mutti;
+  pthread_cond_t work_available, work_finished;
+  work_slot_t *slots;
+  int num_slots;
+  long long next_to_add, next_to_take, next_to_write;  // Monotonic item sequence numbers
+  BOOL knock_off;
+} work_ring;
+
+static struct thread_control {
   pthread_t thread;
-  multistream_context_t work_item;
+  int thread_num;
+  index_environment_t *ixenv;
+  query_processing_environment_t *qoenv;   // Shared by all the threads
+  query_thread_context_t *qtc;             // This thread's own
 } thread_controls[MAX_QUERY_PARALLELISM];
 
-static pthread_mutex_t access_to_output;
-
-static void repeatedly_try_for_lock(pthread_mutex_t *lock, char *id, int thread) {
-  struct timespec req = {0, 1000};
-  int code;
-  do {
-    code = pthread_mutex_trylock(lock);
-    if (code == 0) return;
-    if (code != EBUSY) {
-      printf("Error %d: mutex_lock(%s) in thread %d\n", code, id, thread);
-      exit(1);
-    }
-    nanosleep(&req, NULL);
-  } while (1);
+
+static void check_pthread_code(int code, char *what) {
+  if (code) {
+    fprintf(stderr, "Error %d: %s\n", code, what);
+    exit(1);   // OK - can't sensibly continue with broken synchronisation
+  }
 }
 
-static void *pthread_run_queries(void *control) {
-  struct thread_control *tc = (struct thread_control *) control;
-  multistream_context_t *mscon = &(tc->work_item);
+
+static void run_one_work_item(struct thread_control *tc, work_slot_t *slot) {
+  // Run the query in slot and capture everything written to query_output in
+  // slot->output.   The caller holds no locks.
+  query_processing_environment_t *qoenv = tc->qoenv;
+  query_thread_context_t *qtc = tc->qtc;
   double start;
-  int how_many_results, code;
-  u_char **returned_results = NULL, *qopstring = NULL, *tab1 = NULL,
-    *tab2 = NULL, *query_label = NULL;
+  int how_many_results;
+  u_char **returned_results = NULL, *mqs_copy = NULL;
   double *corresponding_scores = NULL;
   BOOL timed_out = FALSE;
-  struct timespec req = {0, 1};
+  FILE *buffered_output;
+
+  slot->output = NULL;
+  slot->output_len = 0;
+  buffered_output = open_memstream(&(slot->output), &(slot->output_len));
+  if (buffered_output == NULL) {
+    fprintf(stderr, "Error: open_memstream() failed in thread %d\n", tc->thread_num);
+    exit(1);   // OK - the batch can't be completed
+  }
+  qtc->query_output = buffered_output;
+
+  start = what_time_is_it();
+  if (qoenv->chatty) mqs_copy = make_a_copy_of(slot->multi_query_string);
+  how_many_results = handle_multi_query(tc->ixenv, qoenv, qtc, slot->multi_query_string,
+					&returned_results, &corresponding_scores, &timed_out);
+  if (qoenv->chatty) {
+    present_results(qoenv, qtc, mqs_copy, slot->query_label, returned_results, corresponding_scores,
+		    how_many_results, start);
+    free(mqs_copy);
+  } else {
+    terse_show(buffered_output, returned_results, corresponding_scores, how_many_results);
+  }
+
+  free_results_memory(&returned_results, &corresponding_scores, how_many_results);  // f_r_m() tests pointer args for NULL
+
+  fclose(buffered_output);   // Makes slot->output and slot->output_len valid
+  qtc->query_output = NULL;
+}
 
 
+static void *pthread_run_queries(void *control) {
+  struct thread_control *tc = (struct thread_control *)control;
+  work_slot_t *slot;
+
   while (1) {
-    if (mscon->qoenv->query_streams > 1)
-      repeatedly_try_for_lock(&(tc->mutti), "work item", tc->work_item.thread);  // Will wait forever if the mutex remains locked.
-    switch (tc->state) {
-    case KNOCK_OFF_WORK:
-      if (mscon->qoenv->query_streams > 1) {
-	code = pthread_mutex_unlock(&(tc->mutti));
-	if (code) {
-	  printf("Error %d: mutex_unlock() in thread %d\n", code, mscon->thread);
-	  exit(1);
-	}
-      }
-      pthread_exit(NULL);
+    check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in worker");
+    while (work_ring.next_to_take == work_ring.next_to_add && !work_ring.knock_off)
+      check_pthread_code(pthread_cond_wait(&work_ring.work_available, &work_ring.mutti),
+			 "pthread_cond_wait() in worker");
+    if (work_ring.next_to_take == work_ring.next_to_add) {
+      // Nothing left to do and we've been told to knock off.
+      check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in worker");
       break;
-    case WORK_WAITING:
-       start = what_time_is_it();
-      // Assumptions about mscon->multi_query_string:
-      //  - It's stored in writeable memory, so we can insert NULs where we need to
-      //  - Null terminated
-      //  - Leading whitespace has been skipped.
-      //  - May contain 'TAB option-string' or 'TAB option-string TAB query-label'  after the actual query,
-      //    where 
-      //  - If present, query-label is just remembered and printed out with Query and Options.
-      //  - May end with LF or CRLF
-       if (mscon->qoenv->allow_per_query_options) {
-	 tab2 = find_nth_occurrence_in_record(mscon->multi_query_string, '\t', 2);
-	 if (tab2 != NULL) {
-	   if (*tab2 == '\t') query_label = tab2 + 1;
-	   *tab2 = 0;  //  Terminate query + options
-	 }
-       } else {
-	 // Strip out TABs unless per_query_options are allowed
-	 tab1 = find_nth_occurrence_in_record(mscon->multi_query_string, '\t', 1);
-	 if (tab1 != NULL && *tab1 == '\t') *tab1 = 0;  // Zap out everything beyond the first tab
-       }
-       qopstring = mscon->multi_query_string;
-      // Note that ms->qoenv refers to a global version which doesn't yet take into account any options which 
-      // may be set in options_string.  Options set there, only affect a local qoenv which only lives for the
-      // duration of the query.  When we return from the handle_multi_query() call, ms->qoenv still refers to the
-      // global version which means we can correctly record response time statistics.
-
-       how_many_results = handle_multi_query(mscon->ixenv, mscon->qoenv, qopstring,
-					  &returned_results, &corresponding_scores, &timed_out);
-
-
-      // To present results we need to grab a lock on the output stream     
-     if (mscon->qoenv->query_streams > 1)
-       repeatedly_try_for_lock(&access_to_output, "output stream", tc->work_item.thread);  // Will wait forever if the mutex remains locked.
-      present_results(mscon->qoenv, qopstring, query_label,
-		      returned_results, corresponding_scores, 
-		      how_many_results, start);
-      if (mscon->qoenv->query_streams > 1) {
-	code = pthread_mutex_unlock(&access_to_output);  
-	if (code) {
-	  printf("Error %d: mutex_unlock(access_to_to_output) in thread %d\n", code, mscon->thread);
-	  exit(1);
-	}
-      }
-      // Can release the thread control lock at this point.
-      if (mscon->qoenv->query_streams > 1) {
-	code = pthread_mutex_unlock(&(tc->mutti));
-	if (code) {
-	  printf("Error %d: mutex_unlock() in thread %d\n", code, mscon->thread);
-	  exit(1);
-	}
-      }
+    }
+    slot = work_ring.slots + (work_ring.next_to_take % work_ring.num_slots);
+    work_ring.next_to_take++;
+    slot->state = SLOT_RUNNING;
+    check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in worker");
+
+    run_one_work_item(tc, slot);
+
+    check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in worker");
+    slot->state = SLOT_DONE;
+    // Only the main thread waits on work_finished
+    check_pthread_code(pthread_cond_signal(&work_ring.work_finished), "pthread_cond_signal() in worker");
+    check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in worker");
+  }
 
-      
-     if (0) printf("About to call F_R_M\n");
-      if (returned_results != NULL)
-	free_results_memory(&returned_results, &corresponding_scores,
-			    how_many_results);   // f_r_m() tests pointer args for NULL
-      if (0) printf("F_R_M returned\n");
+  pthread_exit(NULL);
+}
 
-      if (mscon->qoenv->x_show_qtimes)
-	// This is just an experimental feature to enable finding the slowest queries in a batch (e.g.)
-	fprintf(mscon->qoenv->query_output, "QTIME: %s\t%.1f msec.\n", qstring, (what_time_is_it() - start) * 1000.0);
 
-      if (mscon->qoenv->queries_run % 1000 == 0) {
-	report_milestone(mscon->qoenv);
-	fprintf(mscon->qoenv->query_output, "Milestone: Input file offset (approximate): %lld\n", input_offset);
-      }
+static long long write_finished_work(query_processing_environment_t *qoenv, BOOL wait_for_room,
+				     BOOL wait_for_all) {
+  // Called only by the main thread.  Write out, in input order, the output of every finished
+  // item at the head of the ring.  If wait_for_room, don't return until there is a free slot.
+  // If wait_for_all, don't return until every queued item has been written.  Return the
+  // number of items written.  Report a milestone after every 1000 queries written.
+  static long long queries_written = 0;
+  work_slot_t *slot;
+  long long written = 0;
 
-      // We still have the lock on the thread_controls entry
-      tc->state = NO_WORK_TO_DO;
-      break;
-    default:
-      if (mscon->qoenv->query_streams > 1) {
-	code = pthread_mutex_unlock(&(tc->mutti));
-	if (code) {
-	  printf("Error %d: mutex_unlock() in thread %d\n", code, mscon->thread);
-	  exit(1);
-	}
-	nanosleep(&req, NULL);
+  check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in main");
+  while (1) {
+    if (work_ring.next_to_write == work_ring.next_to_add) break;   // Ring is empty
+    slot = work_ring.slots + (work_ring.next_to_write % work_ring.num_slots);
+    if (slot->state == SLOT_DONE) {
+      // Nobody else touches a DONE slot, so the write can be done without the lock.
+      check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in main");
+      if (slot->output_len > 0) fwrite(slot->output, 1, slot->output_len, qoenv->query_output);
+      free(slot->output);                 // Allocated by open_memstream()
+      slot->output = NULL;
+      free(slot->multi_query_string);     // FRE0901 (includes the query label)
+      slot->multi_query_string = NULL;
+      slot->query_label = NULL;
+      written++;
+      if (++queries_written % 1000 == 0) {
+	report_milestone(qoenv);
+	fprintf(qoenv->query_output, "Milestone: Input file offset (approximate): %lld\n", input_offset);
       }
+      check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in main");
+      slot->state = SLOT_EMPTY;
+      work_ring.next_to_write++;
+      continue;
+    }
+    if (wait_for_all
+	|| (wait_for_room && work_ring.next_to_add - work_ring.next_to_write >= work_ring.num_slots)) {
+      check_pthread_code(pthread_cond_wait(&work_ring.work_finished, &work_ring.mutti),
+			 "pthread_cond_wait() in main");
+    } else {
       break;
-    }  // end of switch
+    }
+  }
+  check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in main");
+  return written;
+}
 
-   } // End of loop forever
 
-  pthread_exit(NULL);
+static void add_work_item(u_char *multi_query_string, u_char *query_label) {
+  // Called only by the main thread, after write_finished_work() has made room.
+  // Copy the query and optional label into a single malloced block.
+  size_t qlen = strlen((char *)multi_query_string), llen = 0;
+  u_char *copy;
+  work_slot_t *slot;
+
+  if (query_label != NULL) llen = strlen((char *)query_label);
+  copy = (u_char *)malloc(qlen + llen + 2);  // MAL0901
+  if (copy == NULL) {
+    fprintf(stderr, "Error: malloc failed for work item\n");
+    exit(1);   // OK - the batch can't be completed
+  }
+  memcpy(copy, multi_query_string, qlen + 1);
+
+  check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in main");
+  slot = work_ring.slots + (work_ring.next_to_add % work_ring.num_slots);
+  slot->multi_query_string = copy;
+  if (query_label != NULL) {
+    slot->query_label = copy + qlen + 1;
+    memcpy(slot->query_label, query_label, llen + 1);
+  }
+  else slot->query_label = NULL;
+  slot->state = SLOT_QUEUED;
+  work_ring.next_to_add++;
+  check_pthread_code(pthread_cond_signal(&work_ring.work_available), "pthread_cond_signal() in main");
+  check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in main");
 }
 
+
 #endif
 #endif // ifndef NO_THREADS
 
@@ -382,9 +435,11 @@ int main(int argc, char **argv) {
    size_t qlen;
 #endif
 
-#ifdef NO_THREADS
+#if defined(NO_THREADS) || !defined(WIN64)
    double query_started;
+   query_thread_context_t *main_qtc = NULL;   // For queries run in the main thread
 #endif
+  long long queries_in_batch = 0;
 
   //Needed to use the new API ....
   u_char **returned_results;
@@ -491,21 +546,21 @@ int main(int argc, char **argv) {
       if (*p == '\t') *p = ' ';
       p++;
     }
-    how_many_results = handle_multi_query(ixenv, qoenv, qoenv->partial_query, &returned_results, &corresponding_scores, &timed_out);
+    how_many_results = handle_multi_query(ixenv, qoenv, NULL, qoenv->partial_query, &returned_results, &corresponding_scores, &timed_out);
 
     if (qoenv->report_match_counts_only) {
           fprintf(qoenv->query_output, "Match count for AND of\t%s\t%d\n", qoenv->partial_query, how_many_results);
    
     } else if (qoenv->x_batch_testing) {
       if (how_many_results > 0)
-	experimental_show(qoenv, qoenv->partial_query, returned_results, corresponding_scores,
+	experimental_show(qoenv->query_output, qoenv->partial_query, returned_results, corresponding_scores,
 			  how_many_results, query_label);
       else
 	fprintf(qoenv->query_output, "Query:\t%s\n", qoenv->partial_query);
     }
     else {
       if (how_many_results > 0)
-	terse_show(qoenv, returned_results, corresponding_scores, how_many_results);
+	terse_show(qoenv->query_output, returned_results, corresponding_scores, how_many_results);
       else if (how_many_results < 0) {
 	respond_to_error(how_many_results);
       }
@@ -532,6 +587,8 @@ int main(int argc, char **argv) {
     for (th = 0; th < qoenv->query_streams; th++) {
       work_context[th].ixenv = ixenv;
       work_context[th].qoenv = qoenv;
+      work_context[th].qtc = new_query_thread_context(qoenv);
+      if (work_context[th].qtc == NULL) error_exit("Fatal Error: Can't allocate a query thread context\n");   // OK - this happens once at start-up
       work_context[th].thread = th;
       thread_busy[th] = FALSE;
       // query_string will be filled in later for each query.
@@ -541,30 +598,32 @@ int main(int argc, char **argv) {
     }
 
 #else   // pthreads branch
-    int th, code;
-    struct timespec req = {0, 1};
-    code = pthread_mutex_init(&access_to_output, NULL);
-    if (code) {
-      printf("Error %d: mutex_mutex_init(access_to_output) in main thread\n", code);
-      exit(1);
-    }
-    for (th = 0; th < qoenv->query_streams; th++) {
-      thread_controls[th].work_item.ixenv = ixenv;
-      thread_controls[th].work_item.qoenv = qoenv;
-      thread_controls[th].work_item.thread = th;
-      // query_string will be filled in later for each query.
-      thread_controls[th].state = NO_WORK_TO_DO;
-      code = pthread_mutex_init(&(thread_controls[th].mutti), NULL);
-      if (code) {
-	printf("Error %d: pthread_mutex_init() for worker thread %d\n", code, th);
-	exit(1);
+    int th;
+    if (qoenv->query_streams > MAX_QUERY_PARALLELISM) qoenv->query_streams = MAX_QUERY_PARALLELISM;
+    if (qoenv->query_streams > 1) {
+      check_pthread_code(pthread_mutex_init(&work_ring.mutti, NULL), "pthread_mutex_init() in main");
+      check_pthread_code(pthread_cond_init(&work_ring.work_available, NULL), "pthread_cond_init() in main");
+      check_pthread_code(pthread_cond_init(&work_ring.work_finished, NULL), "pthread_cond_init() in main");
+      work_ring.num_slots = qoenv->query_streams * WORK_SLOTS_PER_THREAD;
+      work_ring.slots = (work_slot_t *)calloc(work_ring.num_slots, sizeof(work_slot_t));  // MAL0902
+      if (work_ring.slots == NULL) error_exit("Fatal Error: Can't allocate the work ring\n");  // OK - start-up
+      work_ring.next_to_add = 0;
+      work_ring.next_to_take = 0;
+      work_ring.next_to_write = 0;
+      work_ring.knock_off = FALSE;
+
+      // All the contexts must be created before any thread starts.
+      for (th = 0; th < qoenv->query_streams; th++) {
+	thread_controls[th].thread_num = th;
+	thread_controls[th].ixenv = ixenv;
+	thread_controls[th].qoenv = qoenv;
+	thread_controls[th].qtc = new_query_thread_context(qoenv);
+	if (thread_controls[th].qtc == NULL) error_exit("Fatal Error: Can't allocate a query thread context\n");  // OK - start-up
       }
-      
-      code = pthread_create(&(thread_controls[th].thread), NULL,
-			    pthread_run_queries, thread_controls + th);
-      if (code) {
-	printf("Error %d: pthread_create() for worker thread %d\n", code, th);
-	exit(1);
+      for (th = 0; th < qoenv->query_streams; th++) {
+	check_pthread_code(pthread_create(&(thread_controls[th].thread), NULL,
+					  pthread_run_queries, thread_controls + th),
+			   "pthread_create() in main");
       }
     }
     if (0) printf(" ... all threads set up\n");
@@ -576,6 +635,11 @@ int main(int argc, char **argv) {
     // Query batch -- common to multithreaded and single threaded
     //-------------------------------------------------------------------------
 
+#if defined(NO_THREADS) || !defined(WIN64)
+    main_qtc = new_query_thread_context(qoenv);
+    if (main_qtc == NULL) error_exit("Fatal Error: Can't allocate a query thread context\n");  // OK - start-up
+#endif
+
     if (qoenv->chatty) {
       print_qbasher_version(qoenv->query_output);
       fprintf(qoenv->query_output, "Format of index: %.1f\n", ixenv->index_format_d);
@@ -588,6 +652,7 @@ int main(int argc, char **argv) {
       while (*q && isspace(*q)) q++;
 
       if (*q) { // Only do this for non-blank queries
+	queries_in_batch++;
 
 #ifndef NO_THREADS			  
 #ifdef WIN64   // ------ Multi-threaded path:  At the moment threading is not supported from gcc			  
@@ -649,82 +714,18 @@ int main(int argc, char **argv) {
 					
 	  // Keep looping until this query is launched.
 	}
-#else  // pthreads branch  --- Note that this needs debugging!  On Windows it runs horribly slowly
-	BOOL query_launched;
-	u_char *r, *w;
-	size_t qlen;
-	query_launched = FALSE;
-	while (!query_launched) {
-	  // Find first free thread and slot in a work item
-	  // If none of the threads are free we just fall through.
-	  for (th = 0; th < qoenv->query_streams; th++) {
-	    // Try to get a lock on this thread's state variable.
-	    if (qoenv->query_streams > 1) {
-	      code = pthread_mutex_trylock(&(thread_controls[th].mutti));
-	    }
-	    else code = 0;
-	    if (code == 0) {
-	      // Got the lock
-	      if (thread_controls[th].state == NO_WORK_TO_DO) {
-		query_launched = TRUE;
-		thread_controls[th].state = WORK_WAITING;
-		// Copy the input string into the relevant part of the work item
-		r = q;
-		w = thread_controls[th].work_item.multi_query_string;
-		while (*r  && *r != 0x1D) *w++ = *r++;
-		*w = 0;
-		qlen = r - q;
-		if (*r == 0x1D) {
-		  // Copy the query label following the group separator (GS)
-		  r++;  // Skip the GS
-		  w = work_context[th].query_label;  // This buffer's also guaranteed big enough
-		  while (*r >= ' ') *w++ = *r++;
-		  *w = 0;
-		}
-		else work_context[th].query_label[0] = 0;
-
-		input_offset += qlen;
-		if (0) printf("OK, the request is set up for thread %d (%s).\n",
-			      th, thread_controls[th].work_item.multi_query_string);
-	      }
-	      if (qoenv->query_streams > 1) {
-		code = pthread_mutex_unlock(&(thread_controls[th].mutti));
-	      }
-	      else {
-		code = 0;
-	      }
-	      if (code) {
-		printf("Error %d: pthread_mutex_unlock() for worker thread %d\n", code, th);
-		exit(1);
-	      }
-	      if (query_launched) break;    // ------------------------>
-	    }
-	    else if (code != EBUSY) {  // If the lock is busy, just move on
-	      printf("Error %d: pthread_mutex_trylock() for worker thread %d\n", code, th);
-	      exit(1);
-	    }
-	  }  // End of loop over threads
-
-	  if (!query_launched) {
-	    // Nanosleep for a microsecond here to give the other threads a chance to make progress
-	    code = nanosleep(&req, NULL);
-	    if (code) {
-	      printf("Error %d: nanosleep()\n", code);
-	      exit(1);
-	    }
-	  }
-	}  // while (!query_launched)
-
 #endif
-      
+#endif
 
-#else   // ------------  Unthreaded path for batched queries ------------------------------------
+#if defined(NO_THREADS) || !defined(WIN64)
+	// ------------  POSIX and unthreaded paths for batched queries ------------------------------
 
 
 	multiqstr = q;
 	  
 	      
 	while (*q  && *q != 0x1D && *q != '\n' && *q != '\r') q++;
+	input_offset += (q - multiqstr);
 	if (*q == 0x1D) {
 		// The query label follows the group separator (GS)
 	  *q++ = 0;  // zap the GS
@@ -734,18 +735,30 @@ int main(int argc, char **argv) {
 
 	*q = 0;  // Zap newlines etc at the end
 
+#ifndef NO_THREADS
+	if (qoenv->query_streams > 1) {
+	  // Queue the query for the worker threads, first writing out any results which
+	  // are ready, and waiting for room in the ring if necessary.
+	  write_finished_work(qoenv, TRUE, FALSE);
+	  add_work_item(multiqstr, query_label);
+	  continue;   // ---------------------------> Next fgets()
+	}
+#endif
+
 	if (qoenv->chatty) 
 	  mqs_copy = make_a_copy_of(multiqstr);
 
 	query_started = what_time_is_it();
-	how_many_results = handle_multi_query(ixenv, qoenv, multiqstr,
+	how_many_results = handle_multi_query(ixenv, qoenv, main_qtc, multiqstr,
 					      &returned_results, &corresponding_scores, &timed_out);
 
 	if (qoenv->chatty) {
-	  present_results(qoenv, mqs_copy, query_label, returned_results, corresponding_scores, 
+	  present_results(qoenv, main_qtc, mqs_copy, query_label, returned_results, corresponding_scores, 
 			  how_many_results, query_started);
+	  free(mqs_copy);
+	  mqs_copy = NULL;
 	} else {
-	  terse_show(qoenv, returned_results, corresponding_scores, how_many_results);
+	  terse_show(qoenv->query_output, returned_results, corresponding_scores, how_many_results);
 	}
 	if (0) printf("About to free results\n");
 	
@@ -780,38 +793,29 @@ int main(int argc, char **argv) {
     CloseHandle(h_output_mutex);
 
 #else
-    // Tell all the threads to knock off, and wait until they do.
-    
-    for (th = 0; th < qoenv->query_streams; th++) {
-      code = pthread_mutex_lock(&(thread_controls[th].mutti));
-      if (code) {
-	printf("Error %d: pthread_mutex_lock() for worker thread %d\n", code, th);
-	exit(1);
-      }
-      // Got the lock
-      thread_controls[th].state = KNOCK_OFF_WORK;
-      code = pthread_mutex_unlock(&(thread_controls[th].mutti));
-      if (code) {
-	printf("Error %d: pthread_mutex_unlock() for worker thread %d\n", code, th);
-	exit(1);
+    if (qoenv->query_streams > 1) {
+      // Write out everything still in the ring, then tell all the threads to knock off, and
+      // wait until they do.
+      write_finished_work(qoenv, FALSE, TRUE);
+      check_pthread_code(pthread_mutex_lock(&work_ring.mutti), "pthread_mutex_lock() in main");
+      work_ring.knock_off = TRUE;
+      check_pthread_code(pthread_cond_broadcast(&work_ring.work_available), "pthread_cond_broadcast() in main");
+      check_pthread_code(pthread_mutex_unlock(&work_ring.mutti), "pthread_mutex_unlock() in main");
+
+      for (th = 0; th < qoenv->query_streams; th++) {
+	check_pthread_code(pthread_join(thread_controls[th].thread, NULL), "pthread_join() in main");
       }
-
-      // Note that this thread should finish almost instantaneously because we only get the lock
-      // once it's finished a query, and we're not giving it any more.
-
-      code = pthread_join(thread_controls[th].thread, NULL);
-      if (code) {
-	printf("Error %d: pthread_join() for worker thread %d\n", code, th);
-	exit(1);
-      }
-    
+      free(work_ring.slots);   // FRE0902
+      work_ring.slots = NULL;
+      pthread_cond_destroy(&work_ring.work_available);
+      pthread_cond_destroy(&work_ring.work_finished);
+      pthread_mutex_destroy(&work_ring.mutti);
     }
-   
 #endif
 #endif  // Unthreaded
 
 
-    if (qoenv->chatty && qoenv->queries_run > 0) {
+    if (qoenv->chatty && queries_in_batch > 0) {
       report_query_response_times(qoenv);
       fprintf(qoenv->query_output, "Milestone: Input file offset (approximate): %lld\n", input_offset);
     }
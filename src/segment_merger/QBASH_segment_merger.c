@@ -0,0 +1,345 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// QBASH_segment_merger supports incremental updating of a QBASHER index.  An index_dir may contain
+// delta segments, delta1, delta2, ... each a complete QBASHI index of records which are new or
+// changed since the base was built, and any segment may have a QBASH.tombstones bitmap of deleted
+// documents.  QBASHQ searches all the segments.  (See QBASHER_common_definitions.h.)
+//
+// A typical refresh cycle is:
+//   1. Put the new and changed records in <index_dir>/delta<n>/QBASH.forward and index it with
+//      QBASHI, using the same options as the base, including -max_raw_score so that the doc
+//      scores are on the same scale.
+//   2. Run this program with -tombstone against the base and each earlier delta, giving
+//      delta<n>/QBASH.forward as the keys file, so that superseded versions are hidden, and
+//      again with a file of the triggers of deleted records.
+//   3. Reload the indexes in QBASHQ.
+// Every so often, run this program with -merge to write a single .forward containing all the
+// live records, index it with QBASHI, and replace the base and deltas with the result.
+//
+// The cost of steps 1 and 2 depends on the number of changed records, apart from a scan of the
+// doctable of each older segment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#ifdef WIN64
+#include <windows.h>
+#include <tchar.h>
+#include <strsafe.h>
+#else
+#include <errno.h>
+#endif
+
+#include "../shared/unicode.h"
+#include "../shared/QBASHER_common_definitions.h"
+#include "../shared/utility_nodeps.h"
+
+#define OBUF_SIZE (50 * 1048576)   // X * 1MB
+
+// The docoff field of a doctable entry.  (Mirrors calculate_dte_shifts_and_masks() in QBASHI and QBASHQ.)
+#define dte_docoff(dte) (((dte) >> DTE_WDCNT_BITS) & ((1ULL << DTE_DOCOFF_BITS) - 1))
+
+typedef struct {
+  u_char *text;
+  size_t len;
+} seg_key_t;
+
+typedef struct {
+  byte *doctable, *forward;
+  size_t dsz, fsz;
+  CROSS_PLATFORM_FILE_HANDLE doctable_H, forward_H;
+  HANDLE doctable_MH, forward_MH;
+  docnum_t num_docs;
+} segment_t;
+
+
+static void print_usage(char *progname) {
+  printf("Usage: %s -tombstone <segment_dir> <keys_file>\n"
+	 "       %s -merge <index_dir> <output_file>\n\n"
+	 "  -tombstone marks as deleted every document in the index in segment_dir whose trigger (column 1)\n"
+	 "       matches column 1 of a line in keys_file.  keys_file may be the .forward of a newer delta.\n"
+	 "       Bits are added to any existing QBASH.tombstones.\n"
+	 "  -merge writes all the live records in index_dir and its delta segments to output_file, in\n"
+	 "       segment order and then docnum order, ready for indexing by QBASHI.\n",
+	 progname, progname);
+  exit(1);
+}
+
+
+static size_t trigger_length(u_char *record, u_char *end) {
+  u_char *p = record;
+  while (p < end && *p != '\t' && *p != '\n' && *p != '\r') p++;
+  return p - record;
+}
+
+
+static int key_cmp(const void *ip, const void *jp) {
+  seg_key_t *i = (seg_key_t *)ip, *j = (seg_key_t *)jp;
+  size_t l = i->len < j->len ? i->len : j->len;
+  int c = memcmp(i->text, j->text, l);
+  if (c != 0) return c;
+  if (i->len < j->len) return -1;
+  if (i->len > j->len) return 1;
+  return 0;
+}
+
+
+static seg_key_t *load_keys(u_char *keys_in_mem, size_t ksz, size_t *num_keys) {
+  // Make a sorted array of the column 1 values of all the lines in keys_in_mem
+  u_char *p = keys_in_mem, *end = keys_in_mem + ksz;
+  size_t count = 0, k = 0;
+  seg_key_t *keys;
+
+  while (p < end) {
+    if (*p == '\n') count++;
+    p++;
+  }
+  if (ksz > 0 && end[-1] != '\n') count++;   // Last line unterminated
+  keys = (seg_key_t *)malloc((count + 1) * sizeof(seg_key_t));  // MAL3000
+  if (keys == NULL) error_exit("Malloc of keys failed\n");
+  p = keys_in_mem;
+  while (p < end) {
+    keys[k].text = p;
+    keys[k].len = trigger_length(p, end);
+    k++;
+    while (p < end && *p != '\n') p++;
+    p++;
+  }
+  qsort(keys, k, sizeof(seg_key_t), key_cmp);
+  *num_keys = k;
+  return keys;
+}
+
+
+static BOOL map_segment(u_char *stem, size_t stemlen, segment_t *seg) {
+  // stem is <segment_dir>/QBASH with room to append a suffix.  Return FALSE if there's no index there.
+  int error_code = 0;
+  strcpy((char *)stem + stemlen, ".doctable");
+  if (!exists((char *)stem, "")) return FALSE;  // -------------------------------->
+  seg->doctable = (byte *)mmap_all_of(stem, &(seg->dsz), FALSE, &(seg->doctable_H), &(seg->doctable_MH), &error_code);
+  if (error_code < 0) {
+    printf("Error: unable to map %s.  Error code %d\n", stem, error_code);
+    exit(1);
+  }
+  strcpy((char *)stem + stemlen, ".forward");
+  seg->forward = (byte *)mmap_all_of(stem, &(seg->fsz), FALSE, &(seg->forward_H), &(seg->forward_MH), &error_code);
+  if (error_code < 0) {
+    printf("Error: unable to map %s.  Error code %d\n", stem, error_code);
+    exit(1);
+  }
+  seg->num_docs = (docnum_t)(seg->dsz / DTE_LENGTH);
+  stem[stemlen] = 0;
+  return TRUE;
+}
+
+
+static void unmap_segment(segment_t *seg) {
+  unmmap_all_of(seg->doctable, seg->doctable_H, seg->doctable_MH, seg->dsz);
+  unmmap_all_of(seg->forward, seg->forward_H, seg->forward_MH, seg->fsz);
+}
+
+
+static byte *load_tombstones(u_char *stem, size_t stemlen, docnum_t num_docs, size_t *tsz) {
+  // Return a zeroed bitmap big enough for num_docs, with the bits from any existing .tombstones file ORed in.
+  byte *tombstones, *existing;
+  size_t esz, b;
+  CROSS_PLATFORM_FILE_HANDLE H;
+  HANDLE MH;
+  int error_code = 0;
+
+  *tsz = (size_t)((num_docs + 7) / 8);
+  tombstones = (byte *)calloc(*tsz + 1, 1);  // MAL3001
+  if (tombstones == NULL) error_exit("Malloc of tombstones failed\n");
+  strcpy((char *)stem + stemlen, TS_SUFFIX);
+  if (exists((char *)stem, "")) {
+    existing = (byte *)mmap_all_of(stem, &esz, FALSE, &H, &MH, &error_code);
+    if (error_code < 0 || existing == NULL) {
+      printf("Error: unable to map %s.  Error code %d\n", stem, error_code);
+      exit(1);
+    }
+    for (b = 0; b < esz && b < *tsz; b++) tombstones[b] |= existing[b];
+    unmmap_all_of(existing, H, MH, esz);
+  }
+  stem[stemlen] = 0;
+  return tombstones;
+}
+
+
+static void save_tombstones(u_char *stem, size_t stemlen, byte *tombstones, size_t tsz) {
+  // Write to a temporary file and rename it, so that a QBASHQ which has the old file mapped is undisturbed.
+  u_char *tmpname;
+  FILE *f;
+
+  tmpname = (u_char *)malloc(stemlen + strlen(TS_SUFFIX) + 10);  // MAL3002
+  if (tmpname == NULL) error_exit("Malloc of tmpname failed\n");
+  strcpy((char *)stem + stemlen, TS_SUFFIX);
+  strcpy((char *)tmpname, (char *)stem);
+  strcat((char *)tmpname, ".tmp");
+  f = fopen((char *)tmpname, "wb");
+  if (f == NULL) {
+    printf("Error: can't open %s for writing\n", tmpname);
+    exit(1);
+  }
+  if (fwrite(tombstones, 1, tsz, f) != tsz) {
+    printf("Error: write to %s failed\n", tmpname);
+    exit(1);
+  }
+  fclose(f);
+#ifdef WIN64
+  remove((char *)stem);
+#endif
+  if (rename((char *)tmpname, (char *)stem) != 0) {
+    printf("Error: can't rename %s to %s\n", tmpname, stem);
+    exit(1);
+  }
+  free(tmpname);  // FRE3002
+  stem[stemlen] = 0;
+}
+
+
+static void tombstone(u_char *segment_dir, u_char *keys_file) {
+  u_char *stem, *keys_in_mem;
+  size_t stemlen, ksz, num_keys, tsz;
+  segment_t seg;
+  seg_key_t *keys, probe;
+  byte *tombstones;
+  docnum_t d, newly_deleted = 0, already_deleted = 0;
+  u_ll *dtent;
+  CROSS_PLATFORM_FILE_HANDLE kH;
+  HANDLE kMH;
+  int error_code = 0;
+
+  stemlen = strlen((char *)segment_dir) + 6;
+  stem = (u_char *)malloc(stemlen + 30);  // MAL3003
+  if (stem == NULL) error_exit("Malloc of stem failed\n");
+  strcpy((char *)stem, (char *)segment_dir);
+  strcat((char *)stem, "/QBASH");
+  if (!map_segment(stem, stemlen, &seg)) {
+    printf("Error: no index found in %s\n", segment_dir);
+    exit(1);
+  }
+
+  keys_in_mem = (u_char *)mmap_all_of(keys_file, &ksz, FALSE, &kH, &kMH, &error_code);
+  if (error_code < 0) {
+    printf("Error: unable to map %s.  Error code %d\n", keys_file, error_code);
+    exit(1);
+  }
+  keys = load_keys(keys_in_mem, ksz, &num_keys);
+  printf("%zu keys loaded from %s\n", num_keys, keys_file);
+
+  tombstones = load_tombstones(stem, stemlen, seg.num_docs, &tsz);
+  for (d = 0; d < seg.num_docs; d++) {
+    dtent = (u_ll *)(seg.doctable + d * DTE_LENGTH);
+    probe.text = seg.forward + dte_docoff(*dtent);
+    if (probe.text >= seg.forward + seg.fsz) continue;
+    probe.len = trigger_length(probe.text, seg.forward + seg.fsz);
+    if (bsearch(&probe, keys, num_keys, sizeof(seg_key_t), key_cmp) == NULL) continue;
+    if (ts_is_set(tombstones, tsz, d)) already_deleted++;
+    else {
+      ts_set(tombstones, d);
+      newly_deleted++;
+    }
+  }
+  save_tombstones(stem, stemlen, tombstones, tsz);
+  printf("%s: %lld documents, %lld newly deleted, %lld matching keys were already deleted.\n",
+	 segment_dir, seg.num_docs, newly_deleted, already_deleted);
+
+  free(tombstones);  // FRE3001
+  free(keys);  // FRE3000
+  unmmap_all_of(keys_in_mem, kH, kMH, ksz);
+  unmap_segment(&seg);
+  free(stem);  // FRE3003
+}
+
+
+static void merge(u_char *index_dir, u_char *output_file) {
+  // Write the live records of the base and each delta to output_file
+  u_char *stem, *rec, *eor, *eof;
+  size_t dirlen = strlen((char *)index_dir), stemlen, tsz, obuf_used = 0, reclen;
+  segment_t seg;
+  byte *tombstones, *obuf;
+  docnum_t d, live, dead, total_live = 0;
+  u_ll *dtent;
+  int n;
+  FILE *out;
+
+  stem = (u_char *)malloc(dirlen + 50);  // MAL3003
+  obuf = (byte *)malloc(OBUF_SIZE);  // MAL3004
+  if (stem == NULL || obuf == NULL) error_exit("Malloc failed in merge()\n");
+  out = fopen((char *)output_file, "wb");
+  if (out == NULL) {
+    printf("Error: can't open %s for writing\n", output_file);
+    exit(1);
+  }
+
+  for (n = 0; n <= SEG_MAX_DELTAS; n++) {
+    if (n == 0) sprintf((char *)stem, "%s/QBASH", index_dir);
+    else sprintf((char *)stem, "%s/%s%d/QBASH", index_dir, SEG_DELTA_PREFIX, n);
+    stemlen = strlen((char *)stem);
+    if (!map_segment(stem, stemlen, &seg)) {
+      if (n == 0) {
+	printf("Error: no base index found in %s\n", index_dir);
+	exit(1);
+      }
+      break;
+    }
+    tombstones = load_tombstones(stem, stemlen, seg.num_docs, &tsz);
+    live = 0;
+    dead = 0;
+    eof = seg.forward + seg.fsz;
+    for (d = 0; d < seg.num_docs; d++) {
+      if (ts_is_set(tombstones, tsz, d)) {
+	dead++;
+	continue;
+      }
+      dtent = (u_ll *)(seg.doctable + d * DTE_LENGTH);
+      rec = seg.forward + dte_docoff(*dtent);
+      if (rec >= eof) continue;
+      eor = rec;
+      while (eor < eof && *eor != '\n') eor++;
+      reclen = eor - rec;
+      if (obuf_used + reclen + 1 > OBUF_SIZE) {
+	fwrite(obuf, 1, obuf_used, out);
+	obuf_used = 0;
+      }
+      if (reclen + 1 > OBUF_SIZE) {
+	fwrite(rec, 1, reclen, out);  // Enormous record
+	fputc('\n', out);
+      } else {
+	memcpy(obuf + obuf_used, rec, reclen);
+	obuf_used += reclen;
+	obuf[obuf_used++] = '\n';
+      }
+      live++;
+    }
+    printf("%s: %lld live records written, %lld deleted records dropped.\n", stem, live, dead);
+    total_live += live;
+    free(tombstones);  // FRE3001
+    unmap_segment(&seg);
+  }
+  if (obuf_used > 0) fwrite(obuf, 1, obuf_used, out);
+  if (fclose(out) != 0) {
+    printf("Error: writing %s failed\n", output_file);
+    exit(1);
+  }
+  printf("%lld records from %d segment(s) written to %s.\n"
+	 "Index it with QBASHI, then replace the base and the deltas of %s with the new index.\n",
+	 total_live, n, output_file, index_dir);
+  free(obuf);  // FRE3004
+  free(stem);  // FRE3003
+}
+
+
+int main(int argc, char **argv) {
+  if (sizeof(size_t) != 8) error_exit("Error:  program must be compiled for 64 bit!\n");
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if (argc != 4) print_usage(argv[0]);
+  if (!strcmp(argv[1], "-tombstone")) tombstone((u_char *)argv[2], (u_char *)argv[3]);
+  else if (!strcmp(argv[1], "-merge")) merge((u_char *)argv[2], (u_char *)argv[3]);
+  else print_usage(argv[0]);
+  return 0;
+}
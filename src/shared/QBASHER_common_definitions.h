@@ -7,7 +7,9 @@
 
 #define IF_HEADER_LEN 4096   // Mustn't change this, except in connection with a change in INDEX_FORMAT
 #define INDEX_FORMAT "QBASHER 1.5"  // This will be written into the header area of the .if file.
-#define QBASHER_VERSION ".140-OS"   // This is relative to the INDEX_FORMAT.  Whenever the index format
+#define INDEX_FORMAT_BLOCKED "QBASHER 1.6"  // Written instead if QBASHI is run with -block_postings=TRUE.
+                                            // Only the postings lists differ.  See below.
+#define QBASHER_VERSION ".174-OS"   // This is relative to the INDEX_FORMAT.  Whenever the index format
 				    // changes this should be reset to .0.  Whenever QBASHI or QBASHQ are
 				    // edited it should be incremented.  It's also written into the
 				    // .if header.
@@ -51,7 +53,7 @@
 // the doc score field from 10 to 8 bits and the Bloom filter from 16 to 10.  If speed of
 // partial matching becomes critical we can add an extra file containing stronger Bloom
 // signatures e.g. 16, 32 or 64 additional bits, and use the 10 bits as a preliminary 
-// coarse filter.
+// coarse filter.  (That's QBASH.bloom.  See BL_SUFFIX below.)
 
 // Note that if support for word positions > 255 is required, changes will be needed to 
 // linked list posting_t definitions.
@@ -112,6 +114,245 @@ DTE_DOCBLOOM_SHIFT;
 #define sb_assemble(a,b,c) (((a & SB_MAX_DOCNO) << 27) | ((b & SB_MAX_COUNT) << 15) | (c & SB_MAX_BYTES_PER_RUN))
 
 
+// Definitions for block-based postings lists (INDEX_FORMAT_BLOCKED, i.e. 1.6). Single postings
+// are still kept in the .vocab entry, and lists with fewer than BP_MIN_POSTINGS_IN_BLOCKS postings
+// are written as for INDEX_FORMAT, without skip blocks.  Otherwise the .vocab entry gives the
+// offset of a list laid out as follows:
+//
+//   4 bytes - number of blocks, B
+//   B directory entries of BP_DIRENT_BYTES:
+//      5 bytes - docnum of the last posting in the block
+//      5 bytes - offset of the block from the end of the directory
+//      4 bytes - number of postings in earlier blocks
+//   B blocks, each of which is:
+//      1 byte  - number of bits (b) used for each docgap in this block
+//      5 bytes - docnum of the first posting in the block
+//      n bytes - the wpos of each of the n postings in the block
+//      (n - 1) docgaps packed into b bits each, least significant bit first, padded to a byte.
+//
+// All multi-byte numbers are little-endian. A block is closed at the first document boundary
+// after BP_POSTINGS_PER_BLOCK postings, so the postings for one document never span two blocks.
+// Since a doc can have at most MAX_WDPOS + 1 postings for a word, n <= BP_MAX_POSTINGS_PER_BLOCK.
+// Readers may fetch up to 8 bytes starting anywhere within a list.  The 8-byte length at the end
+// of the .if makes that safe.
+
+#define BP_POSTINGS_PER_BLOCK 128
+#define BP_MIN_POSTINGS_IN_BLOCKS 128  // Shorter lists gain little from skipping and the directory would only add bytes
+#define BP_MAX_POSTINGS_PER_BLOCK 384
+#define BP_LIST_HEADER_BYTES 4
+#define BP_DIRENT_BYTES 14
+#define BP_BLOCK_HEADER_BYTES 6
+#define BP_MASK40 0xFFFFFFFFFFULL
+
+#define bp_get40(p) (*((unsigned long long *)(p)) & BP_MASK40)
+#define bp_get_block_count(list) (*((unsigned int *)(list)))
+#define bp_dirent(dir, k) ((dir) + (k) * BP_DIRENT_BYTES)
+#define bp_dirent_lastdocnum(e) bp_get40(e)
+#define bp_dirent_offset(e) bp_get40((e) + 5)
+#define bp_dirent_postings_before(e) (*((unsigned int *)((e) + 10)))
+
+
+// Definitions for the .vocab.hash file, written by QBASHI alongside the .vocab so that QBASHQ can
+// look up a term with one or two cache misses rather than a binary search.  QBASHQ falls back to
+// binary search if the file is absent or doesn't match the .vocab.  The file is an array of
+// unsigned long longs:
+//
+//   [0] - number of slots, S (a power of two)
+//   [1] - size of the .vocab file in bytes
+//   [2 .. S + 1] - the slots.  An empty slot is zero.  Otherwise the top 32 bits are the top 32
+//          bits of the FNV-1a hash of the term, and the bottom 32 are its .vocab record number + 1.
+//
+// A term's home slot is its hash modulo S, and collisions are resolved by linear probing.
+
+#define VH_SUFFIX ".hash"
+#define VH_HEADER_ULLS 2
+#define VH_MAX_LOAD 0.75   // S is the smallest power of two which keeps the load below this
+#define VH_RECNO_MASK 0xFFFFFFFFULL
+#define vh_signature(h) ((h) >> 32)
+#define vh_assemble(h, recno) (((h) & ~VH_RECNO_MASK) | (((recno) + 1) & VH_RECNO_MASK))
+
+
+// Definitions for delta segments.  An index_dir may contain, as well as the base QBASH.* index,
+// sub-directories delta1, delta2, ... each holding a complete QBASHI index of records which are
+// new or changed since the base was built.  Any of these segments may also have a QBASH.tombstones
+// file:  a bitmap over its doctable in which bit (d & 7) of byte (d >> 3) is set if docnum d has
+// been deleted or superseded by a later segment.  Docnums beyond the end of the bitmap are live.
+// QBASH_segment_merger sets tombstone bits and folds deltas back into a base .forward.
+
+#define SEG_DELTA_PREFIX "delta"
+#define SEG_MAX_DELTAS 99
+#define TS_SUFFIX ".tombstones"
+#define ts_is_set(bitmap, bytes, d) ((size_t)((d) >> 3) < (bytes) && ((bitmap)[(d) >> 3] & (1 << ((d) & 7))))
+#define ts_set(bitmap, d) ((bitmap)[(d) >> 3] |= (byte)(1 << ((d) & 7)))
+
+
+// Definitions for shards.  QBASHI -shards=K splits the records, in descending score order, into K
+// contiguous ranges and writes each as a complete index in <index_dir>/shard0, shard1, ... with its
+// own .forward, .doctable, .vocab and .if, and document numbers counting from zero.  The QIDFs in
+// every shard's .vocab are calculated from corpus-wide term counts, so they agree across shards.
+// QBASHQ searches the shards as segments (before any deltas) and uses the total number of documents
+// and postings in the shards for N and avdoclen.
+
+#define SHARD_PREFIX "shard"
+#define SEG_MAX_SHARDS 64
+
+
+// Definitions for the .impact file, written by QBASHI -impact_file=TRUE alongside the .vocab, for
+// QBASHQ -engine=saat_impact.  For each term, it lists the documents containing it in descending
+// order of a quantized BM25 weight, or impact.  All numbers are little-endian.
+//
+//   IM_HEADER_ULLS unsigned long longs - the number of .vocab records V, the size of the .vocab
+//          file in bytes, the number of documents, and IM_MAX_IMPACT.
+//   The lists.  Each is a 4-byte count of the documents in the list, then one or more runs, in
+//          descending order of impact.  A run is a 2-byte impact, a 4-byte count of documents, n,
+//          and n 5-byte docnums in ascending order.
+//   The list table - V unsigned long longs giving the offset of each term's list, in .vocab order.
+//          Zero means that the term has no list.  (Line prefix terms don't.)
+//   The length of the file, L, as an 8-byte number.  The list table starts at L - 8 * (V + 1), and
+//          the length makes 8-byte reads within a list safe.
+//
+// The BM25 weight of a term in a document is idf * tf / (tf + k1 * (1 - b + b * dl / avdl)), with
+// idf = log((N + 1) / n), where n is the number of documents containing the term, and dl is the
+// number of postings in the document.  It's less than log(N + 1), and the impact is
+// 1 + floor((IM_MAX_IMPACT - 1) * weight / log(N + 1)).  In a set of shards, N, n and avdl are
+// those of the shard.
+
+#define IM_SUFFIX ".impact"
+#define IM_HEADER_ULLS 4
+#define IM_MAX_IMPACT 1023
+#define IM_K1 2.0
+#define IM_B 0.75
+#define IM_LIST_HEADER_BYTES 4
+#define IM_RUN_HEADER_BYTES 6
+#define IM_DOCNUM_BYTES 5
+
+#define im_get_list_count(list) (*((unsigned int *)(list)))
+#define im_get_run_impact(run) (*((unsigned short *)(run)))
+#define im_get_run_count(run) (*((unsigned int *)((run) + 2)))
+
+
+// Definitions for the .if.skips file, written by QBASHI alongside a .if with skip blocks so that
+// saat_skipto() can jump over many skip blocks at once, rather than following the chain of
+// SB_MARKERs one at a time.  For each postings list with at least SK_INTERVAL + 1 skip blocks there
+// is an entry for every SK_INTERVAL-th skip block, k.  (With the default run lengths of sqrt(n), that
+// means lists of more than about 300 postings.)  The file is an array of unsigned long longs:
+//
+//   [0] - number of such lists, D
+//   [1] - size of the .if file in bytes
+//   D + 1 directory pairs - the .if offset of a list (as in its .vocab entry) and the number of
+//          entries for earlier lists, in ascending order of offset.  The last pair is (0, E), where
+//          E is the total number of entries.
+//   E entries of SK_ENTRY_ULLS - the last docnum in skip block k - 1, the .if offset of the
+//          SB_MARKER of skip block k, and the number of postings in skip blocks 0 .. k - 1.
+//
+// QBASHQ ignores the file if it's absent or doesn't match the .if.
+
+#define SK_SUFFIX ".skips"
+#define SK_HEADER_ULLS 2
+#define SK_INTERVAL 16
+#define SK_ENTRY_ULLS 3
+#define sk_dir(skips) ((skips) + SK_HEADER_ULLS)
+#define sk_entries(skips) (sk_dir(skips) + 2 * ((skips)[0] + 1))
+#define sk_entry_docnum(e) ((e)[0])
+#define sk_entry_offset(e) ((e)[1])
+#define sk_entry_postings(e) ((e)[2])
+
+
+// Definitions for the .if.head_answers file, written by QBASHI -head_answers=N for an unsharded
+// index, so that QBASHQ can answer the commonest line prefix queries (see doc/auto_suggest.txt)
+// without touching the postings.  For each line prefix term with at least
+// head_answers_min_postings postings, it holds the first N documents of the term's postings list
+// (the highest scoring, if the records were sorted by weight) with their .doctable entries and
+// the text of their records.  The file is an array of unsigned long longs followed by text:
+//
+//   [0] - number of terms, T
+//   [1] - size of the .if file in bytes
+//   [2] - total number of answers, A
+//   [3] - number of bytes of text, S
+//   T directory entries of HA_DIR_ENTRY_ULLS, in strcmp() order of term - the term, null-padded to
+//          MAX_WD_LEN + 1 bytes, the number of postings for the term, the number of answers
+//          stored for it, and the number of answers stored for earlier terms.
+//   A answers of HA_ANSWER_ULLS - docnum, .doctable entry, offset of the record's text.
+//   S bytes of text - each record up to but not including its newline, followed by a null.
+//
+// QBASHQ ignores the file if it's absent or doesn't match the .if.
+
+#define HA_SUFFIX ".head_answers"
+#define HA_HEADER_ULLS 4
+#define HA_TERM_ULLS ((MAX_WD_LEN + 1) / 8)
+#define HA_DIR_ENTRY_ULLS (HA_TERM_ULLS + 3)
+#define HA_ANSWER_ULLS 3
+#define ha_dir(ha) ((ha) + HA_HEADER_ULLS)
+#define ha_answers(ha) (ha_dir(ha) + HA_DIR_ENTRY_ULLS * (ha)[0])
+#define ha_text(ha) ((u_char *)(ha_answers(ha) + HA_ANSWER_ULLS * (ha)[2]))
+#define ha_entry_term(e) ((u_char *)(e))
+#define ha_entry_postings(e) ((e)[HA_TERM_ULLS])
+#define ha_entry_answers(e) ((e)[HA_TERM_ULLS + 1])
+#define ha_entry_first(e) ((e)[HA_TERM_ULLS + 2])
+#define ha_answer_docnum(a) ((a)[0])
+#define ha_answer_dtent(a) ((a)[1])
+#define ha_answer_text(a) ((a)[2])
+
+
+// Definitions for the optional QBASH.bloom file written by QBASHI -bloom_bits=N, where N is 16,
+// 32 or 64.  This is the extra file of stronger Bloom signatures anticipated above.  QBASHQ uses
+// it as a second filter, after the DTE_BLOOM_BITS in the .doctable, before checking a
+// candidate's text against the partial words in a query.  A document's signature has a bit
+// set for the first byte and for the first two bytes of each word of its trigger, split up
+// exactly as possibly_record_candidate() splits it for partial matching, both with and without
+// accents removed.  The file is:
+//
+//   [0] - bits per signature, N
+//   [1] - number of documents, D
+//   D signatures of N / 8 bytes each, in docnum order, least significant byte first.
+//
+// QBASHQ ignores the file if it's absent or doesn't match the .doctable.
+
+#define BL_SUFFIX ".bloom"
+#define BL_HEADER_ULLS 2
+#define BL_KEY1(b0) ((unsigned long long)(b0))
+#define BL_KEY2(b0, b1) (0x10000ULL | ((unsigned long long)(b0) << 8) | (unsigned long long)(b1))
+#define BL_BIT(key, bits) (1ULL << ((((key) * 0x9E3779B97F4A7C15ULL) >> 32) % (bits)))
+
+
+// Definitions for the optional QBASH.normforward file written by QBASHI -normforward=TRUE.  It
+// holds each document's trigger as possibly_record_candidate() in QBASHQ would otherwise derive
+// it for every candidate needing text: lowercased, with accents removed if QBASHI was run with
+// -conflate_accents=TRUE, and split into words for partial matching.  Each word is also given
+// as its term id, its ordinal in the .vocab, so that classification_score() and
+// extract_text_features() can compare query and document words as integers.  The file is:
+//
+//   [0] - flags.  NF_ACCENTS_REMOVED
+//   [1] - number of documents, D
+//   D records, in docnum order, each a multiple of 8 bytes and comprising NF_RECORD_SHORTS u_shorts:
+//     [0] - length of the trigger in the .forward, or NF_TOO_LONG if > MAX_RESULT_LEN
+//     [1] - L, length of the normalized trigger
+//     [2] - W, number of words
+//     [3] - flags.  NF_ALL_IN_VOCAB
+//   then W u_int term ids, or NF_NO_TERMID for words not in the .vocab, W u_short offsets of words
+//   within the split copy, the normalized trigger, and the split copy, each L + 1 bytes. The split
+//   copy is the normalized trigger after utf8_split_line_into_null_terminated_words(), which
+//   replaces word separators with NULs in place.  Use the nf_ macros below.
+//   D + 1 byte offsets within the file, of each document's record and of the end of the last.
+//
+// Substitution rules aren't applied, because the rules and the language are chosen at query
+// time.  QBASHQ ignores the file if it's absent or doesn't match the .doctable, and doesn't use
+// it if substitutions are in use or if x_conflate_accents doesn't match NF_ACCENTS_REMOVED.
+
+#define NF_SUFFIX ".normforward"
+#define NF_HEADER_ULLS 2
+#define NF_ACCENTS_REMOVED 1ULL
+#define NF_TOO_LONG 0xFFFF
+#define NF_RECORD_SHORTS 4
+#define NF_ALL_IN_VOCAB 1
+#define NF_NO_TERMID 0xFFFFFFFFU
+#define NF_NO_QTERMID 0xFFFFFFFEU   // For a query term which can't equal any document word
+#define nf_termids(r) ((unsigned int *)((r) + NF_RECORD_SHORTS))
+#define nf_word_offsets(r) ((unsigned short *)(nf_termids(r) + (r)[2]))
+#define nf_text(r) ((unsigned char *)(nf_word_offsets(r) + (r)[2]))
+#define nf_split(r) (nf_text(r) + (r)[1] + 1)
+
+
 // ------------------------------------------------------------------------------------------
 
 typedef enum {   // Types of output allowed by the arg_parser (both qbashi and qbashq)
@@ -73,6 +73,19 @@
 #define SLASH '/'   // Change if it needs to be '\\'
 
 
+static void free_rule_prefilter(rule_prefilter_t **pfp) {
+  rule_prefilter_t *pf = *pfp;
+  if (pf == NULL) return;
+  free(pf->next_state);
+  free(pf->dict_link);
+  free(pf->out_start);
+  free(pf->out_count);
+  free(pf->outputs);
+  free(pf);
+  *pfp = NULL;
+}
+
+
 void unload_substitution_rules(dahash_table_t **substitutions_hash, int debug) {
   dahash_table_t *sash = *substitutions_hash;
   off_t table_off;
@@ -93,7 +106,7 @@ void unload_substitution_rules(dahash_table_t **substitutions_hash, int debug) {
       rs = lsr->rule_set;
       if (rs->substitution_rules_regex != NULL) {
 	for (rule = 0; rule < rs->num_substitution_rules; rule++) 
-	  if ((rs->substitution_rules_regex)[rule] != NULL) free((rs->substitution_rules_regex)[rule]);
+	  if ((rs->substitution_rules_regex)[rule] != NULL) pcre2_code_free((rs->substitution_rules_regex)[rule]);
 	free(rs->substitution_rules_regex);
 	rs->substitution_rules_regex = NULL;
       }
@@ -108,6 +121,17 @@ void unload_substitution_rules(dahash_table_t **substitutions_hash, int debug) {
 	free(rs->substitution_rules_rhs_has_operator);
 	rs->substitution_rules_rhs_has_operator = NULL;
       }
+      if (rs->substitution_rules_literals != NULL) {
+	for (rule = 0; rule < rs->num_substitution_rules; rule++)
+	  if ((rs->substitution_rules_literals)[rule] != NULL) free((rs->substitution_rules_literals)[rule]);
+	free(rs->substitution_rules_literals);
+	rs->substitution_rules_literals = NULL;
+      }
+      if (rs->substitution_rules_always_tried != NULL) {
+	free(rs->substitution_rules_always_tried);
+	rs->substitution_rules_always_tried = NULL;
+      }
+      free_rule_prefilter(&(rs->prefilter));
       if (explain) printf("Destroyed arrays for %d %s rules.\n",
 				  rs->num_substitution_rules, hep);
       free(rs);
@@ -140,10 +164,347 @@ static void create_arrays_for_rule_set(rule_set_t *rs, int num_rules,
     (u_char *)emalloc((num_rules + 1) * sizeof(u_char), calling_code, error_code);
   if (*error_code) return;    // ----------------------->
 
+  rs->substitution_rules_literals =
+    (u_char **)emalloc((num_rules + 1) * sizeof(u_char *), calling_code, error_code);
+  if (*error_code) return;    // ----------------------->
+
+  rs->substitution_rules_always_tried =
+    (u_char *)emalloc((num_rules + 1) * sizeof(u_char), calling_code, error_code);
+  if (*error_code) return;    // ----------------------->
+
   for (rule = 0; rule < num_rules; rule++) {
     rs->substitution_rules_regex[rule] = NULL;
     rs->substitution_rules_rhs[rule] = NULL;
     rs->substitution_rules_rhs_has_operator[rule] = 0;
+    rs->substitution_rules_literals[rule] = NULL;
+    rs->substitution_rules_always_tried[rule] = 1;
+  }
+}
+
+
+// The rule prefilter
+// ------------------
+// Most subjects match none of the rules, but without help every rule would have to be tried
+// with pcre2_substitute().  So, when the rules are loaded, a list of literals is extracted
+// from each LHS, such that any match of the LHS must contain at least one of them.  Those of
+// all the rules of a language go into an Aho-Corasick automaton, and
+// apply_substitutions_rules_to_string() makes one pass of the subject through it to find the
+// rules which could match.  Rules for which no such literals could be found are always tried.
+//
+// The extraction is conservative:  An LHS with a top-level alternation gets one literal per
+// alternative, or none at all if any alternative lacks one.  Within an alternative, the
+// literal is the longest run of plain ASCII characters not made optional by a quantifier.
+// Groups, classes, assertions and escapes like \w break runs, and some escapes and option
+// settings make us give up.  Because the rules are compiled caseless and UTF, literals and
+// subjects are compared with ASCII letters folded, and 'k' and 's' break runs because in
+// UTF mode they caselessly match the Kelvin sign and the long s.
+
+#define MAX_RULE_LITERAL 32
+#define MAX_RULE_ALTERNATIVES 64
+
+
+static size_t skip_class(u_char *pat, size_t i, size_t patlen) {
+  // pat[i] is the '[' starting a character class.  Return the index following its ']', or 0 if
+  // there isn't one.
+  i++;
+  if (i < patlen && pat[i] == '^') i++;
+  if (i < patlen && pat[i] == ']') i++;  // A leading ] is a member of the class
+  while (i < patlen) {
+    if (pat[i] == '\\') i += 2;
+    else if (pat[i] == '[' && i + 1 < patlen && pat[i + 1] == ':') {
+      // A POSIX class such as [:alpha:]
+      i += 2;
+      while (i + 1 < patlen && !(pat[i] == ':' && pat[i + 1] == ']')) i++;
+      i += 2;
+    }
+    else if (pat[i] == ']') return i + 1;  // ------------------------------->
+    else i++;
+  }
+  return 0;
+}
+
+
+static size_t skip_group(u_char *pat, size_t i, size_t patlen) {
+  // pat[i] is the '(' starting a group.  Return the index following its ')', or 0 if there isn't
+  // one or if the group sets the x option, in which case literals can't be trusted.
+  int depth = 0;
+  size_t j;
+  if (i + 1 < patlen && pat[i + 1] == '?') {
+    for (j = i + 2; j < patlen && (isalpha(pat[j]) || pat[j] == '-'); j++)
+      if (pat[j] == 'x') return 0;  // ------------------------------->
+  }
+  while (i < patlen) {
+    if (pat[i] == '\\') i += 2;
+    else if (pat[i] == '[') {
+      i = skip_class(pat, i, patlen);
+      if (i == 0) return 0;  // ------------------------------->
+    }
+    else {
+      if (pat[i] == '(') depth++;
+      else if (pat[i] == ')') {
+	depth--;
+	if (depth == 0) return i + 1;  // ------------------------------->
+      }
+      i++;
+    }
+  }
+  return 0;
+}
+
+
+static int longest_literal_in_alternative(u_char *pat, size_t patlen, u_char *lit) {
+  // Find the longest run of characters which every match of the alternative pat must contain.
+  // Copy it, folded to lower case, into lit (with room for MAX_RULE_LITERAL + 1 bytes) and return
+  // its length.  Return zero if there's no such run, or -1 if pat is too hard to analyse.
+  u_char run[MAX_RULE_LITERAL];
+  int runlen = 0, bestlen = 0;
+  BOOL last_was_literal = FALSE;
+  size_t i = 0;
+  u_char c;
+
+#define END_RUN  {if (runlen > bestlen) {memcpy(lit, run, runlen); bestlen = runlen;}  runlen = 0; last_was_literal = FALSE;}
+
+  while (i < patlen) {
+    c = pat[i];
+    if (c == '\\') {
+      if (i + 1 >= patlen) return -1;  // ------------------------------->
+      c = pat[i + 1];
+      i += 2;
+      if (isalnum(c)) {
+	// Only single-character escapes which can't match a literal are understood
+	if (strchr("wWdDsSbBAzZGhHvVRXK", c) == NULL) return -1;  // ------------------------------->
+	END_RUN;
+	continue;
+      }
+      // Otherwise it's an escaped literal.  Fall through.
+    }
+    else if (c == '[') {
+      i = skip_class(pat, i, patlen);
+      if (i == 0) return -1;  // ------------------------------->
+      END_RUN;
+      continue;
+    }
+    else if (c == '(') {
+      i = skip_group(pat, i, patlen);
+      if (i == 0) return -1;  // ------------------------------->
+      END_RUN;
+      continue;
+    }
+    else if (c == ')') return -1;  // ------------------------------->
+    else if (c == '*' || c == '?' || c == '{' || c == '+') {
+      // A quantifier.  Unless it's +, the thing quantified may be absent.
+      if (c != '+' && last_was_literal) runlen--;
+      END_RUN;
+      i++;
+      if (c == '{') {
+	while (i < patlen && (isdigit(pat[i]) || pat[i] == ',')) i++;
+	if (i < patlen && pat[i] == '}') i++;
+      }
+      if (i < patlen && (pat[i] == '?' || pat[i] == '+')) i++;  // Lazy or possessive
+      continue;
+    }
+    else if (c == '.' || c == '^' || c == '$' || c == '|') {
+      END_RUN;
+      i++;
+      continue;
+    }
+    else i++;
+
+    // c is a literal character
+    if (c < ' ' || c >= 128 || c == 'k' || c == 'K' || c == 's' || c == 'S') {
+      END_RUN;
+      continue;
+    }
+    if (runlen >= MAX_RULE_LITERAL) END_RUN;
+    run[runlen++] = (u_char)tolower(c);
+    last_was_literal = TRUE;
+  }
+  END_RUN;
+#undef END_RUN
+
+  lit[bestlen] = 0;
+  return bestlen;
+}
+
+
+static u_char *extract_rule_literals(u_char *pat, size_t patlen, int calling_code, int *error_code) {
+  // Return a malloced list of NUL-terminated literals, terminated by an empty string, at least
+  // one of which must occur in any match of pat.  Return NULL if there's no such list.
+  u_char *literals, *w;
+  size_t i, alt_start = 0;
+  int depth = 0, num_alternatives = 1, l;
+
+  // Find the top-level alternatives
+  for (i = 0; i < patlen; i++) {
+    if (pat[i] == '\\') i++;
+    else if (pat[i] == '[') {
+      i = skip_class(pat, i, patlen);
+      if (i == 0) return NULL;  // ------------------------------->
+      i--;
+    }
+    else if (pat[i] == '(') depth++;
+    else if (pat[i] == ')') depth--;
+    else if (pat[i] == '|' && depth == 0) num_alternatives++;
+  }
+  if (num_alternatives > MAX_RULE_ALTERNATIVES) return NULL;  // ------------------------------->
+
+  literals = (u_char *)emalloc(num_alternatives * (MAX_RULE_LITERAL + 1) + 1, calling_code, error_code);
+  if (*error_code) return NULL;  // ------------------------------->
+  w = literals;
+  depth = 0;
+  for (i = 0; i <= patlen; i++) {
+    if (i < patlen && pat[i] == '\\') i++;
+    else if (i < patlen && pat[i] == '[') {
+      i = skip_class(pat, i, patlen) - 1;
+    }
+    else if (i < patlen && pat[i] == '(') depth++;
+    else if (i < patlen && pat[i] == ')') depth--;
+    else if (i == patlen || (pat[i] == '|' && depth == 0)) {
+      l = longest_literal_in_alternative(pat + alt_start, i - alt_start, w);
+      if (l <= 0) {
+	// An alternative with no literal could match anything.
+	free(literals);
+	return NULL;  // ------------------------------->
+      }
+      w += l + 1;
+      alt_start = i + 1;
+    }
+  }
+  *w = 0;
+  return literals;
+}
+
+
+static void build_rule_prefilter(rule_set_t *rs, int calling_code, int *error_code) {
+  // Build rs->prefilter from rs->substitution_rules_literals, and set
+  // rs->substitution_rules_always_tried for the rules without literals.  Leave rs->prefilter
+  // NULL if no rule has literals.
+  rule_prefilter_t *pf;
+  int rule, num_states = 1, num_outputs = 0, s, t, c, a, *queue, qhead = 0, qtail = 0, *terminal,
+    *fail, o;
+  u_char *l;
+  byte class_used[256];
+
+  memset(class_used, 0, 256);
+  for (rule = 0; rule < rs->num_substitution_rules; rule++) {
+    if (rs->substitution_rules_literals[rule] == NULL) {
+      rs->substitution_rules_always_tried[rule] = 1;
+      continue;
+    }
+    rs->substitution_rules_always_tried[rule] = 0;
+    for (l = rs->substitution_rules_literals[rule]; *l; l += strlen((char *)l) + 1) {
+      num_outputs++;
+      num_states += (int)strlen((char *)l);
+      for (s = 0; l[s]; s++) class_used[l[s]] = 1;
+    }
+  }
+  if (num_outputs == 0) return;  // ------------------------------->
+
+  pf = (rule_prefilter_t *)emalloc(sizeof(rule_prefilter_t), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  memset(pf, 0, sizeof(rule_prefilter_t));
+  rs->prefilter = pf;
+
+  // Literals are lower case ASCII, so upper case letters share their lower case letter's class.
+  pf->alphabet_size = 1;
+  for (c = 0; c < 256; c++) {
+    if (class_used[c]) pf->byte_class[c] = (byte)pf->alphabet_size++;
+  }
+  for (c = 'A'; c <= 'Z'; c++) pf->byte_class[c] = pf->byte_class[c + 'a' - 'A'];
+
+  a = pf->alphabet_size;
+  pf->next_state = (int *)emalloc((size_t)num_states * a * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  pf->dict_link = (int *)emalloc(num_states * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  pf->out_start = (int *)emalloc(num_states * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  pf->out_count = (int *)emalloc(num_states * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  pf->outputs = (int *)emalloc(num_outputs * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  terminal = (int *)emalloc(num_outputs * sizeof(int), calling_code, error_code);
+  if (*error_code) return;  // ------------------------------->
+  queue = (int *)emalloc(2 * num_states * sizeof(int), calling_code, error_code);
+  if (*error_code) {
+    free(terminal);
+    return;  // ------------------------------->
+  }
+  fail = queue + num_states;
+
+  // Build the trie, with -1 for missing transitions
+  for (s = 0; s < num_states * a; s++) pf->next_state[s] = -1;
+  memset(pf->out_count, 0, num_states * sizeof(int));
+  pf->num_states = 1;
+  o = 0;
+  for (rule = 0; rule < rs->num_substitution_rules; rule++) {
+    if (rs->substitution_rules_literals[rule] == NULL) continue;
+    for (l = rs->substitution_rules_literals[rule]; *l; l++) {
+      s = 0;
+      for (; *l; l++) {
+	c = pf->byte_class[*l];
+	if (pf->next_state[s * a + c] < 0) pf->next_state[s * a + c] = pf->num_states++;
+	s = pf->next_state[s * a + c];
+      }
+      terminal[o++] = s;
+      pf->out_count[s]++;
+    }
+  }
+
+  // Lay out the outputs of each state, in rule order
+  pf->out_start[0] = 0;
+  for (s = 1; s < pf->num_states; s++) pf->out_start[s] = pf->out_start[s - 1] + pf->out_count[s - 1];
+  memset(pf->out_count, 0, num_states * sizeof(int));
+  o = 0;
+  for (rule = 0; rule < rs->num_substitution_rules; rule++) {
+    if (rs->substitution_rules_literals[rule] == NULL) continue;
+    for (l = rs->substitution_rules_literals[rule]; *l; l += strlen((char *)l) + 1) {
+      s = terminal[o++];
+      pf->outputs[pf->out_start[s] + pf->out_count[s]++] = rule;
+    }
+  }
+
+  // Breadth first, work out the failure links and fill in the missing transitions
+  pf->dict_link[0] = 0;
+  for (c = 0; c < a; c++) {
+    t = pf->next_state[c];
+    if (t < 0) pf->next_state[c] = 0;
+    else {
+      fail[t] = 0;
+      pf->dict_link[t] = 0;
+      queue[qtail++] = t;
+    }
+  }
+  while (qhead < qtail) {
+    s = queue[qhead++];
+    for (c = 0; c < a; c++) {
+      t = pf->next_state[s * a + c];
+      if (t < 0) pf->next_state[s * a + c] = pf->next_state[fail[s] * a + c];
+      else {
+	fail[t] = pf->next_state[fail[s] * a + c];
+	pf->dict_link[t] = (pf->out_count[fail[t]] > 0) ? fail[t] : pf->dict_link[fail[t]];
+	queue[qtail++] = t;
+      }
+    }
+  }
+
+  free(queue);
+  free(terminal);
+}
+
+
+static void run_rule_prefilter(rule_set_t *rs, u_char *subject, byte *try_rule) {
+  // Set try_rule[r] for every rule r which could match subject, according to the prefilter.
+  rule_prefilter_t *pf = rs->prefilter;
+  int s = 0, o, k;
+  memcpy(try_rule, rs->substitution_rules_always_tried, rs->num_substitution_rules);
+  for (; *subject; subject++) {
+    s = pf->next_state[s * pf->alphabet_size + pf->byte_class[*subject]];
+    o = (pf->out_count[s] > 0) ? s : pf->dict_link[s];
+    while (o > 0) {
+      for (k = 0; k < pf->out_count[o]; k++) try_rule[pf->outputs[pf->out_start[o] + k]] = 1;
+      o = pf->dict_link[o];
+    }
   }
 }
 
@@ -266,6 +627,7 @@ int load_substitution_rules(u_char *srfname, dahash_table_t **substitutions_hash
       lsr->rule_set = (rule_set_t *)emalloc(sizeof(rule_set_t), calling_code, error_code);
       if (*error_code) return 0;  // ------------------------------->
       lsr->rule_set->num_substitution_rules = 0;
+      lsr->rule_set->prefilter = NULL;
       create_arrays_for_rule_set(lsr->rule_set, lsr->num_substitution_rules, calling_code, error_code);
       if (*error_code) return 0;   // ---------------------------------->
       if (explain) printf("Created arrays for %d %s rules.\n",
@@ -340,6 +702,19 @@ int load_substitution_rules(u_char *srfname, dahash_table_t **substitutions_hash
 				     line_start, *error_code, errbuf);
 	      if (*error_code) return 0;  // ------------------------------->
 	    }
+	    // JIT compilation is used by pcre2_substitute() when it's available.  If the PCRE2
+	    // library was built without JIT support, this just returns an error.
+	    if (pcre2_jit_compile(lsr->rule_set->substitution_rules_regex[rule], PCRE2_JIT_COMPLETE) != 0
+		&& debug >= 2) printf("  (Not JIT compiled.)\n");
+
+	    lsr->rule_set->substitution_rules_literals[rule] = extract_rule_literals(line_start, patlen,
+										      calling_code, error_code);
+	    if (*error_code) return 0;  // ------------------------------->
+	    if (explain) {
+	      u_char *l = lsr->rule_set->substitution_rules_literals[rule];
+	      if (l == NULL) printf("(No literals.  Always tried.)  ");
+	      else for (; *l; l += strlen((char *)l) + 1) printf("Literal: '%s'  ", l);
+	    }
 
 	    lsr->rule_set->substitution_rules_rhs[rule] = emalloc(rhslen + 1, calling_code, error_code);
 	    if (*error_code) return 0;  // ------------------------------->
@@ -369,6 +744,27 @@ int load_substitution_rules(u_char *srfname, dahash_table_t **substitutions_hash
   // Unload the memory-mapped file
   unmmap_all_of(rulesfile_in_mem, H, MH, rulesfile_size);
 
+  // Build the prefilter for each language, after which the literals aren't needed.
+  table_off = 0;
+  for (e = 0; e < sash->capacity; e++) {
+    byte *table = (byte *)(sash->table);
+    rule_set_t *rs;
+    hep = table + table_off;
+    if (*hep)  {
+      lsr = (lang_specific_rules_t *)(hep + sash->key_size);
+      rs = lsr->rule_set;
+      build_rule_prefilter(rs, calling_code, error_code);
+      if (*error_code) return 0;  // ------------------------------->
+      for (rule = 0; rule < rs->num_substitution_rules; rule++) {
+	if (rs->substitution_rules_literals[rule] != NULL) free(rs->substitution_rules_literals[rule]);
+	rs->substitution_rules_literals[rule] = NULL;
+      }
+      if (explain) printf("Prefilter for %s rules has %d states\n", hep,
+			  (rs->prefilter == NULL) ? 0 : rs->prefilter->num_states);
+    }
+    table_off += sash->entry_size;
+  }
+
   if (error_code < 0) {
     printf("Error code is %d\n", *error_code);
     unload_substitution_rules(substitutions_hash, debug);
@@ -384,10 +780,12 @@ int load_substitution_rules(u_char *srfname, dahash_table_t **substitutions_hash
 
 #define INITIAL_SUBJECT_LEN_LIMIT 256  // If an input subject is longer than this no substitutions will occur.
 #define MAX_SUBLINE MAX_RESULT_LEN  // This should be significantly larger than INITIAL_SUBJECT_LEN_LIMIT to allow for growth due to substitutions.
+#define PREFILTER_BUF_RULES 1024  // Rule sets with more rules than this need a malloc per call.
 
 int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
 					u_char *intext, BOOL avoid_operators_in_subject,
-					BOOL avoid_operators_in_rule, int debug) {
+					BOOL avoid_operators_in_rule, pcre2_match_data **match_data,
+					int debug) {
 
   // First task is to find the rule set which applies to this language, ... if any
   // Refuse to make substitutions if subject contains a '['
@@ -395,14 +793,20 @@ int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
   // referenced by sin and sout.  Substitutions are always attempted from sin to sout, and if a
   // substitution occurs sin and sout are swapped.
   // (intext is first copied into buf1 which starts of as sin, with sout referencing buf2
+  // Rules which the prefilter shows can't match sin are skipped.
+  //
+  // If match_data is not NULL, *match_data is match data to be reused across calls, e.g. by one
+  // thread.  It's created here if it's NULL, and the caller must eventually free it with
+  // pcre2_match_data_free().  If match_data is NULL, match data is created and freed here.
 
   lang_specific_rules_t *lsr;
   rule_set_t *rs;
   int rule, num_subs, rules_matched = 0;
   u_char buf1[MAX_SUBLINE + 2], buf2[MAX_SUBLINE + 2], *sin = buf1, *sout = buf2, *t, *r, *w;
+  byte try_rule_buf[PREFILTER_BUF_RULES], *try_rule = try_rule_buf;
   size_t buflen, l;
   pcre2_match_data *p2md;
-  BOOL explain = (debug >= 1);
+  BOOL explain = (debug >= 1), any = FALSE;
 
   if (sash == NULL || language == NULL || language[0] == 0) return 0;  // -------------------------------R>
 
@@ -447,9 +851,34 @@ int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
   }
   *w = 0;  
 
-  p2md = pcre2_match_data_create(10, NULL);  // Allow for up to ten different capturing sub-patterns
+  if (rs->num_substitution_rules > PREFILTER_BUF_RULES) {
+    try_rule = (byte *)malloc(rs->num_substitution_rules);
+    if (try_rule == NULL) return 0;   // Maybe this should be an error?
+  }
+  if (rs->prefilter != NULL) run_rule_prefilter(rs, sin, try_rule);
+  else memset(try_rule, 1, rs->num_substitution_rules);
+  for (rule = 0; rule < rs->num_substitution_rules; rule++) {
+    if (try_rule[rule]) {
+      any = TRUE;
+      break;
+    }
+  }
+  if (!any) {
+    if (debug >= 2) printf("No substitution rule can match %s\n", sin);
+    if (try_rule != try_rule_buf) free(try_rule);
+    return 0;   // ---------------------------------------------------------------------------R>
+  }
 
-  if (p2md == NULL) return 0;   // Maybe this should be an error?  
+  if (match_data != NULL && *match_data != NULL) p2md = *match_data;
+  else {
+    p2md = pcre2_match_data_create(10, NULL);  // Allow for up to ten different capturing sub-patterns
+    if (match_data != NULL) *match_data = p2md;
+  }
+
+  if (p2md == NULL) {
+    if (try_rule != try_rule_buf) free(try_rule);
+    return 0;   // Maybe this should be an error?  
+  }
 
   if (explain)
     printf("apply_substitions_to_query_text(%s) called for language %s.  %d rules\n",
@@ -462,6 +891,7 @@ int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
     buflen = MAX_SUBLINE + 1;  // Have to reset this each time, as unsuccessful substitute calls reset it.
     //  buflen sets the size of the output of each substitution.
     
+    if (!try_rule[rule]) continue; // ------------------------------C>
     if (avoid_operators_in_rule && rs->substitution_rules_rhs_has_operator[rule])
       continue; // ------------------------------C>
     if (rs->substitution_rules_regex[rule] == NULL || rs->substitution_rules_rhs[rule] == NULL) {
@@ -480,6 +910,8 @@ int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
       sin = sout;
       sout = t;
       rules_matched++;
+      // The subject has changed, so the later rules which could match may have too.
+      if (rs->prefilter != NULL) run_rule_prefilter(rs, sin, try_rule);
     }
     else if (num_subs < 0 && debug >=1) {
       u_char errbuf[200];
@@ -491,7 +923,8 @@ int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
 
   if (rules_matched > 0) strcpy((char *)intext, (char *)sin);
   if (debug >= 1) printf("Rules matched: %d\n", rules_matched);
-  pcre2_match_data_free(p2md);
+  if (match_data == NULL) pcre2_match_data_free(p2md);
+  if (try_rule != try_rule_buf) free(try_rule);
 
   return rules_matched;
 }
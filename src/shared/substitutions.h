@@ -2,11 +2,26 @@
 // Licensed under the MIT license.
 
 
+typedef struct {
+  // An Aho-Corasick automaton over literals which matches of the rules must contain, used to
+  // skip rules which can't match.  See build_rule_prefilter() in substitutions.c
+  int num_states, alphabet_size;
+  byte byte_class[256];    // Column in next_state for each subject byte.  Zero for bytes in no literal.
+  int *next_state;         // num_states x alphabet_size.  There's a transition for every class.
+  int *dict_link;          // Nearest state for a proper suffix at which a literal ends, or 0 (the root)
+  int *out_start, *out_count;  // The rules having a literal which ends at each state, in outputs[]
+  int *outputs;
+} rule_prefilter_t;
+
+
 typedef struct {
   int num_substitution_rules;
   pcre2_code **substitution_rules_regex;
   u_char **substitution_rules_rhs;
   u_char *substitution_rules_rhs_has_operator;
+  u_char **substitution_rules_literals;    // Only used during loading.  NUL-separated list per rule
+  u_char *substitution_rules_always_tried; // 1 for rules which no literal can rule out
+  rule_prefilter_t *prefilter;             // NULL if there are no literals
 } rule_set_t;
 
 
@@ -23,7 +38,8 @@ int load_substitution_rules(u_char *srfname, dahash_table_t **substitutions_hash
 
 int apply_substitutions_rules_to_string(dahash_table_t *sash, u_char *language,
 					u_char *intext, BOOL avoid_operators_in_subject,
-					BOOL avoid_operators_in_rule, int debug);
+					BOOL avoid_operators_in_rule, pcre2_match_data **match_data,
+					int debug);
 
 int multisub(const pcre2_code *regex, PCRE2_SPTR sin, PCRE2_SIZE sinlen, PCRE2_SIZE startoff, uint32_t opts,
 	pcre2_match_data *p2md, pcre2_match_context *p2mc, PCRE2_SPTR rep, PCRE2_SIZE replen, PCRE2_UCHAR *obuf, PCRE2_SIZE *obuflen);
@@ -6,6 +6,7 @@
 #include <strsafe.h>
 #include <windows.h>
 #include <Psapi.h>  
+#include <direct.h>
 #else
 #include <sys/mman.h>
 #include <unistd.h>
@@ -208,6 +209,16 @@ BOOL exists(char *fstem, char *suffix) {
 }
 
 
+BOOL make_directory(char *path) {
+  // Create the directory path, whose parent must exist.  Return TRUE on success.
+#ifdef WIN64
+  return (_mkdir(path) == 0);
+#else
+  return (mkdir(path, 0777) == 0);
+#endif
+}
+
+
 
 size_t get_filesize(u_char *fname, BOOL verbose, int *error_code) {
 #ifdef WIN64
@@ -96,6 +96,8 @@ BOOL is_a_directory(char *arg);
 
 BOOL exists(char *fstem, char *suffix);
 
+BOOL make_directory(char *path);
+
 size_t get_filesize(u_char *fname, BOOL verbose, int *error_code);
 
 CROSS_PLATFORM_FILE_HANDLE open_ro(const char *fname, int *error_code);